@@ -0,0 +1,140 @@
+/*
+ * Copyright (c) 2024, Rauli Laine
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+namespace varasto::bench
+{
+  struct Result
+  {
+    std::string name;
+    std::size_t iterations;
+    double nanoseconds;
+  };
+
+  using results_type = std::vector<Result>;
+
+  /**
+   * Prevents the compiler from optimizing away computation whose result is
+   * otherwise unused.
+   */
+  template<class T>
+  inline void
+  do_not_optimize(const T& value)
+  {
+    asm volatile("" : : "r,m"(value) : "memory");
+  }
+
+  /**
+   * Runs given function given number of times and records the average time
+   * spent on a single call.
+   */
+  template<class Function>
+  void
+  run(
+    results_type& results,
+    const std::string& name,
+    std::size_t iterations,
+    Function&& function
+  )
+  {
+    using clock = std::chrono::steady_clock;
+    const auto start = clock::now();
+
+    for (std::size_t i = 0; i < iterations; ++i)
+    {
+      function();
+    }
+
+    const auto elapsed = std::chrono::duration<double, std::nano>(
+      clock::now() - start
+    );
+
+    results.push_back({ name, iterations, elapsed.count() / iterations });
+  }
+
+  /**
+   * Options of the HTTP load generator.
+   */
+  struct LoadOptions
+  {
+    std::string hostname;
+    int port;
+    std::string ns;
+    std::size_t threads;
+    std::size_t keys;
+    std::chrono::seconds duration;
+    /** Fraction of requests which read an entry instead of writing one. */
+    double read_ratio;
+  };
+
+  struct LoadResult
+  {
+    std::uint64_t requests;
+    std::uint64_t errors;
+    double seconds;
+    double p50;
+    double p99;
+    double p999;
+  };
+
+  /**
+   * Options of the concurrency stress test.
+   */
+  struct StressOptions
+  {
+    std::size_t threads;
+    std::size_t keys;
+    /** Number of times each thread patches each of the entries. */
+    std::size_t iterations;
+  };
+
+  struct StressResult
+  {
+    std::uint64_t operations;
+    /** Number of writes which were overwritten by a stale value. */
+    std::uint64_t lost_updates;
+    std::uint64_t errors;
+    double seconds;
+  };
+
+  /**
+   * Creates an empty directory for the benchmarks to store data into.
+   */
+  std::filesystem::path make_temporary_directory();
+
+  void bench_slug(results_type& results);
+
+  void bench_utils(results_type& results);
+
+  void bench_json(results_type& results);
+
+  void bench_storage(results_type& results);
+
+  LoadResult run_load(const LoadOptions& options);
+
+  /**
+   * Patches and replaces the same entries from multiple threads through
+   * LockingStorage, and counts updates which were lost.
+   */
+  StressResult run_stress(const StressOptions& options);
+}
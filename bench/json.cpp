@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2024, Rauli Laine
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "../src/json.hpp"
+#include "./bench.hpp"
+
+namespace varasto::bench
+{
+  static const char* small_document =
+    "{\"name\":\"John Doe\",\"address\":\"Some street 4\","
+    "\"phoneNumber\":\"+35840123123\",\"age\":42,\"active\":true,"
+    "\"tags\":[\"foo\",\"bar\",\"baz\"],"
+    "\"created\":\"2024-11-30T12:00:00Z\",\"score\":12.5}";
+
+  static std::string
+  make_large_document()
+  {
+    std::string result("{\"items\":[");
+
+    for (int i = 0; i < 10000; ++i)
+    {
+      if (i > 0)
+      {
+        result.append(",");
+      }
+      result
+        .append("{\"id\":")
+        .append(std::to_string(i))
+        .append(",\"description\":\"Item number ")
+        .append(std::to_string(i))
+        .append(" with \\\"quotes\\\" and \xc3\xa4\xc3\xb6\",")
+        .append("\"price\":")
+        .append(std::to_string(i * 0.25))
+        .append(",\"available\":true}");
+    }
+    result.append("]}");
+
+    return result;
+  }
+
+  void
+  bench_json(results_type& results)
+  {
+    const std::pair<const char*, json::CodecType> codecs[] =
+    {
+      { "peelo", json::CodecType::peelo },
+      { "structural", json::CodecType::structural },
+    };
+    const std::pair<std::string, std::string> documents[] =
+    {
+      { "small", small_document },
+      { "large", make_large_document() },
+    };
+
+    for (const auto& document : documents)
+    {
+      const auto iterations = 10000000 / (document.second.length() + 100);
+
+      for (const auto& codec : codecs)
+      {
+        const auto& c = json::get_codec(codec.second);
+        const auto value = *c.Parse(
+          document.second.data(),
+          document.second.length()
+        );
+        const auto name = std::string("json/") + codec.first + "/";
+
+        run(
+          results,
+          name + "parse/" + document.first,
+          iterations,
+          [&c, &document]()
+          {
+            do_not_optimize(
+              c.Parse(document.second.data(), document.second.length())
+            );
+          }
+        );
+        run(
+          results,
+          name + "format/" + document.first,
+          iterations,
+          [&c, &value]() { do_not_optimize(c.Format(value)); }
+        );
+      }
+    }
+  }
+}
@@ -0,0 +1,153 @@
+/*
+ * Copyright (c) 2024, Rauli Laine
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <algorithm>
+#include <random>
+#include <thread>
+
+#include <httplib.h>
+
+#include "./bench.hpp"
+
+namespace varasto::bench
+{
+  using clock = std::chrono::steady_clock;
+
+  static const char* content_type = "application/json";
+  static const char* value = "{\"name\":\"John Doe\",\"age\":42}";
+
+  static std::string
+  make_path(const LoadOptions& options, std::size_t key)
+  {
+    return "/" + options.ns + "/key-" + std::to_string(key);
+  }
+
+  static double
+  percentile(const std::vector<double>& latencies, double fraction)
+  {
+    if (latencies.empty())
+    {
+      return 0;
+    }
+
+    const auto index = static_cast<std::size_t>(
+      fraction * (latencies.size() - 1)
+    );
+
+    return latencies[index];
+  }
+
+  /**
+   * Sends requests to the server until given deadline and records latency
+   * of each request in nanoseconds.
+   */
+  static void
+  run_worker(
+    const LoadOptions& options,
+    std::size_t seed,
+    clock::time_point deadline,
+    std::vector<double>& latencies,
+    std::uint64_t& errors
+  )
+  {
+    httplib::Client client(options.hostname, options.port);
+    std::mt19937 generator(seed);
+    std::uniform_int_distribution<std::size_t> key_distribution(
+      0,
+      options.keys - 1
+    );
+    std::bernoulli_distribution read_distribution(options.read_ratio);
+
+    client.set_keep_alive(true);
+    while (clock::now() < deadline)
+    {
+      const auto path = make_path(options, key_distribution(generator));
+      const auto read = read_distribution(generator);
+      const auto start = clock::now();
+      const auto result = read
+        ? client.Get(path)
+        : client.Post(path, value, content_type);
+      const auto elapsed = std::chrono::duration<double, std::nano>(
+        clock::now() - start
+      );
+
+      if (!result || result->status >= 500)
+      {
+        ++errors;
+      }
+      latencies.push_back(elapsed.count());
+    }
+  }
+
+  LoadResult
+  run_load(const LoadOptions& options)
+  {
+    std::vector<std::vector<double>> latencies(options.threads);
+    std::vector<std::uint64_t> errors(options.threads, 0);
+    std::vector<std::thread> threads;
+    std::vector<double> all_latencies;
+    LoadResult result = {};
+
+    // Populate the keys first, so that reads do not hit missing entries.
+    {
+      httplib::Client client(options.hostname, options.port);
+
+      client.set_keep_alive(true);
+      for (std::size_t i = 0; i < options.keys; ++i)
+      {
+        client.Post(make_path(options, i), value, content_type);
+      }
+    }
+
+    const auto start = clock::now();
+    const auto deadline = start + options.duration;
+
+    for (std::size_t i = 0; i < options.threads; ++i)
+    {
+      threads.emplace_back(
+        run_worker,
+        std::cref(options),
+        i,
+        deadline,
+        std::ref(latencies[i]),
+        std::ref(errors[i])
+      );
+    }
+    for (auto& thread : threads)
+    {
+      thread.join();
+    }
+
+    result.seconds = std::chrono::duration<double>(
+      clock::now() - start
+    ).count();
+    for (std::size_t i = 0; i < options.threads; ++i)
+    {
+      all_latencies.insert(
+        std::end(all_latencies),
+        std::begin(latencies[i]),
+        std::end(latencies[i])
+      );
+      result.errors += errors[i];
+    }
+    std::sort(std::begin(all_latencies), std::end(all_latencies));
+    result.requests = all_latencies.size();
+    result.p50 = percentile(all_latencies, 0.5);
+    result.p99 = percentile(all_latencies, 0.99);
+    result.p999 = percentile(all_latencies, 0.999);
+
+    return result;
+  }
+}
@@ -0,0 +1,307 @@
+/*
+ * Copyright (c) 2024, Rauli Laine
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+
+#include "./bench.hpp"
+
+using varasto::bench::LoadOptions;
+using varasto::bench::LoadResult;
+using varasto::bench::results_type;
+using varasto::bench::StressOptions;
+using varasto::bench::StressResult;
+
+static void
+display_usage(std::ostream& output, const char* executable)
+{
+  output << std::endl
+         << "Usage: "
+         << executable
+         << " [switches]"
+         << std::endl
+         << "   --json         Output results as JSON."
+         << std::endl
+         << "   --load         Generate HTTP load against a running server"
+         << std::endl
+         << "                  instead of running micro-benchmarks."
+         << std::endl
+         << "   --stress       Patch and replace the same entries from"
+         << std::endl
+         << "                  multiple threads and check that no update"
+         << std::endl
+         << "                  is lost."
+         << std::endl
+         << "   -h             Hostname of the server. (Default: localhost)"
+         << std::endl
+         << "   -p             Port of the server. (Default: 8080)"
+         << std::endl
+         << "   --threads=N    Number of concurrent clients. (Default: 8)"
+         << std::endl
+         << "   --duration=S   Duration of the load in seconds. (Default: 10)"
+         << std::endl
+         << "   --read-ratio=R Fraction of requests which are reads."
+         << std::endl
+         << "                  (Default: 0.9)"
+         << std::endl
+         << "   --keys=N       Number of distinct keys."
+         << std::endl
+         << "                  (Default: 1000, or 16 with --stress)"
+         << std::endl
+         << "   --iterations=N Number of times each thread patches each key"
+         << std::endl
+         << "                  with --stress. (Default: 100)"
+         << std::endl
+         << "   --namespace=NS Namespace to use. (Default: bench)"
+         << std::endl
+         << "   --help         Display this message."
+         << std::endl
+         << std::endl;
+}
+
+static void
+invalid_argument(const char* option)
+{
+  std::cerr << "Invalid argument for the " << option << " option."
+            << std::endl;
+  std::exit(EXIT_FAILURE);
+}
+
+static void
+print_results(const results_type& results, bool json)
+{
+  if (json)
+  {
+    std::cout << "{\"results\":[";
+    for (std::size_t i = 0; i < results.size(); ++i)
+    {
+      std::cout << (i > 0 ? "," : "")
+                << "{\"name\":\""
+                << results[i].name
+                << "\",\"iterations\":"
+                << results[i].iterations
+                << ",\"ns_per_op\":"
+                << std::fixed
+                << std::setprecision(1)
+                << results[i].nanoseconds
+                << "}";
+    }
+    std::cout << "]}" << std::endl;
+    return;
+  }
+
+  for (const auto& result : results)
+  {
+    std::cout << std::left
+              << std::setw(40)
+              << result.name
+              << std::right
+              << std::setw(12)
+              << std::fixed
+              << std::setprecision(1)
+              << result.nanoseconds
+              << " ns/op"
+              << std::endl;
+  }
+}
+
+static void
+print_load_result(const LoadResult& result, bool json)
+{
+  const auto throughput = result.seconds > 0
+    ? result.requests / result.seconds
+    : 0;
+
+  std::cout << std::fixed << std::setprecision(1);
+  if (json)
+  {
+    std::cout << "{\"requests\":"
+              << result.requests
+              << ",\"errors\":"
+              << result.errors
+              << ",\"seconds\":"
+              << result.seconds
+              << ",\"throughput\":"
+              << throughput
+              << ",\"latency_ns\":{\"p50\":"
+              << result.p50
+              << ",\"p99\":"
+              << result.p99
+              << ",\"p999\":"
+              << result.p999
+              << "}}"
+              << std::endl;
+    return;
+  }
+
+  std::cout << "requests    " << result.requests << std::endl
+            << "errors      " << result.errors << std::endl
+            << "throughput  " << throughput << " req/s" << std::endl
+            << "p50         " << result.p50 / 1000 << " us" << std::endl
+            << "p99         " << result.p99 / 1000 << " us" << std::endl
+            << "p999        " << result.p999 / 1000 << " us" << std::endl;
+}
+
+static void
+print_stress_result(const StressResult& result, bool json)
+{
+  const auto throughput = result.seconds > 0
+    ? result.operations / result.seconds
+    : 0;
+
+  std::cout << std::fixed << std::setprecision(1);
+  if (json)
+  {
+    std::cout << "{\"operations\":"
+              << result.operations
+              << ",\"lost_updates\":"
+              << result.lost_updates
+              << ",\"errors\":"
+              << result.errors
+              << ",\"seconds\":"
+              << result.seconds
+              << ",\"throughput\":"
+              << throughput
+              << "}"
+              << std::endl;
+    return;
+  }
+
+  std::cout << "operations    " << result.operations << std::endl
+            << "lost updates  " << result.lost_updates << std::endl
+            << "errors        " << result.errors << std::endl
+            << "throughput    " << throughput << " ops/s" << std::endl;
+}
+
+int
+main(int argc, char** argv)
+{
+  LoadOptions options = {
+    "localhost",
+    8080,
+    "bench",
+    8,
+    1000,
+    std::chrono::seconds(10),
+    0.9,
+  };
+  StressOptions stress_options = { 8, 16, 100 };
+  bool json = false;
+  bool load = false;
+  bool stress = false;
+
+  for (int offset = 1; offset < argc; ++offset)
+  {
+    const auto arg = argv[offset];
+
+    if (!std::strcmp(arg, "--help"))
+    {
+      display_usage(std::cout, argv[0]);
+      return EXIT_SUCCESS;
+    }
+    else if (!std::strcmp(arg, "--json"))
+    {
+      json = true;
+    }
+    else if (!std::strcmp(arg, "--load"))
+    {
+      load = true;
+    }
+    else if (!std::strcmp(arg, "--stress"))
+    {
+      stress = true;
+    }
+    else if (!std::strcmp(arg, "-h") && offset + 1 < argc)
+    {
+      options.hostname = argv[++offset];
+    }
+    else if (!std::strcmp(arg, "-p") && offset + 1 < argc)
+    {
+      options.port = std::atoi(argv[++offset]);
+    }
+    else if (!std::strncmp(arg, "--threads=", 10))
+    {
+      if (!(options.threads = std::strtoul(arg + 10, nullptr, 10)))
+      {
+        invalid_argument("--threads");
+      }
+      stress_options.threads = options.threads;
+    }
+    else if (!std::strncmp(arg, "--duration=", 11))
+    {
+      options.duration = std::chrono::seconds(
+        std::strtoul(arg + 11, nullptr, 10)
+      );
+    }
+    else if (!std::strncmp(arg, "--read-ratio=", 13))
+    {
+      options.read_ratio = std::strtod(arg + 13, nullptr);
+      if (options.read_ratio < 0 || options.read_ratio > 1)
+      {
+        invalid_argument("--read-ratio");
+      }
+    }
+    else if (!std::strncmp(arg, "--keys=", 7))
+    {
+      if (!(options.keys = std::strtoul(arg + 7, nullptr, 10)))
+      {
+        invalid_argument("--keys");
+      }
+      stress_options.keys = options.keys;
+    }
+    else if (!std::strncmp(arg, "--iterations=", 13))
+    {
+      if (!(stress_options.iterations = std::strtoul(arg + 13, nullptr, 10)))
+      {
+        invalid_argument("--iterations");
+      }
+    }
+    else if (!std::strncmp(arg, "--namespace=", 12))
+    {
+      options.ns = arg + 12;
+    } else {
+      std::cerr << "Unrecognized switch: " << arg << std::endl;
+      display_usage(std::cerr, argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (stress)
+  {
+    const auto result = varasto::bench::run_stress(stress_options);
+
+    print_stress_result(result, json);
+    if (result.lost_updates > 0 || result.errors > 0)
+    {
+      return EXIT_FAILURE;
+    }
+  }
+  else if (load)
+  {
+    print_load_result(varasto::bench::run_load(options), json);
+  } else {
+    results_type results;
+
+    varasto::bench::bench_slug(results);
+    varasto::bench::bench_utils(results);
+    varasto::bench::bench_json(results);
+    varasto::bench::bench_storage(results);
+    print_results(results, json);
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2024, Rauli Laine
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <regex>
+
+#include "../src/slug.hpp"
+#include "./bench.hpp"
+
+namespace varasto::bench
+{
+  static const std::regex slug_pattern("^[a-z0-9]+(?:-[a-z0-9]+)*$");
+
+  // The original implementation, kept here for comparison.
+  static bool
+  is_valid_slug_regex(const std::string& input)
+  {
+    return std::regex_match(input, slug_pattern);
+  }
+
+  void
+  bench_slug(results_type& results)
+  {
+    static const std::size_t iterations = 1000000;
+    const std::vector<std::pair<std::string, std::string>> inputs = {
+      { "short", "foo" },
+      { "uuid", "13aa0984-af0f-11ef-a02b-2743ddb77e05" },
+      { "long", std::string(200, 'a') + "-" + std::string(200, 'b') },
+      { "invalid", "foo--bar" },
+    };
+
+    for (const auto& input : inputs)
+    {
+      run(
+        results,
+        "slug/regex/" + input.first,
+        iterations / 10,
+        [&input]() { do_not_optimize(is_valid_slug_regex(input.second)); }
+      );
+      run(
+        results,
+        "slug/is_valid_slug/" + input.first,
+        iterations,
+        [&input]() { do_not_optimize(is_valid_slug(input.second)); }
+      );
+    }
+  }
+}
@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2024, Rauli Laine
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <cstdlib>
+#include <filesystem>
+
+#include "../src/filesystem-storage.hpp"
+#include "../src/json.hpp"
+#include "./bench.hpp"
+
+namespace varasto::bench
+{
+  std::filesystem::path
+  make_temporary_directory()
+  {
+    auto path = (
+      std::filesystem::temp_directory_path() / "varasto-bench-XXXXXX"
+    ).string();
+
+    if (!::mkdtemp(path.data()))
+    {
+      std::abort();
+    }
+
+    return path;
+  }
+
+  void
+  bench_storage(results_type& results)
+  {
+    static const std::size_t namespace_sizes[] = { 10, 100, 1000 };
+    const auto root = make_temporary_directory();
+    const auto value = *json::parse_object(
+      "{\"name\":\"John Doe\",\"address\":\"Some street 4\",\"age\":42}"
+    );
+    FilesystemStorage storage(root);
+
+    for (const auto size : namespace_sizes)
+    {
+      const auto ns = "ns-" + std::to_string(size);
+      const auto suffix = "/" + std::to_string(size);
+      std::size_t counter = 0;
+
+      run(
+        results,
+        "storage/filesystem/set" + suffix,
+        size,
+        [&]()
+        {
+          do_not_optimize(
+            storage.Set(ns, "key-" + std::to_string(counter++), value)
+          );
+        }
+      );
+      counter = 0;
+      run(
+        results,
+        "storage/filesystem/get" + suffix,
+        10000,
+        [&]()
+        {
+          do_not_optimize(
+            storage.Get(ns, "key-" + std::to_string(counter++ % size))
+          );
+        }
+      );
+      counter = 0;
+      run(
+        results,
+        "storage/filesystem/get_raw" + suffix,
+        10000,
+        [&]()
+        {
+          do_not_optimize(
+            storage.GetRaw(ns, "key-" + std::to_string(counter++ % size))
+          );
+        }
+      );
+      run(
+        results,
+        "storage/filesystem/get_all_entries" + suffix,
+        100000 / size,
+        [&]() { do_not_optimize(storage.GetAllEntries(ns)); }
+      );
+    }
+
+    std::error_code ec;
+
+    std::filesystem::remove_all(root, ec);
+  }
+}
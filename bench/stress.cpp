@@ -0,0 +1,227 @@
+/*
+ * Copyright (c) 2024, Rauli Laine
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <atomic>
+#include <cstdlib>
+#include <filesystem>
+#include <thread>
+
+#include "../src/filesystem-storage.hpp"
+#include "../src/json.hpp"
+#include "../src/locking-storage.hpp"
+#include "./bench.hpp"
+
+namespace varasto::bench
+{
+  using clock = std::chrono::steady_clock;
+
+  static const char* stress_namespace = "stress";
+
+  static std::string
+  make_key(std::size_t key)
+  {
+    return "key-" + std::to_string(key);
+  }
+
+  static Storage::value_type
+  make_value(const std::string& property, std::size_t value)
+  {
+    return *json::parse_object(
+      "{\"" + property + "\":" + std::to_string(value) + "}"
+    );
+  }
+
+  /**
+   * Returns numeric property of given entry, or nothing if the entry or the
+   * property does not exist.
+   */
+  static std::optional<std::size_t>
+  get_property(
+    const Storage& storage,
+    std::size_t key,
+    const std::string& property
+  )
+  {
+    const auto result = storage.Get(stress_namespace, make_key(key));
+
+    if (!result || !*result)
+    {
+      return std::nullopt;
+    }
+
+    const auto& properties = (**result)->properties();
+    const auto it = properties.find(json::widen_slug(property));
+
+    if (it == std::end(properties))
+    {
+      return std::nullopt;
+    }
+    else if (const auto n = std::dynamic_pointer_cast<peelo::json::number>(
+      it->second
+    ))
+    {
+      return static_cast<std::size_t>(n->value());
+    }
+
+    return std::nullopt;
+  }
+
+  StressResult
+  run_stress(const StressOptions& options)
+  {
+    const auto root = make_temporary_directory();
+    std::error_code ec;
+    StressResult result = { 0, 0, 0, 0 };
+    std::atomic<std::uint64_t> errors(0);
+    std::atomic<bool> patching(true);
+    std::vector<std::thread> threads;
+    std::vector<std::size_t> last_set(options.keys, 0);
+    const auto start = clock::now();
+
+    {
+      LockingStorage storage(std::make_shared<FilesystemStorage>(root));
+
+      for (std::size_t key = 0; key < options.keys; ++key)
+      {
+        if (!storage.Set(stress_namespace, make_key(key), make_value("s", 0)))
+        {
+          ++errors;
+        }
+      }
+
+      // Each patching thread owns one property of every entry, and
+      // alternates between shallow and merge patches. A lost update shows up
+      // as a property which is older than the last value written into it.
+      for (std::size_t i = 0; i < options.threads; ++i)
+      {
+        threads.emplace_back(
+          [&storage, &options, &errors, i]()
+          {
+            const auto property = "t" + std::to_string(i);
+
+            for (std::size_t n = 1; n <= options.iterations; ++n)
+            {
+              for (std::size_t key = 0; key < options.keys; ++key)
+              {
+                const auto value = make_value(property, n);
+                const auto ok = n % 2
+                  ? static_cast<bool>(
+                    storage.Update(stress_namespace, make_key(key), value)
+                  )
+                  : static_cast<bool>(
+                    storage.Merge(stress_namespace, make_key(key), value)
+                  );
+
+                if (!ok)
+                {
+                  ++errors;
+                }
+              }
+            }
+          }
+        );
+      }
+
+      // Entries are concurrently replaced as a whole, which removes the
+      // properties of the patching threads but must never be undone by a
+      // patch which read the entry before it was replaced.
+      threads.emplace_back(
+        [&storage, &options, &errors, &patching, &last_set]()
+        {
+          for (std::size_t n = 1; patching; ++n)
+          {
+            for (std::size_t key = 0; key < options.keys; ++key)
+            {
+              if (storage.Set(
+                stress_namespace,
+                make_key(key),
+                make_value("s", n)
+              ))
+              {
+                last_set[key] = n;
+              } else {
+                ++errors;
+              }
+            }
+          }
+        }
+      );
+
+      for (std::size_t i = 0; i < options.threads; ++i)
+      {
+        threads[i].join();
+      }
+      patching = false;
+      threads.back().join();
+
+      // Now that the entries are no longer being replaced, one more round of
+      // concurrent patches must leave every property at its final value.
+      threads.clear();
+      for (std::size_t i = 0; i < options.threads; ++i)
+      {
+        threads.emplace_back(
+          [&storage, &options, &errors, i]()
+          {
+            const auto property = "t" + std::to_string(i);
+
+            for (std::size_t key = 0; key < options.keys; ++key)
+            {
+              if (!storage.Update(
+                stress_namespace,
+                make_key(key),
+                make_value(property, options.iterations + 1)
+              ))
+              {
+                ++errors;
+              }
+            }
+          }
+        );
+      }
+      for (auto& thread : threads)
+      {
+        thread.join();
+      }
+
+      for (std::size_t key = 0; key < options.keys; ++key)
+      {
+        if (get_property(storage, key, "s") != last_set[key])
+        {
+          ++result.lost_updates;
+        }
+        for (std::size_t i = 0; i < options.threads; ++i)
+        {
+          if (
+            get_property(storage, key, "t" + std::to_string(i)) !=
+            options.iterations + 1
+          )
+          {
+            ++result.lost_updates;
+          }
+        }
+      }
+    }
+
+    result.operations = options.threads * options.keys *
+      (options.iterations + 1);
+    result.errors = errors;
+    result.seconds = std::chrono::duration<double>(
+      clock::now() - start
+    ).count();
+    std::filesystem::remove_all(root, ec);
+
+    return result;
+  }
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2024, Rauli Laine
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "../src/json.hpp"
+#include "../src/utils.hpp"
+#include "./bench.hpp"
+
+namespace varasto::bench
+{
+  static const char* typical_entry =
+    "{\"name\":\"John Doe\",\"address\":\"Some street 4\","
+    "\"phoneNumber\":\"+35840123123\",\"age\":42,\"active\":true,"
+    "\"tags\":[\"foo\",\"bar\",\"baz\"],"
+    "\"created\":\"2024-11-30T12:00:00Z\",\"score\":12.5}";
+  static const char* typical_patch =
+    "{\"address\":\"Some other street 5\",\"faxNumber\":\"+358000000\"}";
+
+  void
+  bench_utils(results_type& results)
+  {
+    static const std::size_t iterations = 100000;
+    const auto value = *json::parse_object(typical_entry);
+    const auto patch = *json::parse_object(typical_patch);
+
+    run(
+      results,
+      "utils/patch",
+      iterations,
+      [&value, &patch]() { do_not_optimize(utils::patch(value, patch)); }
+    );
+    run(
+      results,
+      "utils/estimate_size",
+      iterations,
+      [&value]() { do_not_optimize(utils::estimate_size(value)); }
+    );
+  }
+}
@@ -0,0 +1,426 @@
+/*
+ * Copyright (c) 2024, Rauli Laine
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+#include <peelo/unicode/encoding/utf8.hpp>
+
+#include "./binary-format.hpp"
+
+namespace varasto::binary
+{
+  using peelo::json::array;
+  using peelo::json::boolean;
+  using peelo::json::number;
+  using peelo::json::object;
+  using peelo::json::string;
+  using peelo::json::value;
+  using peelo::unicode::encoding::utf8::encode;
+
+  const char* format_marker_filename = ".varasto-format";
+
+  // JSON text never begins with this byte, since it's not valid UTF-8.
+  static const unsigned char magic = 0xff;
+  static const unsigned char version = 1;
+  static const double max_integer = 9007199254740992.0;
+  static const int max_depth = 512;
+
+  enum class Tag : unsigned char
+  {
+    null = 0,
+    false_ = 1,
+    true_ = 2,
+    number = 3,
+    integer = 4,
+    string = 5,
+    array = 6,
+    object = 7,
+  };
+
+  static void
+  write_varint(std::string& output, std::uint64_t value)
+  {
+    while (value >= 0x80)
+    {
+      output.push_back(static_cast<char>((value & 0x7f) | 0x80));
+      value >>= 7;
+    }
+    output.push_back(static_cast<char>(value));
+  }
+
+  static void
+  write_string(std::string& output, const std::u32string& value)
+  {
+    const auto encoded = encode(value);
+
+    write_varint(output, encoded.length());
+    output.append(encoded);
+  }
+
+  static void
+  encode_value(std::string& output, const value::ptr& value)
+  {
+    if (!value)
+    {
+      output.push_back(static_cast<char>(Tag::null));
+    }
+    else if (const auto o = std::dynamic_pointer_cast<object>(value))
+    {
+      const auto& properties = o->properties();
+      std::vector<const object::container_type::value_type*> sorted;
+
+      sorted.reserve(properties.size());
+      for (const auto& property : properties)
+      {
+        sorted.push_back(&property);
+      }
+      std::sort(
+        std::begin(sorted),
+        std::end(sorted),
+        [](const auto a, const auto b) { return a->first < b->first; }
+      );
+      output.push_back(static_cast<char>(Tag::object));
+      write_varint(output, sorted.size());
+      for (const auto property : sorted)
+      {
+        write_string(output, property->first);
+        encode_value(output, property->second);
+      }
+    }
+    else if (const auto a = std::dynamic_pointer_cast<array>(value))
+    {
+      output.push_back(static_cast<char>(Tag::array));
+      write_varint(output, a->elements().size());
+      for (const auto& element : a->elements())
+      {
+        encode_value(output, element);
+      }
+    }
+    else if (const auto s = std::dynamic_pointer_cast<string>(value))
+    {
+      output.push_back(static_cast<char>(Tag::string));
+      write_string(output, s->value());
+    }
+    else if (const auto n = std::dynamic_pointer_cast<number>(value))
+    {
+      const auto v = n->value();
+
+      // Integers are stored as zigzag encoded variable length integers,
+      // which usually take only one or two bytes.
+      if (v == std::trunc(v) && std::fabs(v) < max_integer)
+      {
+        const auto i = static_cast<std::int64_t>(v);
+
+        output.push_back(static_cast<char>(Tag::integer));
+        write_varint(
+          output,
+          (static_cast<std::uint64_t>(i) << 1) ^
+            static_cast<std::uint64_t>(i >> 63)
+        );
+      } else {
+        char buffer[sizeof(double)];
+
+        std::memcpy(buffer, &v, sizeof(v));
+        output.push_back(static_cast<char>(Tag::number));
+        output.append(buffer, sizeof(buffer));
+      }
+    }
+    else if (const auto b = std::dynamic_pointer_cast<boolean>(value))
+    {
+      output.push_back(
+        static_cast<char>(b->value() ? Tag::true_ : Tag::false_)
+      );
+    } else {
+      output.push_back(static_cast<char>(Tag::null));
+    }
+  }
+
+  std::string
+  encode(const value::ptr& value)
+  {
+    std::string output;
+
+    output.push_back(static_cast<char>(magic));
+    output.push_back(static_cast<char>(version));
+    encode_value(output, value);
+
+    return output;
+  }
+
+  bool
+  is_binary(const char* data, std::size_t length)
+  {
+    return length > 0 && static_cast<unsigned char>(data[0]) == magic;
+  }
+
+  namespace
+  {
+    class Decoder
+    {
+    public:
+      explicit Decoder(const char* data, std::size_t length)
+        : m_pos(reinterpret_cast<const unsigned char*>(data))
+        , m_end(m_pos + length) {}
+
+      bool DecodeDocument(value::ptr& result)
+      {
+        if (m_end - m_pos < 2 || m_pos[0] != magic || m_pos[1] != version)
+        {
+          return false;
+        }
+        m_pos += 2;
+
+        return DecodeValue(result, 0) && m_pos == m_end;
+      }
+
+    private:
+      bool ReadVarint(std::uint64_t& result)
+      {
+        result = 0;
+        for (int shift = 0; shift < 64; shift += 7)
+        {
+          if (m_pos >= m_end)
+          {
+            return false;
+          }
+
+          const auto byte = *m_pos++;
+
+          result |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+          if (!(byte & 0x80))
+          {
+            return true;
+          }
+        }
+
+        return false;
+      }
+
+      bool ReadString(std::u32string& result)
+      {
+        std::uint64_t length;
+
+        if (
+          !ReadVarint(length) ||
+          length > static_cast<std::uint64_t>(m_end - m_pos)
+        )
+        {
+          return false;
+        }
+
+        const auto data = reinterpret_cast<const char*>(m_pos);
+
+        if (!json::is_valid_utf8(data, length))
+        {
+          return false;
+        }
+        json::decode_utf8(data, length, result);
+        m_pos += length;
+
+        return true;
+      }
+
+      bool DecodeValue(value::ptr& result, int depth)
+      {
+        std::uint64_t count;
+
+        if (m_pos >= m_end || depth > max_depth)
+        {
+          return false;
+        }
+
+        switch (static_cast<Tag>(*m_pos++))
+        {
+          case Tag::null:
+            result = nullptr;
+            return true;
+
+          case Tag::false_:
+            result = boolean::make(false);
+            return true;
+
+          case Tag::true_:
+            result = boolean::make(true);
+            return true;
+
+          case Tag::number:
+            {
+              double v;
+
+              if (m_end - m_pos < static_cast<std::ptrdiff_t>(sizeof(v)))
+              {
+                return false;
+              }
+              std::memcpy(&v, m_pos, sizeof(v));
+              m_pos += sizeof(v);
+              result = number::make(v);
+            }
+            return true;
+
+          case Tag::integer:
+            if (!ReadVarint(count))
+            {
+              return false;
+            }
+            result = number::make(static_cast<double>(
+              static_cast<std::int64_t>(count >> 1) ^
+                -static_cast<std::int64_t>(count & 1)
+            ));
+            return true;
+
+          case Tag::string:
+            {
+              std::u32string s;
+
+              if (!ReadString(s))
+              {
+                return false;
+              }
+              result = string::make(s);
+            }
+            return true;
+
+          case Tag::array:
+            {
+              array::container_type elements;
+
+              // Each element takes at least one byte, which keeps corrupted
+              // counts from reserving huge amounts of memory.
+              if (
+                !ReadVarint(count) ||
+                count > static_cast<std::uint64_t>(m_end - m_pos)
+              )
+              {
+                return false;
+              }
+              elements.reserve(count);
+              for (std::uint64_t i = 0; i < count; ++i)
+              {
+                value::ptr element;
+
+                if (!DecodeValue(element, depth + 1))
+                {
+                  return false;
+                }
+                elements.push_back(element);
+              }
+              result = array::make(elements);
+            }
+            return true;
+
+          case Tag::object:
+            {
+              object::container_type properties;
+
+              if (
+                !ReadVarint(count) ||
+                count > static_cast<std::uint64_t>(m_end - m_pos)
+              )
+              {
+                return false;
+              }
+              for (std::uint64_t i = 0; i < count; ++i)
+              {
+                std::u32string key;
+                value::ptr property;
+
+                if (!ReadString(key) || !DecodeValue(property, depth + 1))
+                {
+                  return false;
+                }
+                properties[std::move(key)] = property;
+              }
+              result = object::make(properties);
+            }
+            return true;
+        }
+
+        return false;
+      }
+
+    private:
+      const unsigned char* m_pos;
+      const unsigned char* m_end;
+    };
+  }
+
+  json::parse_result_type
+  decode(const char* data, std::size_t length)
+  {
+    Decoder decoder(data, length);
+    value::ptr result;
+
+    if (!decoder.DecodeDocument(result))
+    {
+      return json::parse_result_type::error("Corrupted binary value.");
+    }
+
+    return json::parse_result_type::ok(result);
+  }
+
+  json::parse_object_result_type
+  parse_value(const char* data, std::size_t length)
+  {
+    if (!is_binary(data, length))
+    {
+      return json::parse_object(data, length);
+    }
+
+    const auto result = decode(data, length);
+
+    if (!result)
+    {
+      return json::parse_object_result_type::error(result.error());
+    }
+    else if (const auto o = std::dynamic_pointer_cast<object>(*result))
+    {
+      return json::parse_object_result_type::ok(o);
+    }
+
+    return json::parse_object_result_type::error("Value is not an object.");
+  }
+
+  std::optional<ValueFormat>
+  read_format_marker(const std::filesystem::path& root)
+  {
+    std::ifstream file(root / format_marker_filename);
+    std::string format;
+
+    if (!file.good() || !(file >> format))
+    {
+      return std::nullopt;
+    }
+
+    return format == "binary" ? ValueFormat::binary : ValueFormat::json;
+  }
+
+  bool
+  write_format_marker(
+    const std::filesystem::path& root,
+    ValueFormat format
+  )
+  {
+    std::ofstream file(root / format_marker_filename);
+
+    file << (format == ValueFormat::binary ? "binary" : "json") << std::endl;
+
+    return file.good();
+  }
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2024, Rauli Laine
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#pragma once
+
+#include <filesystem>
+#include <optional>
+#include <string>
+
+#include "./json.hpp"
+
+namespace varasto
+{
+  /**
+   * Encoding used for values written into the storage.
+   */
+  enum class ValueFormat
+  {
+    json,
+    binary,
+  };
+}
+
+namespace varasto::binary
+{
+  /**
+   * Name of the file in root of the data directory, which tells which
+   * encoding is used for values stored in the directory.
+   */
+  extern const char* format_marker_filename;
+
+  /**
+   * Encodes given JSON value into compact binary representation. Strings
+   * are length prefixed and properties of objects are sorted by their
+   * keys, so decoding requires no tokenizing or unescaping.
+   */
+  std::string encode(const peelo::json::value::ptr& value);
+
+  /**
+   * Returns true if given data has been encoded with encode().
+   */
+  bool is_binary(const char* data, std::size_t length);
+
+  /**
+   * Decodes binary representation produced by encode().
+   */
+  json::parse_result_type decode(const char* data, std::size_t length);
+
+  /**
+   * Parses stored value, which can be either in JSON or binary format.
+   */
+  json::parse_object_result_type parse_value(
+    const char* data,
+    std::size_t length
+  );
+
+  /**
+   * Reads format marker from given data directory. Returns no value if the
+   * directory has no marker.
+   */
+  std::optional<ValueFormat> read_format_marker(
+    const std::filesystem::path& root
+  );
+
+  bool write_format_marker(
+    const std::filesystem::path& root,
+    ValueFormat format
+  );
+}
@@ -0,0 +1,530 @@
+/*
+ * Copyright (c) 2024, Rauli Laine
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "./caching-storage.hpp"
+#include "./json.hpp"
+#include "./utils.hpp"
+
+namespace varasto
+{
+  CachingStorage::CachingStorage(
+    const storage_type& storage,
+    size_type capacity
+  )
+    : m_storage(storage)
+    , m_capacity(capacity)
+    , m_size(0)
+    , m_generation(0)
+    , m_invalidation_floor(0)
+    , m_hits(0)
+    , m_misses(0)
+    , m_evictions(0) {}
+
+  Storage::get_result_type
+  CachingStorage::Get(
+    const key_type& ns,
+    const key_type& key
+  ) const
+  {
+    counter_type generation;
+    auto values = Lookup(ns, key, generation, true);
+
+    if (values && values->value)
+    {
+      return get_result_type::ok(values->value);
+    }
+    else if (values)
+    {
+      const auto result = json::parse_object(*values->raw);
+
+      if (!result)
+      {
+        return get_result_type::error(result.error());
+      }
+      values->value = *result;
+      Insert(ns, key, std::move(*values), generation);
+
+      return get_result_type::ok(*result);
+    }
+
+    const auto result = m_storage->Get(ns, key);
+
+    if (result && *result)
+    {
+      Insert(ns, key, { **result, nullptr, nullptr }, generation);
+    }
+
+    return result;
+  }
+
+  Storage::get_raw_result_type
+  CachingStorage::GetRaw(
+    const key_type& ns,
+    const key_type& key
+  ) const
+  {
+    counter_type generation;
+
+    if (const auto raw = LookupRaw(ns, key, generation))
+    {
+      return get_raw_result_type::ok(*raw);
+    }
+
+    const auto result = m_storage->GetRaw(ns, key);
+
+    if (result && *result)
+    {
+      Insert(
+        ns,
+        key,
+        { nullptr, std::make_shared<const std::string>(**result), nullptr },
+        generation
+      );
+    }
+
+    return result;
+  }
+
+  Storage::multi_get_result_type
+  CachingStorage::MultiGet(
+    const std::vector<std::pair<key_type, key_type>>& entries
+  ) const
+  {
+    multi_get_result_type results;
+    std::vector<std::pair<key_type, key_type>> misses;
+    std::vector<std::size_t> miss_indexes;
+    std::vector<counter_type> generations;
+
+    results.reserve(entries.size());
+    for (std::size_t i = 0; i < entries.size(); ++i)
+    {
+      counter_type generation;
+
+      if (const auto raw = LookupRaw(
+        entries[i].first,
+        entries[i].second,
+        generation
+      ))
+      {
+        results.push_back(get_raw_result_type::ok(*raw));
+        continue;
+      }
+      results.push_back(get_raw_result_type::ok(std::nullopt));
+      misses.push_back(entries[i]);
+      miss_indexes.push_back(i);
+      generations.push_back(generation);
+    }
+
+    if (misses.empty())
+    {
+      return results;
+    }
+
+    // Only entries which were not found from the cache are read from the
+    // wrapped storage, all of them with a single call.
+    auto fetched = m_storage->MultiGet(misses);
+
+    for (std::size_t i = 0; i < fetched.size(); ++i)
+    {
+      auto& result = fetched[i];
+
+      if (result && *result)
+      {
+        Insert(
+          misses[i].first,
+          misses[i].second,
+          { nullptr, std::make_shared<const std::string>(**result), nullptr },
+          generations[i]
+        );
+      }
+      results[miss_indexes[i]] = std::move(result);
+    }
+
+    return results;
+  }
+
+  Storage::get_version_result_type
+  CachingStorage::GetVersion(
+    const key_type& ns,
+    const key_type& key
+  ) const
+  {
+    counter_type generation;
+    auto values = Lookup(ns, key, generation, false);
+
+    if (values && values->version)
+    {
+      return get_version_result_type::ok(*values->version);
+    }
+
+    const auto result = m_storage->GetVersion(ns, key);
+
+    // Versions are only cached along with values, so that polling for
+    // changes does not evict the values being polled.
+    if (values && result && *result)
+    {
+      values->version = std::make_shared<const std::string>(**result);
+      Insert(ns, key, std::move(*values), generation);
+    }
+
+    return result;
+  }
+
+  Storage::get_all_keys_type
+  CachingStorage::GetAllKeys(const key_type& ns) const
+  {
+    return m_storage->GetAllKeys(ns);
+  }
+
+  Storage::get_stats_result_type
+  CachingStorage::GetStats(const key_type& ns) const
+  {
+    return m_storage->GetStats(ns);
+  }
+
+  Storage::get_namespace_version_result_type
+  CachingStorage::GetNamespaceVersion(const key_type& ns) const
+  {
+    return m_storage->GetNamespaceVersion(ns);
+  }
+
+  Storage::get_all_keys_type
+  CachingStorage::GetKeys(
+    const key_type& ns,
+    const ListOptions& options
+  ) const
+  {
+    return m_storage->GetKeys(ns, options);
+  }
+
+  Storage::for_each_entry_result_type
+  CachingStorage::ForEachEntry(
+    const key_type& ns,
+    const ListOptions& options,
+    const entry_visitor_type& visitor
+  ) const
+  {
+    return m_storage->ForEachEntry(ns, options, visitor);
+  }
+
+  Storage::set_result_type
+  CachingStorage::Set(
+    const key_type& ns,
+    const key_type& key,
+    const value_type& value
+  )
+  {
+    const auto result = m_storage->Set(ns, key, value);
+
+    Invalidate(ns, key);
+
+    return result;
+  }
+
+  Storage::merge_result_type
+  CachingStorage::Merge(
+    const key_type& ns,
+    const key_type& key,
+    const value_type& patch
+  )
+  {
+    const auto result = m_storage->Merge(ns, key, patch);
+
+    Invalidate(ns, key);
+
+    return result;
+  }
+
+  Storage::delete_result_type
+  CachingStorage::Delete(
+    const key_type& ns,
+    const key_type& key
+  )
+  {
+    const auto result = m_storage->Delete(ns, key);
+
+    Invalidate(ns, key);
+
+    return result;
+  }
+
+  Storage::delete_namespace_result_type
+  CachingStorage::DeleteNamespace(const key_type& ns)
+  {
+    const auto result = m_storage->DeleteNamespace(ns);
+
+    InvalidateNamespace(ns);
+
+    return result;
+  }
+
+  Storage::drop_namespace_result_type
+  CachingStorage::DropNamespace(const key_type& ns)
+  {
+    const auto result = m_storage->DropNamespace(ns);
+
+    InvalidateNamespace(ns);
+
+    return result;
+  }
+
+  Storage::write_batch_result_type
+  CachingStorage::Write(const std::vector<WriteOperation>& operations)
+  {
+    const auto results = m_storage->Write(operations);
+
+    for (const auto& operation : operations)
+    {
+      Invalidate(operation.ns, operation.key);
+    }
+
+    return results;
+  }
+
+  CachingStorage::Statistics
+  CachingStorage::GetStatistics() const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    return {
+      m_hits.load(),
+      m_misses.load(),
+      m_evictions.load(),
+      m_entries.size(),
+      m_size,
+      m_capacity,
+    };
+  }
+
+  std::optional<CachingStorage::Values>
+  CachingStorage::Lookup(
+    const key_type& ns,
+    const key_type& key,
+    counter_type& generation,
+    bool count
+  ) const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const auto ns_it = m_index.find(ns);
+
+    generation = m_generation;
+    if (ns_it != std::end(m_index))
+    {
+      const auto key_it = ns_it->second.find(key);
+
+      if (key_it != std::end(ns_it->second))
+      {
+        // Move the entry to the front of the list, marking it as most
+        // recently used one.
+        m_entries.splice(std::begin(m_entries), m_entries, key_it->second);
+        if (count)
+        {
+          ++m_hits;
+        }
+
+        return key_it->second->values;
+      }
+    }
+    if (count)
+    {
+      ++m_misses;
+    }
+
+    return std::nullopt;
+  }
+
+  std::optional<std::string>
+  CachingStorage::LookupRaw(
+    const key_type& ns,
+    const key_type& key,
+    counter_type& generation
+  ) const
+  {
+    auto values = Lookup(ns, key, generation, true);
+
+    if (!values)
+    {
+      return std::nullopt;
+    }
+    else if (values->raw)
+    {
+      return *values->raw;
+    }
+
+    const auto raw = std::make_shared<const std::string>(
+      json::format(values->value)
+    );
+
+    values->raw = raw;
+    Insert(ns, key, std::move(*values), generation);
+
+    return *raw;
+  }
+
+  void
+  CachingStorage::Insert(
+    const key_type& ns,
+    const key_type& key,
+    Values&& values,
+    counter_type generation
+  ) const
+  {
+    auto size = ns.size() + key.size();
+
+    if (values.value)
+    {
+      size += utils::estimate_size(values.value);
+    }
+    if (values.raw)
+    {
+      size += values.raw->capacity();
+    }
+    if (values.version)
+    {
+      size += values.version->capacity();
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    // The entry was modified while we were reading it from the storage, so
+    // the value we have might already be stale.
+    if (IsInvalidated(ns, key, generation) || size > m_capacity)
+    {
+      return;
+    }
+
+    const auto ns_it = m_index.find(ns);
+
+    if (ns_it != std::end(m_index))
+    {
+      const auto key_it = ns_it->second.find(key);
+
+      if (key_it != std::end(ns_it->second))
+      {
+        Erase(key_it->second);
+      }
+    }
+
+    while (!m_entries.empty() && m_size + size > m_capacity)
+    {
+      Erase(std::prev(std::end(m_entries)));
+      ++m_evictions;
+    }
+
+    m_size += size;
+    m_entries.push_front({ ns, key, std::move(values), size });
+    m_index[ns][key] = std::begin(m_entries);
+  }
+
+  void
+  CachingStorage::Invalidate(const key_type& ns, const key_type& key)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const auto ns_it = m_index.find(ns);
+
+    AddInvalidation(ns, key);
+    if (ns_it != std::end(m_index))
+    {
+      const auto key_it = ns_it->second.find(key);
+
+      if (key_it != std::end(ns_it->second))
+      {
+        Erase(key_it->second);
+      }
+    }
+  }
+
+  void
+  CachingStorage::InvalidateNamespace(const key_type& ns)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const auto ns_it = m_index.find(ns);
+
+    AddInvalidation(ns, key_type());
+    if (ns_it != std::end(m_index))
+    {
+      std::vector<list_type::iterator> entries;
+
+      entries.reserve(ns_it->second.size());
+      for (const auto& entry : ns_it->second)
+      {
+        entries.push_back(entry.second);
+      }
+      for (const auto& entry : entries)
+      {
+        Erase(entry);
+      }
+    }
+  }
+
+  bool
+  CachingStorage::IsInvalidated(
+    const key_type& ns,
+    const key_type& key,
+    counter_type generation
+  ) const
+  {
+    if (generation < m_invalidation_floor)
+    {
+      return true;
+    }
+
+    for (const auto& invalidated : { key, key_type() })
+    {
+      const auto it = m_invalidations.find(std::make_pair(ns, invalidated));
+
+      if (it != std::end(m_invalidations) && it->second > generation)
+      {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  void
+  CachingStorage::AddInvalidation(const key_type& ns, const key_type& key)
+  {
+    ++m_generation;
+
+    // Once too many invalidations have been recorded, they are forgotten and
+    // every fill which started before this one is rejected instead.
+    if (m_invalidations.size() >= max_invalidation_count)
+    {
+      m_invalidations.clear();
+      m_invalidation_floor = m_generation;
+    } else {
+      m_invalidations[std::make_pair(ns, key)] = m_generation;
+    }
+  }
+
+  void
+  CachingStorage::Erase(list_type::iterator it) const
+  {
+    const auto ns_it = m_index.find(it->ns);
+
+    if (ns_it != std::end(m_index))
+    {
+      ns_it->second.erase(it->key);
+      if (ns_it->second.empty())
+      {
+        m_index.erase(ns_it);
+      }
+    }
+    m_size -= it->size;
+    m_entries.erase(it);
+  }
+}
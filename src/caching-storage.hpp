@@ -0,0 +1,245 @@
+/*
+ * Copyright (c) 2024, Rauli Laine
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include "./storage.hpp"
+
+namespace varasto
+{
+  /**
+   * Storage decorator which keeps recently read entries in memory, so that
+   * repeated reads of the same entry do not have to go through the wrapped
+   * storage. Least recently used entries are evicted once the total
+   * estimated size of the cached values exceeds the given byte budget.
+   */
+  class CachingStorage : public Storage
+  {
+  public:
+    using storage_type = std::shared_ptr<Storage>;
+    using size_type = std::size_t;
+    using counter_type = std::uint64_t;
+
+    /**
+     * Number of recent invalidations remembered for rejecting stale fills of
+     * the cache, after which they are forgotten all at once.
+     */
+    static constexpr size_type max_invalidation_count = 4096;
+
+    struct Statistics
+    {
+      counter_type hits;
+      counter_type misses;
+      counter_type evictions;
+      size_type entries;
+      size_type size;
+      size_type capacity;
+    };
+
+    explicit CachingStorage(const storage_type& storage, size_type capacity);
+
+    CachingStorage(const CachingStorage&) = delete;
+    CachingStorage(CachingStorage&&) = delete;
+    CachingStorage& operator=(const CachingStorage&) = delete;
+    CachingStorage& operator=(CachingStorage&&) = delete;
+
+    get_result_type Get(
+      const key_type& ns,
+      const key_type& key
+    ) const;
+
+    get_raw_result_type GetRaw(
+      const key_type& ns,
+      const key_type& key
+    ) const;
+
+    get_version_result_type GetVersion(
+      const key_type& ns,
+      const key_type& key
+    ) const;
+
+    multi_get_result_type MultiGet(
+      const std::vector<std::pair<key_type, key_type>>& entries
+    ) const;
+
+    get_all_keys_type GetAllKeys(
+      const key_type& ns
+    ) const;
+
+    get_stats_result_type GetStats(
+      const key_type& ns
+    ) const;
+
+    get_namespace_version_result_type GetNamespaceVersion(
+      const key_type& ns
+    ) const;
+
+    get_all_keys_type GetKeys(
+      const key_type& ns,
+      const ListOptions& options
+    ) const;
+
+    for_each_entry_result_type ForEachEntry(
+      const key_type& ns,
+      const ListOptions& options,
+      const entry_visitor_type& visitor
+    ) const;
+
+    set_result_type Set(
+      const key_type& ns,
+      const key_type& key,
+      const value_type& value
+    );
+
+    merge_result_type Merge(
+      const key_type& ns,
+      const key_type& key,
+      const value_type& patch
+    );
+
+    delete_result_type Delete(
+      const key_type& ns,
+      const key_type& key
+    );
+
+    delete_namespace_result_type DeleteNamespace(
+      const key_type& ns
+    );
+
+    drop_namespace_result_type DropNamespace(
+      const key_type& ns
+    );
+
+    write_batch_result_type Write(
+      const std::vector<WriteOperation>& operations
+    );
+
+    Statistics GetStatistics() const;
+
+  private:
+    using shared_string_type = std::shared_ptr<const std::string>;
+
+    /**
+     * Values of a cached entry. Either the parsed value, the serialized
+     * value or both of them are present, depending on how the entry has
+     * been accessed. Version is filled in once it has been asked for. They
+     * are shared with the cache, so that lookups do not copy them while
+     * holding the lock.
+     */
+    struct Values
+    {
+      value_type value;
+      shared_string_type raw;
+      shared_string_type version;
+    };
+
+    struct Entry
+    {
+      key_type ns;
+      key_type key;
+      Values values;
+      size_type size;
+    };
+    using list_type = std::list<Entry>;
+    using key_index_type = std::unordered_map<
+      key_type,
+      list_type::iterator
+    >;
+    using namespace_index_type = std::unordered_map<
+      key_type,
+      key_index_type
+    >;
+
+    /**
+     * Looks up cached values of an entry. Only lookups of values are counted
+     * as hits or misses, since versions are asked for separately before the
+     * values and are not cached on their own.
+     */
+    std::optional<Values> Lookup(
+      const key_type& ns,
+      const key_type& key,
+      counter_type& generation,
+      bool count
+    ) const;
+
+    /**
+     * Returns serialized value of an entry from the cache. If only the parsed
+     * value has been cached, it's serialized and cached as well.
+     */
+    std::optional<std::string> LookupRaw(
+      const key_type& ns,
+      const key_type& key,
+      counter_type& generation
+    ) const;
+
+    void Insert(
+      const key_type& ns,
+      const key_type& key,
+      Values&& values,
+      counter_type generation
+    ) const;
+
+    void Invalidate(const key_type& ns, const key_type& key);
+
+    void InvalidateNamespace(const key_type& ns);
+
+    /**
+     * Tells whether given entry has been invalidated after the given
+     * generation, in which case a value read from the wrapped storage since
+     * then might already be stale.
+     */
+    bool IsInvalidated(
+      const key_type& ns,
+      const key_type& key,
+      counter_type generation
+    ) const;
+
+    /**
+     * Records invalidation of given entry, or whole namespace when the key
+     * is empty.
+     */
+    void AddInvalidation(const key_type& ns, const key_type& key);
+
+    void Erase(list_type::iterator it) const;
+
+  private:
+    const storage_type m_storage;
+    const size_type m_capacity;
+    mutable std::mutex m_mutex;
+    mutable list_type m_entries;
+    mutable namespace_index_type m_index;
+    mutable size_type m_size;
+    /** Incremented by every invalidation. */
+    mutable counter_type m_generation;
+    /**
+     * Generation at which recently modified entries were last invalidated.
+     * Namespaces which have been invalidated as a whole have an empty key.
+     */
+    std::map<std::pair<key_type, key_type>, counter_type> m_invalidations;
+    /** Generation at which older invalidations were forgotten. */
+    counter_type m_invalidation_floor;
+    mutable std::atomic<counter_type> m_hits;
+    mutable std::atomic<counter_type> m_misses;
+    mutable std::atomic<counter_type> m_evictions;
+  };
+}
@@ -0,0 +1,577 @@
+/*
+ * Copyright (c) 2024, Rauli Laine
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <random>
+#include <unordered_set>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "./compression.hpp"
+#include "./utils.hpp"
+
+namespace varasto
+{
+  static const unsigned char compressed_marker = 0xfe;
+  static const unsigned char compressed_version = 1;
+  static const std::size_t header_size = 6;
+  static const std::size_t gram_size = 8;
+  static const std::size_t segment_size = 64;
+  static const char* dictionary_directory = ".dictionaries";
+
+  static Compressor::dictionary_id_type
+  dictionary_id(const std::string& dictionary)
+  {
+    // Same checksum which zlib stores into the header of streams compressed
+    // with a preset dictionary.
+    return ::adler32(
+      ::adler32(0, nullptr, 0),
+      reinterpret_cast<const Bytef*>(dictionary.data()),
+      dictionary.length()
+    );
+  }
+
+  static bool
+  sync_directory(const std::filesystem::path& path)
+  {
+    const auto fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    bool result;
+
+    if (fd < 0)
+    {
+      return false;
+    }
+    result = ::fsync(fd) == 0;
+    ::close(fd);
+
+    return result;
+  }
+
+  /**
+   * Writes dictionary into given path through a temporary file, syncing both
+   * the file and the directory containing it, so that the dictionary
+   * survives a crash regardless of the durability mode of the storage.
+   */
+  static bool
+  write_dictionary(
+    const std::filesystem::path& path,
+    const std::string& dictionary
+  )
+  {
+    const auto directory = path.parent_path();
+    const auto temporary_path = directory / ("." + path.filename().string());
+    const auto fd = ::open(
+      temporary_path.c_str(),
+      O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+      0644
+    );
+    std::error_code ec;
+
+    if (fd < 0)
+    {
+      return false;
+    }
+    if (
+      !utils::write_fully(fd, dictionary.data(), dictionary.length(), 0) ||
+      ::fsync(fd) != 0
+    )
+    {
+      ::close(fd);
+      std::filesystem::remove(temporary_path, ec);
+
+      return false;
+    }
+    ::close(fd);
+    std::filesystem::rename(temporary_path, path, ec);
+    if (ec)
+    {
+      std::filesystem::remove(temporary_path, ec);
+
+      return false;
+    }
+
+    return sync_directory(directory);
+  }
+
+  static std::uint64_t
+  load_gram(const std::string& input, std::size_t offset)
+  {
+    std::uint64_t gram = 0;
+
+    for (std::size_t i = 0; i < gram_size; ++i)
+    {
+      gram = (gram << 8) | static_cast<unsigned char>(input[offset + i]);
+    }
+
+    return gram;
+  }
+
+  /**
+   * Builds a preset dictionary from given samples. Each sample is split into
+   * segments, which are scored by how many other samples share the byte
+   * sequences they contain. Highest scoring segments are placed at the end
+   * of the dictionary, since zlib finds nearer matches cheaper to encode.
+   */
+  static std::string
+  train_dictionary(const std::vector<std::string>& samples)
+  {
+    std::unordered_map<std::uint64_t, std::uint32_t> counts;
+    std::vector<std::pair<std::uint64_t, std::string>> segments;
+    std::unordered_set<std::string> seen;
+    std::string dictionary;
+    std::size_t size = 0;
+
+    for (const auto& sample : samples)
+    {
+      std::unordered_set<std::uint64_t> grams;
+
+      for (std::size_t i = 0; i + gram_size <= sample.length(); ++i)
+      {
+        if (grams.insert(load_gram(sample, i)).second)
+        {
+          ++counts[load_gram(sample, i)];
+        }
+      }
+    }
+
+    for (const auto& sample : samples)
+    {
+      for (
+        std::size_t offset = 0;
+        offset + gram_size <= sample.length();
+        offset += segment_size
+      )
+      {
+        const auto length = std::min(segment_size, sample.length() - offset);
+        std::uint64_t score = 0;
+
+        for (std::size_t i = offset; i + gram_size <= offset + length; ++i)
+        {
+          score += counts[load_gram(sample, i)] - 1;
+        }
+        if (score > 0)
+        {
+          segments.emplace_back(score, sample.substr(offset, length));
+        }
+      }
+    }
+
+    std::stable_sort(
+      std::begin(segments),
+      std::end(segments),
+      [](const auto& a, const auto& b) { return a.first > b.first; }
+    );
+
+    std::vector<const std::string*> selected;
+
+    for (const auto& segment : segments)
+    {
+      if (size + segment.second.length() > Compressor::max_dictionary_size)
+      {
+        break;
+      }
+      else if (seen.insert(segment.second).second)
+      {
+        selected.push_back(&segment.second);
+        size += segment.second.length();
+      }
+    }
+
+    dictionary.reserve(size);
+    for (auto it = selected.rbegin(); it != selected.rend(); ++it)
+    {
+      dictionary.append(**it);
+    }
+
+    return dictionary;
+  }
+
+  Compressor::Compressor(
+    const path_type& root,
+    const CompressionOptions& options,
+    const std::shared_ptr<Metrics>& metrics
+  )
+    : m_root(root / dictionary_directory)
+    , m_options(options)
+    , m_metrics(metrics)
+    , m_input_bytes(metrics->AddCounter(
+        "varasto_compression_input_bytes_total",
+        "Size of values before compression."
+      ))
+    , m_output_bytes(metrics->AddCounter(
+        "varasto_compression_output_bytes_total",
+        "Size of values after compression."
+      ))
+    , m_trained(metrics->AddCounter(
+        "varasto_compression_dictionaries_trained_total",
+        "Number of compression dictionaries trained."
+      ))
+    , m_running(true)
+  {
+    if (m_options.threshold > 0)
+    {
+      m_training_thread = std::thread(&Compressor::RunTraining, this);
+    }
+  }
+
+  Compressor::~Compressor()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_training_mutex);
+
+      m_running = false;
+    }
+    m_training_condition.notify_all();
+    if (m_training_thread.joinable())
+    {
+      m_training_thread.join();
+    }
+  }
+
+  bool
+  Compressor::IsCompressed(const char* data, size_type length)
+  {
+    return length >= header_size &&
+      static_cast<unsigned char>(data[0]) == compressed_marker;
+  }
+
+  std::string
+  Compressor::Compress(const key_type& ns, std::string&& data)
+  {
+    if (!m_options.threshold || data.length() < m_options.threshold)
+    {
+      return std::move(data);
+    }
+
+    const auto state = GetNamespace(ns);
+    dictionary_type dictionary;
+    z_stream stream {};
+    std::string output;
+
+    {
+      std::lock_guard<std::mutex> lock(state->mutex);
+
+      Sample(*state, data);
+      dictionary = state->current;
+    }
+
+    if (::deflateInit(&stream, Z_DEFAULT_COMPRESSION) != Z_OK)
+    {
+      return std::move(data);
+    }
+    else if (
+      dictionary &&
+      ::deflateSetDictionary(
+        &stream,
+        reinterpret_cast<const Bytef*>(dictionary->data()),
+        dictionary->length()
+      ) != Z_OK
+    )
+    {
+      ::deflateEnd(&stream);
+
+      return std::move(data);
+    }
+
+    output.resize(header_size + ::deflateBound(&stream, data.length()));
+    output[0] = static_cast<char>(compressed_marker);
+    output[1] = static_cast<char>(compressed_version);
+    for (int i = 0; i < 4; ++i)
+    {
+      output[2 + i] = static_cast<char>((data.length() >> (i * 8)) & 0xff);
+    }
+    stream.next_in = reinterpret_cast<Bytef*>(data.data());
+    stream.avail_in = data.length();
+    stream.next_out = reinterpret_cast<Bytef*>(output.data() + header_size);
+    stream.avail_out = output.length() - header_size;
+
+    const auto status = ::deflate(&stream, Z_FINISH);
+
+    ::deflateEnd(&stream);
+    if (status != Z_STREAM_END)
+    {
+      return std::move(data);
+    }
+    output.resize(header_size + stream.total_out);
+
+    // Not worth the cost of decompressing it later.
+    if (output.length() >= data.length())
+    {
+      return std::move(data);
+    }
+    m_input_bytes.Increment(data.length());
+    m_output_bytes.Increment(output.length());
+
+    return output;
+  }
+
+  Compressor::decompress_result_type
+  Compressor::Decompress(
+    const key_type& ns,
+    const char* data,
+    size_type length
+  ) const
+  {
+    z_stream stream {};
+    std::string output;
+    size_type size = 0;
+    int status;
+
+    if (
+      !IsCompressed(data, length) ||
+      static_cast<unsigned char>(data[1]) != compressed_version
+    )
+    {
+      return decompress_result_type::error("Unsupported compression.");
+    }
+    for (int i = 0; i < 4; ++i)
+    {
+      size |= static_cast<size_type>(
+        static_cast<unsigned char>(data[2 + i])
+      ) << (i * 8);
+    }
+    if (::inflateInit(&stream) != Z_OK)
+    {
+      return decompress_result_type::error("Failed to decompress value.");
+    }
+
+    output.resize(size);
+    stream.next_in = reinterpret_cast<Bytef*>(
+      const_cast<char*>(data + header_size)
+    );
+    stream.avail_in = length - header_size;
+    stream.next_out = reinterpret_cast<Bytef*>(output.data());
+    stream.avail_out = size;
+
+    status = ::inflate(&stream, Z_FINISH);
+    if (status == Z_NEED_DICT)
+    {
+      const auto state = GetNamespace(ns);
+      dictionary_type dictionary;
+
+      {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        const auto it = state->dictionaries.find(stream.adler);
+
+        if (it != std::end(state->dictionaries))
+        {
+          dictionary = it->second;
+        }
+      }
+      if (
+        !dictionary ||
+        ::inflateSetDictionary(
+          &stream,
+          reinterpret_cast<const Bytef*>(dictionary->data()),
+          dictionary->length()
+        ) != Z_OK
+      )
+      {
+        ::inflateEnd(&stream);
+
+        return decompress_result_type::error(
+          "Missing compression dictionary."
+        );
+      }
+      status = ::inflate(&stream, Z_FINISH);
+    }
+    ::inflateEnd(&stream);
+
+    if (status != Z_STREAM_END || stream.total_out != size)
+    {
+      return decompress_result_type::error("Failed to decompress value.");
+    }
+
+    return decompress_result_type::ok(std::move(output));
+  }
+
+  void
+  Compressor::Retrain()
+  {
+    std::vector<std::pair<key_type, std::shared_ptr<Namespace>>> namespaces;
+
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      namespaces.assign(std::begin(m_namespaces), std::end(m_namespaces));
+    }
+
+    for (const auto& entry : namespaces)
+    {
+      const auto& state = entry.second;
+      std::vector<std::string> samples;
+      unsigned long generation;
+
+      {
+        std::lock_guard<std::mutex> lock(state->mutex);
+
+        if (
+          state->samples.size() < min_sample_count ||
+          state->seen_since_training < min_sample_count
+        )
+        {
+          continue;
+        }
+        samples = state->samples;
+        generation = state->generation + 1;
+        state->seen_since_training = 0;
+      }
+
+      auto dictionary = std::make_shared<const std::string>(
+        train_dictionary(samples)
+      );
+      const auto id = dictionary_id(*dictionary);
+      const auto ns_path = m_root / entry.first;
+      const auto path = ns_path / std::to_string(generation);
+      std::error_code ec;
+
+      if (dictionary->empty())
+      {
+        continue;
+      }
+
+      // Dictionary must be on disk before any entry compressed with it, so
+      // it's not published until both it and the directories leading to it
+      // have been synced.
+      std::filesystem::create_directories(ns_path, ec);
+      if (
+        ec ||
+        !sync_directory(m_root.parent_path()) ||
+        !sync_directory(m_root) ||
+        !write_dictionary(path, *dictionary)
+      )
+      {
+        continue;
+      }
+
+      std::lock_guard<std::mutex> lock(state->mutex);
+
+      state->dictionaries.emplace(id, dictionary);
+      state->current = dictionary;
+      state->generation = generation;
+      m_trained.Increment();
+    }
+  }
+
+  std::shared_ptr<Compressor::Namespace>
+  Compressor::GetNamespace(const key_type& ns) const
+  {
+    std::shared_ptr<Namespace> state;
+
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      auto& slot = m_namespaces[ns];
+
+      if (!slot)
+      {
+        slot = std::make_shared<Namespace>();
+      }
+      state = slot;
+    }
+
+    // Existing dictionaries are read from disk when the namespace is first
+    // accessed.
+    std::lock_guard<std::mutex> lock(state->mutex);
+
+    if (!state->loaded)
+    {
+      Load(ns, *state);
+    }
+
+    return state;
+  }
+
+  void
+  Compressor::Load(const key_type& ns, Namespace& state) const
+  {
+    std::error_code ec;
+
+    state.loaded = true;
+    for (
+      auto it = std::filesystem::directory_iterator(m_root / ns, ec);
+      !ec && it != std::filesystem::directory_iterator();
+      it.increment(ec)
+    )
+    {
+      const auto filename = it->path().filename().string();
+      char* end;
+      const auto generation = std::strtoul(filename.c_str(), &end, 10);
+
+      if (filename.empty() || *end)
+      {
+        continue;
+      }
+
+      std::ifstream input(it->path(), std::ios::binary);
+      auto dictionary = std::make_shared<const std::string>(
+        (std::istreambuf_iterator<char>(input)),
+        std::istreambuf_iterator<char>()
+      );
+
+      state.dictionaries.emplace(dictionary_id(*dictionary), dictionary);
+      if (generation >= state.generation)
+      {
+        state.current = dictionary;
+        state.generation = generation;
+      }
+    }
+  }
+
+  void
+  Compressor::Sample(Namespace& state, const std::string& data)
+  {
+    static thread_local std::minstd_rand random(std::random_device{}());
+    const auto sample = data.substr(0, max_sample_size);
+
+    ++state.seen;
+    ++state.seen_since_training;
+
+    // Reservoir sampling keeps the samples representative of everything
+    // written into the namespace, not just of the latest writes.
+    if (state.samples.size() < max_sample_count)
+    {
+      state.samples.push_back(sample);
+    } else {
+      const auto index = random() % state.seen;
+
+      if (index < max_sample_count)
+      {
+        state.samples[index] = sample;
+      }
+    }
+  }
+
+  void
+  Compressor::RunTraining()
+  {
+    std::unique_lock<std::mutex> lock(m_training_mutex);
+
+    while (m_running)
+    {
+      m_training_condition.wait_for(lock, m_options.retrain_interval);
+      if (!m_running)
+      {
+        break;
+      }
+      lock.unlock();
+      Retrain();
+      lock.lock();
+    }
+  }
+}
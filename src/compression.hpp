@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2024, Rauli Laine
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <peelo/result.hpp>
+
+#include "./metrics.hpp"
+
+namespace varasto
+{
+  struct CompressionOptions
+  {
+    /** Values smaller than this are stored as they are. Zero disables. */
+    std::size_t threshold = 0;
+    /** How often dictionaries of namespaces are retrained. */
+    std::chrono::seconds retrain_interval = std::chrono::seconds(300);
+  };
+
+  /**
+   * Compresses stored values with zlib, using a preset dictionary trained
+   * separately for each namespace from samples of values written into it.
+   * Dictionaries are kept in a hidden directory inside the data directory,
+   * and older dictionaries are never removed, since existing entries might
+   * still refer to them.
+   */
+  class Compressor
+  {
+  public:
+    using path_type = std::filesystem::path;
+    using key_type = std::string;
+    using size_type = std::size_t;
+    using dictionary_id_type = std::uint32_t;
+    using decompress_result_type = peelo::result<std::string, std::string>;
+
+    static constexpr size_type max_dictionary_size = 32 * 1024;
+    static constexpr size_type max_sample_count = 128;
+    static constexpr size_type max_sample_size = 4096;
+    static constexpr size_type min_sample_count = 16;
+
+    explicit Compressor(
+      const path_type& root,
+      const CompressionOptions& options = CompressionOptions(),
+      const std::shared_ptr<Metrics>& metrics = std::make_shared<Metrics>()
+    );
+
+    Compressor(const Compressor&) = delete;
+    Compressor(Compressor&&) = delete;
+    Compressor& operator=(const Compressor&) = delete;
+    Compressor& operator=(Compressor&&) = delete;
+
+    ~Compressor();
+
+    /**
+     * Returns true if given data has been produced by the compressor.
+     */
+    static bool IsCompressed(const char* data, size_type length);
+
+    /**
+     * Compresses value about to be written into given namespace, if it's
+     * large enough and compression actually makes it smaller. The value is
+     * also considered as a sample for the next dictionary of the namespace.
+     */
+    std::string Compress(const key_type& ns, std::string&& data);
+
+    decompress_result_type Decompress(
+      const key_type& ns,
+      const char* data,
+      size_type length
+    ) const;
+
+    /**
+     * Trains new dictionaries for namespaces which have received enough new
+     * samples since their previous dictionary was trained.
+     */
+    void Retrain();
+
+  private:
+    using dictionary_type = std::shared_ptr<const std::string>;
+
+    struct Namespace
+    {
+      std::mutex mutex;
+      bool loaded = false;
+      std::map<dictionary_id_type, dictionary_type> dictionaries;
+      dictionary_type current;
+      unsigned long generation = 0;
+      std::vector<std::string> samples;
+      size_type seen = 0;
+      size_type seen_since_training = 0;
+    };
+
+    std::shared_ptr<Namespace> GetNamespace(const key_type& ns) const;
+
+    void Load(const key_type& ns, Namespace& state) const;
+
+    void Sample(Namespace& state, const std::string& data);
+
+    void RunTraining();
+
+  private:
+    const path_type m_root;
+    const CompressionOptions m_options;
+    mutable std::mutex m_mutex;
+    mutable std::unordered_map<
+      key_type,
+      std::shared_ptr<Namespace>
+    > m_namespaces;
+    const std::shared_ptr<Metrics> m_metrics;
+    Counter& m_input_bytes;
+    Counter& m_output_bytes;
+    Counter& m_trained;
+    std::mutex m_training_mutex;
+    std::condition_variable m_training_condition;
+    bool m_running;
+    std::thread m_training_thread;
+  };
+}
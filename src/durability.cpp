@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) 2024, Rauli Laine
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <algorithm>
+#include <cerrno>
+#include <filesystem>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "./durability.hpp"
+#include "./utils.hpp"
+
+namespace varasto
+{
+  Durability::Durability(DurabilityMode mode, const interval_type& interval)
+    : m_mode(mode)
+    , m_interval(interval)
+    , m_running(true)
+  {
+    if (m_mode == DurabilityMode::group)
+    {
+      m_thread = std::thread(&Durability::Run, this);
+    }
+  }
+
+  Durability::~Durability()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      m_running = false;
+    }
+    m_condition.notify_all();
+    if (m_thread.joinable())
+    {
+      m_thread.join();
+    }
+  }
+
+  bool
+  Durability::Sync(int fd)
+  {
+    return SyncAll({ fd });
+  }
+
+  bool
+  Durability::SyncAll(const std::vector<int>& fds)
+  {
+    if (m_mode == DurabilityMode::none || fds.empty())
+    {
+      return true;
+    }
+    else if (m_mode == DurabilityMode::sync)
+    {
+      bool result = true;
+
+      for (const auto fd : fds)
+      {
+        result = utils::sync_data(fd) && result;
+      }
+
+      return result;
+    }
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    std::vector<Waiter> waiters;
+
+    waiters.reserve(fds.size());
+    for (const auto fd : fds)
+    {
+      waiters.push_back({ fd, false, false });
+      m_waiters.push_back(&waiters.back());
+    }
+    m_done_condition.wait(
+      lock,
+      [&waiters]()
+      {
+        return std::all_of(
+          std::begin(waiters),
+          std::end(waiters),
+          [](const Waiter& waiter) { return waiter.done; }
+        );
+      }
+    );
+
+    return std::all_of(
+      std::begin(waiters),
+      std::end(waiters),
+      [](const Waiter& waiter) { return waiter.result; }
+    );
+  }
+
+  bool
+  Durability::SyncDirectory(const char* path)
+  {
+    return SyncDirectories({ path });
+  }
+
+  bool
+  Durability::SyncDirectories(const std::vector<std::string>& paths)
+  {
+    std::vector<std::filesystem::path> directories;
+    std::vector<int> fds;
+    bool result = true;
+
+    if (m_mode == DurabilityMode::none)
+    {
+      return true;
+    }
+
+    for (const auto& path : paths)
+    {
+      const auto directory = std::filesystem::path(path).parent_path();
+
+      if (
+        std::find(std::begin(directories), std::end(directories), directory)
+        == std::end(directories)
+      )
+      {
+        directories.push_back(directory);
+      }
+    }
+
+    for (const auto& directory : directories)
+    {
+      const auto fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+
+      if (fd < 0)
+      {
+        result = false;
+        break;
+      }
+      fds.push_back(fd);
+    }
+
+    result = result && SyncAll(fds);
+    for (const auto fd : fds)
+    {
+      ::close(fd);
+    }
+
+    return result;
+  }
+
+  void
+  Durability::Run()
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    while (m_running || !m_waiters.empty())
+    {
+      std::vector<Waiter*> waiters;
+
+      m_condition.wait_for(lock, m_interval);
+      if (m_waiters.empty())
+      {
+        continue;
+      }
+      waiters.swap(m_waiters);
+      lock.unlock();
+
+      // Only the files and directories of the batch are flushed, instead of
+      // everything written into the filesystem. Descriptors given by
+      // multiple waiters are flushed only once.
+      std::sort(
+        std::begin(waiters),
+        std::end(waiters),
+        [](const Waiter* a, const Waiter* b) { return a->fd < b->fd; }
+      );
+      for (std::size_t i = 0; i < waiters.size(); ++i)
+      {
+        waiters[i]->result = i > 0 && waiters[i]->fd == waiters[i - 1]->fd
+          ? waiters[i - 1]->result
+          : utils::sync_data(waiters[i]->fd);
+      }
+
+      lock.lock();
+      for (const auto waiter : waiters)
+      {
+        waiter->done = true;
+      }
+      m_done_condition.notify_all();
+    }
+  }
+}
@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) 2024, Rauli Laine
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace varasto
+{
+  enum class DurabilityMode
+  {
+    /** Leave flushing of written data to the operating system. */
+    none,
+    /** Flush data to disk after each write. */
+    sync,
+    /** Flush data of concurrent writes to disk together periodically. */
+    group,
+  };
+
+  /**
+   * Makes data written into files durable, according to the configured
+   * durability mode. In group mode writers are blocked until a background
+   * thread has flushed the files and directories of all writes made during
+   * the commit interval, so that concurrent durable writes share the cost
+   * of flushing instead of queuing for the disk one by one.
+   */
+  class Durability
+  {
+  public:
+    using interval_type = std::chrono::milliseconds;
+
+    explicit Durability(
+      DurabilityMode mode = DurabilityMode::none,
+      const interval_type& interval = interval_type(10)
+    );
+    ~Durability();
+
+    Durability(const Durability&) = delete;
+    Durability(Durability&&) = delete;
+    Durability& operator=(const Durability&) = delete;
+    Durability& operator=(Durability&&) = delete;
+
+    inline DurabilityMode mode() const
+    {
+      return m_mode;
+    }
+
+    /**
+     * Waits until the data written into given file descriptor has been made
+     * durable. Returns false if flushing the data failed.
+     */
+    bool Sync(int fd);
+
+    /**
+     * Waits until the data written into all of given file descriptors has
+     * been made durable. In group mode all of them are flushed in the same
+     * batch. Returns false if flushing any of the data failed.
+     */
+    bool SyncAll(const std::vector<int>& fds);
+
+    /**
+     * Waits until the entry for given file in its parent directory has been
+     * made durable, which is required after the file has been renamed or
+     * created. Returns false if flushing the directory failed.
+     */
+    bool SyncDirectory(const char* path);
+
+    /**
+     * Same as SyncDirectory(), but for multiple files at once.
+     */
+    bool SyncDirectories(const std::vector<std::string>& paths);
+
+  private:
+    struct Waiter
+    {
+      int fd;
+      bool done;
+      bool result;
+    };
+
+    void Run();
+
+  private:
+    const DurabilityMode m_mode;
+    const interval_type m_interval;
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    std::condition_variable m_done_condition;
+    std::vector<Waiter*> m_waiters;
+    bool m_running;
+    std::thread m_thread;
+  };
+}
@@ -13,23 +13,204 @@
  * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
-#include <fstream>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <thread>
 
-#include <peelo/json/formatter.hpp>
-#include <peelo/json/parser.hpp>
-#include <peelo/unicode/encoding/utf8.hpp>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include "./binary-format.hpp"
 #include "./filesystem-storage.hpp"
+#include "./json.hpp"
+#include "./key-index.hpp"
+#include "./scan.hpp"
 #include "./slug.hpp"
+#include "./utils.hpp"
 
 namespace varasto
 {
-  using peelo::json::format;
-  using peelo::json::parse_object;
-  using peelo::unicode::encoding::utf8::decode;
 
-  FilesystemStorage::FilesystemStorage(const path_type& root)
-    : m_root(root) {}
+  static std::atomic<unsigned long> temporary_file_counter(0);
+  static const std::size_t listing_page_size = 1024;
+  static const std::size_t mmap_threshold = 256 * 1024;
+  static const char manifest_magic[4] = { 'V', 'K', 'M', '1' };
+  static const std::size_t manifest_buffer_size = 1024 * 1024;
+
+  struct ManifestNamespaceHeader
+  {
+    std::uint32_t key_count;
+    std::uint16_t ns_length;
+    std::uint16_t reserved;
+  };
+
+  struct ManifestTrailer
+  {
+    std::uint64_t count;
+    std::uint32_t checksum;
+    std::uint32_t reserved;
+  };
+
+  static Storage::get_all_keys_type
+  scan_keys(const std::filesystem::path& ns_path)
+  {
+    auto result = scan::list(ns_path, scan::EntryType::file);
+
+    if (!result)
+    {
+      return Storage::get_all_keys_type::error(result.error());
+    }
+
+    // Skip temporary files left behind by interrupted writes.
+    result->erase(
+      std::remove_if(
+        std::begin(*result),
+        std::end(*result),
+        [](const std::string& filename) { return !is_valid_slug(filename); }
+      ),
+      std::end(*result)
+    );
+
+    return Storage::get_all_keys_type::ok(*result);
+  }
+
+  static Storage::get_stats_result_type
+  scan_stats(const std::filesystem::path& ns_path)
+  {
+    const auto keys = scan_keys(ns_path);
+    Storage::NamespaceStats stats;
+    struct stat st;
+
+    if (!keys)
+    {
+      return Storage::get_stats_result_type::error(keys.error());
+    }
+
+    for (const auto& key : *keys)
+    {
+      if (::stat((ns_path / key).c_str(), &st) != 0)
+      {
+        continue;
+      }
+
+      const auto modified = Storage::NamespaceStats::time_type(
+        std::chrono::duration_cast<
+          Storage::NamespaceStats::time_type::duration
+        >(
+          std::chrono::seconds(st.st_mtim.tv_sec) +
+          std::chrono::nanoseconds(st.st_mtim.tv_nsec)
+        )
+      );
+
+      ++stats.count;
+      stats.size += st.st_size;
+      if (!stats.last_modified || *stats.last_modified < modified)
+      {
+        stats.last_modified = modified;
+      }
+    }
+
+    return Storage::get_stats_result_type::ok(stats);
+  }
+
+  /**
+   * Returns size of given file, or zero if it does not exist.
+   */
+  static std::uint64_t
+  get_file_size(const std::filesystem::path& path)
+  {
+    struct stat st;
+
+    return ::stat(path.c_str(), &st) == 0 ? st.st_size : 0;
+  }
+
+  /**
+   * Manifest must not survive a crash once it has been loaded, whatever the
+   * durability mode of the storage is, so the directory is always synced.
+   */
+  static void
+  sync_directory(const std::filesystem::path& path)
+  {
+    const auto fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (fd >= 0)
+    {
+      ::fsync(fd);
+      ::close(fd);
+    }
+  }
+
+  static Histogram&
+  add_histogram(Metrics& metrics, const std::string& operation)
+  {
+    return metrics.AddHistogram(
+      "varasto_storage_operation_duration_seconds",
+      "Time spent in individual storage operations.",
+      "operation=\"" + operation + "\""
+    );
+  }
+
+  FilesystemStorage::FilesystemStorage(
+    const path_type& root,
+    const std::shared_ptr<Durability>& durability,
+    const std::shared_ptr<Metrics>& metrics,
+    ValueFormat format,
+    const CompressionOptions& compression,
+    std::size_t reap_rate
+  )
+    : m_root(root)
+    , m_durability(durability)
+    , m_index(std::make_shared<KeyIndex>(
+        [root](const key_type& ns) { return scan_keys(root / ns); },
+        [root](const key_type& ns) { return scan_stats(root / ns); }
+      ))
+    , m_metrics(metrics)
+    , m_open_histogram(&add_histogram(*metrics, "open"))
+    , m_read_histogram(&add_histogram(*metrics, "read"))
+    , m_parse_histogram(&add_histogram(*metrics, "parse"))
+    , m_format_histogram(&add_histogram(*metrics, "format"))
+    , m_decompress_histogram(&add_histogram(*metrics, "decompress"))
+    , m_format(format)
+    , m_compressor(std::make_shared<Compressor>(
+        root,
+        compression,
+        metrics
+      ))
+    , m_reaper(std::make_shared<Reaper>(root / tombstone_directory, reap_rate))
+    , m_warmed_up(false) {}
+
+  FilesystemStorage::~FilesystemStorage()
+  {
+    if (m_warmed_up)
+    {
+      SaveManifest();
+    }
+  }
+
+  std::optional<std::string>
+  FilesystemStorage::WarmUp(std::size_t thread_count)
+  {
+    const auto manifest_result = LoadManifest();
+
+    if (!manifest_result)
+    {
+      return manifest_result.error();
+    }
+    m_warmed_up = true;
+    if (*manifest_result || !thread_count)
+    {
+      return std::nullopt;
+    }
+
+    return ScanNamespaces(thread_count);
+  }
 
   Storage::get_result_type
   FilesystemStorage::Get(
@@ -47,33 +228,176 @@ namespace varasto
     return get_result_type::error(entry_and_path_result.error());
   }
 
+  Storage::get_raw_result_type
+  FilesystemStorage::GetRaw(
+    const key_type& ns,
+    const key_type& key
+  ) const
+  {
+    const auto path_result = GetEntryPath(ns, key);
+
+    if (path_result)
+    {
+      return ReadEntry(*path_result);
+    }
+
+    return get_raw_result_type::error(path_result.error());
+  }
+
+  Storage::get_version_result_type
+  FilesystemStorage::GetVersion(
+    const key_type& ns,
+    const key_type& key
+  ) const
+  {
+    const auto path_result = GetEntryPath(ns, key);
+    struct stat st;
+    char buffer[64];
+
+    if (!path_result)
+    {
+      return get_version_result_type::error(path_result.error());
+    }
+    else if (::stat(path_result->c_str(), &st) != 0)
+    {
+      if (errno == ENOENT || errno == ENOTDIR)
+      {
+        return get_version_result_type::ok(std::nullopt);
+      }
+
+      return get_version_result_type::error("Failed to stat file.");
+    }
+    else if (!S_ISREG(st.st_mode))
+    {
+      return get_version_result_type::ok(std::nullopt);
+    }
+
+    // Every write renames a new file over the entry, so inode number and
+    // modification time of the file change with the value, and the version
+    // can be told without reading the file.
+    std::snprintf(
+      buffer,
+      sizeof(buffer),
+      "%llx-%llx-%llx%09ld",
+      static_cast<unsigned long long>(st.st_ino),
+      static_cast<unsigned long long>(st.st_size),
+      static_cast<unsigned long long>(st.st_mtim.tv_sec),
+      static_cast<long>(st.st_mtim.tv_nsec)
+    );
+
+    return get_version_result_type::ok(std::string(buffer));
+  }
+
+  Storage::get_stats_result_type
+  FilesystemStorage::GetStats(const key_type& ns) const
+  {
+    const auto ns_path_result = GetNamespacePath(ns);
+
+    if (ns_path_result)
+    {
+      return m_index->GetStats(ns);
+    }
+
+    return get_stats_result_type::error(ns_path_result.error());
+  }
+
+  Storage::get_namespace_version_result_type
+  FilesystemStorage::GetNamespaceVersion(const key_type& ns) const
+  {
+    const auto ns_path_result = GetNamespacePath(ns);
+
+    if (!ns_path_result)
+    {
+      return get_namespace_version_result_type::error(
+        ns_path_result.error()
+      );
+    }
+
+    const auto version = m_index->GetVersion(ns);
+
+    if (!version)
+    {
+      return get_namespace_version_result_type::error(version.error());
+    }
+
+    return get_namespace_version_result_type::ok(std::to_string(*version));
+  }
+
   Storage::get_all_keys_type
   FilesystemStorage::GetAllKeys(
     const key_type& ns
   ) const
+  {
+    return GetKeys(ns, ListOptions());
+  }
+
+  Storage::get_all_keys_type
+  FilesystemStorage::GetKeys(
+    const key_type& ns,
+    const ListOptions& options
+  ) const
   {
     const auto ns_path_result = GetNamespacePath(ns);
 
     if (ns_path_result)
     {
-      const auto& ns_path = ns_path_result.value();
-      std::vector<key_type> keys;
+      return m_index->Query(ns, options);
+    }
+
+    return get_all_keys_type::error(ns_path_result.error());
+  }
+
+  Storage::for_each_entry_result_type
+  FilesystemStorage::ForEachEntry(
+    const key_type& ns,
+    const ListOptions& options,
+    const entry_visitor_type& visitor
+  ) const
+  {
+    auto page_options = options;
+    std::size_t count = 0;
+
+    // Keys are retrieved from the index in pages, so that listing a large
+    // namespace does not require copying all of it's keys at once.
+    for (;;)
+    {
+      page_options.limit = options.limit
+        ? std::min(listing_page_size, options.limit - count)
+        : listing_page_size;
+
+      const auto keys = GetKeys(ns, page_options);
+
+      if (!keys)
+      {
+        return for_each_entry_result_type::error(keys.error());
+      }
 
-      if (std::filesystem::is_directory(ns_path))
+      for (const auto& key : *keys)
       {
-        for (const auto& entry : std::filesystem::directory_iterator(ns_path))
+        const auto buffer = ReadEntry(m_root / ns / key);
+
+        if (!buffer)
         {
-          if (std::filesystem::is_regular_file(entry))
-          {
-            keys.push_back(entry.path().filename().string());
-          }
+          return for_each_entry_result_type::error(buffer.error());
+        }
+        else if (*buffer && !visitor(key, **buffer))
+        {
+          return for_each_entry_result_type::ok(false);
         }
       }
 
-      return get_all_keys_type::ok(keys);
+      count += keys->size();
+      if (
+        keys->size() < page_options.limit ||
+        (options.limit && count >= options.limit)
+      )
+      {
+        break;
+      }
+      page_options.after = keys->back();
     }
 
-    return get_all_keys_type::error(ns_path_result.error());
+    return for_each_entry_result_type::ok(true);
   }
 
   Storage::set_result_type
@@ -85,35 +409,46 @@ namespace varasto
   {
     const auto path_result = GetEntryPath(ns, key);
 
-    if (path_result)
+    if (!path_result)
     {
-      const auto ns_path = path_result->parent_path();
+      return set_result_type::error(path_result.error());
+    }
 
-      if (!std::filesystem::is_directory(ns_path))
-      {
-        if (!std::filesystem::create_directories(ns_path))
-        {
-          return set_result_type::error(
-            "Failed to create namespace directory."
-          );
-        }
-      }
+    const auto pending = Prepare(*path_result, value);
 
-      {
-        std::ofstream file(path_result.value());
+    if (!pending)
+    {
+      return set_result_type::error(pending.error());
+    }
+    else if (!m_durability->Sync(pending->fd))
+    {
+      ::close(pending->fd);
+      ::unlink(pending->temporary_path.c_str());
 
-        if (!file.good())
-        {
-          return set_result_type::error("Failed to open file.");
-        }
-        file << format(value);
-        file.close();
-      }
+      return set_result_type::error("Failed to write file.");
+    }
+    ::close(pending->fd);
+
+    std::int64_t size_difference = 0;
+
+    if (
+      const auto error = Commit(
+        *pending,
+        m_index->HasStats(ns) ? &size_difference : nullptr
+      )
+    )
+    {
+      return set_result_type::error(*error);
+    }
 
-      return set_result_type::ok(true);
+    m_index->Insert(ns, key, size_difference);
+
+    if (!m_durability->SyncDirectory(pending->path.c_str()))
+    {
+      return set_result_type::error("Failed to sync directory.");
     }
 
-    return set_result_type::error(path_result.error());
+    return set_result_type::ok(true);
   }
 
   Storage::delete_result_type
@@ -128,19 +463,15 @@ namespace varasto
     {
       const auto& entry_and_path = entry_and_path_result.value();
       const auto& path = entry_and_path.first;
+      const auto size = m_index->HasStats(ns) ? get_file_size(path) : 0;
 
       if (std::filesystem::remove(path))
       {
         const auto parent = path.parent_path();
 
-        // Remove parent directory if it's empty.
-        if (
-          std::filesystem::is_directory(parent) &&
-          std::filesystem::is_empty(parent)
-        )
-        {
-          std::filesystem::remove(parent);
-        }
+        m_index->Erase(ns, key, size);
+
+        RemoveIfEmpty(parent);
 
         return delete_result_type::ok(entry_and_path.second);
       }
@@ -160,19 +491,617 @@ namespace varasto
     {
       const auto list_result = GetAllEntries(ns);
 
-      if (list_result)
+      if (!list_result)
       {
-        std::filesystem::remove_all(*path_result);
+        return delete_namespace_result_type::error(list_result.error());
+      }
+
+      const auto drop_result = DropNamespace(ns);
 
-        return delete_namespace_result_type::ok(*list_result);
+      if (!drop_result)
+      {
+        return delete_namespace_result_type::error(drop_result.error());
       }
 
-      return delete_namespace_result_type::error(list_result.error());
+      return delete_namespace_result_type::ok(*list_result);
     }
 
     return delete_namespace_result_type::ok(std::nullopt);
   }
 
+  Storage::drop_namespace_result_type
+  FilesystemStorage::DropNamespace(const key_type& ns)
+  {
+    const auto path_result = GetNamespacePath(ns);
+
+    if (!path_result)
+    {
+      return drop_namespace_result_type::error(path_result.error());
+    }
+
+    // Namespace directory is moved aside in one atomic rename, and the
+    // files in it are removed later in the background.
+    const auto result = m_reaper->Bury(*path_result);
+
+    if (!result)
+    {
+      return drop_namespace_result_type::error(result.error());
+    }
+    else if (!*result)
+    {
+      return drop_namespace_result_type::ok(false);
+    }
+    m_index->EraseNamespace(ns);
+
+    // Rename removes the namespace from the data root and adds it into the
+    // tombstone directory, so both of them have to be synced.
+    if (!m_durability->SyncDirectories({
+      path_result->string(),
+      (*result)->string(),
+    }))
+    {
+      return drop_namespace_result_type::error("Failed to sync directory.");
+    }
+
+    return drop_namespace_result_type::ok(true);
+  }
+
+  Storage::write_batch_result_type
+  FilesystemStorage::Write(const std::vector<WriteOperation>& operations)
+  {
+    using entry_type = std::pair<key_type, key_type>;
+    write_batch_result_type results;
+    // Values of entries modified by earlier operations of the batch, which
+    // have not been written into the actual files yet.
+    std::map<entry_type, std::optional<value_type>> overlay;
+    std::vector<std::pair<std::size_t, PendingWrite>> pending;
+    std::vector<int> fds;
+    std::vector<std::string> paths;
+
+    results.reserve(operations.size());
+
+    // First write all new values into temporary files, so that all of them
+    // can be flushed to disk at once.
+    for (const auto& operation : operations)
+    {
+      const auto path_result = GetEntryPath(operation.ns, operation.key);
+      const auto entry = std::make_pair(operation.ns, operation.key);
+      std::optional<value_type> current;
+
+      if (!path_result)
+      {
+        results.push_back(write_result_type::error(path_result.error()));
+        continue;
+      }
+
+      if (operation.type != WriteOperation::Type::set)
+      {
+        const auto it = overlay.find(entry);
+
+        if (it != std::end(overlay))
+        {
+          current = it->second;
+        } else {
+          const auto result = GetEntryAndPath(operation.ns, operation.key);
+
+          if (!result)
+          {
+            results.push_back(write_result_type::error(result.error()));
+            continue;
+          }
+          current = result->second;
+        }
+        if (!current)
+        {
+          results.push_back(write_result_type::ok(std::nullopt));
+          continue;
+        }
+      }
+
+      if (operation.type == WriteOperation::Type::remove)
+      {
+        pending.push_back(std::make_pair(
+          results.size(),
+          PendingWrite { path_type(), *path_result, -1, 0 }
+        ));
+        overlay[entry] = std::nullopt;
+        results.push_back(write_result_type::ok(current));
+        continue;
+      }
+
+      const auto value = operation.type == WriteOperation::Type::set
+        ? operation.value
+        : utils::patch(*current, operation.value);
+      const auto prepared = Prepare(*path_result, value);
+
+      if (!prepared)
+      {
+        results.push_back(write_result_type::error(prepared.error()));
+        continue;
+      }
+      pending.push_back(std::make_pair(results.size(), *prepared));
+      fds.push_back(prepared->fd);
+      overlay[entry] = value;
+      results.push_back(write_result_type::ok(value));
+    }
+
+    const auto synced = m_durability->SyncAll(fds);
+
+    for (const auto fd : fds)
+    {
+      ::close(fd);
+    }
+
+    // Then move the new values into place and remove deleted entries, in the
+    // same order as the operations were given.
+    for (const auto& entry : pending)
+    {
+      const auto& operation = operations[entry.first];
+      const auto& write = entry.second;
+      auto& result = results[entry.first];
+
+      const auto measure = m_index->HasStats(operation.ns);
+      std::int64_t size_difference = 0;
+
+      if (write.temporary_path.empty())
+      {
+        const auto size = measure ? get_file_size(write.path) : 0;
+        std::error_code ec;
+
+        if (std::filesystem::remove(write.path, ec))
+        {
+          m_index->Erase(operation.ns, operation.key, size);
+          RemoveIfEmpty(write.path.parent_path());
+        }
+        else if (ec)
+        {
+          result = write_result_type::error("Failed to remove file.");
+        }
+      }
+      else if (!synced)
+      {
+        ::unlink(write.temporary_path.c_str());
+        result = write_result_type::error("Failed to write file.");
+      }
+      else if (
+        const auto error = Commit(
+          write,
+          measure ? &size_difference : nullptr
+        )
+      )
+      {
+        result = write_result_type::error(*error);
+      } else {
+        m_index->Insert(operation.ns, operation.key, size_difference);
+      }
+      paths.push_back(write.path.string());
+    }
+
+    if (!m_durability->SyncDirectories(paths))
+    {
+      for (auto& result : results)
+      {
+        if (result)
+        {
+          result = write_result_type::error("Failed to sync directory.");
+        }
+      }
+    }
+
+    return results;
+  }
+
+  FilesystemStorage::prepare_result_type
+  FilesystemStorage::Prepare(
+    const path_type& path,
+    const value_type& value
+  ) const
+  {
+    const auto ns_path = path.parent_path();
+    const auto key = path.filename().string();
+
+    if (!std::filesystem::is_directory(ns_path))
+    {
+      std::error_code ec;
+
+      if (
+        !std::filesystem::create_directories(ns_path, ec) ||
+        !m_durability->SyncDirectory(ns_path.c_str())
+      )
+      {
+        return prepare_result_type::error(
+          "Failed to create namespace directory."
+        );
+      }
+    }
+
+    // Value is first written into a temporary file which is then renamed
+    // over the actual entry, so that readers and crashes never see a
+    // partially written entry.
+    const auto temporary_path = ns_path / (
+      "." + key + ".tmp-" + std::to_string(++temporary_file_counter)
+    );
+    std::string buffer;
+
+    {
+      ScopedTimer timer(*m_format_histogram);
+
+      buffer = m_format == ValueFormat::binary
+        ? binary::encode(value)
+        : json::format(value);
+      buffer = m_compressor->Compress(
+        ns_path.filename().string(),
+        std::move(buffer)
+      );
+    }
+
+    auto fd = ::open(
+      temporary_path.c_str(),
+      O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+      0644
+    );
+
+    // Deletion of another entry from the same namespace might have removed
+    // the namespace directory in the meantime.
+    if (fd < 0 && errno == ENOENT)
+    {
+      std::error_code ec;
+
+      std::filesystem::create_directories(ns_path, ec);
+      fd = ::open(
+        temporary_path.c_str(),
+        O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+        0644
+      );
+    }
+
+    if (fd < 0)
+    {
+      return prepare_result_type::error("Failed to open file.");
+    }
+    else if (!utils::write_fully(fd, buffer.data(), buffer.length(), 0))
+    {
+      ::close(fd);
+      ::unlink(temporary_path.c_str());
+
+      return prepare_result_type::error("Failed to write file.");
+    }
+
+    return prepare_result_type::ok({
+      temporary_path,
+      path,
+      fd,
+      buffer.length(),
+    });
+  }
+
+  std::optional<std::string>
+  FilesystemStorage::Commit(
+    const PendingWrite& write,
+    std::int64_t* size_difference
+  ) const
+  {
+    if (size_difference)
+    {
+      *size_difference = static_cast<std::int64_t>(write.size) -
+        static_cast<std::int64_t>(get_file_size(write.path));
+    }
+    if (::rename(write.temporary_path.c_str(), write.path.c_str()) != 0)
+    {
+      ::unlink(write.temporary_path.c_str());
+
+      return "Failed to rename file.";
+    }
+
+    return std::nullopt;
+  }
+
+  void
+  FilesystemStorage::RemoveIfEmpty(const path_type& ns_path) const
+  {
+    std::error_code ec;
+
+    // Fails harmlessly if another entry was written into the namespace in
+    // the meantime.
+    if (std::filesystem::is_empty(ns_path, ec) && !ec)
+    {
+      std::filesystem::remove(ns_path, ec);
+    }
+  }
+
+  peelo::result<bool, std::string>
+  FilesystemStorage::LoadManifest()
+  {
+    using result_type = peelo::result<bool, std::string>;
+    const auto path = m_root / manifest_filename;
+    const auto fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    std::vector<std::pair<key_type, std::vector<key_type>>> namespaces;
+    std::string buffer;
+    ManifestTrailer trailer;
+    std::size_t offset = sizeof(manifest_magic);
+    off_t size;
+
+    if (fd < 0)
+    {
+      if (errno == ENOENT)
+      {
+        return result_type::ok(false);
+      }
+
+      return result_type::error(
+        "Failed to open " + path.string() + ": " + std::strerror(errno)
+      );
+    }
+    else if ((size = ::lseek(fd, 0, SEEK_END)) < 0)
+    {
+      ::close(fd);
+
+      return result_type::error(
+        "Failed to open " + path.string() + ": " + std::strerror(errno)
+      );
+    }
+    buffer.resize(size);
+    if (!utils::read_fully(fd, buffer.data(), buffer.size(), 0))
+    {
+      ::close(fd);
+
+      return result_type::error("Failed to read " + path.string() + ".");
+    }
+    ::close(fd);
+
+    // The manifest is valid only until the first write after it has been
+    // loaded, so it's removed before anything else can happen.
+    if (::unlink(path.c_str()) != 0)
+    {
+      return result_type::error(
+        "Failed to remove " + path.string() + ": " + std::strerror(errno)
+      );
+    }
+    sync_directory(m_root);
+
+    // Damaged manifest is not an error, the namespaces are just scanned
+    // instead.
+    if (
+      buffer.size() < sizeof(manifest_magic) + sizeof(trailer) ||
+      std::memcmp(buffer.data(), manifest_magic, sizeof(manifest_magic))
+    )
+    {
+      return result_type::ok(false);
+    }
+    std::memcpy(
+      &trailer,
+      buffer.data() + buffer.size() - sizeof(trailer),
+      sizeof(trailer)
+    );
+    buffer.resize(buffer.size() - sizeof(trailer));
+    if (utils::crc32(buffer.data(), buffer.size()) != trailer.checksum)
+    {
+      return result_type::ok(false);
+    }
+
+    while (offset + sizeof(ManifestNamespaceHeader) <= buffer.size())
+    {
+      ManifestNamespaceHeader header;
+      std::vector<key_type> keys;
+
+      std::memcpy(&header, buffer.data() + offset, sizeof(header));
+      offset += sizeof(header);
+      if (offset + header.ns_length > buffer.size())
+      {
+        return result_type::ok(false);
+      }
+
+      key_type ns(buffer.data() + offset, header.ns_length);
+
+      offset += header.ns_length;
+      keys.reserve(header.key_count);
+      for (std::uint32_t i = 0; i < header.key_count; ++i)
+      {
+        std::uint16_t key_length;
+
+        if (offset + sizeof(key_length) > buffer.size())
+        {
+          return result_type::ok(false);
+        }
+        std::memcpy(&key_length, buffer.data() + offset, sizeof(key_length));
+        offset += sizeof(key_length);
+        if (offset + key_length > buffer.size())
+        {
+          return result_type::ok(false);
+        }
+        keys.emplace_back(buffer.data() + offset, key_length);
+        offset += key_length;
+      }
+      namespaces.emplace_back(std::move(ns), std::move(keys));
+    }
+
+    if (offset != buffer.size() || namespaces.size() != trailer.count)
+    {
+      return result_type::ok(false);
+    }
+    for (auto& ns : namespaces)
+    {
+      m_index->Load(ns.first, std::move(ns.second));
+    }
+
+    return result_type::ok(true);
+  }
+
+  std::optional<std::string>
+  FilesystemStorage::SaveManifest() const
+  {
+    const auto path = m_root / manifest_filename;
+    const auto temporary_path = m_root / (
+      std::string(manifest_filename) + ".tmp"
+    );
+    std::string buffer(manifest_magic, sizeof(manifest_magic));
+    ManifestTrailer trailer;
+    std::int64_t offset = 0;
+    std::uint32_t checksum = 0;
+    bool failed = false;
+    const auto fd = ::open(
+      temporary_path.c_str(),
+      O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+      0644
+    );
+    const auto flush = [&]()
+    {
+      checksum = utils::crc32(buffer.data(), buffer.length(), checksum);
+      if (!utils::write_fully(fd, buffer.data(), buffer.length(), offset))
+      {
+        return false;
+      }
+      offset += buffer.length();
+      buffer.clear();
+
+      return true;
+    };
+
+    if (fd < 0)
+    {
+      return "Failed to open " + temporary_path.string() + ": " +
+        std::strerror(errno);
+    }
+
+    std::memset(&trailer, 0, sizeof(trailer));
+    buffer.reserve(manifest_buffer_size);
+
+    m_index->ForEachNamespace(
+      [&](const key_type& ns, const std::set<key_type>& keys)
+      {
+        ManifestNamespaceHeader header;
+
+        if (failed)
+        {
+          return;
+        }
+        std::memset(&header, 0, sizeof(header));
+        header.key_count = keys.size();
+        header.ns_length = ns.length();
+        buffer.append(reinterpret_cast<const char*>(&header), sizeof(header));
+        buffer.append(ns);
+        for (const auto& key : keys)
+        {
+          const std::uint16_t key_length = key.length();
+
+          buffer.append(
+            reinterpret_cast<const char*>(&key_length),
+            sizeof(key_length)
+          );
+          buffer.append(key);
+          if (buffer.length() >= manifest_buffer_size && !flush())
+          {
+            failed = true;
+
+            return;
+          }
+        }
+        ++trailer.count;
+      }
+    );
+
+    if (failed || !flush())
+    {
+      ::close(fd);
+      ::unlink(temporary_path.c_str());
+
+      return "Failed to write manifest.";
+    }
+    trailer.checksum = checksum;
+    if (
+      !utils::write_fully(
+        fd,
+        reinterpret_cast<const char*>(&trailer),
+        sizeof(trailer),
+        offset
+      ) ||
+      ::fsync(fd) != 0
+    )
+    {
+      ::close(fd);
+      ::unlink(temporary_path.c_str());
+
+      return "Failed to write manifest.";
+    }
+    ::close(fd);
+
+    if (::rename(temporary_path.c_str(), path.c_str()) != 0)
+    {
+      ::unlink(temporary_path.c_str());
+
+      return "Failed to rename manifest.";
+    }
+    sync_directory(m_root);
+
+    return std::nullopt;
+  }
+
+  std::optional<std::string>
+  FilesystemStorage::ScanNamespaces(std::size_t thread_count)
+  {
+    auto namespaces = scan::list(m_root, scan::EntryType::directory);
+    std::atomic<std::size_t> next_namespace(0);
+    std::optional<std::string> error;
+    std::mutex error_mutex;
+    std::vector<std::thread> threads;
+
+    if (!namespaces)
+    {
+      return namespaces.error();
+    }
+    namespaces->erase(
+      std::remove_if(
+        std::begin(*namespaces),
+        std::end(*namespaces),
+        [](const std::string& name) { return !is_valid_slug(name); }
+      ),
+      std::end(*namespaces)
+    );
+
+    // Namespaces are handed out one by one, so that a few large namespaces
+    // do not leave the other threads idle. A single namespace is still read
+    // by one thread, since getdents64() offsets are cookies specific to the
+    // filesystem and cannot be used to split a directory between threads.
+    const auto worker = [&]()
+    {
+      for (;;)
+      {
+        const auto index = next_namespace++;
+
+        if (index >= namespaces->size())
+        {
+          return;
+        }
+
+        const auto& ns = (*namespaces)[index];
+        auto keys = scan_keys(m_root / ns);
+
+        if (!keys)
+        {
+          std::lock_guard<std::mutex> lock(error_mutex);
+
+          error = keys.error();
+
+          return;
+        }
+        m_index->Load(ns, std::move(*keys));
+      }
+    };
+
+    thread_count = std::min(thread_count, namespaces->size());
+    for (std::size_t i = 1; i < thread_count; ++i)
+    {
+      threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : threads)
+    {
+      thread.join();
+    }
+
+    return error;
+  }
+
   FilesystemStorage::get_path_result_type
   FilesystemStorage::GetNamespacePath(const key_type& ns) const
   {
@@ -202,51 +1131,241 @@ namespace varasto
     return get_path_result_type::ok(m_root / ns / key);
   }
 
-  FilesystemStorage::get_entry_and_path_result_type
-  FilesystemStorage::GetEntryAndPath(
-    const key_type& ns,
-    const key_type& key
+  std::optional<std::string>
+  FilesystemStorage::OpenEntry(
+    const path_type& path,
+    int& fd,
+    std::size_t& size
   ) const
   {
-    const auto path_result = GetEntryPath(ns, key);
+    ScopedTimer timer(*m_open_histogram);
+    struct stat st;
 
-    if (path_result)
+    fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+      if (errno == ENOENT || errno == ENOTDIR)
+      {
+        return std::nullopt;
+      }
+
+      return "Failed to open file.";
+    }
+    else if (::fstat(fd, &st) != 0)
+    {
+      ::close(fd);
+      fd = -1;
+
+      return "Failed to open file.";
+    }
+    else if (!S_ISREG(st.st_mode))
+    {
+      ::close(fd);
+      fd = -1;
+
+      return std::nullopt;
+    }
+    size = st.st_size;
+
+    return std::nullopt;
+  }
+
+  Storage::get_raw_result_type
+  FilesystemStorage::ReadEntry(const path_type& path) const
+  {
+    std::string buffer;
+    std::size_t size;
+    int fd;
+
+    if (const auto error = OpenEntry(path, fd, size))
+    {
+      return get_raw_result_type::error(*error);
+    }
+    else if (fd < 0)
     {
-      const auto& path = path_result.value();
+      return get_raw_result_type::ok(std::nullopt);
+    }
+
+    // Size of the file is known beforehand, so it can be read with a single
+    // call into a buffer which does not have to grow.
+    {
+      ScopedTimer timer(*m_read_histogram);
 
-      if (std::filesystem::is_regular_file(path))
+      buffer.resize(size);
+      if (!utils::read_fully(fd, buffer.data(), size, 0))
       {
-        std::ifstream file(path);
+        ::close(fd);
 
-        if (!file.good())
-        {
-          return get_entry_and_path_result_type::error("Failed to open file.");
-        }
+        return get_raw_result_type::error("Failed to read file.");
+      }
+    }
+    ::close(fd);
 
-        const auto buffer = std::string(
-          std::istreambuf_iterator<char>(file),
-          std::istreambuf_iterator<char>()
-        );
+    if (const auto error = Decompress(path, buffer))
+    {
+      return get_raw_result_type::error(*error);
+    }
 
-        file.close();
+    // Binary values have to be converted into JSON before they can be sent
+    // to the clients.
+    if (binary::is_binary(buffer.data(), buffer.length()))
+    {
+      const auto result = ParseEntry(path, buffer.data(), buffer.length());
 
-        const auto result = parse_object(decode(buffer));
+      if (!result)
+      {
+        return get_raw_result_type::error(result.error());
+      }
 
-        if (result)
-        {
-          return get_entry_and_path_result_type::ok(
-            std::make_pair(path, result.value())
-          );
-        }
+      ScopedTimer timer(*m_format_histogram);
+
+      return get_raw_result_type::ok(json::format(**result));
+    }
+
+    return get_raw_result_type::ok(std::move(buffer));
+  }
+
+  Storage::get_result_type
+  FilesystemStorage::ReadValue(const path_type& path) const
+  {
+    std::size_t size;
+    int fd;
 
-        return get_entry_and_path_result_type::error(result.error().what());
+    if (const auto error = OpenEntry(path, fd, size))
+    {
+      return get_result_type::error(*error);
+    }
+    else if (fd < 0)
+    {
+      return get_result_type::ok(std::nullopt);
+    }
+
+    // Large entries are parsed straight from the page cache, instead of
+    // copying them into a buffer first.
+    if (size >= mmap_threshold)
+    {
+      void* data;
+
+      {
+        ScopedTimer timer(*m_read_histogram);
+
+        data = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      }
+      ::close(fd);
+      if (data == MAP_FAILED)
+      {
+        return get_result_type::error("Failed to map file.");
       }
 
-      return get_entry_and_path_result_type::ok(
-        std::make_pair(path, std::nullopt)
+      const auto result = ParseEntry(
+        path,
+        static_cast<const char*>(data),
+        size
       );
+
+      ::munmap(data, size);
+
+      return result;
+    }
+
+    std::string buffer;
+
+    {
+      ScopedTimer timer(*m_read_histogram);
+
+      buffer.resize(size);
+      if (!utils::read_fully(fd, buffer.data(), size, 0))
+      {
+        ::close(fd);
+
+        return get_result_type::error("Failed to read file.");
+      }
+    }
+    ::close(fd);
+
+    return ParseEntry(path, buffer.data(), buffer.length());
+  }
+
+  std::optional<std::string>
+  FilesystemStorage::Decompress(
+    const path_type& path,
+    std::string& buffer
+  ) const
+  {
+    if (!Compressor::IsCompressed(buffer.data(), buffer.length()))
+    {
+      return std::nullopt;
+    }
+
+    ScopedTimer timer(*m_decompress_histogram);
+    auto result = m_compressor->Decompress(
+      path.parent_path().filename().string(),
+      buffer.data(),
+      buffer.length()
+    );
+
+    if (!result)
+    {
+      return result.error();
+    }
+    buffer = std::move(*result);
+
+    return std::nullopt;
+  }
+
+  Storage::get_result_type
+  FilesystemStorage::ParseEntry(
+    const path_type& path,
+    const char* data,
+    std::size_t length
+  ) const
+  {
+    std::string buffer;
+
+    if (Compressor::IsCompressed(data, length))
+    {
+      buffer.assign(data, length);
+      if (const auto error = Decompress(path, buffer))
+      {
+        return get_result_type::error(*error);
+      }
+      data = buffer.data();
+      length = buffer.length();
+    }
+
+    ScopedTimer timer(*m_parse_histogram);
+    const auto result = binary::parse_value(data, length);
+
+    if (!result)
+    {
+      return get_result_type::error(result.error());
+    }
+
+    return get_result_type::ok(*result);
+  }
+
+  FilesystemStorage::get_entry_and_path_result_type
+  FilesystemStorage::GetEntryAndPath(
+    const key_type& ns,
+    const key_type& key
+  ) const
+  {
+    const auto path_result = GetEntryPath(ns, key);
+
+    if (!path_result)
+    {
+      return get_entry_and_path_result_type::error(path_result.error());
+    }
+
+    const auto result = ReadValue(*path_result);
+
+    if (!result)
+    {
+      return get_entry_and_path_result_type::error(result.error());
     }
 
-    return get_entry_and_path_result_type::error(path_result.error());
+    return get_entry_and_path_result_type::ok(
+      std::make_pair(*path_result, *result)
+    );
   }
 }
@@ -16,9 +16,20 @@
 #pragma once
 
 #include <filesystem>
+#include <memory>
 
+#include "./binary-format.hpp"
+#include "./compression.hpp"
+#include "./durability.hpp"
+#include "./metrics.hpp"
+#include "./reaper.hpp"
 #include "./storage.hpp"
 
+namespace varasto
+{
+  class KeyIndex;
+}
+
 namespace varasto
 {
   class FilesystemStorage : public Storage
@@ -38,22 +49,84 @@ namespace varasto
       std::string
     >;
 
-    FilesystemStorage(const path_type& root);
+    explicit FilesystemStorage(
+      const path_type& root,
+      const std::shared_ptr<Durability>& durability =
+        std::make_shared<Durability>(),
+      const std::shared_ptr<Metrics>& metrics = std::make_shared<Metrics>(),
+      ValueFormat format = ValueFormat::json,
+      const CompressionOptions& compression = CompressionOptions(),
+      std::size_t reap_rate = Reaper::default_rate
+    );
+
+    ~FilesystemStorage();
+
+    FilesystemStorage(const FilesystemStorage&) = delete;
+    FilesystemStorage(FilesystemStorage&&) = delete;
+    FilesystemStorage& operator=(const FilesystemStorage&) = delete;
+    FilesystemStorage& operator=(FilesystemStorage&&) = delete;
 
-    FilesystemStorage(const FilesystemStorage&) = default;
-    FilesystemStorage(FilesystemStorage&&) = default;
-    FilesystemStorage& operator=(const FilesystemStorage&) = default;
-    FilesystemStorage& operator=(FilesystemStorage&&) = default;
+    /**
+     * Name of the file into which keys of the index are written when the
+     * storage is closed, so that they do not have to be scanned again on
+     * next startup.
+     */
+    static constexpr const char* manifest_filename = ".manifest";
+
+    /**
+     * Name of the directory into which removed namespaces are moved, until
+     * they have been removed in the background.
+     */
+    static constexpr const char* tombstone_directory = ".tombstones";
+
+    /**
+     * Loads keys of all namespaces into the index before the storage is
+     * taken into use. Keys are read from the manifest when there is one,
+     * otherwise namespaces are scanned in parallel with given number of
+     * threads. Zero threads leaves namespaces to be loaded lazily. Once
+     * this has been called, the manifest is written when the storage is
+     * closed.
+     */
+    std::optional<std::string> WarmUp(std::size_t thread_count);
 
     get_result_type Get(
       const key_type& ns,
       const key_type& key
     ) const;
 
+    get_raw_result_type GetRaw(
+      const key_type& ns,
+      const key_type& key
+    ) const;
+
+    get_version_result_type GetVersion(
+      const key_type& ns,
+      const key_type& key
+    ) const;
+
     get_all_keys_type GetAllKeys(
       const key_type& ns
     ) const;
 
+    get_stats_result_type GetStats(
+      const key_type& ns
+    ) const;
+
+    get_namespace_version_result_type GetNamespaceVersion(
+      const key_type& ns
+    ) const;
+
+    get_all_keys_type GetKeys(
+      const key_type& ns,
+      const ListOptions& options
+    ) const;
+
+    for_each_entry_result_type ForEachEntry(
+      const key_type& ns,
+      const ListOptions& options,
+      const entry_visitor_type& visitor
+    ) const;
+
     set_result_type Set(
       const key_type& ns,
       const key_type& key,
@@ -69,7 +142,59 @@ namespace varasto
       const key_type& ns
     );
 
+    drop_namespace_result_type DropNamespace(
+      const key_type& ns
+    );
+
+    write_batch_result_type Write(
+      const std::vector<WriteOperation>& operations
+    );
+
   private:
+    /**
+     * New value of an entry which has been written into a temporary file,
+     * but not yet moved into place. Empty temporary path means that the
+     * entry is being removed.
+     */
+    struct PendingWrite
+    {
+      path_type temporary_path;
+      path_type path;
+      int fd;
+      /** Size of the new value in bytes. */
+      std::uint64_t size;
+    };
+
+    using prepare_result_type = peelo::result<PendingWrite, std::string>;
+
+    prepare_result_type Prepare(
+      const path_type& path,
+      const value_type& value
+    ) const;
+
+    /**
+     * Moves new value of an entry into place. Difference between sizes of
+     * the new and the previous value is stored into given pointer, unless
+     * it's null.
+     */
+    std::optional<std::string> Commit(
+      const PendingWrite& write,
+      std::int64_t* size_difference
+    ) const;
+
+    void RemoveIfEmpty(const path_type& ns_path) const;
+
+    /**
+     * Loads keys from the manifest, if there is one. The manifest is removed
+     * once it has been read, so that it cannot go stale if the storage is
+     * not closed cleanly.
+     */
+    peelo::result<bool, std::string> LoadManifest();
+
+    std::optional<std::string> SaveManifest() const;
+
+    std::optional<std::string> ScanNamespaces(std::size_t thread_count);
+
     get_path_result_type GetNamespacePath(
       const key_type& ns
     ) const;
@@ -79,6 +204,34 @@ namespace varasto
       const key_type& key
     ) const;
 
+    /**
+     * Opens entry from given path for reading. File descriptor is set to -1
+     * if the entry does not exist.
+     */
+    std::optional<std::string> OpenEntry(
+      const path_type& path,
+      int& fd,
+      std::size_t& size
+    ) const;
+
+    get_raw_result_type ReadEntry(const path_type& path) const;
+
+    get_result_type ReadValue(const path_type& path) const;
+
+    /**
+     * Decompresses value read from given path, if it has been compressed.
+     */
+    std::optional<std::string> Decompress(
+      const path_type& path,
+      std::string& buffer
+    ) const;
+
+    get_result_type ParseEntry(
+      const path_type& path,
+      const char* data,
+      std::size_t length
+    ) const;
+
     get_entry_and_path_result_type GetEntryAndPath(
       const key_type& ns,
       const key_type& key
@@ -86,5 +239,17 @@ namespace varasto
 
   private:
     path_type m_root;
+    std::shared_ptr<Durability> m_durability;
+    std::shared_ptr<KeyIndex> m_index;
+    std::shared_ptr<Metrics> m_metrics;
+    Histogram* m_open_histogram;
+    Histogram* m_read_histogram;
+    Histogram* m_parse_histogram;
+    Histogram* m_format_histogram;
+    Histogram* m_decompress_histogram;
+    ValueFormat m_format;
+    std::shared_ptr<Compressor> m_compressor;
+    std::shared_ptr<Reaper> m_reaper;
+    bool m_warmed_up;
   };
 }
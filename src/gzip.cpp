@@ -0,0 +1,159 @@
+/*
+ * Copyright (c) 2024, Rauli Laine
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <cstdlib>
+
+#include <zlib.h>
+
+#include "./gzip.hpp"
+
+namespace varasto::gzip
+{
+  static const int gzip_window_bits = 15 + 16;
+  static const int memory_level = 8;
+  // Favors speed, since responses are compressed on every request.
+  static const int compression_level = 4;
+  static const std::size_t output_chunk_size = 16 * 1024;
+
+  Encoder::Encoder()
+    : m_stream(std::make_unique<z_stream_s>())
+    , m_initialized(::deflateInit2(
+        m_stream.get(),
+        compression_level,
+        Z_DEFLATED,
+        gzip_window_bits,
+        memory_level,
+        Z_DEFAULT_STRATEGY
+      ) == Z_OK) {}
+
+  Encoder::~Encoder()
+  {
+    if (m_initialized)
+    {
+      ::deflateEnd(m_stream.get());
+    }
+  }
+
+  bool
+  Encoder::Write(const char* data, std::size_t length, std::string& output)
+  {
+    if (!m_initialized)
+    {
+      return false;
+    }
+    m_stream->next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+    m_stream->avail_in = length;
+
+    return Deflate(Z_NO_FLUSH, output);
+  }
+
+  bool
+  Encoder::Finish(std::string& output)
+  {
+    if (!m_initialized)
+    {
+      return false;
+    }
+    m_stream->next_in = nullptr;
+    m_stream->avail_in = 0;
+
+    return Deflate(Z_FINISH, output);
+  }
+
+  bool
+  Encoder::Deflate(int flush, std::string& output)
+  {
+    int status;
+
+    do
+    {
+      const auto offset = output.length();
+
+      output.resize(offset + output_chunk_size);
+      m_stream->next_out = reinterpret_cast<Bytef*>(output.data() + offset);
+      m_stream->avail_out = output_chunk_size;
+      status = ::deflate(m_stream.get(), flush);
+      output.resize(output.length() - m_stream->avail_out);
+      if (status == Z_STREAM_ERROR)
+      {
+        return false;
+      }
+    }
+    while (
+      m_stream->avail_out == 0 ||
+      (flush == Z_FINISH && status != Z_STREAM_END)
+    );
+
+    return true;
+  }
+
+  std::optional<std::string>
+  compress(const std::string& input)
+  {
+    Encoder encoder;
+    std::string output;
+
+    output.reserve(input.length() / 2);
+    if (
+      !encoder.Write(input.data(), input.length(), output) ||
+      !encoder.Finish(output)
+    )
+    {
+      return std::nullopt;
+    }
+
+    return output;
+  }
+
+  bool
+  is_accepted(const std::string& accept_encoding)
+  {
+    std::size_t start = 0;
+
+    while (start < accept_encoding.length())
+    {
+      auto end = accept_encoding.find(',', start);
+
+      if (end == std::string::npos)
+      {
+        end = accept_encoding.length();
+      }
+
+      const auto coding = accept_encoding.substr(start, end - start);
+      const auto name_start = coding.find_first_not_of(" \t");
+      const auto name_end = coding.find_first_of(" \t;", name_start);
+      const auto name = name_start == std::string::npos
+        ? std::string()
+        : coding.substr(name_start, name_end - name_start);
+
+      const auto quality = coding.find("q=", name_end);
+
+      // Quality value of zero explicitly forbids the coding.
+      if (
+        (name == "gzip" || name == "*") &&
+        (
+          quality == std::string::npos ||
+          std::strtod(coding.c_str() + quality + 2, nullptr) > 0
+        )
+      )
+      {
+        return true;
+      }
+      start = end + 1;
+    }
+
+    return false;
+  }
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2024, Rauli Laine
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#pragma once
+
+#include <memory>
+#include <optional>
+#include <string>
+
+struct z_stream_s;
+
+namespace varasto::gzip
+{
+  /**
+   * Incrementally compresses data into gzip format, so that responses which
+   * are streamed to the client can be compressed as well.
+   */
+  class Encoder
+  {
+  public:
+    Encoder();
+    ~Encoder();
+
+    Encoder(const Encoder&) = delete;
+    Encoder(Encoder&&) = delete;
+    Encoder& operator=(const Encoder&) = delete;
+    Encoder& operator=(Encoder&&) = delete;
+
+    /**
+     * Compresses given data and appends whatever output is available into
+     * given buffer.
+     */
+    bool Write(const char* data, std::size_t length, std::string& output);
+
+    /**
+     * Flushes rest of the compressed data into given buffer.
+     */
+    bool Finish(std::string& output);
+
+  private:
+    bool Deflate(int flush, std::string& output);
+
+  private:
+    std::unique_ptr<z_stream_s> m_stream;
+    bool m_initialized;
+  };
+
+  /**
+   * Compresses given data in one go. Returns nothing if compression fails.
+   */
+  std::optional<std::string> compress(const std::string& input);
+
+  /**
+   * Tells whether given value of an Accept-Encoding header allows responses
+   * to be compressed with gzip.
+   */
+  bool is_accepted(const std::string& accept_encoding);
+}
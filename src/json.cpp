@@ -0,0 +1,1142 @@
+/*
+ * Copyright (c) 2024, Rauli Laine
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#if defined(__SSE2__)
+# include <emmintrin.h>
+#endif
+
+#include <peelo/json/formatter.hpp>
+#include <peelo/json/parser.hpp>
+#include <peelo/unicode/encoding/utf8.hpp>
+
+#include "./json.hpp"
+
+namespace varasto::json
+{
+  using peelo::json::array;
+  using peelo::json::boolean;
+  using peelo::json::number;
+  using peelo::json::object;
+  using peelo::json::string;
+  using peelo::json::value;
+
+  static const int max_depth = 512;
+
+  static inline bool
+  is_continuation(unsigned char byte)
+  {
+    return (byte & 0xc0) == 0x80;
+  }
+
+  static inline bool
+  is_whitespace(unsigned char byte)
+  {
+    return byte == ' ' || byte == '\t' || byte == '\n' || byte == '\r';
+  }
+
+  static inline bool
+  is_operator(unsigned char byte)
+  {
+    return byte == '{' ||
+      byte == '}' ||
+      byte == '[' ||
+      byte == ']' ||
+      byte == ':' ||
+      byte == ',';
+  }
+
+  bool
+  is_valid_utf8(const char* data, std::size_t length)
+  {
+    static const std::uint64_t high_bits = 0x8080808080808080;
+    const auto input = reinterpret_cast<const unsigned char*>(data);
+    std::size_t i = 0;
+
+    while (i < length)
+    {
+      // Skip over ASCII eight bytes at a time.
+      if (i + 8 <= length)
+      {
+        std::uint64_t word;
+
+        std::memcpy(&word, input + i, sizeof(word));
+        if (!(word & high_bits))
+        {
+          i += 8;
+          continue;
+        }
+      }
+
+      const auto byte = input[i];
+      const auto remaining = length - i;
+
+      if (byte < 0x80)
+      {
+        ++i;
+      }
+      else if (byte >= 0xc2 && byte <= 0xdf)
+      {
+        if (remaining < 2 || !is_continuation(input[i + 1]))
+        {
+          return false;
+        }
+        i += 2;
+      }
+      else if (byte >= 0xe0 && byte <= 0xef)
+      {
+        // Overlong encodings and surrogates are not allowed.
+        const unsigned char min = byte == 0xe0 ? 0xa0 : 0x80;
+        const unsigned char max = byte == 0xed ? 0x9f : 0xbf;
+
+        if (
+          remaining < 3 ||
+          input[i + 1] < min ||
+          input[i + 1] > max ||
+          !is_continuation(input[i + 2])
+        )
+        {
+          return false;
+        }
+        i += 3;
+      }
+      else if (byte >= 0xf0 && byte <= 0xf4)
+      {
+        // Overlong encodings and code points above U+10FFFF are not allowed.
+        const unsigned char min = byte == 0xf0 ? 0x90 : 0x80;
+        const unsigned char max = byte == 0xf4 ? 0x8f : 0xbf;
+
+        if (
+          remaining < 4 ||
+          input[i + 1] < min ||
+          input[i + 1] > max ||
+          !is_continuation(input[i + 2]) ||
+          !is_continuation(input[i + 3])
+        )
+        {
+          return false;
+        }
+        i += 4;
+      } else {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  /**
+   * Decodes multibyte UTF-8 sequence starting with given byte, advancing
+   * given position past its continuation bytes. The sequence must already
+   * have been validated.
+   */
+  static inline char32_t
+  decode_sequence(unsigned char byte, const unsigned char*& pos)
+  {
+    std::size_t continuations;
+    char32_t c;
+
+    if (byte < 0xe0)
+    {
+      continuations = 1;
+      c = byte & 0x1f;
+    }
+    else if (byte < 0xf0)
+    {
+      continuations = 2;
+      c = byte & 0x0f;
+    } else {
+      continuations = 3;
+      c = byte & 0x07;
+    }
+    for (std::size_t i = 0; i < continuations; ++i)
+    {
+      c = (c << 6) | (*pos++ & 0x3f);
+    }
+
+    return c;
+  }
+
+  void
+  decode_utf8(const char* data, std::size_t length, std::u32string& result)
+  {
+    auto pos = reinterpret_cast<const unsigned char*>(data);
+    const auto end = pos + length;
+
+    result.clear();
+    result.reserve(length);
+    while (pos < end)
+    {
+      const auto byte = *pos++;
+
+      result.push_back(byte < 0x80 ? byte : decode_sequence(byte, pos));
+    }
+  }
+
+  /**
+   * Bit masks of interesting characters in a 64 byte block of input, one
+   * bit per byte.
+   */
+  struct BlockMasks
+  {
+    std::uint64_t quotes;
+    std::uint64_t backslashes;
+    std::uint64_t operators;
+    std::uint64_t whitespace;
+  };
+
+#if defined(__SSE2__)
+  static inline std::uint64_t
+  compare(const __m128i (&chunks)[4], char c)
+  {
+    const auto needle = _mm_set1_epi8(c);
+    std::uint64_t result = 0;
+
+    for (int i = 0; i < 4; ++i)
+    {
+      const auto mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunks[i], needle));
+
+      result |= static_cast<std::uint64_t>(mask & 0xffff) << (i * 16);
+    }
+
+    return result;
+  }
+
+  static inline BlockMasks
+  classify(const unsigned char* block)
+  {
+    __m128i chunks[4];
+
+    for (int i = 0; i < 4; ++i)
+    {
+      chunks[i] = _mm_loadu_si128(
+        reinterpret_cast<const __m128i*>(block + i * 16)
+      );
+    }
+
+    return {
+      compare(chunks, '"'),
+      compare(chunks, '\\'),
+      compare(chunks, '{') |
+        compare(chunks, '}') |
+        compare(chunks, '[') |
+        compare(chunks, ']') |
+        compare(chunks, ':') |
+        compare(chunks, ','),
+      compare(chunks, ' ') |
+        compare(chunks, '\t') |
+        compare(chunks, '\n') |
+        compare(chunks, '\r'),
+    };
+  }
+#else
+  static inline BlockMasks
+  classify(const unsigned char* block)
+  {
+    BlockMasks masks = { 0, 0, 0, 0 };
+
+    for (int i = 0; i < 64; ++i)
+    {
+      const auto bit = static_cast<std::uint64_t>(1) << i;
+      const auto byte = block[i];
+
+      if (byte == '"')
+      {
+        masks.quotes |= bit;
+      }
+      else if (byte == '\\')
+      {
+        masks.backslashes |= bit;
+      }
+      else if (is_operator(byte))
+      {
+        masks.operators |= bit;
+      }
+      else if (is_whitespace(byte))
+      {
+        masks.whitespace |= bit;
+      }
+    }
+
+    return masks;
+  }
+#endif
+
+  /**
+   * Returns mask of characters which are escaped by an odd length sequence
+   * of backslashes preceding them.
+   */
+  static inline std::uint64_t
+  find_escaped(std::uint64_t backslashes, std::uint64_t& previous_ends_odd)
+  {
+    static const std::uint64_t even_bits = 0x5555555555555555;
+    static const std::uint64_t odd_bits = ~even_bits;
+    const auto start_edges = backslashes & ~(backslashes << 1);
+    const auto even_start_mask = even_bits ^ previous_ends_odd;
+    const auto even_starts = start_edges & even_start_mask;
+    const auto odd_starts = start_edges & ~even_start_mask;
+    const auto even_carries = backslashes + even_starts;
+    auto odd_carries = backslashes + odd_starts;
+    const bool ends_odd = odd_carries < backslashes;
+
+    odd_carries |= previous_ends_odd;
+    previous_ends_odd = ends_odd ? 1 : 0;
+
+    const auto even_carry_ends = even_carries & ~backslashes;
+    const auto odd_carry_ends = odd_carries & ~backslashes;
+
+    return (even_carry_ends & odd_bits) | (odd_carry_ends & even_bits);
+  }
+
+  /**
+   * Returns mask where each bit is the XOR of all bits up to and including
+   * it, which marks the bytes between each pair of quotes.
+   */
+  static inline std::uint64_t
+  prefix_xor(std::uint64_t mask)
+  {
+    mask ^= mask << 1;
+    mask ^= mask << 2;
+    mask ^= mask << 4;
+    mask ^= mask << 8;
+    mask ^= mask << 16;
+    mask ^= mask << 32;
+
+    return mask;
+  }
+
+  /**
+   * First stage of the structural parser. Locates operators outside of
+   * strings, quotes which begin and end strings and first characters of
+   * literals and numbers, 64 bytes of input at a time. Returns false if the
+   * input ends in the middle of a string.
+   */
+  static bool
+  find_structurals(
+    const unsigned char* input,
+    std::size_t length,
+    std::vector<std::uint32_t>& indexes
+  )
+  {
+    std::uint64_t previous_ends_odd = 0;
+    std::uint64_t previous_in_string = 0;
+    std::uint64_t previous_scalar = 0;
+    unsigned char padded[64];
+
+    indexes.reserve(length / 4 + 1);
+    for (std::size_t offset = 0; offset < length; offset += 64)
+    {
+      const unsigned char* block = input + offset;
+
+      // Last partial block is padded with whitespace.
+      if (length - offset < 64)
+      {
+        std::memset(padded, ' ', sizeof(padded));
+        std::memcpy(padded, block, length - offset);
+        block = padded;
+      }
+
+      const auto masks = classify(block);
+      const auto escaped = find_escaped(masks.backslashes, previous_ends_odd);
+      const auto quotes = masks.quotes & ~escaped;
+      const auto in_string = prefix_xor(quotes) ^ previous_in_string;
+      const auto scalar = ~(
+        masks.operators |
+        masks.whitespace |
+        quotes |
+        in_string
+      );
+      const auto scalar_starts = scalar & ~((scalar << 1) | previous_scalar);
+      auto structurals = (masks.operators & ~in_string) |
+        quotes |
+        scalar_starts;
+
+      previous_in_string = static_cast<std::uint64_t>(
+        static_cast<std::int64_t>(in_string) >> 63
+      );
+      previous_scalar = scalar >> 63;
+
+      while (structurals)
+      {
+        indexes.push_back(offset + __builtin_ctzll(structurals));
+        structurals &= structurals - 1;
+      }
+    }
+
+    return !previous_in_string;
+  }
+
+  /**
+   * Parses number from the beginning of given range, returning pointer to
+   * the first character after it or null pointer if the range does not
+   * begin with a valid number.
+   */
+  static const unsigned char*
+  parse_number(
+    const unsigned char* begin,
+    const unsigned char* end,
+    double& result
+  )
+  {
+    const auto is_digit = [&end](const unsigned char* p)
+    {
+      return p < end && *p >= '0' && *p <= '9';
+    };
+    auto pos = begin;
+
+    if (pos < end && *pos == '-')
+    {
+      ++pos;
+    }
+    if (pos < end && *pos == '0')
+    {
+      ++pos;
+    }
+    else if (is_digit(pos))
+    {
+      while (is_digit(pos))
+      {
+        ++pos;
+      }
+    } else {
+      return nullptr;
+    }
+    if (pos < end && *pos == '.')
+    {
+      if (!is_digit(++pos))
+      {
+        return nullptr;
+      }
+      while (is_digit(pos))
+      {
+        ++pos;
+      }
+    }
+    if (pos < end && (*pos == 'e' || *pos == 'E'))
+    {
+      ++pos;
+      if (pos < end && (*pos == '+' || *pos == '-'))
+      {
+        ++pos;
+      }
+      if (!is_digit(pos))
+      {
+        return nullptr;
+      }
+      while (is_digit(pos))
+      {
+        ++pos;
+      }
+    }
+
+    // Input is not necessarily terminated, so the number is copied into a
+    // terminated buffer for strtod().
+    const std::string buffer(begin, pos);
+
+    result = std::strtod(buffer.c_str(), nullptr);
+
+    return pos;
+  }
+
+  static bool
+  parse_hex_quad(
+    const unsigned char*& pos,
+    const unsigned char* end,
+    char32_t& c
+  )
+  {
+    c = 0;
+    if (end - pos < 4)
+    {
+      return false;
+    }
+    for (int i = 0; i < 4; ++i)
+    {
+      const auto byte = *pos++;
+
+      c <<= 4;
+      if (byte >= '0' && byte <= '9')
+      {
+        c |= byte - '0';
+      }
+      else if (byte >= 'a' && byte <= 'f')
+      {
+        c |= byte - 'a' + 10;
+      }
+      else if (byte >= 'A' && byte <= 'F')
+      {
+        c |= byte - 'A' + 10;
+      } else {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  /**
+   * Decodes contents of a string between its quotes. The input has already
+   * been validated as UTF-8, so multibyte sequences are known to be well
+   * formed.
+   */
+  static const char*
+  decode_string(
+    const unsigned char* pos,
+    const unsigned char* end,
+    std::u32string& result
+  )
+  {
+    result.reserve(end - pos);
+    while (pos < end)
+    {
+      // Widen runs of plain ASCII characters without decoding them.
+      const auto start = pos;
+
+      while (pos < end && *pos >= 0x20 && *pos < 0x80 && *pos != '\\')
+      {
+        ++pos;
+      }
+      result.append(start, pos);
+      if (pos >= end)
+      {
+        break;
+      }
+
+      const auto byte = *pos++;
+
+      if (byte < 0x20)
+      {
+        return "Control character in string";
+      }
+      else if (byte >= 0x80)
+      {
+        result.push_back(decode_sequence(byte, pos));
+        continue;
+      }
+      else if (pos >= end)
+      {
+        return "Invalid escape sequence";
+      }
+
+      switch (*pos++)
+      {
+        case '"':
+          result.push_back('"');
+          break;
+
+        case '\\':
+          result.push_back('\\');
+          break;
+
+        case '/':
+          result.push_back('/');
+          break;
+
+        case 'b':
+          result.push_back('\b');
+          break;
+
+        case 'f':
+          result.push_back('\f');
+          break;
+
+        case 'n':
+          result.push_back('\n');
+          break;
+
+        case 'r':
+          result.push_back('\r');
+          break;
+
+        case 't':
+          result.push_back('\t');
+          break;
+
+        case 'u':
+          {
+            char32_t c;
+            char32_t low;
+
+            if (!parse_hex_quad(pos, end, c))
+            {
+              return "Invalid escape sequence";
+            }
+            else if (c >= 0xdc00 && c <= 0xdfff)
+            {
+              return "Unpaired surrogate";
+            }
+            else if (c >= 0xd800 && c <= 0xdbff)
+            {
+              if (end - pos < 2 || pos[0] != '\\' || pos[1] != 'u')
+              {
+                return "Unpaired surrogate";
+              }
+              pos += 2;
+              if (!parse_hex_quad(pos, end, low))
+              {
+                return "Invalid escape sequence";
+              }
+              else if (low < 0xdc00 || low > 0xdfff)
+              {
+                return "Unpaired surrogate";
+              }
+              c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+            }
+            result.push_back(c);
+          }
+          break;
+
+        default:
+          return "Invalid escape sequence";
+      }
+    }
+
+    return nullptr;
+  }
+
+  namespace
+  {
+    /**
+     * Second stage of the structural parser, which builds the values by
+     * walking through the structural characters found by the first stage
+     * instead of scanning through the whole input.
+     */
+    class StructuralParser
+    {
+    public:
+      explicit StructuralParser(
+        const unsigned char* input,
+        std::size_t length,
+        const std::vector<std::uint32_t>& indexes
+      )
+        : m_input(input)
+        , m_length(length)
+        , m_indexes(indexes)
+        , m_next(0)
+        , m_depth(0) {}
+
+      bool ParseDocument(value::ptr& result)
+      {
+        if (!ParseValue(result))
+        {
+          return false;
+        }
+        else if (m_next < m_indexes.size())
+        {
+          return Fail("Unexpected data after JSON value");
+        }
+
+        return true;
+      }
+
+      inline const std::string& GetError() const
+      {
+        return m_error;
+      }
+
+    private:
+      bool Fail(const std::string& message)
+      {
+        const auto offset = m_next < m_indexes.size()
+          ? m_indexes[m_next]
+          : m_length;
+
+        m_error = message + " at offset " + std::to_string(offset) + ".";
+
+        return false;
+      }
+
+      inline int Peek() const
+      {
+        return m_next < m_indexes.size() ? m_input[m_indexes[m_next]] : -1;
+      }
+
+      bool ParseValue(value::ptr& result)
+      {
+        switch (Peek())
+        {
+          case -1:
+            return Fail("Unexpected end of input");
+
+          case '{':
+            return ParseObject(result);
+
+          case '[':
+            return ParseArray(result);
+
+          case '"':
+            {
+              std::u32string s;
+
+              if (!ParseString(s))
+              {
+                return false;
+              }
+              result = string::make(s);
+
+              return true;
+            }
+
+          default:
+            return ParseScalar(result);
+        }
+      }
+
+      bool ParseObject(value::ptr& result)
+      {
+        object::container_type properties;
+
+        if (++m_depth > max_depth)
+        {
+          return Fail("Maximum nesting depth exceeded");
+        }
+        ++m_next;
+        if (Peek() == '}')
+        {
+          ++m_next;
+        } else {
+          for (;;)
+          {
+            std::u32string key;
+            value::ptr property;
+
+            if (Peek() != '"')
+            {
+              return Fail("Expected property name");
+            }
+            else if (!ParseString(key))
+            {
+              return false;
+            }
+            else if (Peek() != ':')
+            {
+              return Fail("Expected ':'");
+            }
+            ++m_next;
+            if (!ParseValue(property))
+            {
+              return false;
+            }
+            properties[std::move(key)] = property;
+            if (Peek() == ',')
+            {
+              ++m_next;
+            }
+            else if (Peek() == '}')
+            {
+              ++m_next;
+              break;
+            } else {
+              return Fail("Expected ',' or '}'");
+            }
+          }
+        }
+        --m_depth;
+        result = object::make(properties);
+
+        return true;
+      }
+
+      bool ParseArray(value::ptr& result)
+      {
+        array::container_type elements;
+
+        if (++m_depth > max_depth)
+        {
+          return Fail("Maximum nesting depth exceeded");
+        }
+        ++m_next;
+        if (Peek() == ']')
+        {
+          ++m_next;
+        } else {
+          for (;;)
+          {
+            value::ptr element;
+
+            if (!ParseValue(element))
+            {
+              return false;
+            }
+            elements.push_back(element);
+            if (Peek() == ',')
+            {
+              ++m_next;
+            }
+            else if (Peek() == ']')
+            {
+              ++m_next;
+              break;
+            } else {
+              return Fail("Expected ',' or ']'");
+            }
+          }
+        }
+        --m_depth;
+        result = array::make(elements);
+
+        return true;
+      }
+
+      bool ParseString(std::u32string& result)
+      {
+        // Both quotes of the string are structural characters, so the end
+        // of the string is already known.
+        if (m_next + 1 >= m_indexes.size())
+        {
+          return Fail("Unterminated string");
+        }
+
+        const auto begin = m_input + m_indexes[m_next] + 1;
+        const auto end = m_input + m_indexes[m_next + 1];
+
+        if (const auto error = decode_string(begin, end, result))
+        {
+          return Fail(error);
+        }
+        m_next += 2;
+
+        return true;
+      }
+
+      bool ParseScalar(value::ptr& result)
+      {
+        const auto begin = m_input + m_indexes[m_next];
+        auto end = begin;
+
+        while (
+          end < m_input + m_length &&
+          !is_whitespace(*end) &&
+          !is_operator(*end) &&
+          *end != '"'
+        )
+        {
+          ++end;
+        }
+
+        const std::size_t length = end - begin;
+
+        if (length == 4 && !std::memcmp(begin, "true", 4))
+        {
+          result = boolean::make(true);
+        }
+        else if (length == 5 && !std::memcmp(begin, "false", 5))
+        {
+          result = boolean::make(false);
+        }
+        else if (length == 4 && !std::memcmp(begin, "null", 4))
+        {
+          result = nullptr;
+        } else {
+          double number;
+
+          if (parse_number(begin, end, number) != end)
+          {
+            return Fail("Unexpected input");
+          }
+          result = number::make(number);
+        }
+        ++m_next;
+
+        return true;
+      }
+
+    private:
+      const unsigned char* m_input;
+      const std::size_t m_length;
+      const std::vector<std::uint32_t>& m_indexes;
+      std::size_t m_next;
+      int m_depth;
+      std::string m_error;
+    };
+
+    class PeeloCodec : public Codec
+    {
+    public:
+      parse_result_type Parse(const char* data, std::size_t length) const
+      {
+        using peelo::unicode::encoding::utf8::decode;
+
+        const auto result = peelo::json::parse(
+          decode(std::string(data, length))
+        );
+
+        if (!result)
+        {
+          return parse_result_type::error(result.error().what());
+        }
+
+        return parse_result_type::ok(*result);
+      }
+
+      std::string Format(const value::ptr& value) const
+      {
+        return peelo::json::format(value);
+      }
+    };
+
+    class StructuralCodec : public Codec
+    {
+    public:
+      parse_result_type Parse(const char* data, std::size_t length) const;
+
+      std::string Format(const value::ptr& value) const;
+    };
+  }
+
+  parse_result_type
+  StructuralCodec::Parse(const char* data, std::size_t length) const
+  {
+    const auto input = reinterpret_cast<const unsigned char*>(data);
+    std::vector<std::uint32_t> indexes;
+    value::ptr result;
+
+    if (length > UINT32_MAX)
+    {
+      return parse_result_type::error("Input is too large.");
+    }
+    else if (!is_valid_utf8(data, length))
+    {
+      return parse_result_type::error("Input is not valid UTF-8.");
+    }
+    else if (!find_structurals(input, length, indexes))
+    {
+      return parse_result_type::error("Unterminated string.");
+    }
+
+    StructuralParser parser(input, length, indexes);
+
+    if (!parser.ParseDocument(result))
+    {
+      return parse_result_type::error(parser.GetError());
+    }
+
+    return parse_result_type::ok(result);
+  }
+
+  static void
+  format_string(std::string& output, const std::u32string& input)
+  {
+    static const char hex[] = "0123456789abcdef";
+
+    output.push_back('"');
+    for (const auto c : input)
+    {
+      switch (c)
+      {
+        case '"':
+          output.append("\\\"");
+          break;
+
+        case '\\':
+          output.append("\\\\");
+          break;
+
+        case '\b':
+          output.append("\\b");
+          break;
+
+        case '\f':
+          output.append("\\f");
+          break;
+
+        case '\n':
+          output.append("\\n");
+          break;
+
+        case '\r':
+          output.append("\\r");
+          break;
+
+        case '\t':
+          output.append("\\t");
+          break;
+
+        default:
+          if (c < 0x20)
+          {
+            output.append("\\u00");
+            output.push_back(hex[c >> 4]);
+            output.push_back(hex[c & 0xf]);
+          }
+          else if (c < 0x80)
+          {
+            output.push_back(static_cast<char>(c));
+          }
+          else if (c < 0x800)
+          {
+            output.push_back(static_cast<char>(0xc0 | (c >> 6)));
+            output.push_back(static_cast<char>(0x80 | (c & 0x3f)));
+          }
+          else if (c < 0x10000)
+          {
+            output.push_back(static_cast<char>(0xe0 | (c >> 12)));
+            output.push_back(static_cast<char>(0x80 | ((c >> 6) & 0x3f)));
+            output.push_back(static_cast<char>(0x80 | (c & 0x3f)));
+          } else {
+            output.push_back(static_cast<char>(0xf0 | (c >> 18)));
+            output.push_back(static_cast<char>(0x80 | ((c >> 12) & 0x3f)));
+            output.push_back(static_cast<char>(0x80 | ((c >> 6) & 0x3f)));
+            output.push_back(static_cast<char>(0x80 | (c & 0x3f)));
+          }
+      }
+    }
+    output.push_back('"');
+  }
+
+  static void
+  format_number(std::string& output, double value)
+  {
+    char buffer[32];
+
+    // JSON has no representation for infinities or NaN.
+    if (!std::isfinite(value))
+    {
+      output.append("null");
+      return;
+    }
+    else if (value == std::trunc(value) && std::fabs(value) < 1e15)
+    {
+      std::snprintf(buffer, sizeof(buffer), "%.0f", value);
+    } else {
+      std::snprintf(buffer, sizeof(buffer), "%.17g", value);
+    }
+    output.append(buffer);
+  }
+
+  static void
+  format_value(std::string& output, const value::ptr& value)
+  {
+    if (!value)
+    {
+      output.append("null");
+    }
+    else if (const auto o = std::dynamic_pointer_cast<object>(value))
+    {
+      bool first = true;
+
+      output.push_back('{');
+      for (const auto& property : o->properties())
+      {
+        if (first)
+        {
+          first = false;
+        } else {
+          output.push_back(',');
+        }
+        format_string(output, property.first);
+        output.push_back(':');
+        format_value(output, property.second);
+      }
+      output.push_back('}');
+    }
+    else if (const auto a = std::dynamic_pointer_cast<array>(value))
+    {
+      bool first = true;
+
+      output.push_back('[');
+      for (const auto& element : a->elements())
+      {
+        if (first)
+        {
+          first = false;
+        } else {
+          output.push_back(',');
+        }
+        format_value(output, element);
+      }
+      output.push_back(']');
+    }
+    else if (const auto s = std::dynamic_pointer_cast<string>(value))
+    {
+      format_string(output, s->value());
+    }
+    else if (const auto n = std::dynamic_pointer_cast<number>(value))
+    {
+      format_number(output, n->value());
+    }
+    else if (const auto b = std::dynamic_pointer_cast<boolean>(value))
+    {
+      output.append(b->value() ? "true" : "false");
+    } else {
+      output.append("null");
+    }
+  }
+
+  std::string
+  StructuralCodec::Format(const value::ptr& value) const
+  {
+    std::string output;
+
+    format_value(output, value);
+
+    return output;
+  }
+
+  static const PeeloCodec peelo_codec;
+  static const StructuralCodec structural_codec;
+  static const Codec* selected_codec = &structural_codec;
+
+  const Codec&
+  get_codec(CodecType type)
+  {
+    if (type == CodecType::peelo)
+    {
+      return peelo_codec;
+    }
+
+    return structural_codec;
+  }
+
+  void
+  set_codec(CodecType type)
+  {
+    selected_codec = &get_codec(type);
+  }
+
+  parse_result_type
+  parse(const char* data, std::size_t length)
+  {
+    return selected_codec->Parse(data, length);
+  }
+
+  parse_object_result_type
+  parse_object(const char* data, std::size_t length)
+  {
+    const auto result = parse(data, length);
+
+    if (!result)
+    {
+      return parse_object_result_type::error(result.error());
+    }
+    else if (const auto o = std::dynamic_pointer_cast<object>(*result))
+    {
+      return parse_object_result_type::ok(o);
+    }
+
+    return parse_object_result_type::error("Value is not an object.");
+  }
+
+  std::string
+  format(const value::ptr& value)
+  {
+    return selected_codec->Format(value);
+  }
+}
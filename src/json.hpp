@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2024, Rauli Laine
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include <peelo/json/value.hpp>
+#include <peelo/result.hpp>
+
+namespace varasto::json
+{
+  using parse_result_type = peelo::result<
+    peelo::json::value::ptr,
+    std::string
+  >;
+  using parse_object_result_type = peelo::result<
+    peelo::json::object::ptr,
+    std::string
+  >;
+
+  enum class CodecType
+  {
+    /** Parser and formatter of the peelo-json library. */
+    peelo,
+    /** Two stage parser which first locates the structural characters. */
+    structural,
+  };
+
+  /**
+   * Converts JSON values from and into their UTF-8 encoded textual
+   * representation.
+   */
+  class Codec
+  {
+  public:
+    virtual ~Codec() = default;
+
+    virtual parse_result_type Parse(
+      const char* data,
+      std::size_t length
+    ) const = 0;
+
+    virtual std::string Format(const peelo::json::value::ptr& value) const = 0;
+  };
+
+  /**
+   * Returns codec of given type.
+   */
+  const Codec& get_codec(CodecType type);
+
+  /**
+   * Selects codec used by the functions below. Must be called before any
+   * other threads are started.
+   */
+  void set_codec(CodecType type);
+
+  /**
+   * Returns true if given bytes are valid UTF-8. ASCII input is checked
+   * eight bytes at a time.
+   */
+  bool is_valid_utf8(const char* data, std::size_t length);
+
+  /**
+   * Decodes UTF-8 bytes which have already been validated with
+   * is_valid_utf8() into given string, without copying them first.
+   */
+  void decode_utf8(
+    const char* data,
+    std::size_t length,
+    std::u32string& result
+  );
+
+  /**
+   * Parses JSON value from UTF-8 encoded bytes with the selected codec.
+   */
+  parse_result_type parse(const char* data, std::size_t length);
+
+  /**
+   * Parses JSON object from UTF-8 encoded bytes with the selected codec.
+   */
+  parse_object_result_type parse_object(const char* data, std::size_t length);
+
+  /**
+   * Formats given JSON value into UTF-8 encoded text with the selected
+   * codec.
+   */
+  std::string format(const peelo::json::value::ptr& value);
+
+  inline parse_result_type
+  parse(const std::string& input)
+  {
+    return parse(input.data(), input.length());
+  }
+
+  inline parse_object_result_type
+  parse_object(const std::string& input)
+  {
+    return parse_object(input.data(), input.length());
+  }
+
+  /**
+   * Converts given slug into key of a JSON object. Slugs consist only of
+   * ASCII characters, so they can be widened without decoding them.
+   */
+  inline std::u32string
+  widen_slug(const std::string& slug)
+  {
+    return std::u32string(std::begin(slug), std::end(slug));
+  }
+}
@@ -0,0 +1,430 @@
+/*
+ * Copyright (c) 2024, Rauli Laine
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <algorithm>
+#include <iterator>
+
+#include "./key-index.hpp"
+
+namespace varasto
+{
+  KeyIndex::KeyIndex(
+    const loader_type& loader,
+    const stats_loader_type& stats_loader,
+    std::size_t capacity
+  )
+    : m_loader(loader)
+    , m_stats_loader(stats_loader)
+    , m_shard_capacity(std::max<std::size_t>(capacity / shard_count, 1))
+    , m_last_version(0) {}
+
+  KeyIndex::query_result_type
+  KeyIndex::Query(const key_type& ns, const list_options_type& options)
+  {
+    auto& shard = GetShard(ns);
+    std::unique_lock<std::mutex> lock(shard.mutex);
+    const auto ns_it = Find(shard, lock, ns);
+    std::vector<key_type> result;
+
+    if (!ns_it)
+    {
+      return query_result_type::error(ns_it.error());
+    }
+    else if (*ns_it == std::end(shard.namespaces))
+    {
+      return query_result_type::ok(result);
+    }
+
+    const auto& keys = (*ns_it)->second.keys;
+    auto it = options.after < options.prefix
+      ? keys.lower_bound(options.prefix)
+      : keys.upper_bound(options.after);
+
+    for (; it != std::end(keys); ++it)
+    {
+      if (
+        (options.limit && result.size() >= options.limit) ||
+        it->compare(0, options.prefix.length(), options.prefix)
+      )
+      {
+        break;
+      }
+      result.push_back(*it);
+    }
+
+    return query_result_type::ok(result);
+  }
+
+  KeyIndex::stats_result_type
+  KeyIndex::GetStats(const key_type& ns)
+  {
+    auto& shard = GetShard(ns);
+    std::unique_lock<std::mutex> lock(shard.mutex);
+
+    for (;;)
+    {
+      const auto ns_it = Find(shard, lock, ns);
+
+      if (!ns_it)
+      {
+        return stats_result_type::error(ns_it.error());
+      }
+      else if (*ns_it == std::end(shard.namespaces))
+      {
+        return stats_result_type::ok(std::nullopt);
+      }
+
+      auto& entry = (*ns_it)->second;
+
+      if (entry.stats)
+      {
+        entry.stats->count = entry.keys.size();
+
+        return stats_result_type::ok(entry.stats);
+      }
+      else if (entry.stats_loading)
+      {
+        shard.loaded.wait(lock);
+        continue;
+      }
+
+      const auto generation = entry.generation;
+
+      entry.stats_loading = true;
+      lock.unlock();
+      const auto result = m_stats_loader(ns);
+      lock.lock();
+      shard.loaded.notify_all();
+
+      // Namespace may have been evicted or removed during the scan, in
+      // which case the statistics are thrown away and the namespace is
+      // loaded again.
+      const auto it = shard.namespaces.find(ns);
+
+      if (
+        it == std::end(shard.namespaces) ||
+        it->second.loading ||
+        it->second.generation != generation
+      )
+      {
+        if (!result)
+        {
+          return result;
+        }
+        continue;
+      }
+
+      auto& loaded = it->second;
+
+      loaded.stats_loading = false;
+      if (!result)
+      {
+        loaded.pending_size = 0;
+
+        return result;
+      }
+      // Entries modified during the scan may have been measured by it
+      // either before or after the modification, so the statistics are an
+      // estimate until the namespace is scanned again.
+      loaded.stats = result->value_or(stats_type());
+      loaded.stats->size = static_cast<std::uint64_t>(std::max<std::int64_t>(
+        static_cast<std::int64_t>(loaded.stats->size) + loaded.pending_size,
+        0
+      ));
+      loaded.stats->count = loaded.keys.size();
+      loaded.pending_size = 0;
+
+      return stats_result_type::ok(loaded.stats);
+    }
+  }
+
+  bool
+  KeyIndex::HasStats(const key_type& ns)
+  {
+    auto& shard = GetShard(ns);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    const auto ns_it = shard.namespaces.find(ns);
+
+    return ns_it != std::end(shard.namespaces) && (
+      ns_it->second.stats || ns_it->second.stats_loading
+    );
+  }
+
+  KeyIndex::version_result_type
+  KeyIndex::GetVersion(const key_type& ns)
+  {
+    auto& shard = GetShard(ns);
+    std::unique_lock<std::mutex> lock(shard.mutex);
+    const auto ns_it = Find(shard, lock, ns);
+
+    if (!ns_it)
+    {
+      return version_result_type::error(ns_it.error());
+    }
+    else if (*ns_it == std::end(shard.namespaces))
+    {
+      return version_result_type::ok(0);
+    }
+
+    return version_result_type::ok((*ns_it)->second.version);
+  }
+
+  void
+  KeyIndex::Load(const key_type& ns, std::vector<key_type>&& keys)
+  {
+    auto& shard = GetShard(ns);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    if (
+      !keys.empty() &&
+      shard.namespaces.find(ns) == std::end(shard.namespaces)
+    )
+    {
+      const auto ns_it = shard.namespaces.emplace(ns, Namespace()).first;
+
+      ns_it->second.keys = std::set<key_type>(
+        std::make_move_iterator(std::begin(keys)),
+        std::make_move_iterator(std::end(keys))
+      );
+      ns_it->second.version = ++m_last_version;
+      ns_it->second.generation = ns_it->second.version;
+      shard.lru.push_front(ns);
+      ns_it->second.lru_position = std::begin(shard.lru);
+      Touch(shard, ns_it);
+    }
+  }
+
+  void
+  KeyIndex::ForEachNamespace(const visitor_type& visitor)
+  {
+    for (auto& shard : m_shards)
+    {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+
+      for (const auto& ns : shard.namespaces)
+      {
+        if (!ns.second.loading)
+        {
+          visitor(ns.first, ns.second.keys);
+        }
+      }
+    }
+  }
+
+  void
+  KeyIndex::Insert(
+    const key_type& ns,
+    const key_type& key,
+    std::int64_t size_difference
+  )
+  {
+    auto& shard = GetShard(ns);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    const auto ns_it = shard.namespaces.find(ns);
+
+    // Namespaces which have not been loaded yet will pick up the key when
+    // they are.
+    if (ns_it == std::end(shard.namespaces))
+    {
+      return;
+    }
+
+    auto& entry = ns_it->second;
+
+    if (entry.loading)
+    {
+      entry.pending[key] = true;
+
+      return;
+    }
+    entry.keys.insert(key);
+    entry.version = ++m_last_version;
+    if (entry.stats)
+    {
+      entry.stats->size += size_difference;
+      entry.stats->last_modified = stats_type::time_type::clock::now();
+    }
+    else if (entry.stats_loading)
+    {
+      entry.pending_size += size_difference;
+    }
+  }
+
+  void
+  KeyIndex::Erase(
+    const key_type& ns,
+    const key_type& key,
+    std::uint64_t size
+  )
+  {
+    auto& shard = GetShard(ns);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    const auto ns_it = shard.namespaces.find(ns);
+
+    if (ns_it == std::end(shard.namespaces))
+    {
+      return;
+    }
+
+    auto& entry = ns_it->second;
+
+    if (entry.loading)
+    {
+      entry.pending[key] = false;
+
+      return;
+    }
+    entry.keys.erase(key);
+    entry.version = ++m_last_version;
+    if (entry.keys.empty())
+    {
+      Remove(shard, ns_it);
+    }
+    else if (entry.stats)
+    {
+      entry.stats->size -= std::min(entry.stats->size, size);
+      entry.stats->last_modified = stats_type::time_type::clock::now();
+    }
+    else if (entry.stats_loading)
+    {
+      entry.pending_size -= static_cast<std::int64_t>(size);
+    }
+  }
+
+  void
+  KeyIndex::EraseNamespace(const key_type& ns)
+  {
+    auto& shard = GetShard(ns);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    const auto ns_it = shard.namespaces.find(ns);
+
+    if (ns_it == std::end(shard.namespaces))
+    {
+      return;
+    }
+    else if (ns_it->second.loading)
+    {
+      // Whatever the scan finds has been removed by now.
+      ns_it->second.cleared = true;
+      ns_it->second.pending.clear();
+    } else {
+      Remove(shard, ns_it);
+    }
+  }
+
+  KeyIndex::Shard&
+  KeyIndex::GetShard(const key_type& ns)
+  {
+    return m_shards[std::hash<key_type>()(ns) % shard_count];
+  }
+
+  peelo::result<KeyIndex::namespace_map_type::iterator, std::string>
+  KeyIndex::Find(
+    Shard& shard,
+    std::unique_lock<std::mutex>& lock,
+    const key_type& ns
+  )
+  {
+    using result_type = peelo::result<
+      namespace_map_type::iterator,
+      std::string
+    >;
+    auto ns_it = shard.namespaces.find(ns);
+
+    // Wait for other thread which is already scanning the namespace.
+    while (ns_it != std::end(shard.namespaces) && ns_it->second.loading)
+    {
+      shard.loaded.wait(lock);
+      ns_it = shard.namespaces.find(ns);
+    }
+
+    if (ns_it != std::end(shard.namespaces))
+    {
+      Touch(shard, ns_it);
+
+      return result_type::ok(ns_it);
+    }
+
+    shard.namespaces[ns].loading = true;
+    lock.unlock();
+    auto keys = m_loader(ns);
+    lock.lock();
+    ns_it = shard.namespaces.find(ns);
+
+    auto& entry = ns_it->second;
+
+    entry.loading = false;
+    shard.loaded.notify_all();
+
+    if (!keys)
+    {
+      shard.namespaces.erase(ns_it);
+
+      return result_type::error(keys.error());
+    }
+    else if (!entry.cleared)
+    {
+      entry.keys.insert(std::begin(*keys), std::end(*keys));
+    }
+    for (const auto& operation : entry.pending)
+    {
+      if (operation.second)
+      {
+        entry.keys.insert(operation.first);
+      } else {
+        entry.keys.erase(operation.first);
+      }
+    }
+    entry.pending.clear();
+    entry.cleared = false;
+
+    // Namespaces which do not exist are not stored in the index.
+    if (entry.keys.empty())
+    {
+      shard.namespaces.erase(ns_it);
+
+      return result_type::ok(std::end(shard.namespaces));
+    }
+    entry.version = ++m_last_version;
+    entry.generation = entry.version;
+    shard.lru.push_front(ns);
+    entry.lru_position = std::begin(shard.lru);
+    Touch(shard, ns_it);
+
+    return result_type::ok(ns_it);
+  }
+
+  void
+  KeyIndex::Touch(Shard& shard, namespace_map_type::iterator ns_it)
+  {
+    shard.lru.splice(
+      std::begin(shard.lru),
+      shard.lru,
+      ns_it->second.lru_position
+    );
+    while (shard.lru.size() > m_shard_capacity)
+    {
+      shard.namespaces.erase(shard.lru.back());
+      shard.lru.pop_back();
+    }
+  }
+
+  void
+  KeyIndex::Remove(Shard& shard, namespace_map_type::iterator ns_it)
+  {
+    shard.lru.erase(ns_it->second.lru_position);
+    shard.namespaces.erase(ns_it);
+  }
+}
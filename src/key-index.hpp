@@ -0,0 +1,208 @@
+/*
+ * Copyright (c) 2024, Rauli Laine
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <set>
+#include <unordered_map>
+
+#include "./storage.hpp"
+
+namespace varasto
+{
+  /**
+   * Keeps keys of each namespace in sorted order, so that listings can be
+   * restricted to a range of keys without looking at the whole namespace.
+   * Namespaces are loaded into the index lazily when they are first listed.
+   * Statistics of a namespace are loaded when they are first requested, and
+   * kept up to date from then on. Each namespace also has a version, which
+   * is taken from a counter shared by all namespaces whenever the namespace
+   * is loaded or modified, so that versions are never reused.
+   *
+   * Namespaces are spread over shards with their own locks, and they and
+   * their statistics are scanned without holding the lock. Modifications
+   * made while a namespace is being scanned are recorded and replayed once
+   * the scan is done. When a shard holds too many namespaces, the least
+   * recently used ones are evicted and loaded again when they are needed.
+   */
+  class KeyIndex
+  {
+  public:
+    using key_type = Storage::key_type;
+    using list_options_type = Storage::ListOptions;
+    using query_result_type = Storage::get_all_keys_type;
+    using stats_type = Storage::NamespaceStats;
+    using stats_result_type = Storage::get_stats_result_type;
+    using version_type = std::uint64_t;
+    using version_result_type = peelo::result<version_type, std::string>;
+    using loader_type = std::function<query_result_type(const key_type&)>;
+    using stats_loader_type = std::function<
+      stats_result_type(const key_type&)
+    >;
+    using visitor_type = std::function<
+      void(const key_type&, const std::set<key_type>&)
+    >;
+
+    /** Default for maximum number of namespaces kept in the index. */
+    static constexpr std::size_t default_capacity = 65536;
+
+    explicit KeyIndex(
+      const loader_type& loader,
+      const stats_loader_type& stats_loader,
+      std::size_t capacity = default_capacity
+    );
+
+    KeyIndex(const KeyIndex&) = delete;
+    KeyIndex(KeyIndex&&) = delete;
+    KeyIndex& operator=(const KeyIndex&) = delete;
+    KeyIndex& operator=(KeyIndex&&) = delete;
+
+    /**
+     * Returns keys of given namespace matching given options, loading the
+     * namespace into the index first if needed.
+     */
+    query_result_type Query(
+      const key_type& ns,
+      const list_options_type& options
+    );
+
+    /**
+     * Returns statistics of given namespace, loading the namespace and its
+     * statistics into the index first if needed.
+     */
+    stats_result_type GetStats(const key_type& ns);
+
+    /**
+     * Returns true if statistics of given namespace are being kept up to
+     * date, so that callers know whether to measure size differences of the
+     * entries they modify.
+     */
+    bool HasStats(const key_type& ns);
+
+    /**
+     * Returns version of given namespace, loading the namespace into the
+     * index first if needed. Namespaces which do not exist have version
+     * zero.
+     */
+    version_result_type GetVersion(const key_type& ns);
+
+    /**
+     * Stores keys of given namespace which have been scanned in advance,
+     * unless the namespace has already been loaded.
+     */
+    void Load(const key_type& ns, std::vector<key_type>&& keys);
+
+    /**
+     * Calls given visitor with keys of each namespace which has been loaded
+     * into the index.
+     */
+    void ForEachNamespace(const visitor_type& visitor);
+
+    /**
+     * Adds key into given namespace. Size difference between the new and
+     * the previous value of the entry is added into size of the namespace.
+     */
+    void Insert(
+      const key_type& ns,
+      const key_type& key,
+      std::int64_t size_difference = 0
+    );
+
+    void Erase(
+      const key_type& ns,
+      const key_type& key,
+      std::uint64_t size = 0
+    );
+
+    void EraseNamespace(const key_type& ns);
+
+  private:
+    struct Namespace
+    {
+      std::set<key_type> keys;
+      /** Statistics of the namespace, once they have been loaded. */
+      std::optional<stats_type> stats;
+      /** Whether statistics of the namespace are being scanned. */
+      bool stats_loading = false;
+      /** Size difference of entries modified during the statistics scan. */
+      std::int64_t pending_size = 0;
+      version_type version = 0;
+      /** Version of the namespace when it was loaded into the index. */
+      version_type generation = 0;
+      /** Whether the namespace is still being scanned. */
+      bool loading = false;
+      /** Whether the namespace was removed while it was being scanned. */
+      bool cleared = false;
+      /**
+       * Keys inserted (true) or erased (false) while the namespace was being
+       * scanned.
+       */
+      std::unordered_map<key_type, bool> pending;
+      std::list<key_type>::iterator lru_position;
+    };
+
+    using namespace_map_type = std::unordered_map<key_type, Namespace>;
+
+    struct Shard
+    {
+      std::mutex mutex;
+      /**
+       * Signaled when a namespace of the shard or its statistics have been
+       * scanned.
+       */
+      std::condition_variable loaded;
+      namespace_map_type namespaces;
+      /** Loaded namespaces, most recently used first. */
+      std::list<key_type> lru;
+    };
+
+    static constexpr std::size_t shard_count = 16;
+
+    Shard& GetShard(const key_type& ns);
+
+    /**
+     * Loads given namespace into the index if it's not there already. The
+     * lock of the shard is released while the namespace is being scanned.
+     * Returns end iterator if the namespace does not exist.
+     */
+    peelo::result<namespace_map_type::iterator, std::string> Find(
+      Shard& shard,
+      std::unique_lock<std::mutex>& lock,
+      const key_type& ns
+    );
+
+    /**
+     * Marks given namespace as the most recently used one and evicts least
+     * recently used namespaces of the shard if it has grown too large.
+     */
+    void Touch(Shard& shard, namespace_map_type::iterator ns_it);
+
+    void Remove(Shard& shard, namespace_map_type::iterator ns_it);
+
+  private:
+    const loader_type m_loader;
+    const stats_loader_type m_stats_loader;
+    const std::size_t m_shard_capacity;
+    std::array<Shard, shard_count> m_shards;
+    std::atomic<version_type> m_last_version;
+  };
+}
@@ -0,0 +1,283 @@
+/*
+ * Copyright (c) 2024, Rauli Laine
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <algorithm>
+#include <functional>
+#include <mutex>
+
+#include "./locking-storage.hpp"
+
+namespace varasto
+{
+  using shared_lock = std::shared_lock<std::shared_mutex>;
+  using unique_lock = std::unique_lock<std::shared_mutex>;
+
+  LockingStorage::LockingStorage(const storage_type& storage)
+    : m_storage(storage) {}
+
+  Storage::get_result_type
+  LockingStorage::Get(
+    const key_type& ns,
+    const key_type& key
+  ) const
+  {
+    shared_lock ns_lock(GetNamespaceMutex(ns));
+    shared_lock entry_lock(GetEntryMutex(ns, key));
+
+    return m_storage->Get(ns, key);
+  }
+
+  Storage::get_raw_result_type
+  LockingStorage::GetRaw(
+    const key_type& ns,
+    const key_type& key
+  ) const
+  {
+    shared_lock ns_lock(GetNamespaceMutex(ns));
+    shared_lock entry_lock(GetEntryMutex(ns, key));
+
+    return m_storage->GetRaw(ns, key);
+  }
+
+  Storage::get_version_result_type
+  LockingStorage::GetVersion(
+    const key_type& ns,
+    const key_type& key
+  ) const
+  {
+    shared_lock ns_lock(GetNamespaceMutex(ns));
+    shared_lock entry_lock(GetEntryMutex(ns, key));
+
+    return m_storage->GetVersion(ns, key);
+  }
+
+  Storage::multi_get_result_type
+  LockingStorage::MultiGet(
+    const std::vector<std::pair<key_type, key_type>>& entries
+  ) const
+  {
+    std::vector<std::shared_mutex*> mutexes;
+    std::vector<shared_lock> locks;
+
+    for (const auto& entry : entries)
+    {
+      mutexes.push_back(&GetNamespaceMutex(entry.first));
+    }
+
+    // Namespace stripes are locked before entry stripes, and stripes of both
+    // kinds in the order of their addresses, just like in Write().
+    std::sort(std::begin(mutexes), std::end(mutexes));
+    mutexes.erase(
+      std::unique(std::begin(mutexes), std::end(mutexes)),
+      std::end(mutexes)
+    );
+    locks.reserve(mutexes.size() + entries.size());
+    for (const auto mutex : mutexes)
+    {
+      locks.emplace_back(*mutex);
+    }
+
+    mutexes.clear();
+    for (const auto& entry : entries)
+    {
+      mutexes.push_back(&GetEntryMutex(entry.first, entry.second));
+    }
+    std::sort(std::begin(mutexes), std::end(mutexes));
+    mutexes.erase(
+      std::unique(std::begin(mutexes), std::end(mutexes)),
+      std::end(mutexes)
+    );
+    for (const auto mutex : mutexes)
+    {
+      locks.emplace_back(*mutex);
+    }
+
+    return m_storage->MultiGet(entries);
+  }
+
+  Storage::get_all_keys_type
+  LockingStorage::GetAllKeys(const key_type& ns) const
+  {
+    shared_lock ns_lock(GetNamespaceMutex(ns));
+
+    return m_storage->GetAllKeys(ns);
+  }
+
+  Storage::get_stats_result_type
+  LockingStorage::GetStats(const key_type& ns) const
+  {
+    shared_lock ns_lock(GetNamespaceMutex(ns));
+
+    return m_storage->GetStats(ns);
+  }
+
+  Storage::get_namespace_version_result_type
+  LockingStorage::GetNamespaceVersion(const key_type& ns) const
+  {
+    shared_lock ns_lock(GetNamespaceMutex(ns));
+
+    return m_storage->GetNamespaceVersion(ns);
+  }
+
+  Storage::get_all_keys_type
+  LockingStorage::GetKeys(
+    const key_type& ns,
+    const ListOptions& options
+  ) const
+  {
+    shared_lock ns_lock(GetNamespaceMutex(ns));
+
+    return m_storage->GetKeys(ns, options);
+  }
+
+  Storage::for_each_entry_result_type
+  LockingStorage::ForEachEntry(
+    const key_type& ns,
+    const ListOptions& options,
+    const entry_visitor_type& visitor
+  ) const
+  {
+    // Listing can be streamed to a slow client, so no lock is held for its
+    // whole duration. Entries are read one at a time, and each of them is
+    // either the previous or the new version of the entry.
+    return m_storage->ForEachEntry(ns, options, visitor);
+  }
+
+  Storage::set_result_type
+  LockingStorage::Set(
+    const key_type& ns,
+    const key_type& key,
+    const value_type& value
+  )
+  {
+    shared_lock ns_lock(GetNamespaceMutex(ns));
+    unique_lock entry_lock(GetEntryMutex(ns, key));
+
+    return m_storage->Set(ns, key, value);
+  }
+
+  Storage::update_result_type
+  LockingStorage::Update(
+    const key_type& ns,
+    const key_type& key,
+    const value_type& value
+  )
+  {
+    shared_lock ns_lock(GetNamespaceMutex(ns));
+    unique_lock entry_lock(GetEntryMutex(ns, key));
+
+    return m_storage->Update(ns, key, value);
+  }
+
+  Storage::merge_result_type
+  LockingStorage::Merge(
+    const key_type& ns,
+    const key_type& key,
+    const value_type& patch
+  )
+  {
+    shared_lock ns_lock(GetNamespaceMutex(ns));
+    unique_lock entry_lock(GetEntryMutex(ns, key));
+
+    return m_storage->Merge(ns, key, patch);
+  }
+
+  Storage::delete_result_type
+  LockingStorage::Delete(
+    const key_type& ns,
+    const key_type& key
+  )
+  {
+    shared_lock ns_lock(GetNamespaceMutex(ns));
+    unique_lock entry_lock(GetEntryMutex(ns, key));
+
+    return m_storage->Delete(ns, key);
+  }
+
+  Storage::delete_namespace_result_type
+  LockingStorage::DeleteNamespace(const key_type& ns)
+  {
+    unique_lock ns_lock(GetNamespaceMutex(ns));
+
+    return m_storage->DeleteNamespace(ns);
+  }
+
+  Storage::drop_namespace_result_type
+  LockingStorage::DropNamespace(const key_type& ns)
+  {
+    unique_lock ns_lock(GetNamespaceMutex(ns));
+
+    return m_storage->DropNamespace(ns);
+  }
+
+  Storage::write_batch_result_type
+  LockingStorage::Write(const std::vector<WriteOperation>& operations)
+  {
+    std::vector<std::shared_mutex*> ns_mutexes;
+    std::vector<std::shared_mutex*> entry_mutexes;
+    std::vector<shared_lock> ns_locks;
+    std::vector<unique_lock> entry_locks;
+
+    for (const auto& operation : operations)
+    {
+      ns_mutexes.push_back(&GetNamespaceMutex(operation.ns));
+      entry_mutexes.push_back(&GetEntryMutex(operation.ns, operation.key));
+    }
+
+    // Stripes are always locked in the order of their addresses, so that two
+    // batches touching the same stripes cannot deadlock each other.
+    for (auto* mutexes : { &ns_mutexes, &entry_mutexes })
+    {
+      std::sort(std::begin(*mutexes), std::end(*mutexes));
+      mutexes->erase(
+        std::unique(std::begin(*mutexes), std::end(*mutexes)),
+        std::end(*mutexes)
+      );
+    }
+
+    ns_locks.reserve(ns_mutexes.size());
+    for (const auto mutex : ns_mutexes)
+    {
+      ns_locks.emplace_back(*mutex);
+    }
+    entry_locks.reserve(entry_mutexes.size());
+    for (const auto mutex : entry_mutexes)
+    {
+      entry_locks.emplace_back(*mutex);
+    }
+
+    return m_storage->Write(operations);
+  }
+
+  std::shared_mutex&
+  LockingStorage::GetNamespaceMutex(const key_type& ns) const
+  {
+    const auto hash = std::hash<key_type>()(ns);
+
+    return m_namespace_mutexes[hash % namespace_stripe_count];
+  }
+
+  std::shared_mutex&
+  LockingStorage::GetEntryMutex(
+    const key_type& ns,
+    const key_type& key
+  ) const
+  {
+    const std::hash<key_type> hasher;
+    const auto hash = hasher(ns) * 31 + hasher(key);
+
+    return m_entry_mutexes[hash % entry_stripe_count];
+  }
+}
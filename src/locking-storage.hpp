@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2024, Rauli Laine
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#pragma once
+
+#include <array>
+#include <memory>
+#include <shared_mutex>
+
+#include "./storage.hpp"
+
+namespace varasto
+{
+  /**
+   * Storage decorator which serializes conflicting operations on the wrapped
+   * storage. Entries are protected by a fixed array of reader-writer locks
+   * selected by hash of the namespace and key, so that reads never block
+   * each other and writes only block operations on entries that hash into
+   * the same stripe. Namespaces have their own lock stripes, which are held
+   * exclusively while a whole namespace is being deleted.
+   */
+  class LockingStorage : public Storage
+  {
+  public:
+    using storage_type = std::shared_ptr<Storage>;
+
+    static constexpr std::size_t namespace_stripe_count = 64;
+    static constexpr std::size_t entry_stripe_count = 1024;
+
+    explicit LockingStorage(const storage_type& storage);
+
+    LockingStorage(const LockingStorage&) = delete;
+    LockingStorage(LockingStorage&&) = delete;
+    LockingStorage& operator=(const LockingStorage&) = delete;
+    LockingStorage& operator=(LockingStorage&&) = delete;
+
+    get_result_type Get(
+      const key_type& ns,
+      const key_type& key
+    ) const;
+
+    get_raw_result_type GetRaw(
+      const key_type& ns,
+      const key_type& key
+    ) const;
+
+    get_version_result_type GetVersion(
+      const key_type& ns,
+      const key_type& key
+    ) const;
+
+    multi_get_result_type MultiGet(
+      const std::vector<std::pair<key_type, key_type>>& entries
+    ) const;
+
+    get_all_keys_type GetAllKeys(
+      const key_type& ns
+    ) const;
+
+    get_stats_result_type GetStats(
+      const key_type& ns
+    ) const;
+
+    get_namespace_version_result_type GetNamespaceVersion(
+      const key_type& ns
+    ) const;
+
+    get_all_keys_type GetKeys(
+      const key_type& ns,
+      const ListOptions& options
+    ) const;
+
+    for_each_entry_result_type ForEachEntry(
+      const key_type& ns,
+      const ListOptions& options,
+      const entry_visitor_type& visitor
+    ) const;
+
+    set_result_type Set(
+      const key_type& ns,
+      const key_type& key,
+      const value_type& value
+    );
+
+    update_result_type Update(
+      const key_type& ns,
+      const key_type& key,
+      const value_type& value
+    );
+
+    merge_result_type Merge(
+      const key_type& ns,
+      const key_type& key,
+      const value_type& patch
+    );
+
+    delete_result_type Delete(
+      const key_type& ns,
+      const key_type& key
+    );
+
+    delete_namespace_result_type DeleteNamespace(
+      const key_type& ns
+    );
+
+    drop_namespace_result_type DropNamespace(
+      const key_type& ns
+    );
+
+    write_batch_result_type Write(
+      const std::vector<WriteOperation>& operations
+    );
+
+  private:
+    std::shared_mutex& GetNamespaceMutex(const key_type& ns) const;
+
+    std::shared_mutex& GetEntryMutex(
+      const key_type& ns,
+      const key_type& key
+    ) const;
+
+  private:
+    const storage_type m_storage;
+    mutable std::array<
+      std::shared_mutex,
+      namespace_stripe_count
+    > m_namespace_mutexes;
+    mutable std::array<std::shared_mutex, entry_stripe_count> m_entry_mutexes;
+  };
+}
@@ -0,0 +1,1504 @@
+/*
+ * Copyright (c) 2024, Rauli Laine
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "./json.hpp"
+#include "./log-storage.hpp"
+#include "./slug.hpp"
+#include "./utils.hpp"
+
+namespace varasto
+{
+
+  static constexpr auto compaction_interval = std::chrono::seconds(30);
+
+  static std::optional<std::string>
+  validate(const Storage::key_type& ns, const Storage::key_type& key)
+  {
+    if (!is_valid_slug(ns) || ns.length() > UINT16_MAX)
+    {
+      return "Invalid namespace: " + ns;
+    }
+    else if (
+      !key.empty() &&
+      (!is_valid_slug(key) || key.length() > UINT16_MAX)
+    )
+    {
+      return "Invalid key: " + key;
+    }
+
+    return std::nullopt;
+  }
+
+  static std::optional<LogStorage::segment_id_type>
+  parse_segment_filename(const std::string& filename)
+  {
+    unsigned int id;
+    char suffix[5] = { 0 };
+
+    if (
+      filename.length() == 20 &&
+      std::sscanf(filename.c_str(), "segment-%8u.%3s", &id, suffix) == 2 &&
+      !std::strcmp(suffix, "log")
+    )
+    {
+      return id;
+    }
+
+    return std::nullopt;
+  }
+
+  static std::string
+  make_segment_filename(LogStorage::segment_id_type id)
+  {
+    char buffer[32];
+
+    std::snprintf(buffer, sizeof(buffer), "segment-%08u.log", id);
+
+    return buffer;
+  }
+
+  LogStorage::Segment::~Segment()
+  {
+    if (fd >= 0)
+    {
+      ::close(fd);
+    }
+  }
+
+  LogStorage::open_result_type
+  LogStorage::Open(
+    const path_type& root,
+    const std::shared_ptr<Durability>& durability,
+    size_type segment_size
+  )
+  {
+    std::shared_ptr<LogStorage> storage(
+      new LogStorage(root, durability, segment_size)
+    );
+
+    if (const auto error = storage->Load())
+    {
+      return open_result_type::error(*error);
+    }
+    storage->m_compaction_thread = std::thread(
+      &LogStorage::RunCompaction,
+      storage.get()
+    );
+
+    return open_result_type::ok(storage);
+  }
+
+  LogStorage::LogStorage(
+    const path_type& root,
+    const std::shared_ptr<Durability>& durability,
+    size_type segment_size
+  )
+    : m_root(root)
+    , m_durability(durability)
+    , m_segment_size(segment_size)
+    , m_published_sequence(0)
+    , m_next_sequence(1)
+    , m_running(true) {}
+
+  LogStorage::~LogStorage()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_compaction_mutex);
+
+      m_running = false;
+    }
+    m_compaction_condition.notify_all();
+    if (m_compaction_thread.joinable())
+    {
+      m_compaction_thread.join();
+    }
+  }
+
+  Storage::get_result_type
+  LogStorage::Get(
+    const key_type& ns,
+    const key_type& key
+  ) const
+  {
+    if (const auto error = validate(ns, key))
+    {
+      return get_result_type::error(*error);
+    }
+    else if (const auto location = Find(ns, key))
+    {
+      return Read(*location);
+    }
+
+    return get_result_type::ok(std::nullopt);
+  }
+
+  Storage::get_raw_result_type
+  LogStorage::GetRaw(
+    const key_type& ns,
+    const key_type& key
+  ) const
+  {
+    if (const auto error = validate(ns, key))
+    {
+      return get_raw_result_type::error(*error);
+    }
+    else if (const auto location = Find(ns, key))
+    {
+      return ReadRaw(*location);
+    }
+
+    return get_raw_result_type::ok(std::nullopt);
+  }
+
+  Storage::multi_get_result_type
+  LogStorage::MultiGet(
+    const std::vector<std::pair<key_type, key_type>>& entries
+  ) const
+  {
+    multi_get_result_type results;
+    std::vector<std::optional<Location>> locations;
+
+    results.reserve(entries.size());
+    locations.reserve(entries.size());
+
+    // Locations of all entries are looked up with a single acquisition of
+    // the index lock, and the values are read after it has been released.
+    {
+      std::shared_lock<std::shared_mutex> index_lock(m_index_mutex);
+
+      for (const auto& entry : entries)
+      {
+        const auto ns_it = m_index.find(entry.first);
+        std::optional<Location> location;
+
+        if (ns_it != std::end(m_index))
+        {
+          const auto key_it = ns_it->second.find(entry.second);
+
+          if (key_it != std::end(ns_it->second))
+          {
+            location = key_it->second;
+          }
+        }
+        locations.push_back(location);
+      }
+    }
+
+    for (std::size_t i = 0; i < entries.size(); ++i)
+    {
+      if (const auto error = validate(entries[i].first, entries[i].second))
+      {
+        results.push_back(get_raw_result_type::error(*error));
+      }
+      else if (locations[i])
+      {
+        results.push_back(ReadRaw(*locations[i]));
+      } else {
+        results.push_back(get_raw_result_type::ok(std::nullopt));
+      }
+    }
+
+    return results;
+  }
+
+  Storage::get_version_result_type
+  LogStorage::GetVersion(
+    const key_type& ns,
+    const key_type& key
+  ) const
+  {
+    if (const auto error = validate(ns, key))
+    {
+      return get_version_result_type::error(*error);
+    }
+    // Sequence numbers are never reused and compaction preserves them, so
+    // sequence of the latest record identifies the value.
+    else if (const auto location = Find(ns, key))
+    {
+      return get_version_result_type::ok(std::to_string(location->sequence));
+    }
+
+    return get_version_result_type::ok(std::nullopt);
+  }
+
+  Storage::get_all_keys_type
+  LogStorage::GetAllKeys(const key_type& ns) const
+  {
+    if (const auto error = validate(ns, key_type()))
+    {
+      return get_all_keys_type::error(*error);
+    }
+
+    std::shared_lock<std::shared_mutex> lock(m_index_mutex);
+    const auto it = m_index.find(ns);
+    std::vector<key_type> keys;
+
+    if (it != std::end(m_index))
+    {
+      keys.reserve(it->second.size());
+      for (const auto& entry : it->second)
+      {
+        keys.push_back(entry.first);
+      }
+    }
+
+    return get_all_keys_type::ok(keys);
+  }
+
+  Storage::get_stats_result_type
+  LogStorage::GetStats(const key_type& ns) const
+  {
+    if (const auto error = validate(ns, key_type()))
+    {
+      return get_stats_result_type::error(*error);
+    }
+
+    std::shared_lock<std::shared_mutex> lock(m_index_mutex);
+    const auto it = m_index.find(ns);
+    const auto stats_it = m_stats.find(ns);
+    NamespaceStats stats;
+
+    if (it == std::end(m_index))
+    {
+      return get_stats_result_type::ok(std::nullopt);
+    }
+    else if (stats_it != std::end(m_stats))
+    {
+      stats = stats_it->second;
+    }
+    stats.count = it->second.size();
+
+    return get_stats_result_type::ok(stats);
+  }
+
+  Storage::get_namespace_version_result_type
+  LogStorage::GetNamespaceVersion(const key_type& ns) const
+  {
+    if (const auto error = validate(ns, key_type()))
+    {
+      return get_namespace_version_result_type::error(*error);
+    }
+
+    std::shared_lock<std::shared_mutex> lock(m_index_mutex);
+    const auto it = m_versions.find(ns);
+
+    return get_namespace_version_result_type::ok(std::to_string(
+      it != std::end(m_versions) ? it->second : 0
+    ));
+  }
+
+  Storage::set_result_type
+  LogStorage::Set(
+    const key_type& ns,
+    const key_type& key,
+    const value_type& value
+  )
+  {
+    if (const auto error = validate(ns, key))
+    {
+      return set_result_type::error(*error);
+    }
+
+    const auto buffer = json::format(value);
+    std::unique_lock<std::mutex> write_lock(m_write_mutex);
+    const auto result = Append(RecordType::set, ns, key, buffer);
+
+    write_lock.unlock();
+
+    if (!result)
+    {
+      return set_result_type::error(result.error());
+    }
+
+    const auto synced = m_durability->Sync(result->segment->fd);
+
+    Publish({ { RecordType::set, ns, key, *result } }, synced);
+    if (!synced)
+    {
+      return set_result_type::error("Failed to sync segment.");
+    }
+
+    return set_result_type::ok(true);
+  }
+
+  Storage::merge_result_type
+  LogStorage::Merge(
+    const key_type& ns,
+    const key_type& key,
+    const value_type& patch
+  )
+  {
+    if (const auto error = validate(ns, key))
+    {
+      return merge_result_type::error(*error);
+    }
+
+    const auto buffer = json::format(patch);
+    std::unique_lock<std::mutex> write_lock(m_write_mutex);
+
+    WaitForEntry(ns, key);
+
+    const auto location = Find(ns, key);
+    std::optional<value_type> folded;
+
+    if (!location)
+    {
+      return merge_result_type::ok(std::nullopt);
+    }
+
+    // Only the patch is appended into the log, until the patches would take
+    // more space than the value itself, at which point the entry is folded
+    // into a full value again.
+    if (
+      location->deltas.size() >= max_delta_count ||
+      GetValueLength(*location) + buffer.length() >
+        2 * static_cast<size_type>(location->value_length)
+    )
+    {
+      const auto current = Read(*location);
+
+      if (!current)
+      {
+        return merge_result_type::error(current.error());
+      }
+      folded = utils::merge_patch(**current, patch);
+    }
+
+    const auto type = folded ? RecordType::set : RecordType::merge;
+    const auto result = Append(
+      type,
+      ns,
+      key,
+      folded ? json::format(*folded) : buffer
+    );
+
+    write_lock.unlock();
+
+    if (!result)
+    {
+      return merge_result_type::error(result.error());
+    }
+
+    const auto synced = m_durability->Sync(result->segment->fd);
+
+    Publish({ { type, ns, key, *result } }, synced);
+    if (!synced)
+    {
+      return merge_result_type::error("Failed to sync segment.");
+    }
+
+    // Patched value is only known if the entry was folded, since otherwise
+    // only the patch is written.
+    return merge_result_type::ok(folded ? *folded : value_type());
+  }
+
+  Storage::delete_result_type
+  LogStorage::Delete(
+    const key_type& ns,
+    const key_type& key
+  )
+  {
+    if (const auto error = validate(ns, key))
+    {
+      return delete_result_type::error(*error);
+    }
+
+    std::unique_lock<std::mutex> write_lock(m_write_mutex);
+
+    WaitForEntry(ns, key);
+
+    const auto location = Find(ns, key);
+
+    if (!location)
+    {
+      return delete_result_type::ok(std::nullopt);
+    }
+
+    const auto old_value = Read(*location);
+
+    if (!old_value)
+    {
+      return delete_result_type::error(old_value.error());
+    }
+
+    const auto result = Append(RecordType::remove, ns, key, std::string());
+
+    write_lock.unlock();
+
+    if (!result)
+    {
+      return delete_result_type::error(result.error());
+    }
+
+    const auto synced = m_durability->Sync(result->segment->fd);
+
+    Publish({ { RecordType::remove, ns, key, *result } }, synced);
+    if (!synced)
+    {
+      return delete_result_type::error("Failed to sync segment.");
+    }
+
+    return delete_result_type::ok(*old_value);
+  }
+
+  Storage::delete_namespace_result_type
+  LogStorage::DeleteNamespace(const key_type& ns)
+  {
+    if (const auto error = validate(ns, key_type()))
+    {
+      return delete_namespace_result_type::error(*error);
+    }
+
+    std::unique_lock<std::mutex> write_lock(m_write_mutex);
+
+    WaitForNamespace(ns);
+
+    const auto entries = GetAllEntries(ns);
+
+    if (!entries)
+    {
+      return delete_namespace_result_type::error(entries.error());
+    }
+    else if (entries->empty())
+    {
+      return delete_namespace_result_type::ok(std::nullopt);
+    }
+    else if (const auto error = RemoveNamespace(ns, write_lock))
+    {
+      return delete_namespace_result_type::error(*error);
+    }
+
+    return delete_namespace_result_type::ok(*entries);
+  }
+
+  Storage::drop_namespace_result_type
+  LogStorage::DropNamespace(const key_type& ns)
+  {
+    if (const auto error = validate(ns, key_type()))
+    {
+      return drop_namespace_result_type::error(*error);
+    }
+
+    std::unique_lock<std::mutex> write_lock(m_write_mutex);
+
+    WaitForNamespace(ns);
+
+    {
+      std::shared_lock<std::shared_mutex> index_lock(m_index_mutex);
+
+      if (m_index.find(ns) == std::end(m_index))
+      {
+        return drop_namespace_result_type::ok(false);
+      }
+    }
+
+    if (const auto error = RemoveNamespace(ns, write_lock))
+    {
+      return drop_namespace_result_type::error(*error);
+    }
+
+    return drop_namespace_result_type::ok(true);
+  }
+
+  Storage::write_batch_result_type
+  LogStorage::Write(const std::vector<WriteOperation>& operations)
+  {
+    write_batch_result_type results;
+    std::vector<PendingRecord> records;
+    std::vector<std::shared_ptr<Segment>> segments;
+    // Entries written earlier in the batch are not yet in the index, so their
+    // locations are tracked here. Removed entries have no location.
+    std::map<std::pair<key_type, key_type>, std::optional<Location>> written;
+    std::unique_lock<std::mutex> write_lock(m_write_mutex);
+
+    results.reserve(operations.size());
+
+    // All records of the batch are appended while holding the write lock,
+    // and the segments are synced only once after all of them have been
+    // written.
+    for (const auto& operation : operations)
+    {
+      const auto& ns = operation.ns;
+      const auto& key = operation.key;
+      value_type value = operation.value;
+      std::optional<Location> location;
+      std::optional<value_type> current;
+
+      if (const auto error = validate(ns, key))
+      {
+        results.push_back(write_result_type::error(*error));
+        continue;
+      }
+
+      if (operation.type != WriteOperation::Type::set)
+      {
+        const auto written_it = written.find(std::make_pair(ns, key));
+
+        if (written_it != std::end(written))
+        {
+          location = written_it->second;
+        } else {
+          WaitForEntry(ns, key);
+          location = Find(ns, key);
+        }
+        if (!location)
+        {
+          results.push_back(write_result_type::ok(std::nullopt));
+          continue;
+        }
+
+        const auto result = Read(*location);
+
+        if (!result)
+        {
+          results.push_back(write_result_type::error(result.error()));
+          continue;
+        }
+        current = *result;
+        if (operation.type == WriteOperation::Type::update)
+        {
+          value = utils::patch(*current, operation.value);
+        }
+      }
+
+      const auto type = operation.type == WriteOperation::Type::remove
+        ? RecordType::remove
+        : RecordType::set;
+      const auto result = type == RecordType::remove
+        ? Append(type, ns, key, std::string())
+        : Append(type, ns, key, json::format(value));
+
+      if (!result)
+      {
+        results.push_back(write_result_type::error(result.error()));
+        continue;
+      }
+
+      records.push_back({ type, ns, key, *result });
+      if (type == RecordType::remove)
+      {
+        written[std::make_pair(ns, key)] = std::nullopt;
+        results.push_back(write_result_type::ok(current));
+      } else {
+        written[std::make_pair(ns, key)] = *result;
+        results.push_back(write_result_type::ok(value));
+      }
+
+      if (segments.empty() || segments.back() != result->segment)
+      {
+        segments.push_back(result->segment);
+      }
+    }
+
+    write_lock.unlock();
+
+    if (records.empty())
+    {
+      return results;
+    }
+
+    std::vector<int> fds;
+
+    fds.reserve(segments.size());
+    for (const auto& segment : segments)
+    {
+      fds.push_back(segment->fd);
+    }
+
+    const auto synced = m_durability->SyncAll(fds);
+
+    Publish(records, synced);
+    if (!synced)
+    {
+      for (auto& result : results)
+      {
+        if (result)
+        {
+          result = write_result_type::error("Failed to sync segment.");
+        }
+      }
+    }
+
+    return results;
+  }
+
+  void
+  LogStorage::Compact()
+  {
+    std::vector<std::shared_ptr<Segment>> candidates;
+    segment_id_type active_id;
+
+    {
+      std::lock_guard<std::mutex> write_lock(m_write_mutex);
+
+      // Records still waiting to be synced may be located in segments which
+      // are no longer active, and must reach the index before liveness of
+      // the records in those segments can be decided.
+      WaitForPublished();
+      active_id = m_active->id;
+    }
+
+    {
+      std::shared_lock<std::shared_mutex> index_lock(m_index_mutex);
+
+      for (const auto& entry : m_segments)
+      {
+        const auto& segment = entry.second;
+
+        if (
+          segment->id != active_id &&
+          segment->live_size * 2 <= segment->size
+        )
+        {
+          candidates.push_back(segment);
+        }
+      }
+    }
+
+    for (const auto& segment : candidates)
+    {
+      CompactSegment(segment);
+    }
+  }
+
+  std::optional<std::string>
+  LogStorage::Load()
+  {
+    std::vector<segment_id_type> ids;
+    tombstone_map_type tombstones;
+    floor_map_type floors;
+    std::error_code ec;
+
+    if (!std::filesystem::is_directory(m_root, ec))
+    {
+      return "Root directory " + m_root.string() + " does not exist.";
+    }
+
+    for (const auto& entry : std::filesystem::directory_iterator(m_root, ec))
+    {
+      if (const auto id = parse_segment_filename(entry.path().filename()))
+      {
+        ids.push_back(*id);
+      }
+    }
+    if (ec)
+    {
+      return "Failed to list segments: " + ec.message();
+    }
+    std::sort(std::begin(ids), std::end(ids));
+
+    for (const auto id : ids)
+    {
+      if (const auto error = OpenSegment(id))
+      {
+        return error;
+      }
+      if (const auto error = Replay(
+        m_active,
+        tombstones,
+        floors,
+        id == ids.back()
+      ))
+      {
+        return error;
+      }
+    }
+
+    // Records do not carry timestamps, so modification times of namespaces
+    // are only known for modifications made after the storage was opened.
+    for (const auto& ns : m_index)
+    {
+      auto& stats = m_stats[ns.first];
+
+      m_versions[ns.first] = m_next_sequence - 1;
+      for (const auto& entry : ns.second)
+      {
+        entry.second.segment->live_size += entry.second.record_size;
+        for (const auto& delta : entry.second.deltas)
+        {
+          delta.segment->live_size += delta.record_size;
+        }
+        stats.size += GetValueLength(entry.second);
+      }
+    }
+
+    m_published_sequence = m_next_sequence - 1;
+
+    if (!m_active || m_active->size >= m_segment_size)
+    {
+      return OpenSegment(m_active ? m_active->id + 1 : 1);
+    }
+
+    return std::nullopt;
+  }
+
+  std::optional<std::string>
+  LogStorage::Replay(
+    const std::shared_ptr<Segment>& segment,
+    tombstone_map_type& tombstones,
+    floor_map_type& floors,
+    bool last
+  )
+  {
+    std::string buffer;
+    size_type offset = 0;
+
+    buffer.resize(segment->size);
+    if (!utils::read_fully(segment->fd, buffer.data(), buffer.size(), 0))
+    {
+      return "Failed to read " + segment->path.string() + ".";
+    }
+
+    while (offset + sizeof(RecordHeader) <= buffer.size())
+    {
+      RecordHeader header;
+
+      std::memcpy(&header, buffer.data() + offset, sizeof(RecordHeader));
+
+      const auto record_size = sizeof(RecordHeader) +
+        header.ns_length +
+        header.key_length +
+        header.value_length;
+
+      if (offset + record_size > buffer.size())
+      {
+        break;
+      }
+
+      const auto checksum = header.checksum;
+
+      header.checksum = 0;
+      if (
+        utils::crc32(
+          buffer.data() + offset + sizeof(RecordHeader),
+          record_size - sizeof(RecordHeader),
+          utils::crc32(reinterpret_cast<const char*>(&header), sizeof(header))
+        ) != checksum
+      )
+      {
+        break;
+      }
+
+      const auto payload = buffer.data() + offset + sizeof(RecordHeader);
+      const key_type ns(payload, header.ns_length);
+      const key_type key(payload + header.ns_length, header.key_length);
+      const auto sequence = header.sequence;
+      const auto floor = floors.find(ns);
+
+      segment->first_sequence = std::min(segment->first_sequence, sequence);
+      m_next_sequence = std::max(m_next_sequence, sequence + 1);
+
+      if (floor == std::end(floors) || floor->second < sequence)
+      {
+        auto& keys = m_index[ns];
+        auto& removed = tombstones[ns];
+
+        if (header.type == RecordType::remove_namespace)
+        {
+          for (auto it = std::begin(keys); it != std::end(keys);)
+          {
+            if (it->second.sequence < sequence)
+            {
+              it = keys.erase(it);
+            } else {
+              ++it;
+            }
+          }
+          floors[ns] = sequence;
+        } else {
+          const auto existing = keys.find(key);
+          const auto tombstone = removed.find(key);
+
+          if (
+            (existing == std::end(keys) ||
+             existing->second.sequence < sequence) &&
+            (tombstone == std::end(removed) || tombstone->second < sequence)
+          )
+          {
+            const Location location = {
+              segment,
+              offset,
+              record_size,
+              header.value_length,
+              sequence,
+              {},
+            };
+
+            if (header.type == RecordType::set)
+            {
+              keys[key] = location;
+            }
+            else if (header.type == RecordType::merge)
+            {
+              // Patches are only written for existing entries, and
+              // compaction folds entries with patches into full values, so
+              // a patch without a value before it has been superseded by a
+              // folded value in a later segment.
+              if (existing != std::end(keys))
+              {
+                existing->second.deltas.push_back(location);
+                existing->second.sequence = sequence;
+              }
+            } else {
+              keys.erase(key);
+              removed[key] = sequence;
+            }
+          }
+        }
+        if (keys.empty())
+        {
+          m_index.erase(ns);
+        }
+      }
+
+      offset += record_size;
+    }
+
+    if (offset < segment->size)
+    {
+      std::cerr << "Ignoring " << (segment->size - offset)
+                << " bytes of corrupted or truncated data at the end of "
+                << segment->path
+                << std::endl;
+      // Only the last segment can contain partially written records, so
+      // corruption anywhere else is left alone for manual inspection.
+      if (!last)
+      {
+        return std::nullopt;
+      }
+      else if (::ftruncate(segment->fd, offset) != 0)
+      {
+        return "Failed to truncate " + segment->path.string() + ".";
+      }
+      segment->size = offset;
+    }
+
+    return std::nullopt;
+  }
+
+  std::optional<std::string>
+  LogStorage::OpenSegment(segment_id_type id)
+  {
+    auto segment = std::make_shared<Segment>();
+
+    segment->id = id;
+    segment->path = m_root / make_segment_filename(id);
+    segment->fd = ::open(segment->path.c_str(), O_RDWR | O_CREAT, 0644);
+    segment->live_size = 0;
+    segment->first_sequence = UINT64_MAX;
+    if (segment->fd < 0)
+    {
+      return "Failed to open " + segment->path.string() + ": " +
+        std::strerror(errno);
+    }
+
+    const auto size = ::lseek(segment->fd, 0, SEEK_END);
+
+    if (size < 0)
+    {
+      return "Failed to open " + segment->path.string() + ": " +
+        std::strerror(errno);
+    }
+    segment->size = size;
+    if (size == 0 && !m_durability->SyncDirectory(segment->path.c_str()))
+    {
+      return "Failed to sync " + m_root.string() + ".";
+    }
+
+    {
+      std::unique_lock<std::shared_mutex> index_lock(m_index_mutex);
+
+      m_segments[id] = segment;
+    }
+    m_active = segment;
+
+    return std::nullopt;
+  }
+
+  LogStorage::append_result_type
+  LogStorage::Append(
+    RecordType type,
+    const key_type& ns,
+    const key_type& key,
+    const std::string& value,
+    std::optional<sequence_type> sequence
+  )
+  {
+    RecordHeader header;
+    const auto record_size = sizeof(RecordHeader) +
+      ns.length() +
+      key.length() +
+      value.length();
+    std::string buffer;
+
+    if (m_active->size > 0 && m_active->size + record_size > m_segment_size)
+    {
+      if (const auto error = OpenSegment(m_active->id + 1))
+      {
+        return append_result_type::error(*error);
+      }
+    }
+
+    std::memset(&header, 0, sizeof(header));
+    header.sequence = sequence ? *sequence : m_next_sequence;
+    header.value_length = value.length();
+    header.ns_length = ns.length();
+    header.key_length = key.length();
+    header.type = type;
+
+    buffer.reserve(record_size);
+    buffer.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    buffer.append(ns);
+    buffer.append(key);
+    buffer.append(value);
+    header.checksum = utils::crc32(buffer.data(), buffer.length());
+    std::memcpy(buffer.data(), &header, sizeof(header));
+
+    // Partially written record will be overwritten by the next append, since
+    // the size of the segment is only updated after successful write.
+    if (!utils::write_fully(m_active->fd, buffer.data(), buffer.length(),
+                     m_active->size))
+    {
+      return append_result_type::error("Failed to write into segment.");
+    }
+
+    // Records re-appended by compaction are already in the index, but new
+    // records must be published with Publish() once they have been synced.
+    if (!sequence)
+    {
+      std::lock_guard<std::shared_mutex> index_lock(m_index_mutex);
+
+      ++m_next_sequence;
+      ++m_unpublished[std::make_pair(ns, key)];
+    }
+
+    Location location = {
+      m_active,
+      m_active->size,
+      record_size,
+      header.value_length,
+      header.sequence,
+      {},
+    };
+
+    m_active->size += record_size;
+    m_active->first_sequence = std::min(
+      m_active->first_sequence,
+      header.sequence
+    );
+
+    return append_result_type::ok(location);
+  }
+
+  std::optional<std::string>
+  LogStorage::RemoveNamespace(
+    const key_type& ns,
+    std::unique_lock<std::mutex>& write_lock
+  )
+  {
+    const auto result = Append(
+      RecordType::remove_namespace,
+      ns,
+      key_type(),
+      std::string()
+    );
+
+    write_lock.unlock();
+
+    if (!result)
+    {
+      return result.error();
+    }
+
+    const auto synced = m_durability->Sync(result->segment->fd);
+
+    Publish(
+      { { RecordType::remove_namespace, ns, key_type(), *result } },
+      synced
+    );
+    if (!synced)
+    {
+      return "Failed to sync segment.";
+    }
+
+    return std::nullopt;
+  }
+
+  void
+  LogStorage::Publish(const std::vector<PendingRecord>& records, bool synced)
+  {
+    std::unique_lock<std::shared_mutex> index_lock(m_index_mutex);
+
+    // Records are synced concurrently, but published in the same order as
+    // they have been appended into the log. Record which failed to sync is
+    // dropped, even though it might still be replayed after a crash, just
+    // like any other write which the client did not see to complete.
+    m_published_condition.wait(
+      index_lock,
+      [this, &records]()
+      {
+        return m_published_sequence + 1 == records.front().location.sequence;
+      }
+    );
+
+    for (const auto& record : records)
+    {
+      const auto& ns = record.ns;
+      const auto& location = record.location;
+      const auto unpublished_it = m_unpublished.find(
+        std::make_pair(ns, record.key)
+      );
+
+      if (--unpublished_it->second == 0)
+      {
+        m_unpublished.erase(unpublished_it);
+      }
+      if (!synced)
+      {
+        continue;
+      }
+
+      if (record.type == RecordType::remove_namespace)
+      {
+        const auto ns_it = m_index.find(ns);
+
+        if (ns_it != std::end(m_index))
+        {
+          for (const auto& entry : ns_it->second)
+          {
+            Release(entry.second);
+          }
+          m_index.erase(ns_it);
+          m_stats.erase(ns);
+          m_versions.erase(ns);
+        }
+        continue;
+      }
+
+      auto& keys = m_index[ns];
+      auto& stats = m_stats[ns];
+      const auto it = keys.find(record.key);
+
+      if (record.type == RecordType::remove)
+      {
+        if (it != std::end(keys))
+        {
+          Release(it->second);
+          stats.size -= GetValueLength(it->second);
+          keys.erase(it);
+        }
+      }
+      else if (record.type == RecordType::merge && it != std::end(keys))
+      {
+        it->second.deltas.push_back(location);
+        it->second.sequence = location.sequence;
+        location.segment->live_size += location.record_size;
+        stats.size += location.value_length;
+      }
+      else if (record.type == RecordType::set)
+      {
+        if (it != std::end(keys))
+        {
+          Release(it->second);
+          stats.size -= GetValueLength(it->second);
+        }
+        keys[record.key] = location;
+        location.segment->live_size += location.record_size;
+        stats.size += location.value_length;
+      }
+      if (keys.empty())
+      {
+        m_index.erase(ns);
+        m_stats.erase(ns);
+        m_versions.erase(ns);
+        continue;
+      }
+      stats.last_modified = NamespaceStats::time_type::clock::now();
+      m_versions[ns] = location.sequence;
+    }
+
+    m_published_sequence = records.back().location.sequence;
+    index_lock.unlock();
+    m_published_condition.notify_all();
+  }
+
+  void
+  LogStorage::WaitForEntry(const key_type& ns, const key_type& key)
+  {
+    std::unique_lock<std::shared_mutex> index_lock(m_index_mutex);
+
+    m_published_condition.wait(
+      index_lock,
+      [this, &ns, &key]()
+      {
+        return !m_unpublished.count(std::make_pair(ns, key)) &&
+          !m_unpublished.count(std::make_pair(ns, key_type()));
+      }
+    );
+  }
+
+  void
+  LogStorage::WaitForNamespace(const key_type& ns)
+  {
+    std::unique_lock<std::shared_mutex> index_lock(m_index_mutex);
+
+    m_published_condition.wait(
+      index_lock,
+      [this, &ns]()
+      {
+        const auto it = m_unpublished.lower_bound(
+          std::make_pair(ns, key_type())
+        );
+
+        return it == std::end(m_unpublished) || it->first.first != ns;
+      }
+    );
+  }
+
+  void
+  LogStorage::WaitForPublished()
+  {
+    std::unique_lock<std::shared_mutex> index_lock(m_index_mutex);
+
+    m_published_condition.wait(
+      index_lock,
+      [this]() { return m_unpublished.empty(); }
+    );
+  }
+
+  std::optional<LogStorage::Location>
+  LogStorage::Find(
+    const key_type& ns,
+    const key_type& key
+  ) const
+  {
+    std::shared_lock<std::shared_mutex> lock(m_index_mutex);
+    const auto ns_it = m_index.find(ns);
+
+    if (ns_it != std::end(m_index))
+    {
+      const auto key_it = ns_it->second.find(key);
+
+      if (key_it != std::end(ns_it->second))
+      {
+        return key_it->second;
+      }
+    }
+
+    return std::nullopt;
+  }
+
+  Storage::get_raw_result_type
+  LogStorage::ReadRecord(const Location& location) const
+  {
+    std::string buffer;
+
+    buffer.resize(location.value_length);
+    if (!utils::read_fully(
+      location.segment->fd,
+      buffer.data(),
+      buffer.size(),
+      location.offset + location.record_size - location.value_length
+    ))
+    {
+      return get_raw_result_type::error("Failed to read from segment.");
+    }
+
+    return get_raw_result_type::ok(std::move(buffer));
+  }
+
+  Storage::get_raw_result_type
+  LogStorage::ReadRaw(const Location& location) const
+  {
+    if (location.deltas.empty())
+    {
+      return ReadRecord(location);
+    }
+
+    const auto result = Read(location);
+
+    if (!result)
+    {
+      return get_raw_result_type::error(result.error());
+    }
+
+    return get_raw_result_type::ok(json::format(**result));
+  }
+
+  Storage::get_result_type
+  LogStorage::Read(const Location& location) const
+  {
+    const auto buffer = ReadRecord(location);
+
+    if (!buffer)
+    {
+      return get_result_type::error(buffer.error());
+    }
+
+    const auto result = json::parse_object(**buffer);
+
+    if (!result)
+    {
+      return get_result_type::error(result.error());
+    }
+
+    auto value = *result;
+
+    for (const auto& delta : location.deltas)
+    {
+      const auto delta_buffer = ReadRecord(delta);
+
+      if (!delta_buffer)
+      {
+        return get_result_type::error(delta_buffer.error());
+      }
+
+      const auto patch = json::parse_object(**delta_buffer);
+
+      if (!patch)
+      {
+        return get_result_type::error(patch.error());
+      }
+      value = utils::merge_patch(value, *patch);
+    }
+
+    return get_result_type::ok(value);
+  }
+
+  void
+  LogStorage::Release(const Location& location)
+  {
+    location.segment->live_size -= location.record_size;
+    for (const auto& delta : location.deltas)
+    {
+      delta.segment->live_size -= delta.record_size;
+    }
+  }
+
+  LogStorage::size_type
+  LogStorage::GetValueLength(const Location& location)
+  {
+    size_type length = location.value_length;
+
+    for (const auto& delta : location.deltas)
+    {
+      length += delta.value_length;
+    }
+
+    return length;
+  }
+
+  void
+  LogStorage::CompactSegment(const std::shared_ptr<Segment>& segment)
+  {
+    std::string buffer;
+    size_type offset = 0;
+    std::vector<std::shared_ptr<Segment>> targets;
+
+    buffer.resize(segment->size);
+    if (!utils::read_fully(segment->fd, buffer.data(), buffer.size(), 0))
+    {
+      std::cerr << "Failed to read " << segment->path << std::endl;
+      return;
+    }
+
+    while (offset + sizeof(RecordHeader) <= buffer.size())
+    {
+      RecordHeader header;
+
+      std::memcpy(&header, buffer.data() + offset, sizeof(RecordHeader));
+
+      const auto record_size = sizeof(RecordHeader) +
+        header.ns_length +
+        header.key_length +
+        header.value_length;
+
+      if (offset + record_size > buffer.size())
+      {
+        break;
+      }
+
+      const auto payload = buffer.data() + offset + sizeof(RecordHeader);
+      const key_type ns(payload, header.ns_length);
+      const key_type key(payload + header.ns_length, header.key_length);
+      const std::string value(
+        payload + header.ns_length + header.key_length,
+        header.value_length
+      );
+      std::lock_guard<std::mutex> write_lock(m_write_mutex);
+      bool live = false;
+      bool older_segments = false;
+      std::optional<Location> patched;
+      std::optional<std::string> folded;
+
+      {
+        std::shared_lock<std::shared_mutex> index_lock(m_index_mutex);
+
+        for (const auto& entry : m_segments)
+        {
+          if (
+            entry.second != segment &&
+            entry.second->first_sequence < header.sequence
+          )
+          {
+            older_segments = true;
+            break;
+          }
+        }
+
+        const auto ns_it = m_index.find(ns);
+
+        if (ns_it != std::end(m_index))
+        {
+          const auto key_it = ns_it->second.find(key);
+
+          if (key_it != std::end(ns_it->second))
+          {
+            const auto& location = key_it->second;
+
+            live = location.segment == segment && location.offset == offset;
+            for (const auto& delta : location.deltas)
+            {
+              live = live || (
+                delta.segment == segment && delta.offset == offset
+              );
+            }
+            if (live && !location.deltas.empty())
+            {
+              patched = location;
+            }
+          }
+        }
+      }
+
+      // Records of an entry with patches may be spread over several
+      // segments, so instead of copying them one by one the entry is folded
+      // into a full value which keeps the sequence of the latest patch.
+      if (patched)
+      {
+        const auto current = Read(*patched);
+
+        if (!current)
+        {
+          std::cerr << "Compaction of " << segment->path << " failed: "
+                    << current.error()
+                    << std::endl;
+          return;
+        }
+        folded = json::format(**current);
+      }
+
+      // Removals only need to be carried over if some other segment might
+      // still contain records that they hide.
+      if (
+        live ||
+        (
+          (header.type == RecordType::remove ||
+           header.type == RecordType::remove_namespace) &&
+          older_segments
+        )
+      )
+      {
+        const auto result = folded
+          ? Append(RecordType::set, ns, key, *folded, patched->sequence)
+          : Append(header.type, ns, key, value, header.sequence);
+
+        if (!result)
+        {
+          std::cerr << "Compaction of " << segment->path << " failed: "
+                    << result.error()
+                    << std::endl;
+          return;
+        }
+
+        const auto& target = result->segment;
+
+        if (
+          std::find(std::begin(targets), std::end(targets), target) ==
+          std::end(targets)
+        )
+        {
+          targets.push_back(target);
+        }
+        if (live)
+        {
+          std::unique_lock<std::shared_mutex> index_lock(m_index_mutex);
+
+          m_index[ns][key] = *result;
+          if (patched)
+          {
+            auto& stats = m_stats[ns];
+
+            Release(*patched);
+            stats.size -= GetValueLength(*patched);
+            stats.size += result->value_length;
+          } else {
+            segment->live_size -= record_size;
+          }
+          result->segment->live_size += result->record_size;
+        }
+      }
+
+      offset += record_size;
+    }
+
+    // Copied records must be on disk before the only other copy of them is
+    // removed, regardless of the durability mode.
+    for (const auto& target : targets)
+    {
+      if (::fsync(target->fd) != 0)
+      {
+        std::cerr << "Compaction of " << segment->path << " failed: "
+                  << "Unable to sync " << target->path
+                  << std::endl;
+        return;
+      }
+    }
+
+    std::lock_guard<std::mutex> write_lock(m_write_mutex);
+    std::unique_lock<std::shared_mutex> index_lock(m_index_mutex);
+    std::error_code ec;
+
+    m_segments.erase(segment->id);
+    std::filesystem::remove(segment->path, ec);
+  }
+
+  void
+  LogStorage::RunCompaction()
+  {
+    std::unique_lock<std::mutex> lock(m_compaction_mutex);
+
+    while (m_running)
+    {
+      m_compaction_condition.wait_for(lock, compaction_interval);
+      if (!m_running)
+      {
+        break;
+      }
+      lock.unlock();
+      Compact();
+      lock.lock();
+    }
+  }
+}
@@ -0,0 +1,329 @@
+/*
+ * Copyright (c) 2024, Rauli Laine
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "./durability.hpp"
+#include "./storage.hpp"
+
+namespace varasto
+{
+  /**
+   * Storage implementation which appends every mutation as a record into
+   * segment files and keeps an in-memory index of where the latest value of
+   * each entry is located. Segments containing mostly overwritten or deleted
+   * records are compacted in a background thread, and the index is rebuilt
+   * from the segment files when the storage is opened.
+   */
+  class LogStorage : public Storage
+  {
+  public:
+    using path_type = std::filesystem::path;
+    using size_type = std::uint64_t;
+    using sequence_type = std::uint64_t;
+    using segment_id_type = std::uint32_t;
+
+    using open_result_type = peelo::result<
+      std::shared_ptr<LogStorage>,
+      std::string
+    >;
+
+    static constexpr size_type default_segment_size = 64 * 1024 * 1024;
+
+    /**
+     * Number of merge patches stored for an entry, after which the entry is
+     * folded into a full value on next merge.
+     */
+    static constexpr std::size_t max_delta_count = 16;
+
+    /**
+     * Opens log storage from given directory, replaying all segment files
+     * found in it.
+     */
+    static open_result_type Open(
+      const path_type& root,
+      const std::shared_ptr<Durability>& durability =
+        std::make_shared<Durability>(),
+      size_type segment_size = default_segment_size
+    );
+
+    LogStorage(const LogStorage&) = delete;
+    LogStorage(LogStorage&&) = delete;
+    LogStorage& operator=(const LogStorage&) = delete;
+    LogStorage& operator=(LogStorage&&) = delete;
+
+    ~LogStorage();
+
+    get_result_type Get(
+      const key_type& ns,
+      const key_type& key
+    ) const;
+
+    get_raw_result_type GetRaw(
+      const key_type& ns,
+      const key_type& key
+    ) const;
+
+    get_version_result_type GetVersion(
+      const key_type& ns,
+      const key_type& key
+    ) const;
+
+    multi_get_result_type MultiGet(
+      const std::vector<std::pair<key_type, key_type>>& entries
+    ) const;
+
+    get_all_keys_type GetAllKeys(
+      const key_type& ns
+    ) const;
+
+    get_stats_result_type GetStats(
+      const key_type& ns
+    ) const;
+
+    get_namespace_version_result_type GetNamespaceVersion(
+      const key_type& ns
+    ) const;
+
+    set_result_type Set(
+      const key_type& ns,
+      const key_type& key,
+      const value_type& value
+    );
+
+    merge_result_type Merge(
+      const key_type& ns,
+      const key_type& key,
+      const value_type& patch
+    );
+
+    delete_result_type Delete(
+      const key_type& ns,
+      const key_type& key
+    );
+
+    delete_namespace_result_type DeleteNamespace(
+      const key_type& ns
+    );
+
+    drop_namespace_result_type DropNamespace(
+      const key_type& ns
+    );
+
+    write_batch_result_type Write(
+      const std::vector<WriteOperation>& operations
+    );
+
+    /**
+     * Rewrites live records of segments which consist mostly of dead
+     * records into the active segment and removes the old segment files.
+     */
+    void Compact();
+
+  private:
+    enum class RecordType : std::uint8_t
+    {
+      set = 1,
+      remove = 2,
+      remove_namespace = 3,
+      merge = 4,
+    };
+
+    struct RecordHeader
+    {
+      sequence_type sequence;
+      std::uint32_t checksum;
+      std::uint32_t value_length;
+      std::uint16_t ns_length;
+      std::uint16_t key_length;
+      RecordType type;
+      std::uint8_t reserved[3];
+    };
+
+    struct Segment
+    {
+      segment_id_type id;
+      path_type path;
+      int fd;
+      size_type size;
+      size_type live_size;
+      sequence_type first_sequence;
+
+      ~Segment();
+    };
+
+    /**
+     * Location of the latest value of an entry. Merge patches written after
+     * the value are kept as deltas, oldest first, and applied to the value
+     * when it's read. Sequence of an entry with deltas is that of the latest
+     * delta.
+     */
+    struct Location
+    {
+      std::shared_ptr<Segment> segment;
+      size_type offset;
+      size_type record_size;
+      std::uint32_t value_length;
+      sequence_type sequence;
+      std::vector<Location> deltas;
+    };
+
+    /** Record which has been appended but not yet published to the index. */
+    struct PendingRecord
+    {
+      RecordType type;
+      key_type ns;
+      key_type key;
+      Location location;
+    };
+
+    using key_index_type = std::unordered_map<key_type, Location>;
+    using index_type = std::unordered_map<key_type, key_index_type>;
+    using append_result_type = peelo::result<Location, std::string>;
+    using tombstone_map_type = std::unordered_map<
+      key_type,
+      std::unordered_map<key_type, sequence_type>
+    >;
+    using floor_map_type = std::unordered_map<key_type, sequence_type>;
+
+    LogStorage(
+      const path_type& root,
+      const std::shared_ptr<Durability>& durability,
+      size_type segment_size
+    );
+
+    std::optional<std::string> Load();
+
+    std::optional<std::string> Replay(
+      const std::shared_ptr<Segment>& segment,
+      tombstone_map_type& tombstones,
+      floor_map_type& floors,
+      bool last
+    );
+
+    std::optional<std::string> OpenSegment(segment_id_type id);
+
+    append_result_type Append(
+      RecordType type,
+      const key_type& ns,
+      const key_type& key,
+      const std::string& value,
+      std::optional<sequence_type> sequence = std::nullopt
+    );
+
+    /**
+     * Appends removal of given namespace into the log and removes the
+     * namespace from the index once the record has been synced. Write lock
+     * is released before the segment is synced.
+     */
+    std::optional<std::string> RemoveNamespace(
+      const key_type& ns,
+      std::unique_lock<std::mutex>& write_lock
+    );
+
+    /**
+     * Waits until given records, appended one after another, are next in
+     * turn and then applies them to the index, unless they failed to sync.
+     * Records are published in the same order as they were appended, so the
+     * index only ever contains synced records.
+     */
+    void Publish(const std::vector<PendingRecord>& records, bool synced);
+
+    /**
+     * Waits until no record appended for given entry, or removing its
+     * namespace, is waiting to be published. Must be called while holding
+     * the write lock, before reading the index for a new record.
+     */
+    void WaitForEntry(const key_type& ns, const key_type& key);
+
+    /**
+     * Waits until no record appended for given namespace is waiting to be
+     * published. Must be called while holding the write lock.
+     */
+    void WaitForNamespace(const key_type& ns);
+
+    /**
+     * Waits until every appended record has been published. Must be called
+     * while holding the write lock.
+     */
+    void WaitForPublished();
+
+    std::optional<Location> Find(
+      const key_type& ns,
+      const key_type& key
+    ) const;
+
+    /**
+     * Reads value of single record from given location, without applying
+     * deltas to it.
+     */
+    get_raw_result_type ReadRecord(const Location& location) const;
+
+    get_raw_result_type ReadRaw(const Location& location) const;
+
+    get_result_type Read(const Location& location) const;
+
+    /**
+     * Subtracts sizes of the records of given location, including its
+     * deltas, from live sizes of the segments containing them.
+     */
+    static void Release(const Location& location);
+
+    /** Returns total length of the values of given location. */
+    static size_type GetValueLength(const Location& location);
+
+    void CompactSegment(const std::shared_ptr<Segment>& segment);
+
+    void RunCompaction();
+
+  private:
+    const path_type m_root;
+    const std::shared_ptr<Durability> m_durability;
+    const size_type m_segment_size;
+    mutable std::shared_mutex m_index_mutex;
+    index_type m_index;
+    /** Total size and modification time of each indexed namespace. */
+    std::unordered_map<key_type, NamespaceStats> m_stats;
+    /** Sequence of the latest record of each indexed namespace. */
+    std::unordered_map<key_type, sequence_type> m_versions;
+    /** Sequence of the latest record published to the index. */
+    sequence_type m_published_sequence;
+    /**
+     * Number of appended records of each entry which are waiting to be
+     * published. Removals of namespaces are counted with an empty key.
+     */
+    std::map<std::pair<key_type, key_type>, std::size_t> m_unpublished;
+    std::condition_variable_any m_published_condition;
+    std::map<segment_id_type, std::shared_ptr<Segment>> m_segments;
+    std::mutex m_write_mutex;
+    std::shared_ptr<Segment> m_active;
+    sequence_type m_next_sequence;
+    std::mutex m_compaction_mutex;
+    std::condition_variable m_compaction_condition;
+    bool m_running;
+    std::thread m_compaction_thread;
+  };
+}
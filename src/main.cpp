@@ -13,9 +13,13 @@
  * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
+#include <algorithm>
+#include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <thread>
 
+#include "./reaper.hpp"
 #include "./server.hpp"
 
 using varasto::ServerOptions;
@@ -32,6 +36,138 @@ display_usage(std::ostream& output, const char* executable)
          << std::endl
          << "   -p             Port to listen to. (Default: 8080)"
          << std::endl
+         << "   --storage=TYPE Storage backend to use. Either \"filesystem\","
+         << std::endl
+         << "                  \"log\" or \"memory\". (Default: filesystem)"
+         << std::endl
+         << "   --snapshot-interval=S"
+         << std::endl
+         << "                  How often memory storage is written into a"
+         << std::endl
+         << "                  snapshot. Zero disables. (Default: 60)"
+         << std::endl
+         << "   --durability=MODE"
+         << std::endl
+         << "                  When written entries are flushed to disk."
+         << std::endl
+         << "                  Either \"none\" (left to the OS), \"sync\""
+         << std::endl
+         << "                  (after each write) or \"group\" (periodically"
+         << std::endl
+         << "                  for all concurrent writes). (Default: none)"
+         << std::endl
+         << "   --commit-interval=MS"
+         << std::endl
+         << "                  Interval of group mode flushes. (Default: 10)"
+         << std::endl
+         << "   --wal          Write mutations into a write-ahead log and"
+         << std::endl
+         << "                  apply them to the filesystem storage in the"
+         << std::endl
+         << "                  background."
+         << std::endl
+         << "   --warm-up-threads=N"
+         << std::endl
+         << "                  Number of threads used to load keys of the"
+         << std::endl
+         << "                  filesystem storage at startup. Zero loads"
+         << std::endl
+         << "                  namespaces when first listed."
+         << std::endl
+         << "                  (Default: number of CPU cores)"
+         << std::endl
+         << "   --reap-rate=N  Number of files of removed namespaces deleted"
+         << std::endl
+         << "                  per second in the background. Zero removes"
+         << std::endl
+         << "                  them as fast as possible. (Default: 10000)"
+         << std::endl
+         << "   --cache-size=SIZE"
+         << std::endl
+         << "                  Cache up to SIZE bytes of entries in memory."
+         << std::endl
+         << "                  Accepts K, M and G suffixes. (Default: 0)"
+         << std::endl
+         << "   --uuid=VERSION UUID version used for generated keys. Either"
+         << std::endl
+         << "                  \"v4\" (random) or \"v7\" (time ordered)."
+         << std::endl
+         << "                  (Default: v4)"
+         << std::endl
+         << "   --json=CODEC   JSON parser and formatter to use. Either"
+         << std::endl
+         << "                  \"structural\" or \"peelo\"."
+         << std::endl
+         << "                  (Default: structural)"
+         << std::endl
+         << "   --value-format=FORMAT"
+         << std::endl
+         << "                  Format of stored values. Either \"json\" or"
+         << std::endl
+         << "                  \"binary\". Only used by the filesystem"
+         << std::endl
+         << "                  storage. (Default: format of the directory)"
+         << std::endl
+         << "   --compress=SIZE"
+         << std::endl
+         << "                  Compress values of at least SIZE bytes with"
+         << std::endl
+         << "                  a dictionary trained for each namespace. Only"
+         << std::endl
+         << "                  used by the filesystem storage. (Default: 0,"
+         << std::endl
+         << "                  disabled)"
+         << std::endl
+         << "   --compress-retrain=S"
+         << std::endl
+         << "                  Interval of dictionary retraining."
+         << std::endl
+         << "                  (Default: 300)"
+         << std::endl
+         << "   --threads=N    Number of worker threads."
+         << std::endl
+         << "                  (Default: number of CPU cores, at least 8)"
+         << std::endl
+         << "   --queue-depth=N"
+         << std::endl
+         << "                  Reject requests with 503 once N connections"
+         << std::endl
+         << "                  are waiting for a worker. (Default: 0, never)"
+         << std::endl
+         << "   --max-queued=N Close new connections without a response once"
+         << std::endl
+         << "                  N connections are waiting for a worker."
+         << std::endl
+         << "                  (Default: 1024, 0 for no limit)"
+         << std::endl
+         << "   --keep-alive-max=N"
+         << std::endl
+         << "                  Requests served per connection. (Default: 5)"
+         << std::endl
+         << "   --keep-alive-timeout=S"
+         << std::endl
+         << "                  Idle connection timeout. (Default: 5)"
+         << std::endl
+         << "   --read-timeout=S"
+         << std::endl
+         << "                  Timeout for reading requests. (Default: 5)"
+         << std::endl
+         << "   --write-timeout=S"
+         << std::endl
+         << "                  Timeout for writing responses. (Default: 5)"
+         << std::endl
+         << "   --max-body-size=SIZE"
+         << std::endl
+         << "                  Maximum size of request bodies. Accepts K, M"
+         << std::endl
+         << "                  and G suffixes. (Default: 0, unlimited)"
+         << std::endl
+         << "   --gzip=SIZE    Compress responses of at least SIZE bytes"
+         << std::endl
+         << "                  when the client accepts gzip. Zero disables."
+         << std::endl
+         << "                  (Default: 1K)"
+         << std::endl
          << "   --version      Print the version."
          << std::endl
          << "   --help         Display this message."
@@ -39,6 +175,68 @@ display_usage(std::ostream& output, const char* executable)
          << std::endl;
 }
 
+static bool
+parse_size(const char* input, std::size_t& output)
+{
+  char* end = nullptr;
+  const auto value = std::strtoull(input, &end, 10);
+
+  if (end == input)
+  {
+    return false;
+  }
+
+  switch (*end)
+  {
+    case 'k':
+    case 'K':
+      output = value * 1024;
+      ++end;
+      break;
+
+    case 'm':
+    case 'M':
+      output = value * 1024 * 1024;
+      ++end;
+      break;
+
+    case 'g':
+    case 'G':
+      output = value * 1024 * 1024 * 1024;
+      ++end;
+      break;
+
+    default:
+      output = value;
+  }
+
+  return !*end;
+}
+
+static bool
+parse_count(const char* input, std::size_t& output)
+{
+  char* end = nullptr;
+
+  output = std::strtoull(input, &end, 10);
+
+  return end != input && !*end;
+}
+
+static bool
+parse_seconds(const char* input, std::chrono::seconds& output)
+{
+  std::size_t count;
+
+  if (!parse_count(input, count))
+  {
+    return false;
+  }
+  output = std::chrono::seconds(count);
+
+  return true;
+}
+
 static void
 parse_args(int argc, char** argv, ServerOptions& options)
 {
@@ -47,6 +245,25 @@ parse_args(int argc, char** argv, ServerOptions& options)
   options.hostname = "localhost";
   options.port = 8080;
   options.root = std::filesystem::current_path() / "data";
+  options.storage = varasto::StorageType::filesystem;
+  options.durability = varasto::DurabilityMode::none;
+  options.commit_interval = std::chrono::milliseconds(10);
+  options.wal = false;
+  options.snapshot_interval = std::chrono::seconds(60);
+  options.warm_up_threads = std::thread::hardware_concurrency();
+  options.reap_rate = varasto::Reaper::default_rate;
+  options.cache_size = 0;
+  options.uuid_version = varasto::UuidVersion::v4;
+  options.json_codec = varasto::json::CodecType::structural;
+  options.worker_count = std::max(8u, std::thread::hardware_concurrency());
+  options.queue_depth = 0;
+  options.max_queued_connections = 1024;
+  options.keep_alive_max_count = 5;
+  options.keep_alive_timeout = std::chrono::seconds(5);
+  options.read_timeout = std::chrono::seconds(5);
+  options.write_timeout = std::chrono::seconds(5);
+  options.payload_max_length = 0;
+  options.gzip_threshold = 1024;
 
   while (offset < argc)
   {
@@ -76,6 +293,243 @@ parse_args(int argc, char** argv, ServerOptions& options)
       {
         std::cout << "Varasto server 0.0.1" << std::endl;
         std::exit(EXIT_SUCCESS);
+      }
+      else if (!std::strcmp(arg, "--storage=filesystem"))
+      {
+        options.storage = varasto::StorageType::filesystem;
+        continue;
+      }
+      else if (!std::strcmp(arg, "--storage=log"))
+      {
+        options.storage = varasto::StorageType::log;
+        continue;
+      }
+      else if (!std::strcmp(arg, "--storage=memory"))
+      {
+        options.storage = varasto::StorageType::memory;
+        continue;
+      }
+      else if (!std::strcmp(arg, "--wal"))
+      {
+        options.wal = true;
+        continue;
+      }
+      else if (!std::strcmp(arg, "--durability=none"))
+      {
+        options.durability = varasto::DurabilityMode::none;
+        continue;
+      }
+      else if (!std::strcmp(arg, "--durability=sync"))
+      {
+        options.durability = varasto::DurabilityMode::sync;
+        continue;
+      }
+      else if (!std::strcmp(arg, "--durability=group"))
+      {
+        options.durability = varasto::DurabilityMode::group;
+        continue;
+      }
+      else if (!std::strncmp(arg, "--snapshot-interval=", 20))
+      {
+        if (!parse_seconds(arg + 20, options.snapshot_interval))
+        {
+          std::cerr << "Invalid argument for the --snapshot-interval option."
+                    << std::endl;
+          std::exit(EXIT_FAILURE);
+        }
+        continue;
+      }
+      else if (!std::strncmp(arg, "--warm-up-threads=", 18))
+      {
+        if (!parse_count(arg + 18, options.warm_up_threads))
+        {
+          std::cerr << "Invalid argument for the --warm-up-threads option."
+                    << std::endl;
+          std::exit(EXIT_FAILURE);
+        }
+        continue;
+      }
+      else if (!std::strncmp(arg, "--reap-rate=", 12))
+      {
+        if (!parse_count(arg + 12, options.reap_rate))
+        {
+          std::cerr << "Invalid argument for the --reap-rate option."
+                    << std::endl;
+          std::exit(EXIT_FAILURE);
+        }
+        continue;
+      }
+      else if (!std::strncmp(arg, "--commit-interval=", 18))
+      {
+        try
+        {
+          options.commit_interval = std::chrono::milliseconds(
+            std::stoul(arg + 18)
+          );
+        }
+        catch (const std::exception& e)
+        {
+          std::cerr << "Invalid argument for the --commit-interval option."
+                    << std::endl;
+          std::exit(EXIT_FAILURE);
+        }
+        continue;
+      }
+      else if (!std::strcmp(arg, "--uuid=v4"))
+      {
+        options.uuid_version = varasto::UuidVersion::v4;
+        continue;
+      }
+      else if (!std::strcmp(arg, "--uuid=v7"))
+      {
+        options.uuid_version = varasto::UuidVersion::v7;
+        continue;
+      }
+      else if (!std::strcmp(arg, "--json=structural"))
+      {
+        options.json_codec = varasto::json::CodecType::structural;
+        continue;
+      }
+      else if (!std::strcmp(arg, "--json=peelo"))
+      {
+        options.json_codec = varasto::json::CodecType::peelo;
+        continue;
+      }
+      else if (!std::strcmp(arg, "--value-format=json"))
+      {
+        options.value_format = varasto::ValueFormat::json;
+        continue;
+      }
+      else if (!std::strcmp(arg, "--value-format=binary"))
+      {
+        options.value_format = varasto::ValueFormat::binary;
+        continue;
+      }
+      else if (!std::strncmp(arg, "--threads=", 10))
+      {
+        if (
+          !parse_count(arg + 10, options.worker_count) ||
+          !options.worker_count
+        )
+        {
+          std::cerr << "Invalid argument for the --threads option."
+                    << std::endl;
+          std::exit(EXIT_FAILURE);
+        }
+        continue;
+      }
+      else if (!std::strncmp(arg, "--queue-depth=", 14))
+      {
+        if (!parse_count(arg + 14, options.queue_depth))
+        {
+          std::cerr << "Invalid argument for the --queue-depth option."
+                    << std::endl;
+          std::exit(EXIT_FAILURE);
+        }
+        continue;
+      }
+      else if (!std::strncmp(arg, "--max-queued=", 13))
+      {
+        if (!parse_count(arg + 13, options.max_queued_connections))
+        {
+          std::cerr << "Invalid argument for the --max-queued option."
+                    << std::endl;
+          std::exit(EXIT_FAILURE);
+        }
+        continue;
+      }
+      else if (!std::strncmp(arg, "--keep-alive-max=", 17))
+      {
+        if (!parse_count(arg + 17, options.keep_alive_max_count))
+        {
+          std::cerr << "Invalid argument for the --keep-alive-max option."
+                    << std::endl;
+          std::exit(EXIT_FAILURE);
+        }
+        continue;
+      }
+      else if (!std::strncmp(arg, "--keep-alive-timeout=", 21))
+      {
+        if (!parse_seconds(arg + 21, options.keep_alive_timeout))
+        {
+          std::cerr << "Invalid argument for the --keep-alive-timeout option."
+                    << std::endl;
+          std::exit(EXIT_FAILURE);
+        }
+        continue;
+      }
+      else if (!std::strncmp(arg, "--read-timeout=", 15))
+      {
+        if (!parse_seconds(arg + 15, options.read_timeout))
+        {
+          std::cerr << "Invalid argument for the --read-timeout option."
+                    << std::endl;
+          std::exit(EXIT_FAILURE);
+        }
+        continue;
+      }
+      else if (!std::strncmp(arg, "--write-timeout=", 16))
+      {
+        if (!parse_seconds(arg + 16, options.write_timeout))
+        {
+          std::cerr << "Invalid argument for the --write-timeout option."
+                    << std::endl;
+          std::exit(EXIT_FAILURE);
+        }
+        continue;
+      }
+      else if (!std::strncmp(arg, "--max-body-size=", 16))
+      {
+        if (!parse_size(arg + 16, options.payload_max_length))
+        {
+          std::cerr << "Invalid argument for the --max-body-size option."
+                    << std::endl;
+          std::exit(EXIT_FAILURE);
+        }
+        continue;
+      }
+      else if (!std::strncmp(arg, "--compress=", 11))
+      {
+        if (!parse_size(arg + 11, options.compression.threshold))
+        {
+          std::cerr << "Invalid argument for the --compress option."
+                    << std::endl;
+          std::exit(EXIT_FAILURE);
+        }
+        continue;
+      }
+      else if (!std::strncmp(arg, "--compress-retrain=", 19))
+      {
+        if (
+          !parse_seconds(arg + 19, options.compression.retrain_interval) ||
+          options.compression.retrain_interval.count() <= 0
+        )
+        {
+          std::cerr << "Invalid argument for the --compress-retrain option."
+                    << std::endl;
+          std::exit(EXIT_FAILURE);
+        }
+        continue;
+      }
+      else if (!std::strncmp(arg, "--gzip=", 7))
+      {
+        if (!parse_size(arg + 7, options.gzip_threshold))
+        {
+          std::cerr << "Invalid argument for the --gzip option."
+                    << std::endl;
+          std::exit(EXIT_FAILURE);
+        }
+        continue;
+      }
+      else if (!std::strncmp(arg, "--cache-size=", 13))
+      {
+        if (!parse_size(arg + 13, options.cache_size))
+        {
+          std::cerr << "Invalid argument for the --cache-size option."
+                    << std::endl;
+          std::exit(EXIT_FAILURE);
+        }
+        continue;
       } else {
         std::cerr << "Unrecognized switch: " << arg << std::endl;
         display_usage(std::cerr, argv[0]);
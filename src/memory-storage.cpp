@@ -0,0 +1,948 @@
+/*
+ * Copyright (c) 2024, Rauli Laine
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <iostream>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "./json.hpp"
+#include "./memory-storage.hpp"
+#include "./slug.hpp"
+#include "./utils.hpp"
+
+namespace varasto
+{
+  static const char snapshot_magic[4] = { 'V', 'M', 'S', '1' };
+  static const std::size_t snapshot_buffer_size = 1024 * 1024;
+  static const std::size_t listing_page_size = 1024;
+
+  struct SnapshotRecordHeader
+  {
+    std::uint32_t value_length;
+    std::uint16_t ns_length;
+    std::uint16_t key_length;
+  };
+
+  struct SnapshotTrailer
+  {
+    std::uint64_t count;
+    std::uint32_t checksum;
+    std::uint32_t reserved;
+  };
+
+  static std::optional<std::string>
+  validate(const Storage::key_type& ns, const Storage::key_type& key)
+  {
+    if (!is_valid_slug(ns) || ns.length() > UINT16_MAX)
+    {
+      return "Invalid namespace: " + ns;
+    }
+    else if (
+      !key.empty() &&
+      (!is_valid_slug(key) || key.length() > UINT16_MAX)
+    )
+    {
+      return "Invalid key: " + key;
+    }
+
+    return std::nullopt;
+  }
+
+  MemoryStorage::open_result_type
+  MemoryStorage::Open(
+    const path_type& root,
+    const interval_type& snapshot_interval
+  )
+  {
+    std::shared_ptr<MemoryStorage> storage(
+      new MemoryStorage(root, snapshot_interval)
+    );
+
+    if (snapshot_interval.count() > 0)
+    {
+      if (const auto error = storage->Load())
+      {
+        return open_result_type::error(*error);
+      }
+      storage->m_snapshot_thread = std::thread(
+        &MemoryStorage::RunSnapshots,
+        storage.get()
+      );
+    }
+
+    return open_result_type::ok(storage);
+  }
+
+  MemoryStorage::MemoryStorage(
+    const path_type& root,
+    const interval_type& interval
+  )
+    : m_root(root)
+    , m_snapshot_interval(interval)
+    , m_epoch(std::to_string(
+        std::chrono::system_clock::now().time_since_epoch().count()
+      ))
+    , m_next_sequence(1)
+    , m_snapshot_sequence(1)
+    , m_running(true) {}
+
+  MemoryStorage::~MemoryStorage()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_snapshot_mutex);
+
+      m_running = false;
+    }
+    m_snapshot_condition.notify_all();
+    if (m_snapshot_thread.joinable())
+    {
+      m_snapshot_thread.join();
+      if (m_snapshot_sequence != m_next_sequence)
+      {
+        if (const auto error = Snapshot())
+        {
+          std::cerr << *error << std::endl;
+        }
+      }
+    }
+  }
+
+  Storage::get_result_type
+  MemoryStorage::Get(
+    const key_type& ns,
+    const key_type& key
+  ) const
+  {
+    const auto raw = GetRaw(ns, key);
+
+    if (!raw)
+    {
+      return get_result_type::error(raw.error());
+    }
+    else if (!*raw)
+    {
+      return get_result_type::ok(std::nullopt);
+    }
+
+    const auto result = json::parse_object(**raw);
+
+    if (!result)
+    {
+      return get_result_type::error(result.error());
+    }
+
+    return get_result_type::ok(*result);
+  }
+
+  Storage::get_raw_result_type
+  MemoryStorage::GetRaw(
+    const key_type& ns,
+    const key_type& key
+  ) const
+  {
+    if (const auto error = validate(ns, key))
+    {
+      return get_raw_result_type::error(*error);
+    }
+
+    const auto& shard = GetShard(ns);
+    std::shared_lock<std::shared_mutex> lock(shard.mutex);
+    const auto ns_it = shard.namespaces.find(ns);
+
+    if (ns_it != std::end(shard.namespaces))
+    {
+      const auto key_it = ns_it->second.find(key);
+
+      if (key_it != std::end(ns_it->second))
+      {
+        return get_raw_result_type::ok(key_it->second.raw);
+      }
+    }
+
+    return get_raw_result_type::ok(std::nullopt);
+  }
+
+  Storage::multi_get_result_type
+  MemoryStorage::MultiGet(
+    const std::vector<std::pair<key_type, key_type>>& entries
+  ) const
+  {
+    multi_get_result_type results(
+      entries.size(),
+      get_raw_result_type::ok(std::nullopt)
+    );
+    std::vector<const Shard*> shards;
+
+    shards.reserve(entries.size());
+    for (std::size_t i = 0; i < entries.size(); ++i)
+    {
+      const auto& ns = entries[i].first;
+
+      if (const auto error = validate(ns, entries[i].second))
+      {
+        results[i] = get_raw_result_type::error(*error);
+        shards.push_back(nullptr);
+      } else {
+        shards.push_back(&GetShard(ns));
+      }
+    }
+
+    // Each shard is locked only once, for reading all of the entries which
+    // belong into it.
+    for (std::size_t i = 0; i < entries.size(); ++i)
+    {
+      const auto shard = shards[i];
+
+      if (!shard)
+      {
+        continue;
+      }
+
+      std::shared_lock<std::shared_mutex> lock(shard->mutex);
+
+      for (auto j = i; j < entries.size(); ++j)
+      {
+        if (shards[j] != shard)
+        {
+          continue;
+        }
+        shards[j] = nullptr;
+
+        const auto ns_it = shard->namespaces.find(entries[j].first);
+
+        if (ns_it != std::end(shard->namespaces))
+        {
+          const auto key_it = ns_it->second.find(entries[j].second);
+
+          if (key_it != std::end(ns_it->second))
+          {
+            results[j] = get_raw_result_type::ok(key_it->second.raw);
+          }
+        }
+      }
+    }
+
+    return results;
+  }
+
+  Storage::get_version_result_type
+  MemoryStorage::GetVersion(
+    const key_type& ns,
+    const key_type& key
+  ) const
+  {
+    if (const auto error = validate(ns, key))
+    {
+      return get_version_result_type::error(*error);
+    }
+
+    const auto& shard = GetShard(ns);
+    std::shared_lock<std::shared_mutex> lock(shard.mutex);
+    const auto ns_it = shard.namespaces.find(ns);
+
+    if (ns_it != std::end(shard.namespaces))
+    {
+      const auto key_it = ns_it->second.find(key);
+
+      if (key_it != std::end(ns_it->second))
+      {
+        return get_version_result_type::ok(
+          m_epoch + "-" + std::to_string(key_it->second.sequence)
+        );
+      }
+    }
+
+    return get_version_result_type::ok(std::nullopt);
+  }
+
+  Storage::get_all_keys_type
+  MemoryStorage::GetAllKeys(const key_type& ns) const
+  {
+    return GetKeys(ns, ListOptions());
+  }
+
+  Storage::get_stats_result_type
+  MemoryStorage::GetStats(const key_type& ns) const
+  {
+    if (const auto error = validate(ns, key_type()))
+    {
+      return get_stats_result_type::error(*error);
+    }
+
+    const auto& shard = GetShard(ns);
+    std::shared_lock<std::shared_mutex> lock(shard.mutex);
+    const auto ns_it = shard.namespaces.find(ns);
+    const auto stats_it = shard.stats.find(ns);
+    NamespaceStats stats;
+
+    if (ns_it == std::end(shard.namespaces))
+    {
+      return get_stats_result_type::ok(std::nullopt);
+    }
+    else if (stats_it != std::end(shard.stats))
+    {
+      stats = stats_it->second;
+    }
+    stats.count = ns_it->second.size();
+
+    return get_stats_result_type::ok(stats);
+  }
+
+  Storage::get_namespace_version_result_type
+  MemoryStorage::GetNamespaceVersion(const key_type& ns) const
+  {
+    if (const auto error = validate(ns, key_type()))
+    {
+      return get_namespace_version_result_type::error(*error);
+    }
+
+    const auto& shard = GetShard(ns);
+    std::shared_lock<std::shared_mutex> lock(shard.mutex);
+    const auto it = shard.versions.find(ns);
+
+    return get_namespace_version_result_type::ok(std::to_string(
+      it != std::end(shard.versions) ? it->second : 0
+    ));
+  }
+
+  Storage::get_all_keys_type
+  MemoryStorage::GetKeys(
+    const key_type& ns,
+    const ListOptions& options
+  ) const
+  {
+    if (const auto error = validate(ns, key_type()))
+    {
+      return get_all_keys_type::error(*error);
+    }
+
+    const auto& shard = GetShard(ns);
+    std::shared_lock<std::shared_mutex> lock(shard.mutex);
+    const auto ns_it = shard.namespaces.find(ns);
+    std::vector<key_type> keys;
+
+    if (ns_it == std::end(shard.namespaces))
+    {
+      return get_all_keys_type::ok(keys);
+    }
+
+    const auto& entries = ns_it->second;
+    auto it = options.after < options.prefix
+      ? entries.lower_bound(options.prefix)
+      : entries.upper_bound(options.after);
+
+    for (; it != std::end(entries); ++it)
+    {
+      if (
+        (options.limit && keys.size() >= options.limit) ||
+        it->first.compare(0, options.prefix.length(), options.prefix)
+      )
+      {
+        break;
+      }
+      keys.push_back(it->first);
+    }
+
+    return get_all_keys_type::ok(keys);
+  }
+
+  Storage::for_each_entry_result_type
+  MemoryStorage::ForEachEntry(
+    const key_type& ns,
+    const ListOptions& options,
+    const entry_visitor_type& visitor
+  ) const
+  {
+    if (const auto error = validate(ns, key_type()))
+    {
+      return for_each_entry_result_type::error(*error);
+    }
+
+    const auto& shard = GetShard(ns);
+    auto after = options.after;
+    std::size_t count = 0;
+
+    // Entries are copied out in pages, so that the shard is not kept locked
+    // while the visitor is sending them to the client.
+    for (;;)
+    {
+      std::vector<std::pair<key_type, std::string>> page;
+
+      {
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        const auto ns_it = shard.namespaces.find(ns);
+
+        if (ns_it == std::end(shard.namespaces))
+        {
+          break;
+        }
+
+        const auto& entries = ns_it->second;
+        auto it = after < options.prefix
+          ? entries.lower_bound(options.prefix)
+          : entries.upper_bound(after);
+
+        for (; it != std::end(entries); ++it)
+        {
+          if (
+            page.size() >= listing_page_size ||
+            (options.limit && count + page.size() >= options.limit) ||
+            it->first.compare(0, options.prefix.length(), options.prefix)
+          )
+          {
+            break;
+          }
+          page.emplace_back(it->first, it->second.raw);
+        }
+      }
+
+      for (const auto& entry : page)
+      {
+        if (!visitor(entry.first, entry.second))
+        {
+          return for_each_entry_result_type::ok(false);
+        }
+      }
+      count += page.size();
+      if (
+        page.size() < listing_page_size ||
+        (options.limit && count >= options.limit)
+      )
+      {
+        break;
+      }
+      after = page.back().first;
+    }
+
+    return for_each_entry_result_type::ok(true);
+  }
+
+  Storage::set_result_type
+  MemoryStorage::Set(
+    const key_type& ns,
+    const key_type& key,
+    const value_type& value
+  )
+  {
+    if (const auto error = validate(ns, key))
+    {
+      return set_result_type::error(*error);
+    }
+
+    auto raw = json::format(value);
+    auto& shard = GetShard(ns);
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+
+    auto& entry = shard.namespaces[ns][key];
+    auto& stats = shard.stats[ns];
+
+    stats.size -= entry.raw.length();
+    stats.size += raw.length();
+    stats.last_modified = NamespaceStats::time_type::clock::now();
+    entry = { std::move(raw), m_next_sequence++ };
+    shard.versions[ns] = entry.sequence;
+
+    return set_result_type::ok(true);
+  }
+
+  Storage::update_result_type
+  MemoryStorage::Update(
+    const key_type& ns,
+    const key_type& key,
+    const value_type& value
+  )
+  {
+    if (const auto error = validate(ns, key))
+    {
+      return update_result_type::error(*error);
+    }
+
+    auto& shard = GetShard(ns);
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+    const auto ns_it = shard.namespaces.find(ns);
+
+    if (ns_it == std::end(shard.namespaces))
+    {
+      return update_result_type::ok(std::nullopt);
+    }
+
+    const auto key_it = ns_it->second.find(key);
+
+    if (key_it == std::end(ns_it->second))
+    {
+      return update_result_type::ok(std::nullopt);
+    }
+
+    // Shard stays locked while the entry is merged, which makes updates
+    // atomic even without LockingStorage.
+    const auto current = json::parse_object(key_it->second.raw);
+
+    if (!current)
+    {
+      return update_result_type::error(current.error());
+    }
+
+    const auto new_value = utils::patch(*current, value);
+    auto raw = json::format(new_value);
+    auto& stats = shard.stats[ns];
+
+    stats.size -= key_it->second.raw.length();
+    stats.size += raw.length();
+    stats.last_modified = NamespaceStats::time_type::clock::now();
+    key_it->second = { std::move(raw), m_next_sequence++ };
+    shard.versions[ns] = key_it->second.sequence;
+
+    return update_result_type::ok(new_value);
+  }
+
+  Storage::merge_result_type
+  MemoryStorage::Merge(
+    const key_type& ns,
+    const key_type& key,
+    const value_type& patch
+  )
+  {
+    if (const auto error = validate(ns, key))
+    {
+      return merge_result_type::error(*error);
+    }
+
+    auto& shard = GetShard(ns);
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+    const auto ns_it = shard.namespaces.find(ns);
+
+    if (ns_it == std::end(shard.namespaces))
+    {
+      return merge_result_type::ok(std::nullopt);
+    }
+
+    const auto key_it = ns_it->second.find(key);
+
+    if (key_it == std::end(ns_it->second))
+    {
+      return merge_result_type::ok(std::nullopt);
+    }
+
+    const auto current = json::parse_object(key_it->second.raw);
+
+    if (!current)
+    {
+      return merge_result_type::error(current.error());
+    }
+
+    const auto new_value = utils::merge_patch(*current, patch);
+    auto raw = json::format(new_value);
+    auto& stats = shard.stats[ns];
+
+    stats.size -= key_it->second.raw.length();
+    stats.size += raw.length();
+    stats.last_modified = NamespaceStats::time_type::clock::now();
+    key_it->second = { std::move(raw), m_next_sequence++ };
+    shard.versions[ns] = key_it->second.sequence;
+
+    return merge_result_type::ok(new_value);
+  }
+
+  Storage::delete_result_type
+  MemoryStorage::Delete(
+    const key_type& ns,
+    const key_type& key
+  )
+  {
+    if (const auto error = validate(ns, key))
+    {
+      return delete_result_type::error(*error);
+    }
+
+    auto& shard = GetShard(ns);
+    std::string raw;
+
+    {
+      std::unique_lock<std::shared_mutex> lock(shard.mutex);
+      const auto ns_it = shard.namespaces.find(ns);
+
+      if (ns_it == std::end(shard.namespaces))
+      {
+        return delete_result_type::ok(std::nullopt);
+      }
+
+      const auto key_it = ns_it->second.find(key);
+
+      if (key_it == std::end(ns_it->second))
+      {
+        return delete_result_type::ok(std::nullopt);
+      }
+      raw = std::move(key_it->second.raw);
+      ns_it->second.erase(key_it);
+      if (ns_it->second.empty())
+      {
+        shard.namespaces.erase(ns_it);
+        shard.stats.erase(ns);
+        shard.versions.erase(ns);
+        ++m_next_sequence;
+      } else {
+        auto& stats = shard.stats[ns];
+
+        stats.size -= raw.length();
+        stats.last_modified = NamespaceStats::time_type::clock::now();
+        shard.versions[ns] = m_next_sequence++;
+      }
+    }
+
+    const auto result = json::parse_object(raw);
+
+    if (!result)
+    {
+      return delete_result_type::error(result.error());
+    }
+
+    return delete_result_type::ok(*result);
+  }
+
+  Storage::delete_namespace_result_type
+  MemoryStorage::DeleteNamespace(const key_type& ns)
+  {
+    if (const auto error = validate(ns, key_type()))
+    {
+      return delete_namespace_result_type::error(*error);
+    }
+
+    auto& shard = GetShard(ns);
+    namespace_type entries;
+    std::vector<mapped_type> result;
+
+    {
+      std::unique_lock<std::shared_mutex> lock(shard.mutex);
+      const auto ns_it = shard.namespaces.find(ns);
+
+      if (ns_it == std::end(shard.namespaces))
+      {
+        return delete_namespace_result_type::ok(std::nullopt);
+      }
+      entries = std::move(ns_it->second);
+      shard.namespaces.erase(ns_it);
+      shard.stats.erase(ns);
+      shard.versions.erase(ns);
+      ++m_next_sequence;
+    }
+
+    // Removed values are parsed after the shard has been unlocked.
+    result.reserve(entries.size());
+    for (const auto& entry : entries)
+    {
+      const auto value = json::parse_object(entry.second.raw);
+
+      if (!value)
+      {
+        return delete_namespace_result_type::error(value.error());
+      }
+      result.push_back(std::make_pair(entry.first, *value));
+    }
+
+    return delete_namespace_result_type::ok(result);
+  }
+
+  Storage::drop_namespace_result_type
+  MemoryStorage::DropNamespace(const key_type& ns)
+  {
+    if (const auto error = validate(ns, key_type()))
+    {
+      return drop_namespace_result_type::error(*error);
+    }
+
+    auto& shard = GetShard(ns);
+    namespace_type entries;
+
+    {
+      std::unique_lock<std::shared_mutex> lock(shard.mutex);
+      const auto ns_it = shard.namespaces.find(ns);
+
+      if (ns_it == std::end(shard.namespaces))
+      {
+        return drop_namespace_result_type::ok(false);
+      }
+      entries = std::move(ns_it->second);
+      shard.namespaces.erase(ns_it);
+      shard.stats.erase(ns);
+      shard.versions.erase(ns);
+      ++m_next_sequence;
+    }
+
+    // Entries are freed only after the shard has been unlocked.
+    return drop_namespace_result_type::ok(true);
+  }
+
+  std::optional<std::string>
+  MemoryStorage::Snapshot() const
+  {
+    std::lock_guard<std::mutex> snapshot_lock(m_snapshot_write_mutex);
+    const auto path = m_root / snapshot_filename;
+    const auto temporary_path = m_root / (
+      std::string(".") + snapshot_filename + ".tmp"
+    );
+    const auto sequence = m_next_sequence.load();
+    std::string buffer(snapshot_magic, sizeof(snapshot_magic));
+    SnapshotTrailer trailer;
+    std::int64_t offset = 0;
+    std::uint32_t checksum = 0;
+    const auto fd = ::open(
+      temporary_path.c_str(),
+      O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+      0644
+    );
+    const auto flush = [&]()
+    {
+      checksum = utils::crc32(buffer.data(), buffer.length(), checksum);
+      if (!utils::write_fully(fd, buffer.data(), buffer.length(), offset))
+      {
+        return false;
+      }
+      offset += buffer.length();
+      buffer.clear();
+
+      return true;
+    };
+
+    if (fd < 0)
+    {
+      return "Failed to open " + temporary_path.string() + ": " +
+        std::strerror(errno);
+    }
+
+    std::memset(&trailer, 0, sizeof(trailer));
+    buffer.reserve(snapshot_buffer_size);
+
+    // Each shard is consistent within itself, but shards are written one by
+    // one, so the snapshot is not a point in time view of all namespaces.
+    // Records of a shard are copied into the buffer while holding its lock
+    // and written out only after it has been released, so that writers of
+    // the shard do not have to wait for the disk.
+    for (const auto& shard : m_shards)
+    {
+      {
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+
+        for (const auto& ns : shard.namespaces)
+        {
+          for (const auto& entry : ns.second)
+          {
+            SnapshotRecordHeader header;
+
+            header.value_length = entry.second.raw.length();
+            header.ns_length = ns.first.length();
+            header.key_length = entry.first.length();
+            buffer.append(
+              reinterpret_cast<const char*>(&header),
+              sizeof(header)
+            );
+            buffer.append(ns.first);
+            buffer.append(entry.first);
+            buffer.append(entry.second.raw);
+            ++trailer.count;
+          }
+        }
+      }
+      if (buffer.length() >= snapshot_buffer_size && !flush())
+      {
+        ::close(fd);
+        ::unlink(temporary_path.c_str());
+
+        return "Failed to write snapshot.";
+      }
+    }
+
+    if (!flush())
+    {
+      ::close(fd);
+      ::unlink(temporary_path.c_str());
+
+      return "Failed to write snapshot.";
+    }
+    trailer.checksum = checksum;
+    if (
+      !utils::write_fully(
+        fd,
+        reinterpret_cast<const char*>(&trailer),
+        sizeof(trailer),
+        offset
+      ) ||
+      ::fsync(fd) != 0
+    )
+    {
+      ::close(fd);
+      ::unlink(temporary_path.c_str());
+
+      return "Failed to write snapshot.";
+    }
+    ::close(fd);
+
+    if (::rename(temporary_path.c_str(), path.c_str()) != 0)
+    {
+      ::unlink(temporary_path.c_str());
+
+      return "Failed to rename snapshot.";
+    }
+
+    const auto dir_fd = ::open(m_root.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (dir_fd >= 0)
+    {
+      ::fsync(dir_fd);
+      ::close(dir_fd);
+    }
+    m_snapshot_sequence = sequence;
+
+    return std::nullopt;
+  }
+
+  std::optional<std::string>
+  MemoryStorage::Load()
+  {
+    const auto path = m_root / snapshot_filename;
+    const auto fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    std::string buffer;
+    SnapshotTrailer trailer;
+    std::size_t offset = sizeof(snapshot_magic);
+    std::uint64_t count = 0;
+    off_t size;
+
+    if (fd < 0)
+    {
+      if (errno == ENOENT)
+      {
+        return std::nullopt;
+      }
+
+      return "Failed to open " + path.string() + ": " + std::strerror(errno);
+    }
+    else if ((size = ::lseek(fd, 0, SEEK_END)) < 0)
+    {
+      ::close(fd);
+
+      return "Failed to open " + path.string() + ": " + std::strerror(errno);
+    }
+    buffer.resize(size);
+    if (!utils::read_fully(fd, buffer.data(), buffer.size(), 0))
+    {
+      ::close(fd);
+
+      return "Failed to read " + path.string() + ".";
+    }
+    ::close(fd);
+
+    // Snapshots are replaced atomically, so a snapshot which does not pass
+    // the checks has been damaged after it was written.
+    if (
+      buffer.size() < sizeof(snapshot_magic) + sizeof(trailer) ||
+      std::memcmp(buffer.data(), snapshot_magic, sizeof(snapshot_magic))
+    )
+    {
+      return "Invalid snapshot " + path.string() + ".";
+    }
+    std::memcpy(
+      &trailer,
+      buffer.data() + buffer.size() - sizeof(trailer),
+      sizeof(trailer)
+    );
+    buffer.resize(buffer.size() - sizeof(trailer));
+    if (utils::crc32(buffer.data(), buffer.size()) != trailer.checksum)
+    {
+      return "Corrupted snapshot " + path.string() + ".";
+    }
+
+    while (offset + sizeof(SnapshotRecordHeader) <= buffer.size())
+    {
+      SnapshotRecordHeader header;
+
+      std::memcpy(&header, buffer.data() + offset, sizeof(header));
+      offset += sizeof(header);
+      if (
+        offset +
+        header.ns_length +
+        header.key_length +
+        header.value_length > buffer.size()
+      )
+      {
+        break;
+      }
+
+      const key_type ns(buffer.data() + offset, header.ns_length);
+      const key_type key(
+        buffer.data() + offset + header.ns_length,
+        header.key_length
+      );
+      auto& shard = GetShard(ns);
+
+      offset += header.ns_length + header.key_length;
+      shard.stats[ns].size += header.value_length;
+      shard.versions[ns] = m_next_sequence;
+      shard.namespaces[ns][key] = {
+        buffer.substr(offset, header.value_length),
+        m_next_sequence++,
+      };
+      offset += header.value_length;
+      ++count;
+    }
+
+    if (offset != buffer.size() || count != trailer.count)
+    {
+      return "Corrupted snapshot " + path.string() + ".";
+    }
+    m_snapshot_sequence = m_next_sequence.load();
+
+    return std::nullopt;
+  }
+
+  MemoryStorage::Shard&
+  MemoryStorage::GetShard(const key_type& ns)
+  {
+    return m_shards[std::hash<key_type>()(ns) % shard_count];
+  }
+
+  const MemoryStorage::Shard&
+  MemoryStorage::GetShard(const key_type& ns) const
+  {
+    return m_shards[std::hash<key_type>()(ns) % shard_count];
+  }
+
+  void
+  MemoryStorage::RunSnapshots()
+  {
+    std::unique_lock<std::mutex> lock(m_snapshot_mutex);
+
+    while (m_running)
+    {
+      m_snapshot_condition.wait_for(lock, m_snapshot_interval);
+      if (!m_running)
+      {
+        break;
+      }
+      else if (m_snapshot_sequence == m_next_sequence)
+      {
+        continue;
+      }
+      lock.unlock();
+      if (const auto error = Snapshot())
+      {
+        std::cerr << *error << std::endl;
+      }
+      lock.lock();
+    }
+  }
+}
@@ -0,0 +1,200 @@
+/*
+ * Copyright (c) 2024, Rauli Laine
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
+
+#include "./storage.hpp"
+
+namespace varasto
+{
+  /**
+   * Storage implementation which keeps all entries in memory, in a hash map
+   * of namespaces split into independently locked shards. Entries can be
+   * periodically written into a snapshot file, which is loaded back when
+   * the storage is opened, so that the data survives restarts.
+   */
+  class MemoryStorage : public Storage
+  {
+  public:
+    using path_type = std::filesystem::path;
+    using interval_type = std::chrono::seconds;
+    using sequence_type = std::uint64_t;
+
+    using open_result_type = peelo::result<
+      std::shared_ptr<MemoryStorage>,
+      std::string
+    >;
+
+    static constexpr std::size_t shard_count = 16;
+    static constexpr const char* snapshot_filename = "memory.snapshot";
+
+    /**
+     * Opens memory storage, loading the snapshot from given directory if
+     * there is one. Snapshots are written every given interval, and once
+     * more when the storage is destroyed. Zero interval disables snapshots,
+     * in which case the data is lost when the server stops.
+     */
+    static open_result_type Open(
+      const path_type& root,
+      const interval_type& snapshot_interval = interval_type(60)
+    );
+
+    MemoryStorage(const MemoryStorage&) = delete;
+    MemoryStorage(MemoryStorage&&) = delete;
+    MemoryStorage& operator=(const MemoryStorage&) = delete;
+    MemoryStorage& operator=(MemoryStorage&&) = delete;
+
+    ~MemoryStorage();
+
+    get_result_type Get(
+      const key_type& ns,
+      const key_type& key
+    ) const;
+
+    get_raw_result_type GetRaw(
+      const key_type& ns,
+      const key_type& key
+    ) const;
+
+    get_version_result_type GetVersion(
+      const key_type& ns,
+      const key_type& key
+    ) const;
+
+    multi_get_result_type MultiGet(
+      const std::vector<std::pair<key_type, key_type>>& entries
+    ) const;
+
+    get_all_keys_type GetAllKeys(
+      const key_type& ns
+    ) const;
+
+    get_stats_result_type GetStats(
+      const key_type& ns
+    ) const;
+
+    get_namespace_version_result_type GetNamespaceVersion(
+      const key_type& ns
+    ) const;
+
+    get_all_keys_type GetKeys(
+      const key_type& ns,
+      const ListOptions& options
+    ) const;
+
+    for_each_entry_result_type ForEachEntry(
+      const key_type& ns,
+      const ListOptions& options,
+      const entry_visitor_type& visitor
+    ) const;
+
+    set_result_type Set(
+      const key_type& ns,
+      const key_type& key,
+      const value_type& value
+    );
+
+    update_result_type Update(
+      const key_type& ns,
+      const key_type& key,
+      const value_type& value
+    );
+
+    merge_result_type Merge(
+      const key_type& ns,
+      const key_type& key,
+      const value_type& patch
+    );
+
+    delete_result_type Delete(
+      const key_type& ns,
+      const key_type& key
+    );
+
+    delete_namespace_result_type DeleteNamespace(
+      const key_type& ns
+    );
+
+    drop_namespace_result_type DropNamespace(
+      const key_type& ns
+    );
+
+    /**
+     * Writes all entries into the snapshot file, replacing the previous
+     * snapshot atomically.
+     */
+    std::optional<std::string> Snapshot() const;
+
+  private:
+    /**
+     * Stored entry. Values are kept serialized, since they are more compact
+     * that way and most reads send them to clients as they are.
+     */
+    struct Entry
+    {
+      std::string raw;
+      sequence_type sequence;
+    };
+
+    using namespace_type = std::map<key_type, Entry>;
+
+    struct alignas(64) Shard
+    {
+      mutable std::shared_mutex mutex;
+      std::unordered_map<key_type, namespace_type> namespaces;
+      /** Total size and modification time of each namespace. */
+      std::unordered_map<key_type, NamespaceStats> stats;
+      /** Sequence of the latest modification of each namespace. */
+      std::unordered_map<key_type, sequence_type> versions;
+    };
+
+    MemoryStorage(const path_type& root, const interval_type& interval);
+
+    std::optional<std::string> Load();
+
+    Shard& GetShard(const key_type& ns);
+
+    const Shard& GetShard(const key_type& ns) const;
+
+    void RunSnapshots();
+
+  private:
+    const path_type m_root;
+    const interval_type m_snapshot_interval;
+    /** Distinguishes versions of entries from earlier runs. */
+    const std::string m_epoch;
+    std::array<Shard, shard_count> m_shards;
+    std::atomic<sequence_type> m_next_sequence;
+    mutable std::atomic<sequence_type> m_snapshot_sequence;
+    mutable std::mutex m_snapshot_write_mutex;
+    std::mutex m_snapshot_mutex;
+    std::condition_variable m_snapshot_condition;
+    bool m_running;
+    std::thread m_snapshot_thread;
+  };
+}
@@ -0,0 +1,234 @@
+/*
+ * Copyright (c) 2024, Rauli Laine
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <cstdio>
+
+#include "./metrics.hpp"
+
+namespace varasto
+{
+  const std::array<Histogram::duration_type, Histogram::bucket_count>
+  Histogram::bounds =
+  {
+    std::chrono::microseconds(100),
+    std::chrono::microseconds(250),
+    std::chrono::microseconds(500),
+    std::chrono::milliseconds(1),
+    std::chrono::microseconds(2500),
+    std::chrono::milliseconds(5),
+    std::chrono::milliseconds(10),
+    std::chrono::milliseconds(25),
+    std::chrono::milliseconds(50),
+    std::chrono::milliseconds(100),
+    std::chrono::milliseconds(250),
+    std::chrono::milliseconds(500),
+    std::chrono::seconds(1),
+    std::chrono::milliseconds(2500),
+    std::chrono::seconds(5),
+    std::chrono::seconds(10),
+  };
+
+  static std::string
+  format_seconds(std::uint64_t nanoseconds)
+  {
+    char buffer[32];
+
+    std::snprintf(
+      buffer,
+      sizeof(buffer),
+      "%.9g",
+      static_cast<double>(nanoseconds) / 1e9
+    );
+
+    return buffer;
+  }
+
+  static void
+  format_sample(
+    std::string& output,
+    const std::string& name,
+    const std::string& labels,
+    const std::string& value
+  )
+  {
+    output.append(name);
+    if (!labels.empty())
+    {
+      output.append("{").append(labels).append("}");
+    }
+    output.append(" ").append(value).append("\n");
+  }
+
+  void
+  Counter::Format(
+    std::string& output,
+    const std::string& name,
+    const std::string& labels
+  ) const
+  {
+    format_sample(output, name, labels, std::to_string(Value()));
+  }
+
+  void
+  Gauge::Format(
+    std::string& output,
+    const std::string& name,
+    const std::string& labels
+  ) const
+  {
+    format_sample(output, name, labels, std::to_string(Value()));
+  }
+
+  void
+  Histogram::Observe(duration_type duration)
+  {
+    std::size_t bucket = 0;
+
+    while (bucket < bucket_count && duration > bounds[bucket])
+    {
+      ++bucket;
+    }
+    m_buckets[bucket].Add(1);
+    m_sum.Add(duration.count() > 0 ? duration.count() : 0);
+  }
+
+  void
+  Histogram::Format(
+    std::string& output,
+    const std::string& name,
+    const std::string& labels
+  ) const
+  {
+    const auto prefix = labels.empty() ? labels : labels + ",";
+    counter_type count = 0;
+
+    // Buckets are stored separately but exposed as cumulative counts, as
+    // Prometheus expects.
+    for (std::size_t i = 0; i < bucket_count; ++i)
+    {
+      count += m_buckets[i].Value();
+      format_sample(
+        output,
+        name + "_bucket",
+        prefix + "le=\"" + format_seconds(bounds[i].count()) + "\"",
+        std::to_string(count)
+      );
+    }
+    count += m_buckets[bucket_count].Value();
+    format_sample(
+      output,
+      name + "_bucket",
+      prefix + "le=\"+Inf\"",
+      std::to_string(count)
+    );
+    format_sample(
+      output,
+      name + "_sum",
+      labels,
+      format_seconds(m_sum.Value())
+    );
+    format_sample(output, name + "_count", labels, std::to_string(count));
+  }
+
+  Counter&
+  Metrics::AddCounter(
+    const std::string& name,
+    const std::string& help,
+    const std::string& labels
+  )
+  {
+    return Add<Counter>(name, help, "counter", labels);
+  }
+
+  Gauge&
+  Metrics::AddGauge(
+    const std::string& name,
+    const std::string& help,
+    const std::string& labels
+  )
+  {
+    return Add<Gauge>(name, help, "gauge", labels);
+  }
+
+  Histogram&
+  Metrics::AddHistogram(
+    const std::string& name,
+    const std::string& help,
+    const std::string& labels
+  )
+  {
+    return Add<Histogram>(name, help, "histogram", labels);
+  }
+
+  void
+  Metrics::AddCollector(const collector_type& collector)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    m_collectors.push_back(collector);
+  }
+
+  std::string
+  Metrics::Format() const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::string output;
+
+    for (const auto& family : m_families)
+    {
+      output
+        .append("# HELP ")
+        .append(family.first)
+        .append(" ")
+        .append(family.second.help)
+        .append("\n# TYPE ")
+        .append(family.first)
+        .append(" ")
+        .append(family.second.type)
+        .append("\n");
+      for (const auto& metric : family.second.metrics)
+      {
+        metric.second->Format(output, family.first, metric.first);
+      }
+    }
+    for (const auto& collector : m_collectors)
+    {
+      collector(output);
+    }
+
+    return output;
+  }
+
+  template<class T>
+  T&
+  Metrics::Add(
+    const std::string& name,
+    const std::string& help,
+    const std::string& type,
+    const std::string& labels
+  )
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto& family = m_families[name];
+    auto metric = std::make_unique<T>();
+    auto& result = *metric;
+
+    family.help = help;
+    family.type = type;
+    family.metrics.push_back(std::make_pair(labels, std::move(metric)));
+
+    return result;
+  }
+}
@@ -0,0 +1,289 @@
+/*
+ * Copyright (c) 2024, Rauli Laine
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace varasto
+{
+  /**
+   * Base class for metrics which can be formatted in the Prometheus text
+   * exposition format.
+   */
+  class Metric
+  {
+  public:
+    virtual ~Metric() = default;
+
+    virtual void Format(
+      std::string& output,
+      const std::string& name,
+      const std::string& labels
+    ) const = 0;
+  };
+
+  /**
+   * Integer value spread across multiple cache line sized shards. Each
+   * thread always updates the same shard, so that threads updating the same
+   * value do not have to fight over the same cache line. Reading the value
+   * sums up all of the shards.
+   */
+  template<class T>
+  class ShardedValue
+  {
+  public:
+    static constexpr std::size_t shard_count = 16;
+
+    ShardedValue()
+    {
+      for (auto& shard : m_shards)
+      {
+        shard.value.store(0, std::memory_order_relaxed);
+      }
+    }
+
+    ShardedValue(const ShardedValue&) = delete;
+    ShardedValue(ShardedValue&&) = delete;
+    ShardedValue& operator=(const ShardedValue&) = delete;
+    ShardedValue& operator=(ShardedValue&&) = delete;
+
+    inline void Add(T amount)
+    {
+      m_shards[GetShardIndex()].value.fetch_add(
+        amount,
+        std::memory_order_relaxed
+      );
+    }
+
+    inline T Value() const
+    {
+      T result = 0;
+
+      for (const auto& shard : m_shards)
+      {
+        result += shard.value.load(std::memory_order_relaxed);
+      }
+
+      return result;
+    }
+
+  private:
+    struct alignas(64) Shard
+    {
+      std::atomic<T> value;
+    };
+
+    static std::size_t GetShardIndex()
+    {
+      static std::atomic<std::size_t> next_index(0);
+      thread_local const std::size_t index = next_index++ % shard_count;
+
+      return index;
+    }
+
+  private:
+    std::array<Shard, shard_count> m_shards;
+  };
+
+  /**
+   * Monotonically increasing counter.
+   */
+  class Counter : public Metric
+  {
+  public:
+    using value_type = std::uint64_t;
+
+    inline void Increment(value_type amount = 1)
+    {
+      m_value.Add(amount);
+    }
+
+    inline value_type Value() const
+    {
+      return m_value.Value();
+    }
+
+    void Format(
+      std::string& output,
+      const std::string& name,
+      const std::string& labels
+    ) const;
+
+  private:
+    ShardedValue<value_type> m_value;
+  };
+
+  /**
+   * Value which can go both up and down, such as number of requests being
+   * currently processed.
+   */
+  class Gauge : public Metric
+  {
+  public:
+    using value_type = std::int64_t;
+
+    inline void Add(value_type amount)
+    {
+      m_value.Add(amount);
+    }
+
+    inline value_type Value() const
+    {
+      return m_value.Value();
+    }
+
+    void Format(
+      std::string& output,
+      const std::string& name,
+      const std::string& labels
+    ) const;
+
+  private:
+    ShardedValue<value_type> m_value;
+  };
+
+  /**
+   * Distribution of durations in fixed buckets, ranging from 100
+   * microseconds to 10 seconds.
+   */
+  class Histogram : public Metric
+  {
+  public:
+    using duration_type = std::chrono::nanoseconds;
+    using counter_type = std::uint64_t;
+
+    static constexpr std::size_t bucket_count = 16;
+    static const std::array<duration_type, bucket_count> bounds;
+
+    void Observe(duration_type duration);
+
+    void Format(
+      std::string& output,
+      const std::string& name,
+      const std::string& labels
+    ) const;
+
+  private:
+    // Last bucket counts observations which exceed all of the bounds.
+    std::array<ShardedValue<counter_type>, bucket_count + 1> m_buckets;
+    ShardedValue<counter_type> m_sum;
+  };
+
+  /**
+   * Observes time elapsed between construction and destruction of the timer
+   * into the given histogram.
+   */
+  class ScopedTimer
+  {
+  public:
+    using clock_type = std::chrono::steady_clock;
+
+    explicit ScopedTimer(Histogram& histogram)
+      : m_histogram(histogram)
+      , m_start(clock_type::now()) {}
+
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer(ScopedTimer&&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(ScopedTimer&&) = delete;
+
+    ~ScopedTimer()
+    {
+      m_histogram.Observe(clock_type::now() - m_start);
+    }
+
+  private:
+    Histogram& m_histogram;
+    const clock_type::time_point m_start;
+  };
+
+  /**
+   * Registry of metrics. Metrics are registered when the server is being
+   * set up, after which they are updated without taking any locks.
+   * Registered metrics live as long as the registry does.
+   */
+  class Metrics
+  {
+  public:
+    /**
+     * Callback which appends samples computed at the time of formatting,
+     * such as statistics of caching storage, into the output.
+     */
+    using collector_type = std::function<void(std::string&)>;
+
+    Metrics() = default;
+    Metrics(const Metrics&) = delete;
+    Metrics(Metrics&&) = delete;
+    Metrics& operator=(const Metrics&) = delete;
+    Metrics& operator=(Metrics&&) = delete;
+
+    Counter& AddCounter(
+      const std::string& name,
+      const std::string& help,
+      const std::string& labels = std::string()
+    );
+
+    Gauge& AddGauge(
+      const std::string& name,
+      const std::string& help,
+      const std::string& labels = std::string()
+    );
+
+    Histogram& AddHistogram(
+      const std::string& name,
+      const std::string& help,
+      const std::string& labels = std::string()
+    );
+
+    void AddCollector(const collector_type& collector);
+
+    /**
+     * Formats all registered metrics in the Prometheus text exposition
+     * format.
+     */
+    std::string Format() const;
+
+  private:
+    struct Family
+    {
+      std::string help;
+      std::string type;
+      std::vector<std::pair<std::string, std::unique_ptr<Metric>>> metrics;
+    };
+
+    template<class T>
+    T& Add(
+      const std::string& name,
+      const std::string& help,
+      const std::string& type,
+      const std::string& labels
+    );
+
+  private:
+    mutable std::mutex m_mutex;
+    std::map<std::string, Family> m_families;
+    std::vector<collector_type> m_collectors;
+  };
+}
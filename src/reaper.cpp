@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) 2024, Rauli Laine
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "./reaper.hpp"
+#include "./scan.hpp"
+
+namespace varasto
+{
+  /**
+   * Length of the period within which the rate of removals is limited.
+   * Shorter period spreads the removals more evenly over time.
+   */
+  static const std::chrono::milliseconds rate_period(100);
+
+  Reaper::Reaper(const path_type& root, std::size_t rate)
+    : m_root(root)
+    , m_rate(rate)
+    , m_counter(0)
+    , m_running(true)
+    , m_pending(true)
+    , m_thread(&Reaper::Run, this) {}
+
+  Reaper::~Reaper()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      m_running = false;
+    }
+    m_condition.notify_all();
+    if (m_thread.joinable())
+    {
+      m_thread.join();
+    }
+  }
+
+  Reaper::bury_result_type
+  Reaper::Bury(const path_type& path)
+  {
+    const auto timestamp = std::chrono::duration_cast<
+      std::chrono::nanoseconds
+    >(std::chrono::system_clock::now().time_since_epoch()).count();
+    // Timestamp keeps the name unique across restarts, while the counter
+    // keeps it unique within this one.
+    const auto tombstone = m_root / (
+      path.filename().string() +
+      "." +
+      std::to_string(timestamp) +
+      "-" +
+      std::to_string(++m_counter)
+    );
+    std::error_code ec;
+
+    std::filesystem::create_directories(m_root, ec);
+    if (ec)
+    {
+      return bury_result_type::error(
+        "Failed to create " + m_root.string() + ": " + ec.message()
+      );
+    }
+    else if (::rename(path.c_str(), tombstone.c_str()) != 0)
+    {
+      if (errno == ENOENT)
+      {
+        return bury_result_type::ok(std::nullopt);
+      }
+
+      return bury_result_type::error(
+        "Failed to rename " + path.string() + ": " + std::strerror(errno)
+      );
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      m_pending = true;
+    }
+    m_condition.notify_all();
+
+    return bury_result_type::ok(tombstone);
+  }
+
+  void
+  Reaper::Run()
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    while (m_running)
+    {
+      m_condition.wait(lock, [this]() { return !m_running || m_pending; });
+      if (!m_running)
+      {
+        break;
+      }
+      m_pending = false;
+      lock.unlock();
+
+      const auto tombstones = scan::list(m_root, scan::EntryType::directory);
+
+      if (!tombstones)
+      {
+        std::cerr << tombstones.error() << std::endl;
+      } else {
+        for (const auto& name : *tombstones)
+        {
+          if (!Reap(m_root / name))
+          {
+            break;
+          }
+        }
+      }
+      lock.lock();
+    }
+  }
+
+  bool
+  Reaper::Reap(const path_type& path)
+  {
+    const auto files = scan::list(path, scan::EntryType::file);
+    const auto budget = std::max<std::size_t>(
+      m_rate * rate_period.count() / 1000,
+      1
+    );
+    auto period_end = std::chrono::steady_clock::now() + rate_period;
+    std::size_t removed = 0;
+    std::error_code ec;
+    const auto fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (!files || fd < 0)
+    {
+      std::cerr << "Failed to remove " << path << "." << std::endl;
+      if (fd >= 0)
+      {
+        ::close(fd);
+      }
+
+      return true;
+    }
+
+    for (const auto& name : *files)
+    {
+      ::unlinkat(fd, name.c_str(), 0);
+      if (m_rate && ++removed >= budget)
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        // Waiting on the condition lets the reaper stop without waiting
+        // for the rest of the period.
+        m_condition.wait_until(
+          lock,
+          period_end,
+          [this]() { return !m_running; }
+        );
+        if (!m_running)
+        {
+          ::close(fd);
+
+          return false;
+        }
+        period_end = std::chrono::steady_clock::now() + rate_period;
+        removed = 0;
+      }
+    }
+    ::close(fd);
+
+    // Whatever was not removed above, such as nested directories, is
+    // removed in one go.
+    std::filesystem::remove_all(path, ec);
+    if (ec)
+    {
+      std::cerr << "Failed to remove " << path << ": " << ec.message()
+                << std::endl;
+    }
+
+    return true;
+  }
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2024, Rauli Laine
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <thread>
+
+#include <peelo/result.hpp>
+
+namespace varasto
+{
+  /**
+   * Removes directories which have been moved aside into a tombstone
+   * directory. Removal happens in a background thread at a limited rate, so
+   * that freeing the space of a large namespace does not starve the disk
+   * from requests being served. Tombstones left behind by an earlier run
+   * are removed as well.
+   */
+  class Reaper
+  {
+  public:
+    using path_type = std::filesystem::path;
+    using bury_result_type = peelo::result<
+      std::optional<path_type>,
+      std::string
+    >;
+
+    /** Default number of files removed per second. */
+    static constexpr std::size_t default_rate = 10000;
+
+    /**
+     * Starts removing tombstones from given directory, at most given number
+     * of files per second. Zero rate removes them as fast as possible.
+     */
+    explicit Reaper(const path_type& root, std::size_t rate = default_rate);
+
+    ~Reaper();
+
+    Reaper(const Reaper&) = delete;
+    Reaper(Reaper&&) = delete;
+    Reaper& operator=(const Reaper&) = delete;
+    Reaper& operator=(Reaper&&) = delete;
+
+    /**
+     * Atomically moves given directory into the tombstone directory and
+     * schedules it for removal. Returns path of the tombstone, or nothing
+     * if the directory does not exist.
+     */
+    bury_result_type Bury(const path_type& path);
+
+  private:
+    void Run();
+
+    /**
+     * Removes given tombstone. Returns false if the reaper was stopped
+     * before the whole tombstone was removed.
+     */
+    bool Reap(const path_type& path);
+
+  private:
+    const path_type m_root;
+    const std::size_t m_rate;
+    std::atomic<unsigned long> m_counter;
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    bool m_running;
+    bool m_pending;
+    std::thread m_thread;
+  };
+}
@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2024, Rauli Laine
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <cerrno>
+#include <cstring>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "./scan.hpp"
+
+namespace varasto::scan
+{
+  static const std::size_t buffer_size = 256 * 1024;
+
+  /**
+   * Layout of entries returned by getdents64(), which glibc does not
+   * declare.
+   */
+  struct linux_dirent64
+  {
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+  };
+
+  static bool
+  is_type(int fd, const linux_dirent64* entry, EntryType type)
+  {
+    struct stat st;
+
+    switch (entry->d_type)
+    {
+      case DT_REG:
+        return type == EntryType::file;
+
+      case DT_DIR:
+        return type == EntryType::directory;
+
+      case DT_UNKNOWN:
+        // Some filesystems do not report types of the entries, in which
+        // case we have to ask for it.
+        if (::fstatat(fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+        {
+          return false;
+        }
+
+        return type == EntryType::file
+          ? S_ISREG(st.st_mode)
+          : S_ISDIR(st.st_mode);
+
+      default:
+        return false;
+    }
+  }
+
+  list_result_type
+  list(const std::filesystem::path& path, EntryType type)
+  {
+    const auto fd = ::open(
+      path.c_str(),
+      O_RDONLY | O_DIRECTORY | O_CLOEXEC
+    );
+    std::vector<std::string> names;
+    std::vector<char> buffer(buffer_size);
+
+    if (fd < 0)
+    {
+      // Namespace being removed while it's being scanned is not an error.
+      if (errno == ENOENT || errno == ENOTDIR)
+      {
+        return list_result_type::ok(names);
+      }
+
+      return list_result_type::error(
+        "Failed to open " + path.string() + ": " + std::strerror(errno)
+      );
+    }
+
+    for (;;)
+    {
+      const auto count = ::syscall(
+        SYS_getdents64,
+        fd,
+        buffer.data(),
+        buffer.size()
+      );
+
+      if (count < 0)
+      {
+        const auto error = errno;
+
+        ::close(fd);
+        if (error == ENOENT)
+        {
+          return list_result_type::ok(names);
+        }
+
+        return list_result_type::error(
+          "Failed to read " + path.string() + ": " + std::strerror(error)
+        );
+      }
+      else if (count == 0)
+      {
+        break;
+      }
+      for (long offset = 0; offset < count;)
+      {
+        const auto entry = reinterpret_cast<const linux_dirent64*>(
+          buffer.data() + offset
+        );
+
+        if (
+          entry->d_name[0] != '.' &&
+          is_type(fd, entry, type)
+        )
+        {
+          names.emplace_back(entry->d_name);
+        }
+        offset += entry->d_reclen;
+      }
+    }
+    ::close(fd);
+
+    return list_result_type::ok(names);
+  }
+}
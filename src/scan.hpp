@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2024, Rauli Laine
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#pragma once
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include <peelo/result.hpp>
+
+namespace varasto::scan
+{
+  enum class EntryType
+  {
+    file,
+    directory,
+  };
+
+  using list_result_type = peelo::result<
+    std::vector<std::string>,
+    std::string
+  >;
+
+  /**
+   * Lists names of entries of given type in given directory. Directory is
+   * read in large batches with getdents64(), and type of each entry is
+   * taken from the directory entry itself, so that the entries do not have
+   * to be stat()ed one by one. Directory which does not exist is treated as
+   * an empty one.
+   */
+  list_result_type list(const std::filesystem::path& path, EntryType type);
+}
@@ -13,30 +13,53 @@
  * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
+#include <csignal>
+#include <ctime>
+
 #include <httplib.h>
-#include <peelo/json/formatter.hpp>
-#include <peelo/json/parser.hpp>
 #include <peelo/unicode/encoding/utf8.hpp>
 #include <uuid.h>
 
+#include "./caching-storage.hpp"
 #include "./filesystem-storage.hpp"
+#include "./gzip.hpp"
+#include "./json.hpp"
+#include "./locking-storage.hpp"
+#include "./log-storage.hpp"
+#include "./memory-storage.hpp"
+#include "./metrics.hpp"
 #include "./server.hpp"
+#include "./slug.hpp"
+#include "./task-queue.hpp"
+#include "./utils.hpp"
+#include "./wal-storage.hpp"
 
 namespace varasto
 {
+  using httplib::DataSink;
   using httplib::Request;
   using httplib::Response;
   using httplib::Server;
-  using peelo::json::format;
+  using peelo::json::array;
   using peelo::json::object;
-  using peelo::json::parse_object;
   using peelo::json::string;
   using peelo::unicode::encoding::utf8::decode;
+  using peelo::unicode::encoding::utf8::encode;
 
   static const char* content_type = "application/json; charset=utf-8";
+  static const char* metrics_content_type = "text/plain; version=0.0.4";
+  static const char* merge_patch_content_type = "application/merge-patch+json";
+  static const std::array<int, 9> known_statuses =
+  {
+    200, 201, 204, 304, 400, 404, 413, 500, 503,
+  };
+  static const std::size_t stream_buffer_size = 64 * 1024;
+  static const char* gzip_etag_suffix = "-gzip";
+  static const std::size_t max_batch_size = 1000;
+  static Server* running_server = nullptr;
 
-  static std::string
-  generate_uuid()
+  static std::mt19937
+  make_generator()
   {
     std::random_device device;
     std::array<int, std::mt19937::state_size> seed_data;
@@ -46,12 +69,97 @@ namespace varasto
       std::ref(device)
     );
     std::seed_seq sequence(std::begin(seed_data), std::end(seed_data));
-    std::mt19937 generator(sequence);
-    uuids::uuid_random_generator gen { generator };
+
+    return std::mt19937(sequence);
+  }
+
+  // Seeding the generator is expensive, so each worker thread seeds it's own
+  // generator once and then keeps reusing it.
+  static std::mt19937&
+  get_generator()
+  {
+    thread_local std::mt19937 generator = make_generator();
+
+    return generator;
+  }
+
+  static std::string
+  generate_uuid4()
+  {
+    thread_local uuids::uuid_random_generator gen { get_generator() };
 
     return uuids::to_string(gen());
   }
 
+  /**
+   * Generates time ordered UUID as specified in RFC 9562. UUIDs generated by
+   * the same thread within the same millisecond are kept in order by using
+   * the 12 bits following the timestamp as a counter.
+   */
+  static std::string
+  generate_uuid7()
+  {
+    static const char digits[] = "0123456789abcdef";
+    thread_local std::uint64_t last_timestamp = 0;
+    thread_local std::uint16_t counter = 0;
+    auto& generator = get_generator();
+    std::uint64_t timestamp = std::chrono::duration_cast<
+      std::chrono::milliseconds
+    >(std::chrono::system_clock::now().time_since_epoch()).count();
+    std::array<std::uint8_t, 16> bytes;
+    std::string result;
+
+    if (timestamp <= last_timestamp)
+    {
+      timestamp = last_timestamp;
+      if (++counter > 0x0fff)
+      {
+        counter = generator() & 0x01ff;
+        ++timestamp;
+      }
+    } else {
+      // Leave plenty of room for the counter to grow.
+      counter = generator() & 0x01ff;
+    }
+    last_timestamp = timestamp;
+
+    for (int i = 0; i < 6; ++i)
+    {
+      bytes[i] = static_cast<std::uint8_t>(timestamp >> (40 - i * 8));
+    }
+    bytes[6] = static_cast<std::uint8_t>(0x70 | (counter >> 8));
+    bytes[7] = static_cast<std::uint8_t>(counter);
+
+    const std::uint64_t random = (
+      static_cast<std::uint64_t>(generator()) << 32
+    ) | generator();
+
+    for (int i = 8; i < 16; ++i)
+    {
+      bytes[i] = static_cast<std::uint8_t>(random >> ((15 - i) * 8));
+    }
+    bytes[8] = (bytes[8] & 0x3f) | 0x80;
+
+    result.reserve(36);
+    for (int i = 0; i < 16; ++i)
+    {
+      if (i == 4 || i == 6 || i == 8 || i == 10)
+      {
+        result.push_back('-');
+      }
+      result.push_back(digits[bytes[i] >> 4]);
+      result.push_back(digits[bytes[i] & 0x0f]);
+    }
+
+    return result;
+  }
+
+  static std::string
+  generate_uuid(UuidVersion version)
+  {
+    return version == UuidVersion::v7 ? generate_uuid7() : generate_uuid4();
+  }
+
   static void
   send_error_message(Response& res, const std::string& message, int status)
   {
@@ -59,13 +167,13 @@ namespace varasto
 
     properties[U"error"] = string::make(decode(message));
     res.status = status;
-    res.set_content(format(object::make(properties)), content_type);
+    res.set_content(json::format(object::make(properties)), content_type);
   }
 
   static std::optional<Storage::value_type>
   parse_object(const Request& req, Response& res)
   {
-    const auto result = parse_object(decode(req.body));
+    const auto result = json::parse_object(req.body);
 
     if (result)
     {
@@ -77,51 +185,504 @@ namespace varasto
     return std::nullopt;
   }
 
+  static bool
+  parse_list_options(
+    const Request& req,
+    Response& res,
+    Storage::ListOptions& options
+  )
+  {
+    options.prefix = req.get_param_value("prefix");
+    options.after = req.get_param_value("after");
+    if (req.has_param("limit"))
+    {
+      try
+      {
+        options.limit = std::stoul(req.get_param_value("limit"));
+      }
+      catch (const std::exception&)
+      {
+        send_error_message(res, "Invalid limit.", 400);
+
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  /**
+   * Returns entity tag of the gzip compressed version of a representation.
+   * Strong entity tags identify the exact bytes sent, so the compressed
+   * version must not share the entity tag of the uncompressed one.
+   */
+  static std::string
+  get_gzip_etag(const std::string& etag)
+  {
+    return etag.substr(0, etag.length() - 1) + gzip_etag_suffix + "\"";
+  }
+
+  /**
+   * Tells whether the client already has the representation identified by
+   * given entity tag, according to the If-None-Match header of the request.
+   * Returns the entity tag the client has, which can be either of the
+   * uncompressed or the compressed version of the representation.
+   */
+  static std::optional<std::string>
+  matches_etag(const Request& req, const std::string& etag)
+  {
+    const auto header = req.get_header_value("If-None-Match");
+    const auto gzip_etag = get_gzip_etag(etag);
+    std::size_t start = 0;
+
+    while (start < header.length())
+    {
+      auto end = header.find(',', start);
+
+      if (end == std::string::npos)
+      {
+        end = header.length();
+      }
+
+      const auto first = header.find_first_not_of(" \t", start);
+      const auto last = header.find_last_not_of(" \t", end - 1);
+
+      if (first != std::string::npos && first <= last && first < end)
+      {
+        auto tag = header.substr(first, last - first + 1);
+
+        // Weak comparison is used for If-None-Match.
+        if (!tag.compare(0, 2, "W/"))
+        {
+          tag.erase(0, 2);
+        }
+        if (tag == "*")
+        {
+          return etag;
+        }
+        else if (tag == etag || tag == gzip_etag)
+        {
+          return tag;
+        }
+      }
+      start = end + 1;
+    }
+
+    return std::nullopt;
+  }
+
   static void
-  handle_entry_list(
+  send_not_modified(
+    Response& res,
+    const std::string& etag,
+    std::size_t gzip_threshold
+  )
+  {
+    res.status = 304;
+    res.set_header("ETag", etag);
+    if (gzip_threshold > 0)
+    {
+      res.set_header("Vary", "Accept-Encoding");
+    }
+  }
+
+  /**
+   * Sends given body with given entity tag, compressed if it's large enough
+   * and the client accepts compressed responses.
+   */
+  static void
+  send_content(
+    const Request& req,
+    Response& res,
+    std::string&& body,
+    const std::string& etag,
+    std::size_t gzip_threshold
+  )
+  {
+    // Caches must know that the response depends on the Accept-Encoding
+    // header, even when this particular response is not compressed.
+    if (gzip_threshold > 0)
+    {
+      res.set_header("Vary", "Accept-Encoding");
+    }
+    if (
+      gzip_threshold > 0 &&
+      body.length() >= gzip_threshold &&
+      gzip::is_accepted(req.get_header_value("Accept-Encoding"))
+    )
+    {
+      if (auto compressed = gzip::compress(body))
+      {
+        res.set_header("Content-Encoding", "gzip");
+        res.set_header("ETag", get_gzip_etag(etag));
+        res.set_content(std::move(*compressed), content_type);
+
+        return;
+      }
+    }
+    res.set_header("ETag", etag);
+    res.set_content(std::move(body), content_type);
+  }
+
+  /**
+   * Distinguishes entity tags of listings from those given out before the
+   * server was started, since versions of namespaces are only unique during
+   * lifetime of the storage.
+   */
+  static const std::string&
+  get_instance_tag()
+  {
+    static const std::string tag = []()
+    {
+      auto generator = make_generator();
+      char buffer[32];
+
+      std::snprintf(
+        buffer,
+        sizeof(buffer),
+        "%08x%08x",
+        static_cast<unsigned int>(generator()),
+        static_cast<unsigned int>(generator())
+      );
+
+      return std::string(buffer);
+    }();
+
+    return tag;
+  }
+
+  /**
+   * Computes entity tag of a listing from version of the namespace and the
+   * options of the listing, so that unchanged namespaces can be detected
+   * without looking at any of the entries.
+   */
+  static peelo::result<std::string, std::string>
+  get_listing_etag(
+    const Storage& storage,
+    const Storage::key_type& ns,
+    const Storage::ListOptions& options
+  )
+  {
+    using result_type = peelo::result<std::string, std::string>;
+    const auto version = storage.GetNamespaceVersion(ns);
+    std::string buffer;
+    char crc[16];
+
+    if (!version)
+    {
+      return result_type::error(version.error());
+    }
+    buffer
+      .append(options.prefix).append(1, '\0')
+      .append(options.after).append(1, '\0')
+      .append(std::to_string(options.limit));
+    std::snprintf(
+      crc,
+      sizeof(crc),
+      "%08x",
+      utils::crc32(buffer.data(), buffer.length())
+    );
+
+    return result_type::ok(
+      "\"" + get_instance_tag() + "-" + *version + "-" + crc + "\""
+    );
+  }
+
+  static void
+  handle_key_list(
     const Storage& storage,
+    const Storage::key_type& ns,
+    const Storage::ListOptions& options,
+    std::size_t gzip_threshold,
     const Request& req,
     Response& res
   )
   {
-    const auto& ns = req.path_params.at("namespace");
-    const auto result = storage.GetAllEntries(ns);
+    // Just like with listings of entries, the entity tag is derived from
+    // version of the namespace, so that unchanged listings are detected
+    // without reading any of the keys.
+    const auto etag = get_listing_etag(storage, ns, options);
+
+    if (!etag)
+    {
+      send_error_message(res, etag.error(), 500);
+      return;
+    }
+    else if (const auto tag = matches_etag(req, *etag))
+    {
+      send_not_modified(res, *tag, gzip_threshold);
+      return;
+    }
+
+    const auto result = storage.GetKeys(ns, options);
 
     if (result)
     {
-      object::container_type properties;
+      std::string buffer("[");
 
-      for (const auto& entry : result.value())
+      for (const auto& key : *result)
       {
-        properties[decode(entry.first)] = entry.second;
+        if (buffer.length() > 1)
+        {
+          buffer.append(",");
+        }
+        // Keys are slugs, so they never need to be escaped.
+        buffer.append("\"").append(key).append("\"");
       }
-      res.set_content(
-        format(object::make(properties)),
-        content_type
-      );
+      buffer.append("]");
+      send_content(req, res, std::move(buffer), *etag, gzip_threshold);
     } else {
       send_error_message(res, result.error(), 500);
     }
   }
 
+  static std::string
+  format_time(
+    const Storage::NamespaceStats::time_type& time,
+    const char* format
+  )
+  {
+    const auto seconds = Storage::NamespaceStats::time_type::clock::to_time_t(
+      time
+    );
+    struct tm tm;
+    char buffer[64];
+
+    ::gmtime_r(&seconds, &tm);
+    std::strftime(buffer, sizeof(buffer), format, &tm);
+
+    return buffer;
+  }
+
+  /**
+   * Responds with number of entries in the namespace and their total size,
+   * which the storage can tell without reading the entries.
+   */
+  static void
+  handle_namespace_stats(
+    const Storage& storage,
+    const Storage::key_type& ns,
+    Response& res
+  )
+  {
+    const auto result = storage.GetStats(ns);
+
+    if (!result)
+    {
+      send_error_message(res, result.error(), 500);
+      return;
+    }
+    else if (!*result)
+    {
+      send_error_message(res, "Namespace does not exist.", 404);
+      return;
+    }
+
+    const auto& stats = **result;
+    std::string buffer;
+
+    buffer
+      .append("{\"count\":")
+      .append(std::to_string(stats.count))
+      .append(",\"size\":")
+      .append(std::to_string(stats.size));
+    if (stats.last_modified)
+    {
+      buffer
+        .append(",\"lastModified\":\"")
+        .append(format_time(*stats.last_modified, "%Y-%m-%dT%H:%M:%SZ"))
+        .append("\"");
+      res.set_header(
+        "Last-Modified",
+        format_time(*stats.last_modified, "%a, %d %b %Y %H:%M:%S GMT")
+      );
+    }
+    buffer.append("}");
+    res.set_header("X-Entry-Count", std::to_string(stats.count));
+    res.set_header("X-Total-Size", std::to_string(stats.size));
+    res.set_content(buffer, content_type);
+  }
+
+  static void
+  handle_entry_list(
+    const Storage& storage,
+    std::size_t gzip_threshold,
+    const Request& req,
+    Response& res
+  )
+  {
+    const auto ns = req.path_params.at("namespace");
+    Storage::ListOptions options;
+
+    if (!is_valid_slug(ns))
+    {
+      send_error_message(res, "Invalid namespace: " + ns, 400);
+      return;
+    }
+    else if (req.method == "HEAD" || req.get_param_value("stats") == "1")
+    {
+      handle_namespace_stats(storage, ns, res);
+      return;
+    }
+    else if (!parse_list_options(req, res, options))
+    {
+      return;
+    }
+    else if (req.get_param_value("keys") == "1")
+    {
+      handle_key_list(storage, ns, options, gzip_threshold, req, res);
+      return;
+    }
+
+    // Version is looked up before the entries are read, so that concurrent
+    // writes can only make the entity tag older than the listing, which
+    // just causes the client to fetch the listing again.
+    const auto etag = get_listing_etag(storage, ns, options);
+
+    if (!etag)
+    {
+      send_error_message(res, etag.error(), 500);
+      return;
+    }
+    else if (const auto tag = matches_etag(req, *etag))
+    {
+      send_not_modified(res, *tag, gzip_threshold);
+      return;
+    }
+
+    // Size of the listing is not known beforehand, so it's compressed
+    // whenever the client accepts it.
+    const auto compress = gzip_threshold > 0 && gzip::is_accepted(
+      req.get_header_value("Accept-Encoding")
+    );
+
+    if (gzip_threshold > 0)
+    {
+      res.set_header("Vary", "Accept-Encoding");
+    }
+    if (compress)
+    {
+      res.set_header("Content-Encoding", "gzip");
+      res.set_header("ETag", get_gzip_etag(*etag));
+    } else {
+      res.set_header("ETag", *etag);
+    }
+
+    // Entries are streamed to the client as they are read from the storage,
+    // so that memory usage does not depend on size of the namespace.
+    res.set_chunked_content_provider(
+      content_type,
+      [&storage, ns, options, compress](std::size_t, DataSink& sink)
+      {
+        std::string buffer("{");
+        std::string compressed;
+        bool first = true;
+        const auto encoder = compress
+          ? std::make_unique<gzip::Encoder>()
+          : nullptr;
+        const auto flush = [&buffer, &compressed, &sink, &encoder](
+          bool last = false
+        )
+        {
+          bool result;
+
+          if (!encoder)
+          {
+            result = sink.write(buffer.data(), buffer.length());
+          }
+          else if (
+            !encoder->Write(buffer.data(), buffer.length(), compressed) ||
+            (last && !encoder->Finish(compressed))
+          )
+          {
+            result = false;
+          } else {
+            result = compressed.empty() ||
+              sink.write(compressed.data(), compressed.length());
+            compressed.clear();
+          }
+          buffer.clear();
+
+          return result;
+        };
+        const auto result = storage.ForEachEntry(
+          ns,
+          options,
+          [&buffer, &first, &flush](const auto& key, const auto& value)
+          {
+            if (first)
+            {
+              first = false;
+            } else {
+              buffer.append(",");
+            }
+            // Keys are slugs, so they never need to be escaped.
+            buffer.append("\"").append(key).append("\":").append(value);
+
+            return buffer.length() < stream_buffer_size || flush();
+          }
+        );
+
+        if (!result || !*result)
+        {
+          return false;
+        }
+        buffer.append("}");
+        if (!flush(true))
+        {
+          return false;
+        }
+        sink.done();
+
+        return true;
+      }
+    );
+  }
+
   static void
   handle_entry_get(
     const Storage& storage,
+    std::size_t gzip_threshold,
     const Request& req,
     Response& res
   )
   {
     const auto& ns = req.path_params.at("namespace");
     const auto& key = req.path_params.at("key");
-    const auto result = storage.Get(ns, key);
+    // Version is looked up before the value, so that a concurrent write can
+    // only make the entity tag older than the value, which just causes the
+    // client to fetch the value again.
+    const auto version = storage.GetVersion(ns, key);
+
+    if (!version)
+    {
+      send_error_message(res, version.error(), 500);
+      return;
+    }
+    else if (!*version)
+    {
+      send_error_message(res, "Entry does not exist.", 404);
+      return;
+    }
+
+    const auto etag = "\"" + **version + "\"";
+
+    if (const auto tag = matches_etag(req, etag))
+    {
+      send_not_modified(res, *tag, gzip_threshold);
+      return;
+    }
+
+    const auto result = storage.GetRaw(ns, key);
 
     if (result)
     {
-      const auto& value = result.value();
+      auto value = result.value();
 
       if (value)
       {
-        res.set_content(format(*value), content_type);
+        // Value is already serialized JSON, so it can be sent as it is.
+        send_content(req, res, std::move(*value), etag, gzip_threshold);
       } else {
         send_error_message(res, "Entry does not exist.", 404);
       }
@@ -144,7 +705,7 @@ namespace varasto
     if (result)
     {
       res.status = 201;
-      res.set_content(format(value), content_type);
+      res.set_content(json::format(value), content_type);
     } else {
       send_error_message(res, result.error(), 500);
     }
@@ -170,6 +731,7 @@ namespace varasto
   static void
   handle_entry_insert(
     Storage& storage,
+    UuidVersion uuid_version,
     const Request& req,
     Response& res
   )
@@ -178,17 +740,17 @@ namespace varasto
 
     if (const auto value = parse_object(req, res))
     {
-      const auto key = generate_uuid();
+      const auto key = generate_uuid(uuid_version);
       const auto result = storage.Set(ns, key, *value);
 
       if (result)
       {
         object::container_type properties;
 
-        properties[U"key"] = string::make(decode(key));
+        properties[U"key"] = string::make(json::widen_slug(key));
         res.status = 201;
         res.set_content(
-          format(object::make(properties)),
+          json::format(object::make(properties)),
           content_type
         );
       } else {
@@ -197,6 +759,41 @@ namespace varasto
     }
   }
 
+  static void
+  handle_entry_merge(
+    Storage& storage,
+    const Request& req,
+    Response& res
+  )
+  {
+    const auto& ns = req.path_params.at("namespace");
+    const auto& key = req.path_params.at("key");
+
+    if (const auto patch = parse_object(req, res))
+    {
+      const auto result = storage.Merge(ns, key, *patch);
+
+      if (!result)
+      {
+        send_error_message(res, result.error(), 500);
+      }
+      else if (!*result)
+      {
+        send_error_message(res, "Entry does not exist.", 404);
+      }
+      else if (req.get_param_value("return") == "none" || !**result)
+      {
+        // Storages which store only the patch don't know the patched value,
+        // and it's not read back separately, since it might already have
+        // been modified by someone else.
+        res.status = 204;
+      } else {
+        res.status = 201;
+        res.set_content(json::format(**result), content_type);
+      }
+    }
+  }
+
   static void
   handle_entry_update(
     Storage& storage,
@@ -207,6 +804,19 @@ namespace varasto
     const auto& ns = req.path_params.at("namespace");
     const auto& key = req.path_params.at("key");
 
+    // RFC 7396 merge patches are told apart from shallow patches by their
+    // media type.
+    if (
+      req.get_header_value("Content-Type").rfind(
+        merge_patch_content_type,
+        0
+      ) == 0
+    )
+    {
+      handle_entry_merge(storage, req, res);
+      return;
+    }
+
     if (const auto value = parse_object(req, res))
     {
       const auto result = storage.Update(ns, key, *value);
@@ -218,7 +828,7 @@ namespace varasto
         if (new_value)
         {
           res.status = 201;
-          res.set_content(format(*new_value), content_type);
+          res.set_content(json::format(*new_value), content_type);
         } else {
           send_error_message(res, "Entry does not exist.", 404);
         }
@@ -236,22 +846,42 @@ namespace varasto
   )
   {
     const auto& ns = req.path_params.at("namespace");
-    const auto result = storage.DeleteNamespace(ns);
 
-    if (result)
+    // Returning the removed entries requires reading all of them, which
+    // clients not interested in them can skip.
+    if (req.get_param_value("return") == "none")
     {
-      if (const auto entries = *result)
-      {
-        object::container_type properties;
+      const auto result = storage.DropNamespace(ns);
 
-        for (const auto& entry : *entries)
-        {
-          properties[decode(entry.first)] = entry.second;
-        }
-        res.status = 201;
-        res.set_content(format(object::make(properties)), content_type);
-      } else {
-        send_error_message(res, "Namespace does not exist.", 404);
+      if (!result)
+      {
+        send_error_message(res, result.error(), 500);
+      }
+      else if (!*result)
+      {
+        send_error_message(res, "Namespace does not exist.", 404);
+      } else {
+        res.status = 204;
+      }
+      return;
+    }
+
+    const auto result = storage.DeleteNamespace(ns);
+
+    if (result)
+    {
+      if (const auto entries = *result)
+      {
+        object::container_type properties;
+
+        for (const auto& entry : *entries)
+        {
+          properties[json::widen_slug(entry.first)] = entry.second;
+        }
+        res.status = 201;
+        res.set_content(json::format(object::make(properties)), content_type);
+      } else {
+        send_error_message(res, "Namespace does not exist.", 404);
       }
     } else {
       send_error_message(res, result.error(), 500);
@@ -276,7 +906,7 @@ namespace varasto
       if (value)
       {
         res.status = 201;
-        res.set_content(format(*value), content_type);
+        res.set_content(json::format(*value), content_type);
       } else {
         send_error_message(res, "Entry does not exist.", 404);
       }
@@ -285,10 +915,501 @@ namespace varasto
     }
   }
 
+  /**
+   * Single operation of a batch request.
+   */
+  struct BatchOperation
+  {
+    enum class Type
+    {
+      get,
+      set,
+      patch,
+      remove,
+    };
+
+    Type type;
+    Storage::key_type ns;
+    Storage::key_type key;
+    Storage::value_type value;
+  };
+
+  static std::optional<std::string>
+  get_string_property(const object::ptr& value, const std::u32string& name)
+  {
+    const auto& properties = value->properties();
+    const auto it = properties.find(name);
+
+    if (it != std::end(properties))
+    {
+      if (const auto s = std::dynamic_pointer_cast<string>(it->second))
+      {
+        return encode(s->value());
+      }
+    }
+
+    return std::nullopt;
+  }
+
+  static std::optional<std::string>
+  parse_batch_operation(
+    const peelo::json::value::ptr& value,
+    BatchOperation& operation
+  )
+  {
+    static const std::unordered_map<std::string, BatchOperation::Type> types =
+    {
+      { "get", BatchOperation::Type::get },
+      { "set", BatchOperation::Type::set },
+      { "patch", BatchOperation::Type::patch },
+      { "delete", BatchOperation::Type::remove },
+    };
+    const auto o = std::dynamic_pointer_cast<object>(value);
+
+    if (!o)
+    {
+      return "Operation is not an object.";
+    }
+
+    const auto type = get_string_property(o, U"op");
+    const auto ns = get_string_property(o, U"namespace");
+    const auto key = get_string_property(o, U"key");
+    const auto type_it = type ? types.find(*type) : std::end(types);
+
+    if (type_it == std::end(types))
+    {
+      return "Invalid operation.";
+    }
+    else if (!ns || !is_valid_slug(*ns))
+    {
+      return "Invalid namespace.";
+    }
+    else if (!key || !is_valid_slug(*key))
+    {
+      return "Invalid key.";
+    }
+    operation.type = type_it->second;
+    operation.ns = *ns;
+    operation.key = *key;
+
+    if (
+      operation.type == BatchOperation::Type::set ||
+      operation.type == BatchOperation::Type::patch
+    )
+    {
+      const auto& properties = o->properties();
+      const auto it = properties.find(U"value");
+
+      if (
+        it == std::end(properties) ||
+        !(operation.value = std::dynamic_pointer_cast<object>(it->second))
+      )
+      {
+        return "Value is not an object.";
+      }
+    }
+
+    return std::nullopt;
+  }
+
+  static void
+  append_batch_result(
+    std::string& buffer,
+    int status,
+    const std::optional<std::string>& value,
+    const std::optional<std::string>& error = std::nullopt
+  )
+  {
+    if (buffer.length() > 1)
+    {
+      buffer.append(",");
+    }
+    buffer.append("{\"status\":").append(std::to_string(status));
+    if (value)
+    {
+      buffer.append(",\"value\":").append(*value);
+    }
+    if (error)
+    {
+      buffer
+        .append(",\"error\":")
+        .append(json::format(string::make(decode(*error))));
+    }
+    buffer.append("}");
+  }
+
+  /**
+   * Executes multiple operations with a single request. Consecutive reads
+   * are executed with a single multi-get and consecutive writes as a single
+   * write batch, so that the storage can flush all of them to disk at once.
+   */
+  static void
+  handle_batch(
+    Storage& storage,
+    const Request& req,
+    Response& res
+  )
+  {
+    const auto result = json::parse(req.body);
+    const auto operations = result
+      ? std::dynamic_pointer_cast<array>(*result)
+      : nullptr;
+    std::vector<BatchOperation> batch;
+    std::string buffer("[");
+
+    if (!operations)
+    {
+      send_error_message(res, "Value is not an array.", 400);
+      return;
+    }
+    else if (operations->elements().size() > max_batch_size)
+    {
+      send_error_message(res, "Too many operations in batch.", 413);
+      return;
+    }
+
+    batch.resize(operations->elements().size());
+    for (std::size_t i = 0; i < batch.size(); ++i)
+    {
+      const auto error = parse_batch_operation(
+        operations->elements()[i],
+        batch[i]
+      );
+
+      if (error)
+      {
+        send_error_message(
+          res,
+          *error + " (operation " + std::to_string(i) + ")",
+          400
+        );
+        return;
+      }
+    }
+
+    for (std::size_t i = 0; i < batch.size();)
+    {
+      const auto read = batch[i].type == BatchOperation::Type::get;
+      std::size_t end = i;
+
+      while (
+        end < batch.size() &&
+        (batch[end].type == BatchOperation::Type::get) == read
+      )
+      {
+        ++end;
+      }
+
+      if (read)
+      {
+        std::vector<std::pair<Storage::key_type, Storage::key_type>> entries;
+
+        for (; i < end; ++i)
+        {
+          entries.push_back(std::make_pair(batch[i].ns, batch[i].key));
+        }
+        for (const auto& result : storage.MultiGet(entries))
+        {
+          if (!result)
+          {
+            append_batch_result(buffer, 500, std::nullopt, result.error());
+          }
+          else if (*result)
+          {
+            append_batch_result(buffer, 200, *result);
+          } else {
+            append_batch_result(
+              buffer,
+              404,
+              std::nullopt,
+              "Entry does not exist."
+            );
+          }
+        }
+        continue;
+      }
+
+      std::vector<Storage::WriteOperation> writes;
+
+      for (; i < end; ++i)
+      {
+        writes.push_back({
+          batch[i].type == BatchOperation::Type::set
+            ? Storage::WriteOperation::Type::set
+            : batch[i].type == BatchOperation::Type::patch
+            ? Storage::WriteOperation::Type::update
+            : Storage::WriteOperation::Type::remove,
+          batch[i].ns,
+          batch[i].key,
+          batch[i].value,
+        });
+      }
+      for (const auto& result : storage.Write(writes))
+      {
+        if (!result)
+        {
+          append_batch_result(buffer, 500, std::nullopt, result.error());
+        }
+        else if (*result)
+        {
+          append_batch_result(buffer, 201, json::format(**result));
+        } else {
+          append_batch_result(
+            buffer,
+            404,
+            std::nullopt,
+            "Entry does not exist."
+          );
+        }
+      }
+    }
+    buffer.append("]");
+    res.set_content(buffer, content_type);
+  }
+
+  /**
+   * Wraps given route handler into one which records number of requests,
+   * response status codes, latency and transferred bytes of the route.
+   */
+  static Server::Handler
+  instrument(
+    Metrics& metrics,
+    Gauge& in_flight,
+    const std::string& method,
+    const std::string& route,
+    const Server::Handler& handler
+  )
+  {
+    const auto labels = "method=\"" + method + "\",route=\"" + route + "\"";
+    auto& latency = metrics.AddHistogram(
+      "varasto_http_request_duration_seconds",
+      "Time spent processing HTTP requests.",
+      labels
+    );
+    auto& received = metrics.AddCounter(
+      "varasto_http_received_bytes_total",
+      "Size of HTTP request bodies received.",
+      labels
+    );
+    auto& sent = metrics.AddCounter(
+      "varasto_http_sent_bytes_total",
+      "Size of HTTP response bodies sent.",
+      labels
+    );
+    std::array<Counter*, known_statuses.size() + 1> statuses;
+
+    for (std::size_t i = 0; i < statuses.size(); ++i)
+    {
+      statuses[i] = &metrics.AddCounter(
+        "varasto_http_requests_total",
+        "Number of HTTP requests processed.",
+        labels + ",status=\"" + (
+          i < known_statuses.size()
+            ? std::to_string(known_statuses[i])
+            : std::string("other")
+        ) + "\""
+      );
+    }
+
+    return [&latency, &received, &sent, &in_flight, statuses, handler](
+      const Request& req,
+      Response& res
+    )
+    {
+      in_flight.Add(1);
+      {
+        ScopedTimer timer(latency);
+
+        try
+        {
+          handler(req, res);
+        }
+        catch (...)
+        {
+          in_flight.Add(-1);
+          throw;
+        }
+      }
+      in_flight.Add(-1);
+
+      // Status is left unset by handlers which respond with 200, since
+      // cpp-httplib only fills it in after the routing.
+      const auto it = std::find(
+        std::begin(known_statuses),
+        std::end(known_statuses),
+        res.status == -1 ? 200 : res.status
+      );
+
+      statuses[it - std::begin(known_statuses)]->Increment();
+      received.Increment(req.body.length());
+
+      // Streamed bodies are only produced after the handler has returned,
+      // so they are counted as they are being written into the socket.
+      if (res.content_provider_)
+      {
+        res.content_provider_ = [&sent, provider = res.content_provider_](
+          std::size_t offset,
+          std::size_t length,
+          DataSink& sink
+        )
+        {
+          const auto write = sink.write;
+          bool result;
+
+          sink.write = [&sent, &write](const char* data, std::size_t size)
+          {
+            sent.Increment(size);
+
+            return write(data, size);
+          };
+          result = provider(offset, length, sink);
+          sink.write = write;
+
+          return result;
+        };
+      } else {
+        sent.Increment(res.body.length());
+      }
+    };
+  }
+
+  static void
+  collect_cache_statistics(std::string& output, const CachingStorage& cache)
+  {
+    const auto statistics = cache.GetStatistics();
+    const std::pair<const char*, std::uint64_t> counters[] =
+    {
+      { "hits", statistics.hits },
+      { "misses", statistics.misses },
+      { "evictions", statistics.evictions },
+    };
+    const std::pair<const char*, std::uint64_t> gauges[] =
+    {
+      { "entries", statistics.entries },
+      { "size_bytes", statistics.size },
+      { "capacity_bytes", statistics.capacity },
+    };
+
+    for (const auto& counter : counters)
+    {
+      const auto name = std::string("varasto_cache_") + counter.first;
+
+      output
+        .append("# TYPE ").append(name).append("_total counter\n")
+        .append(name).append("_total ")
+        .append(std::to_string(counter.second)).append("\n");
+    }
+    for (const auto& gauge : gauges)
+    {
+      const auto name = std::string("varasto_cache_") + gauge.first;
+
+      output
+        .append("# TYPE ").append(name).append(" gauge\n")
+        .append(name).append(" ")
+        .append(std::to_string(gauge.second)).append("\n");
+    }
+  }
+
+  /**
+   * Logs that the server is saturated, at most once per second so that the
+   * log does not become yet another bottleneck.
+   */
+  static void
+  log_saturation(std::size_t pending, const Counter& shed)
+  {
+    using clock = std::chrono::steady_clock;
+    static std::atomic<clock::rep> last_logged(0);
+    const auto now = clock::now().time_since_epoch().count();
+    auto previous = last_logged.load();
+
+    if (
+      now - previous >= clock::rep(clock::period::den) &&
+      last_logged.compare_exchange_strong(previous, now)
+    )
+    {
+      std::cerr << "Server saturated: "
+                << pending
+                << " connections waiting for a worker, "
+                << shed.Value()
+                << " requests rejected in total."
+                << std::endl;
+    }
+  }
+
+  /**
+   * Stops the server on SIGINT and SIGTERM, so that storages get a chance to
+   * flush their state before the process exits.
+   */
+  static void
+  handle_stop_signal(int)
+  {
+    if (running_server)
+    {
+      running_server->stop();
+    }
+  }
+
+  /**
+   * Determines format of values stored in the data directory, from the
+   * format marker of the directory and the format given on command line.
+   * Directories without a marker which already contain data are from
+   * before binary format existed, so they contain JSON.
+   */
+  static ValueFormat
+  resolve_value_format(const ServerOptions& options)
+  {
+    const auto marker = binary::read_format_marker(options.root);
+    std::error_code ec;
+
+    if (marker)
+    {
+      if (options.value_format && *options.value_format != *marker)
+      {
+        std::cerr << "Values in "
+                  << options.root
+                  << " are stored in different format. Convert them with"
+                  << " varasto-migrate first."
+                  << std::endl;
+        std::exit(EXIT_FAILURE);
+      }
+
+      return *marker;
+    }
+
+    const auto format = options.value_format.value_or(ValueFormat::json);
+
+    if (
+      format != ValueFormat::json &&
+      !std::filesystem::is_empty(options.root, ec)
+    )
+    {
+      std::cerr << "Values in "
+                << options.root
+                << " are stored as JSON. Convert them with varasto-migrate"
+                << " first."
+                << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+    else if (!binary::write_format_marker(options.root, format))
+    {
+      std::cerr << "Unable to write format marker into "
+                << options.root
+                << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+
+    return format;
+  }
+
   void
   run_server(const ServerOptions& options)
   {
-    FilesystemStorage storage(options.root);
+    std::shared_ptr<Storage> storage;
+    const auto metrics = std::make_shared<Metrics>();
+    auto& in_flight = metrics->AddGauge(
+      "varasto_http_requests_in_flight",
+      "Number of HTTP requests currently being processed."
+    );
     Server server;
 
     if (!std::filesystem::is_directory(options.root))
@@ -300,61 +1421,285 @@ namespace varasto
       std::exit(EXIT_FAILURE);
     }
 
+    json::set_codec(options.json_codec);
+
+    const auto durability = std::make_shared<Durability>(
+      options.durability,
+      options.commit_interval
+    );
+
+    if (options.wal && options.storage != StorageType::filesystem)
+    {
+      std::cerr << "Write-ahead log can only be used with the filesystem "
+                << "storage."
+                << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+    else if (options.storage == StorageType::log)
+    {
+      const auto result = LogStorage::Open(options.root, durability);
+
+      if (!result)
+      {
+        std::cerr << result.error() << std::endl;
+        std::exit(EXIT_FAILURE);
+      }
+      storage = *result;
+    }
+    else if (options.storage == StorageType::memory)
+    {
+      const auto result = MemoryStorage::Open(
+        options.root,
+        options.snapshot_interval
+      );
+
+      if (!result)
+      {
+        std::cerr << result.error() << std::endl;
+        std::exit(EXIT_FAILURE);
+      }
+      storage = *result;
+    } else {
+      // With a write-ahead log, writes into the entry files no longer have
+      // to be durable on their own, since the log is replayed after a crash.
+      const auto filesystem = std::make_shared<FilesystemStorage>(
+        options.root,
+        options.wal ? std::make_shared<Durability>() : durability,
+        metrics,
+        resolve_value_format(options),
+        options.compression,
+        options.reap_rate
+      );
+      const auto error = filesystem->WarmUp(options.warm_up_threads);
+
+      if (error)
+      {
+        std::cerr << *error << std::endl;
+        std::exit(EXIT_FAILURE);
+      }
+      storage = filesystem;
+    }
+
+    if (options.wal)
+    {
+      const auto result = WalStorage::Open(
+        options.root / ".wal",
+        options.root,
+        storage,
+        durability
+      );
+
+      if (!result)
+      {
+        std::cerr << result.error() << std::endl;
+        std::exit(EXIT_FAILURE);
+      }
+      storage = *result;
+    }
+
+    if (options.cache_size > 0)
+    {
+      const auto cache = std::make_shared<CachingStorage>(
+        storage,
+        options.cache_size
+      );
+
+      metrics->AddCollector(
+        [cache](std::string& output)
+        {
+          collect_cache_statistics(output, *cache);
+        }
+      );
+      storage = cache;
+    }
+
+    // Requests are served from multiple threads, so conflicting operations
+    // on the same entries must be serialized.
+    storage = std::make_shared<LockingStorage>(storage);
+
+    const auto pending = std::make_shared<CountingTaskQueue::counter_type>(0);
+    auto& shed = metrics->AddCounter(
+      "varasto_http_requests_shed_total",
+      "Number of requests rejected because the server was saturated."
+    );
+
+    metrics->AddCollector(
+      [pending](std::string& output)
+      {
+        output
+          .append("# TYPE varasto_http_connections_waiting gauge\n")
+          .append("varasto_http_connections_waiting ")
+          .append(std::to_string(pending->load()))
+          .append("\n");
+      }
+    );
+    server.new_task_queue = [&options, &shed, pending]()
+    {
+      return new CountingTaskQueue(
+        options.worker_count,
+        options.max_queued_connections,
+        pending,
+        shed
+      );
+    };
+    server.set_keep_alive_max_count(options.keep_alive_max_count);
+    server.set_keep_alive_timeout(options.keep_alive_timeout.count());
+    server.set_read_timeout(options.read_timeout.count());
+    server.set_write_timeout(options.write_timeout.count());
+    if (options.payload_max_length > 0)
+    {
+      server.set_payload_max_length(options.payload_max_length);
+    }
+
+    // Once too many connections are waiting for a worker, requests are
+    // rejected instead of letting the latency grow without a bound. The
+    // connection is closed as well, so that the worker can move on to the
+    // waiting connections.
+    if (options.queue_depth > 0)
+    {
+      server.set_pre_routing_handler(
+        [&options, &shed, pending](const Request& req, Response& res)
+        {
+          const std::size_t waiting = *pending;
+
+          if (waiting < options.queue_depth)
+          {
+            return Server::HandlerResponse::Unhandled;
+          }
+          shed.Increment();
+          log_saturation(waiting, shed);
+          res.set_header("Connection", "close");
+          res.set_header("Retry-After", "1");
+          send_error_message(res, "Server is too busy.", 503);
+
+          return Server::HandlerResponse::Handled;
+        }
+      );
+    }
+
     server.Get(
       "/",
-      [](const Request& req, Response& res)
+      instrument(
+        *metrics,
+        in_flight,
+        "GET",
+        "/",
+        [](const Request& req, Response& res)
+        {
+          res.set_content("{}", content_type);
+        }
+      )
+    );
+    server.Get(
+      "/_metrics",
+      [metrics](const Request& req, Response& res)
       {
-        res.set_content("{}", content_type);
+        res.set_content(metrics->Format(), metrics_content_type);
       }
     );
+    server.Post(
+      "/_batch",
+      instrument(
+        *metrics,
+        in_flight,
+        "POST",
+        "/_batch",
+        [&storage](const Request& req, Response& res)
+        {
+          handle_batch(*storage, req, res);
+        }
+      )
+    );
     server.Get(
       "/:namespace",
-      [&storage](const Request& req, Response& res)
-      {
-        handle_entry_list(storage, req, res);
-      }
+      instrument(
+        *metrics,
+        in_flight,
+        "GET",
+        "/:namespace",
+        [&storage, &options](const Request& req, Response& res)
+        {
+          handle_entry_list(*storage, options.gzip_threshold, req, res);
+        }
+      )
     );
     server.Post(
       "/:namespace",
-      [&storage](const Request& req, Response& res)
-      {
-        handle_entry_insert(storage, req, res);
-      }
+      instrument(
+        *metrics,
+        in_flight,
+        "POST",
+        "/:namespace",
+        [&storage, &options](const Request& req, Response& res)
+        {
+          handle_entry_insert(*storage, options.uuid_version, req, res);
+        }
+      )
     );
     server.Get(
       "/:namespace/:key",
-      [&storage](const Request& req, Response& res)
-      {
-        handle_entry_get(storage, req, res);
-      }
+      instrument(
+        *metrics,
+        in_flight,
+        "GET",
+        "/:namespace/:key",
+        [&storage, &options](const Request& req, Response& res)
+        {
+          handle_entry_get(*storage, options.gzip_threshold, req, res);
+        }
+      )
     );
     server.Post(
       "/:namespace/:key",
-      [&storage](const Request& req, Response& res)
-      {
-        handle_entry_set(storage, req, res);
-      }
+      instrument(
+        *metrics,
+        in_flight,
+        "POST",
+        "/:namespace/:key",
+        [&storage](const Request& req, Response& res)
+        {
+          handle_entry_set(*storage, req, res);
+        }
+      )
     );
     server.Patch(
       "/:namespace/:key",
-      [&storage](const Request& req, Response& res)
-      {
-        handle_entry_update(storage, req, res);
-      }
+      instrument(
+        *metrics,
+        in_flight,
+        "PATCH",
+        "/:namespace/:key",
+        [&storage](const Request& req, Response& res)
+        {
+          handle_entry_update(*storage, req, res);
+        }
+      )
     );
     server.Delete(
       "/:namespace",
-      [&storage](const Request& req, Response& res)
-      {
-        handle_namespace_delete(storage, req, res);
-      }
+      instrument(
+        *metrics,
+        in_flight,
+        "DELETE",
+        "/:namespace",
+        [&storage](const Request& req, Response& res)
+        {
+          handle_namespace_delete(*storage, req, res);
+        }
+      )
     );
     server.Delete(
       "/:namespace/:key",
-      [&storage](const Request& req, Response& res)
-      {
-        handle_entry_delete(storage, req, res);
-      }
+      instrument(
+        *metrics,
+        in_flight,
+        "DELETE",
+        "/:namespace/:key",
+        [&storage](const Request& req, Response& res)
+        {
+          handle_entry_delete(*storage, req, res);
+        }
+      )
     );
 
     std::cout << "Listening on http://"
@@ -363,6 +1708,10 @@ namespace varasto
               << options.port
               << std::endl;
 
+    running_server = &server;
+    std::signal(SIGINT, handle_stop_signal);
+    std::signal(SIGTERM, handle_stop_signal);
+
     if (!server.listen(options.hostname, options.port))
     {
       std::cerr << "Failed to listen on "
@@ -372,5 +1721,6 @@ namespace varasto
                 << std::endl;
       std::exit(EXIT_FAILURE);
     }
+    running_server = nullptr;
   }
 }
@@ -15,17 +15,71 @@
  */
 #pragma once
 
+#include <chrono>
 #include <filesystem>
 #include <optional>
 #include <utility>
 
+#include "./binary-format.hpp"
+#include "./compression.hpp"
+#include "./durability.hpp"
+#include "./json.hpp"
+
 namespace varasto
 {
+  enum class StorageType
+  {
+    filesystem,
+    log,
+    memory,
+  };
+
+  enum class UuidVersion
+  {
+    v4,
+    v7,
+  };
+
   struct ServerOptions
   {
     std::string hostname;
     int port;
     std::filesystem::path root;
+    StorageType storage;
+    DurabilityMode durability;
+    std::chrono::milliseconds commit_interval;
+    /** Whether mutations are written into a write-ahead log first. */
+    bool wal;
+    /** How often memory storage is snapshotted, or zero for never. */
+    std::chrono::seconds snapshot_interval;
+    /**
+     * Number of threads used to scan keys of the filesystem storage at
+     * startup, or zero to scan namespaces lazily.
+     */
+    std::size_t warm_up_threads;
+    /** Number of files of removed namespaces deleted per second. */
+    std::size_t reap_rate;
+    std::size_t cache_size;
+    UuidVersion uuid_version;
+    json::CodecType json_codec;
+    /** Format of stored values, or none to use format of the directory. */
+    std::optional<ValueFormat> value_format;
+    CompressionOptions compression;
+    std::size_t worker_count;
+    /** Number of waiting connections after which requests are rejected. */
+    std::size_t queue_depth;
+    /**
+     * Number of waiting connections after which new connections are closed
+     * without a response. Zero for no limit.
+     */
+    std::size_t max_queued_connections;
+    std::size_t keep_alive_max_count;
+    std::chrono::seconds keep_alive_timeout;
+    std::chrono::seconds read_timeout;
+    std::chrono::seconds write_timeout;
+    std::size_t payload_max_length;
+    /** Responses at least this large are compressed. Zero disables. */
+    std::size_t gzip_threshold;
     std::optional<std::pair<std::string, std::string>> credentials;
   };
 
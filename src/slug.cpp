@@ -13,17 +13,58 @@
  * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
-#include <regex>
-
 #include "./slug.hpp"
 
 namespace varasto
 {
-  static const std::regex slug_pattern("^[a-z0-9]+(?:-[a-z0-9]+)*$");
+  // Classes of characters that can appear in a slug.
+  enum : unsigned char
+  {
+    invalid = 0,
+    alnum = 1,
+    hyphen = 2,
+  };
+
+  static const struct CharacterTable
+  {
+    unsigned char classes[256];
+
+    CharacterTable()
+      : classes()
+    {
+      for (int c = 'a'; c <= 'z'; ++c)
+      {
+        classes[c] = alnum;
+      }
+      for (int c = '0'; c <= '9'; ++c)
+      {
+        classes[c] = alnum;
+      }
+      classes[static_cast<unsigned char>('-')] = hyphen;
+    }
+  } table;
 
   bool
   is_valid_slug(const std::string& input)
   {
-    return std::regex_match(input, slug_pattern);
+    const auto data = reinterpret_cast<const unsigned char*>(input.data());
+    const auto length = input.length();
+    unsigned char previous = hyphen;
+
+    // Equivalent to ^[a-z0-9]+(?:-[a-z0-9]+)*$ - hyphens are allowed only
+    // between two alphanumeric characters, which is checked by not allowing
+    // a hyphen to follow another hyphen or the beginning of the input.
+    for (std::size_t i = 0; i < length; ++i)
+    {
+      const auto current = table.classes[data[i]];
+
+      if (current == invalid || (current == hyphen && previous == hyphen))
+      {
+        return false;
+      }
+      previous = current;
+    }
+
+    return previous == alnum;
   }
 }
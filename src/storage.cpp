@@ -13,11 +13,66 @@
  * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
+#include <algorithm>
+#include <cstdio>
+
+#include "./json.hpp"
 #include "./storage.hpp"
 #include "./utils.hpp"
 
 namespace varasto
 {
+  Storage::get_raw_result_type
+  Storage::GetRaw(
+    const key_type& ns,
+    const key_type& key
+  ) const
+  {
+    const auto result = Get(ns, key);
+
+    if (result)
+    {
+      if (const auto& value = *result)
+      {
+        return get_raw_result_type::ok(json::format(*value));
+      }
+
+      return get_raw_result_type::ok(std::nullopt);
+    }
+
+    return get_raw_result_type::error(result.error());
+  }
+
+  Storage::get_version_result_type
+  Storage::GetVersion(
+    const key_type& ns,
+    const key_type& key
+  ) const
+  {
+    const auto result = GetRaw(ns, key);
+
+    if (!result)
+    {
+      return get_version_result_type::error(result.error());
+    }
+    else if (const auto& raw = *result)
+    {
+      char buffer[32];
+
+      std::snprintf(
+        buffer,
+        sizeof(buffer),
+        "%zx-%08x",
+        raw->length(),
+        utils::crc32(raw->data(), raw->length())
+      );
+
+      return get_version_result_type::ok(std::string(buffer));
+    }
+
+    return get_version_result_type::ok(std::nullopt);
+  }
+
   Storage::get_all_entries_type
   Storage::GetAllEntries(const key_type& ns) const
   {
@@ -48,6 +103,160 @@ namespace varasto
     return get_all_entries_type::error(keys.error());
   }
 
+  Storage::multi_get_result_type
+  Storage::MultiGet(
+    const std::vector<std::pair<key_type, key_type>>& entries
+  ) const
+  {
+    multi_get_result_type results;
+
+    // Entries are read on the calling thread, since requests are already
+    // served from a pool of worker threads.
+    results.reserve(entries.size());
+    for (const auto& entry : entries)
+    {
+      results.push_back(GetRaw(entry.first, entry.second));
+    }
+
+    return results;
+  }
+
+  Storage::get_all_keys_type
+  Storage::GetKeys(const key_type& ns, const ListOptions& options) const
+  {
+    auto keys = GetAllKeys(ns);
+
+    if (!keys)
+    {
+      return keys;
+    }
+
+    auto& all_keys = keys.value();
+    std::vector<key_type> result;
+
+    std::sort(std::begin(all_keys), std::end(all_keys));
+
+    auto it = options.after < options.prefix
+      ? std::lower_bound(
+          std::begin(all_keys),
+          std::end(all_keys),
+          options.prefix
+        )
+      : std::upper_bound(
+          std::begin(all_keys),
+          std::end(all_keys),
+          options.after
+        );
+
+    for (; it != std::end(all_keys); ++it)
+    {
+      if (
+        (options.limit && result.size() >= options.limit) ||
+        it->compare(0, options.prefix.length(), options.prefix)
+      )
+      {
+        break;
+      }
+      result.push_back(*it);
+    }
+
+    return get_all_keys_type::ok(result);
+  }
+
+  Storage::for_each_entry_result_type
+  Storage::ForEachEntry(
+    const key_type& ns,
+    const ListOptions& options,
+    const entry_visitor_type& visitor
+  ) const
+  {
+    const auto keys = GetKeys(ns, options);
+
+    if (!keys)
+    {
+      return for_each_entry_result_type::error(keys.error());
+    }
+
+    for (const auto& key : keys.value())
+    {
+      const auto value = GetRaw(ns, key);
+
+      if (!value)
+      {
+        return for_each_entry_result_type::error(value.error());
+      }
+      // Entry might have been removed after the keys were retrieved.
+      else if (*value && !visitor(key, **value))
+      {
+        return for_each_entry_result_type::ok(false);
+      }
+    }
+
+    return for_each_entry_result_type::ok(true);
+  }
+
+  Storage::get_stats_result_type
+  Storage::GetStats(const key_type& ns) const
+  {
+    NamespaceStats stats;
+    const auto result = ForEachEntry(
+      ns,
+      ListOptions(),
+      [&stats](const key_type&, const std::string& value)
+      {
+        ++stats.count;
+        stats.size += value.length();
+
+        return true;
+      }
+    );
+
+    if (!result)
+    {
+      return get_stats_result_type::error(result.error());
+    }
+    else if (!stats.count)
+    {
+      return get_stats_result_type::ok(std::nullopt);
+    }
+
+    return get_stats_result_type::ok(stats);
+  }
+
+  Storage::get_namespace_version_result_type
+  Storage::GetNamespaceVersion(const key_type& ns) const
+  {
+    const auto keys = GetAllKeys(ns);
+    std::uint32_t crc = 0;
+    char buffer[32];
+
+    if (!keys)
+    {
+      return get_namespace_version_result_type::error(keys.error());
+    }
+    for (const auto& key : *keys)
+    {
+      const auto version = GetVersion(ns, key);
+
+      if (!version)
+      {
+        return get_namespace_version_result_type::error(version.error());
+      }
+      else if (*version)
+      {
+        crc = utils::crc32(key.data(), key.length() + 1, crc);
+        crc = utils::crc32(
+          (*version)->data(),
+          (*version)->length() + 1,
+          crc
+        );
+      }
+    }
+    std::snprintf(buffer, sizeof(buffer), "%zx-%08x", keys->size(), crc);
+
+    return get_namespace_version_result_type::ok(std::string(buffer));
+  }
+
   Storage::update_result_type
   Storage::Update(
     const key_type& ns,
@@ -68,7 +277,7 @@ namespace varasto
 
         if (set_result)
         {
-          return update_result_type::ok(*old_value);
+          return update_result_type::ok(new_value);
         }
 
         return update_result_type::error(set_result.error());
@@ -79,4 +288,90 @@ namespace varasto
 
     return update_result_type::error(old_value_result.error());
   }
+
+  Storage::merge_result_type
+  Storage::Merge(
+    const key_type& ns,
+    const key_type& key,
+    const value_type& patch
+  )
+  {
+    const auto old_value_result = Get(ns, key);
+
+    if (!old_value_result)
+    {
+      return merge_result_type::error(old_value_result.error());
+    }
+    else if (!*old_value_result)
+    {
+      return merge_result_type::ok(std::nullopt);
+    }
+
+    const auto new_value = utils::merge_patch(**old_value_result, patch);
+    const auto set_result = Set(ns, key, new_value);
+
+    if (!set_result)
+    {
+      return merge_result_type::error(set_result.error());
+    }
+
+    return merge_result_type::ok(new_value);
+  }
+
+  Storage::drop_namespace_result_type
+  Storage::DropNamespace(const key_type& ns)
+  {
+    const auto result = DeleteNamespace(ns);
+
+    if (!result)
+    {
+      return drop_namespace_result_type::error(result.error());
+    }
+
+    return drop_namespace_result_type::ok(result->has_value());
+  }
+
+  Storage::write_batch_result_type
+  Storage::Write(const std::vector<WriteOperation>& operations)
+  {
+    write_batch_result_type results;
+
+    results.reserve(operations.size());
+    for (const auto& operation : operations)
+    {
+      switch (operation.type)
+      {
+        case WriteOperation::Type::set:
+          {
+            const auto result = Set(
+              operation.ns,
+              operation.key,
+              operation.value
+            );
+
+            if (result)
+            {
+              results.push_back(write_result_type::ok(operation.value));
+            } else {
+              results.push_back(write_result_type::error(result.error()));
+            }
+          }
+          break;
+
+        case WriteOperation::Type::update:
+          results.push_back(Update(
+            operation.ns,
+            operation.key,
+            operation.value
+          ));
+          break;
+
+        case WriteOperation::Type::remove:
+          results.push_back(Delete(operation.ns, operation.key));
+          break;
+      }
+    }
+
+    return results;
+  }
 }
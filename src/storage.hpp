@@ -15,6 +15,9 @@
  */
 #pragma once
 
+#include <chrono>
+#include <cstdint>
+#include <functional>
 #include <optional>
 
 #include <peelo/json/value.hpp>
@@ -29,14 +32,87 @@ namespace varasto
     using value_type = peelo::json::object::ptr;
     using mapped_type = std::pair<key_type, value_type>;
 
+    /**
+     * Restricts which keys of a namespace are included in a listing. Keys
+     * are always listed in sorted order when options are given.
+     */
+    struct ListOptions
+    {
+      /** Only keys beginning with this prefix are included. */
+      key_type prefix;
+      /** Only keys sorting after this key are included. */
+      key_type after;
+      /** Maximum number of keys to include, or zero for no limit. */
+      std::size_t limit = 0;
+    };
+
+    /**
+     * Summary of a namespace, which storages should be able to tell without
+     * reading the entries.
+     */
+    struct NamespaceStats
+    {
+      using time_type = std::chrono::system_clock::time_point;
+
+      /** Number of entries in the namespace. */
+      std::size_t count = 0;
+      /** Total size of the entries in bytes, as stored by the storage. */
+      std::uint64_t size = 0;
+      /** When an entry of the namespace was last modified, if known. */
+      std::optional<time_type> last_modified;
+    };
+
+    /**
+     * Single modification of an entry, performed as part of a batch with
+     * Write().
+     */
+    struct WriteOperation
+    {
+      enum class Type
+      {
+        set,
+        update,
+        remove,
+      };
+
+      Type type;
+      key_type ns;
+      key_type key;
+      /** New value of the entry, or value to merge into it. */
+      value_type value;
+    };
+
     using get_result_type = peelo::result<
       std::optional<value_type>,
       std::string
     >;
+    using get_raw_result_type = peelo::result<
+      std::optional<std::string>,
+      std::string
+    >;
+    using get_version_result_type = peelo::result<
+      std::optional<std::string>,
+      std::string
+    >;
+    using get_namespace_version_result_type = peelo::result<
+      std::string,
+      std::string
+    >;
     using get_all_keys_type = peelo::result<
       std::vector<key_type>,
       std::string
     >;
+    using entry_visitor_type = std::function<
+      bool(const key_type&, const std::string&)
+    >;
+    using for_each_entry_result_type = peelo::result<
+      bool,
+      std::string
+    >;
+    using get_stats_result_type = peelo::result<
+      std::optional<NamespaceStats>,
+      std::string
+    >;
     using get_all_entries_type = peelo::result<
       std::vector<mapped_type>,
       std::string
@@ -49,6 +125,10 @@ namespace varasto
       std::optional<value_type>,
       std::string
     >;
+    using merge_result_type = peelo::result<
+      std::optional<value_type>,
+      std::string
+    >;
     using delete_result_type = peelo::result<
       std::optional<value_type>,
       std::string
@@ -57,32 +137,146 @@ namespace varasto
       std::optional<std::vector<mapped_type>>,
       std::string
     >;
+    using drop_namespace_result_type = peelo::result<
+      bool,
+      std::string
+    >;
+    using multi_get_result_type = std::vector<get_raw_result_type>;
+    using write_result_type = peelo::result<
+      std::optional<value_type>,
+      std::string
+    >;
+    using write_batch_result_type = std::vector<write_result_type>;
+
+    virtual ~Storage() = default;
 
     virtual get_result_type Get(
       const key_type& ns,
       const key_type& key
     ) const = 0;
 
+    /**
+     * Returns the value of an entry as serialized JSON, without parsing it
+     * into an object first. Storages which keep their values in serialized
+     * form should override this with a version which returns the stored
+     * bytes as they are.
+     */
+    virtual get_raw_result_type GetRaw(
+      const key_type& ns,
+      const key_type& key
+    ) const;
+
+    /**
+     * Returns an opaque token which changes whenever value of an entry
+     * changes, or nothing if the entry does not exist. The default
+     * implementation checksums the serialized value, so storages which can
+     * tell version of an entry without reading it should override this.
+     */
+    virtual get_version_result_type GetVersion(
+      const key_type& ns,
+      const key_type& key
+    ) const;
+
+    /**
+     * Returns serialized values of multiple entries at once, in the same
+     * order as the entries were given. The default implementation reads
+     * them one by one with GetRaw(), so storages which can look up several
+     * entries with a single acquisition of their locks should override this.
+     */
+    virtual multi_get_result_type MultiGet(
+      const std::vector<std::pair<key_type, key_type>>& entries
+    ) const;
+
     virtual get_all_keys_type GetAllKeys(
       const key_type& ns
     ) const = 0;
 
+    /**
+     * Returns sorted keys of given namespace which match given options. The
+     * default implementation retrieves all keys with GetAllKeys() and
+     * filters them, so storages which keep their keys in sorted order should
+     * override this with a version which only looks at the matching keys.
+     */
+    virtual get_all_keys_type GetKeys(
+      const key_type& ns,
+      const ListOptions& options
+    ) const;
+
     get_all_entries_type GetAllEntries(
       const key_type& ns
     ) const;
 
+    /**
+     * Calls given visitor with key and serialized value of each entry in
+     * given namespace matching given options, one entry at a time, so that
+     * the whole namespace does not have to be kept in memory at once.
+     * Iteration stops if the visitor returns false, in which case false is
+     * also returned from this method.
+     */
+    virtual for_each_entry_result_type ForEachEntry(
+      const key_type& ns,
+      const ListOptions& options,
+      const entry_visitor_type& visitor
+    ) const;
+
+    /**
+     * Returns number of entries in given namespace and their total size, or
+     * nothing if the namespace does not exist. The default implementation
+     * goes through all of the entries, so storages should override this
+     * with a version which keeps the statistics up to date as the namespace
+     * is modified.
+     */
+    virtual get_stats_result_type GetStats(
+      const key_type& ns
+    ) const;
+
+    /**
+     * Returns an opaque token which changes whenever an entry of given
+     * namespace is set or removed. Tokens are only unique during lifetime
+     * of the storage. The default implementation combines versions of all
+     * entries in the namespace, so storages should override this with a
+     * version which keeps count of modifications to the namespace.
+     */
+    virtual get_namespace_version_result_type GetNamespaceVersion(
+      const key_type& ns
+    ) const;
+
     virtual set_result_type Set(
       const key_type& ns,
       const key_type& key,
       const value_type& value
     ) = 0;
 
-    update_result_type Update(
+    /**
+     * Shallowly merges given value into an existing entry, and returns the
+     * merged value, or nothing if the entry does not exist. The default
+     * implementation reads the entry with Get() and writes the merged value
+     * back with Set(), which means that it's not atomic unless the storage
+     * is wrapped in LockingStorage.
+     */
+    virtual update_result_type Update(
       const key_type& ns,
       const key_type& key,
       const value_type& value
     );
 
+    /**
+     * Applies given JSON merge patch (RFC 7396) to an existing entry, and
+     * returns the patched value, or nothing if the entry does not exist.
+     * Unlike Update(), nested objects are merged as well and properties set
+     * to null are removed. Storages which store only the patch return null
+     * pointer instead of the patched value, so that it doesn't have to be
+     * constructed. The default implementation reads the entry with Get()
+     * and writes the patched value back with Set(), so storages which can
+     * store the patch without rewriting the whole value should override
+     * this.
+     */
+    virtual merge_result_type Merge(
+      const key_type& ns,
+      const key_type& key,
+      const value_type& patch
+    );
+
     virtual delete_result_type Delete(
       const key_type& ns,
       const key_type& key
@@ -91,5 +285,27 @@ namespace varasto
     virtual delete_namespace_result_type DeleteNamespace(
       const key_type& ns
     ) = 0;
+
+    /**
+     * Removes given namespace without returning its entries. Returns false
+     * if the namespace did not exist. The default implementation uses
+     * DeleteNamespace(), so storages which can remove a namespace without
+     * reading its entries should override this.
+     */
+    virtual drop_namespace_result_type DropNamespace(
+      const key_type& ns
+    );
+
+    /**
+     * Performs given modifications in order and returns result of each one
+     * of them. Result of a set or an update is the new value of the entry,
+     * and result of a removal is the removed value. Missing value means that
+     * the entry did not exist. The default implementation performs each
+     * operation separately, so storages should override this with a version
+     * which shares the cost of making the writes durable among them.
+     */
+    virtual write_batch_result_type Write(
+      const std::vector<WriteOperation>& operations
+    );
   };
 }
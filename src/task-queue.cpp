@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2024, Rauli Laine
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "./task-queue.hpp"
+
+namespace varasto
+{
+  CountingTaskQueue::CountingTaskQueue(
+    std::size_t worker_count,
+    std::size_t max_queued,
+    const std::shared_ptr<counter_type>& pending,
+    Counter& rejected
+  )
+    : m_pool(worker_count, max_queued)
+    , m_pending(pending)
+    , m_rejected(rejected) {}
+
+  bool
+  CountingTaskQueue::enqueue(std::function<void()> task)
+  {
+    ++*m_pending;
+
+    if (!m_pool.enqueue(
+      [pending = m_pending, task = std::move(task)]()
+      {
+        --*pending;
+        task();
+      }
+    ))
+    {
+      --*m_pending;
+      m_rejected.Increment();
+
+      return false;
+    }
+
+    return true;
+  }
+
+  void
+  CountingTaskQueue::shutdown()
+  {
+    m_pool.shutdown();
+  }
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2024, Rauli Laine
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#pragma once
+
+#include <atomic>
+#include <memory>
+
+#include <httplib.h>
+
+#include "./metrics.hpp"
+
+namespace varasto
+{
+  /**
+   * Task queue of the HTTP server which executes connections in a fixed
+   * size pool of worker threads, and keeps count of connections which are
+   * waiting for a free worker. The counter is shared, since the HTTP server
+   * takes ownership of the queue itself. Once given number of connections
+   * are waiting, new ones are rejected and the HTTP server closes them.
+   */
+  class CountingTaskQueue : public httplib::TaskQueue
+  {
+  public:
+    using counter_type = std::atomic<std::size_t>;
+
+    explicit CountingTaskQueue(
+      std::size_t worker_count,
+      std::size_t max_queued,
+      const std::shared_ptr<counter_type>& pending,
+      Counter& rejected
+    );
+
+    bool enqueue(std::function<void()> task) override;
+
+    void shutdown() override;
+
+  private:
+    httplib::ThreadPool m_pool;
+    const std::shared_ptr<counter_type> m_pending;
+    Counter& m_rejected;
+  };
+}
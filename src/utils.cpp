@@ -13,6 +13,11 @@
  * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
+#include <array>
+#include <cerrno>
+
+#include <unistd.h>
+
 #include "./utils.hpp"
 
 namespace varasto::utils
@@ -32,4 +37,191 @@ namespace varasto::utils
 
     return peelo::json::object::make(result);
   }
+
+  peelo::json::object::ptr
+  merge_patch(
+    const peelo::json::object::ptr& target,
+    const peelo::json::object::ptr& patch
+  )
+  {
+    using peelo::json::object;
+    object::container_type result;
+
+    if (target)
+    {
+      result = target->properties();
+    }
+
+    for (const auto& property : patch->properties())
+    {
+      if (!property.second)
+      {
+        result.erase(property.first);
+      }
+      else if (
+        const auto nested = std::dynamic_pointer_cast<object>(property.second)
+      )
+      {
+        const auto it = result.find(property.first);
+        // Nested patch is applied even when there is nothing to merge it
+        // into, so that null values are removed from it.
+        const auto merged = merge_patch(
+          it != std::end(result)
+            ? std::dynamic_pointer_cast<object>(it->second)
+            : nullptr,
+          nested
+        );
+
+        result[property.first] = merged;
+      } else {
+        result[property.first] = property.second;
+      }
+    }
+
+    return object::make(result);
+  }
+
+  std::size_t
+  estimate_size(const peelo::json::value::ptr& value)
+  {
+    using peelo::json::array;
+    using peelo::json::object;
+    using peelo::json::string;
+
+    std::size_t size = sizeof(peelo::json::value::ptr);
+
+    if (!value)
+    {
+      return size;
+    }
+    else if (const auto o = std::dynamic_pointer_cast<object>(value))
+    {
+      size += sizeof(object);
+      for (const auto& property : o->properties())
+      {
+        size += property.first.capacity() * sizeof(char32_t);
+        size += estimate_size(property.second);
+      }
+    }
+    else if (const auto a = std::dynamic_pointer_cast<array>(value))
+    {
+      size += sizeof(array);
+      for (const auto& element : a->elements())
+      {
+        size += estimate_size(element);
+      }
+    }
+    else if (const auto s = std::dynamic_pointer_cast<string>(value))
+    {
+      size += sizeof(string) + s->value().capacity() * sizeof(char32_t);
+    } else {
+      // Booleans and numbers.
+      size += 2 * sizeof(double);
+    }
+
+    return size;
+  }
+
+  static std::array<std::uint32_t, 256>
+  make_crc32_table()
+  {
+    std::array<std::uint32_t, 256> table;
+
+    for (std::uint32_t i = 0; i < 256; ++i)
+    {
+      std::uint32_t c = i;
+
+      for (int j = 0; j < 8; ++j)
+      {
+        c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+      }
+      table[i] = c;
+    }
+
+    return table;
+  }
+
+  std::uint32_t
+  crc32(const char* data, std::size_t length, std::uint32_t crc)
+  {
+    static const auto table = make_crc32_table();
+
+    crc = ~crc;
+    for (std::size_t i = 0; i < length; ++i)
+    {
+      crc = table[(crc ^ static_cast<unsigned char>(data[i])) & 0xff] ^
+        (crc >> 8);
+    }
+
+    return ~crc;
+  }
+
+  bool
+  read_fully(int fd, char* buffer, std::size_t size, std::int64_t offset)
+  {
+    while (size > 0)
+    {
+      const auto result = ::pread(fd, buffer, size, offset);
+
+      if (result < 0 && errno == EINTR)
+      {
+        continue;
+      }
+      else if (result <= 0)
+      {
+        return false;
+      }
+      buffer += result;
+      size -= result;
+      offset += result;
+    }
+
+    return true;
+  }
+
+  bool
+  write_fully(
+    int fd,
+    const char* buffer,
+    std::size_t size,
+    std::int64_t offset
+  )
+  {
+    while (size > 0)
+    {
+      const auto result = ::pwrite(fd, buffer, size, offset);
+
+      if (result < 0 && errno == EINTR)
+      {
+        continue;
+      }
+      else if (result <= 0)
+      {
+        return false;
+      }
+      buffer += result;
+      size -= result;
+      offset += result;
+    }
+
+    return true;
+  }
+
+  bool
+  sync_data(int fd)
+  {
+    int result;
+
+    do
+    {
+#if defined(__APPLE__)
+      result = ::fsync(fd);
+#else
+      result = ::fdatasync(fd);
+#endif
+    }
+    while (result < 0 && errno == EINTR);
+
+    return result == 0;
+  }
 }
@@ -15,6 +15,8 @@
  */
 #pragma once
 
+#include <cstdint>
+
 #include <peelo/json/value.hpp>
 
 namespace varasto::utils
@@ -24,4 +26,59 @@ namespace varasto::utils
     const peelo::json::object::ptr& a,
     const peelo::json::object::ptr& b
   );
+
+  /**
+   * Applies JSON merge patch (RFC 7396) to given object. Properties of the
+   * patch with null value are removed, nested objects are merged
+   * recursively and other values replace the existing ones. Subtrees which
+   * the patch does not touch are shared with the original object instead of
+   * being copied.
+   */
+  peelo::json::object::ptr
+  merge_patch(
+    const peelo::json::object::ptr& target,
+    const peelo::json::object::ptr& patch
+  );
+
+  /**
+   * Returns rough estimate of how many bytes of memory given JSON value
+   * occupies. Used for keeping caches within their configured size.
+   */
+  std::size_t
+  estimate_size(const peelo::json::value::ptr& value);
+
+  /**
+   * Calculates CRC-32 checksum of given data. Previously calculated checksum
+   * can be given as the last argument, allowing the checksum to be calculated
+   * incrementally.
+   */
+  std::uint32_t
+  crc32(const char* data, std::size_t length, std::uint32_t crc = 0);
+
+  /**
+   * Reads exactly given number of bytes from given file descriptor at given
+   * offset, retrying on partial reads. Returns false if the read fails or
+   * end of file is reached before enough bytes have been read.
+   */
+  bool
+  read_fully(int fd, char* buffer, std::size_t size, std::int64_t offset);
+
+  /**
+   * Writes all of given bytes into given file descriptor at given offset,
+   * retrying on partial writes. Returns false if the write fails.
+   */
+  bool
+  write_fully(
+    int fd,
+    const char* buffer,
+    std::size_t size,
+    std::int64_t offset
+  );
+
+  /**
+   * Flushes data written into given file descriptor to disk, retrying if
+   * interrupted by a signal. Returns false if flushing fails.
+   */
+  bool
+  sync_data(int fd);
 }
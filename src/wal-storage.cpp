@@ -0,0 +1,1229 @@
+/*
+ * Copyright (c) 2024, Rauli Laine
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <map>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "./json.hpp"
+#include "./slug.hpp"
+#include "./utils.hpp"
+#include "./wal-storage.hpp"
+
+namespace varasto
+{
+  static constexpr auto retry_interval = std::chrono::seconds(1);
+
+  static std::optional<std::string>
+  validate(const Storage::key_type& ns, const Storage::key_type& key)
+  {
+    if (!is_valid_slug(ns) || ns.length() > UINT16_MAX)
+    {
+      return "Invalid namespace: " + ns;
+    }
+    else if (
+      !key.empty() &&
+      (!is_valid_slug(key) || key.length() > UINT16_MAX)
+    )
+    {
+      return "Invalid key: " + key;
+    }
+
+    return std::nullopt;
+  }
+
+  static std::optional<WalStorage::segment_id_type>
+  parse_segment_filename(const std::string& filename)
+  {
+    unsigned int id;
+    char suffix[5] = { 0 };
+
+    if (
+      filename.length() == 16 &&
+      std::sscanf(filename.c_str(), "wal-%8u.%3s", &id, suffix) == 2 &&
+      !std::strcmp(suffix, "log")
+    )
+    {
+      return id;
+    }
+
+    return std::nullopt;
+  }
+
+  static std::string
+  make_segment_filename(WalStorage::segment_id_type id)
+  {
+    char buffer[32];
+
+    std::snprintf(buffer, sizeof(buffer), "wal-%08u.log", id);
+
+    return buffer;
+  }
+
+  WalStorage::Segment::~Segment()
+  {
+    if (fd >= 0)
+    {
+      ::close(fd);
+    }
+  }
+
+  WalStorage::open_result_type
+  WalStorage::Open(
+    const path_type& root,
+    const path_type& data_root,
+    const storage_type& storage,
+    const std::shared_ptr<Durability>& durability,
+    size_type segment_size
+  )
+  {
+    std::shared_ptr<WalStorage> wal(
+      new WalStorage(root, data_root, storage, durability, segment_size)
+    );
+
+    if (const auto error = wal->Recover())
+    {
+      return open_result_type::error(*error);
+    }
+    wal->m_applier_thread = std::thread(&WalStorage::RunApplier, wal.get());
+
+    return open_result_type::ok(wal);
+  }
+
+  WalStorage::WalStorage(
+    const path_type& root,
+    const path_type& data_root,
+    const storage_type& storage,
+    const std::shared_ptr<Durability>& durability,
+    size_type segment_size
+  )
+    : m_root(root)
+    , m_data_root(data_root)
+    , m_storage(storage)
+    , m_durability(durability)
+    , m_segment_size(segment_size)
+    , m_next_sequence(1)
+    , m_published_sequence(0)
+    , m_running(true) {}
+
+  WalStorage::~WalStorage()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      m_running = false;
+    }
+    m_condition.notify_all();
+    if (m_applier_thread.joinable())
+    {
+      m_applier_thread.join();
+    }
+
+    // Everything has been applied, so the log is no longer needed.
+    if (m_queue.empty() && m_active && SyncStorage())
+    {
+      for (const auto& segment : m_retired)
+      {
+        ::unlink(segment->path.c_str());
+      }
+      ::unlink(m_active->path.c_str());
+    }
+  }
+
+  Storage::get_result_type
+  WalStorage::Get(
+    const key_type& ns,
+    const key_type& key
+  ) const
+  {
+    PendingEntry entry;
+
+    if (Lookup(ns, key, entry))
+    {
+      return get_result_type::ok(entry.value);
+    }
+
+    return m_storage->Get(ns, key);
+  }
+
+  Storage::get_raw_result_type
+  WalStorage::GetRaw(
+    const key_type& ns,
+    const key_type& key
+  ) const
+  {
+    PendingEntry entry;
+
+    if (!Lookup(ns, key, entry))
+    {
+      return m_storage->GetRaw(ns, key);
+    }
+    else if (entry.value)
+    {
+      return get_raw_result_type::ok(json::format(*entry.value));
+    }
+
+    return get_raw_result_type::ok(std::nullopt);
+  }
+
+  Storage::get_version_result_type
+  WalStorage::GetVersion(
+    const key_type& ns,
+    const key_type& key
+  ) const
+  {
+    PendingEntry entry;
+
+    if (!Lookup(ns, key, entry))
+    {
+      return m_storage->GetVersion(ns, key);
+    }
+    else if (entry.value)
+    {
+      return get_version_result_type::ok(
+        "wal-" + std::to_string(entry.sequence)
+      );
+    }
+
+    return get_version_result_type::ok(std::nullopt);
+  }
+
+  Storage::get_all_keys_type
+  WalStorage::GetAllKeys(const key_type& ns) const
+  {
+    // Pending mutations are looked up before the wrapped storage is read,
+    // so that mutations applied in the meantime are not missed.
+    const auto pending = GetPendingNamespace(ns);
+
+    if (!pending)
+    {
+      return m_storage->GetAllKeys(ns);
+    }
+
+    std::vector<key_type> keys;
+
+    if (!pending->removed)
+    {
+      const auto result = m_storage->GetAllKeys(ns);
+
+      if (!result)
+      {
+        return result;
+      }
+      for (const auto& key : *result)
+      {
+        if (pending->entries.find(key) == std::end(pending->entries))
+        {
+          keys.push_back(key);
+        }
+      }
+    }
+    for (const auto& entry : pending->entries)
+    {
+      if (entry.second.value)
+      {
+        keys.push_back(entry.first);
+      }
+    }
+
+    return get_all_keys_type::ok(keys);
+  }
+
+  Storage::get_stats_result_type
+  WalStorage::GetStats(const key_type& ns) const
+  {
+    std::shared_lock<std::shared_mutex> apply_lock(m_apply_mutex);
+    const auto pending = GetPendingNamespace(ns);
+    NamespaceStats stats;
+
+    if (!pending)
+    {
+      apply_lock.unlock();
+
+      return m_storage->GetStats(ns);
+    }
+    else if (!pending->removed)
+    {
+      const auto result = m_storage->GetStats(ns);
+
+      if (!result)
+      {
+        return result;
+      }
+      else if (*result)
+      {
+        stats = **result;
+      }
+    }
+
+    // Only entries with pending mutations are read from the wrapped
+    // storage. Their sizes are compared in serialized form, so the size is
+    // an estimate if the wrapped storage compresses its values.
+    for (const auto& entry : pending->entries)
+    {
+      if (!pending->removed)
+      {
+        const auto raw = m_storage->GetRaw(ns, entry.first);
+
+        if (!raw)
+        {
+          return get_stats_result_type::error(raw.error());
+        }
+        else if (*raw && stats.count > 0)
+        {
+          --stats.count;
+          stats.size -= std::min<std::uint64_t>(stats.size, (*raw)->length());
+        }
+      }
+      if (entry.second.value)
+      {
+        ++stats.count;
+        stats.size += json::format(*entry.second.value).length();
+      }
+    }
+
+    if (!stats.count)
+    {
+      return get_stats_result_type::ok(std::nullopt);
+    }
+    stats.last_modified = NamespaceStats::time_type::clock::now();
+
+    return get_stats_result_type::ok(stats);
+  }
+
+  Storage::get_namespace_version_result_type
+  WalStorage::GetNamespaceVersion(const key_type& ns) const
+  {
+    sequence_type sequence = 0;
+
+    // Pending mutations are looked up before the wrapped storage, so that
+    // mutations applied in between show up in the version of the wrapped
+    // storage instead of being missed altogether.
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      const auto it = m_overlay.find(ns);
+
+      if (it != std::end(m_overlay))
+      {
+        sequence = it->second.sequence;
+      }
+    }
+
+    const auto version = m_storage->GetNamespaceVersion(ns);
+
+    if (!version)
+    {
+      return version;
+    }
+
+    return get_namespace_version_result_type::ok(
+      *version + "-" + std::to_string(sequence)
+    );
+  }
+
+  Storage::get_all_keys_type
+  WalStorage::GetKeys(
+    const key_type& ns,
+    const ListOptions& options
+  ) const
+  {
+    if (!GetPendingNamespace(ns))
+    {
+      return m_storage->GetKeys(ns, options);
+    }
+
+    return Storage::GetKeys(ns, options);
+  }
+
+  Storage::for_each_entry_result_type
+  WalStorage::ForEachEntry(
+    const key_type& ns,
+    const ListOptions& options,
+    const entry_visitor_type& visitor
+  ) const
+  {
+    if (!GetPendingNamespace(ns))
+    {
+      return m_storage->ForEachEntry(ns, options, visitor);
+    }
+
+    return Storage::ForEachEntry(ns, options, visitor);
+  }
+
+  Storage::set_result_type
+  WalStorage::Set(
+    const key_type& ns,
+    const key_type& key,
+    const value_type& value
+  )
+  {
+    const auto results = Write({
+      { WriteOperation::Type::set, ns, key, value },
+    });
+
+    if (!results[0])
+    {
+      return set_result_type::error(results[0].error());
+    }
+
+    return set_result_type::ok(true);
+  }
+
+  Storage::delete_result_type
+  WalStorage::Delete(
+    const key_type& ns,
+    const key_type& key
+  )
+  {
+    const auto results = Write({
+      { WriteOperation::Type::remove, ns, key, nullptr },
+    });
+
+    return results[0];
+  }
+
+  Storage::delete_namespace_result_type
+  WalStorage::DeleteNamespace(const key_type& ns)
+  {
+    if (const auto error = validate(ns, key_type()))
+    {
+      return delete_namespace_result_type::error(*error);
+    }
+
+    const auto entries = GetAllEntries(ns);
+
+    if (!entries)
+    {
+      return delete_namespace_result_type::error(entries.error());
+    }
+    else if (entries->empty())
+    {
+      return delete_namespace_result_type::ok(std::nullopt);
+    }
+
+    std::vector<Operation> operations;
+
+    operations.push_back({
+      OperationType::remove_namespace,
+      ns,
+      key_type(),
+      nullptr,
+    });
+
+    const auto result = Append(std::move(operations));
+
+    if (!result)
+    {
+      return delete_namespace_result_type::error(result.error());
+    }
+
+    return delete_namespace_result_type::ok(*entries);
+  }
+
+  Storage::drop_namespace_result_type
+  WalStorage::DropNamespace(const key_type& ns)
+  {
+    ListOptions options;
+
+    if (const auto error = validate(ns, key_type()))
+    {
+      return drop_namespace_result_type::error(*error);
+    }
+
+    options.limit = 1;
+
+    const auto keys = GetKeys(ns, options);
+
+    if (!keys)
+    {
+      return drop_namespace_result_type::error(keys.error());
+    }
+    else if (keys->empty())
+    {
+      return drop_namespace_result_type::ok(false);
+    }
+
+    std::vector<Operation> operations;
+
+    operations.push_back({
+      OperationType::remove_namespace,
+      ns,
+      key_type(),
+      nullptr,
+    });
+
+    const auto result = Append(std::move(operations));
+
+    if (!result)
+    {
+      return drop_namespace_result_type::error(result.error());
+    }
+
+    return drop_namespace_result_type::ok(true);
+  }
+
+  Storage::write_batch_result_type
+  WalStorage::Write(const std::vector<WriteOperation>& operations)
+  {
+    using entry_type = std::pair<key_type, key_type>;
+    write_batch_result_type results;
+    // Values of entries modified by earlier operations of the batch.
+    std::map<entry_type, std::optional<value_type>> overlay;
+    std::vector<Operation> records;
+
+    results.reserve(operations.size());
+    for (const auto& operation : operations)
+    {
+      const auto entry = std::make_pair(operation.ns, operation.key);
+      std::optional<value_type> current;
+
+      if (const auto error = validate(operation.ns, operation.key))
+      {
+        results.push_back(write_result_type::error(*error));
+        continue;
+      }
+      else if (operation.key.empty())
+      {
+        results.push_back(write_result_type::error("Invalid key: "));
+        continue;
+      }
+
+      if (operation.type != WriteOperation::Type::set)
+      {
+        const auto it = overlay.find(entry);
+
+        if (it != std::end(overlay))
+        {
+          current = it->second;
+        } else {
+          const auto result = Get(operation.ns, operation.key);
+
+          if (!result)
+          {
+            results.push_back(write_result_type::error(result.error()));
+            continue;
+          }
+          current = *result;
+        }
+        if (!current)
+        {
+          results.push_back(write_result_type::ok(std::nullopt));
+          continue;
+        }
+      }
+
+      if (operation.type == WriteOperation::Type::remove)
+      {
+        records.push_back({
+          OperationType::remove,
+          operation.ns,
+          operation.key,
+          nullptr,
+        });
+        overlay[entry] = std::nullopt;
+        results.push_back(write_result_type::ok(current));
+        continue;
+      }
+
+      const auto value = operation.type == WriteOperation::Type::set
+        ? operation.value
+        : utils::patch(*current, operation.value);
+
+      records.push_back({
+        OperationType::set,
+        operation.ns,
+        operation.key,
+        value,
+      });
+      overlay[entry] = value;
+      results.push_back(write_result_type::ok(value));
+    }
+
+    if (records.empty())
+    {
+      return results;
+    }
+
+    // Whole batch is written as a single record, so either all of it or
+    // none of it survives a crash.
+    if (!Append(std::move(records)))
+    {
+      for (auto& result : results)
+      {
+        if (result)
+        {
+          result = write_result_type::error("Failed to write log.");
+        }
+      }
+    }
+
+    return results;
+  }
+
+  std::optional<std::string>
+  WalStorage::Recover()
+  {
+    std::vector<segment_id_type> ids;
+    std::vector<Batch> batches;
+    std::error_code ec;
+
+    if (
+      !std::filesystem::is_directory(m_root, ec) &&
+      !std::filesystem::create_directories(m_root, ec)
+    )
+    {
+      return "Failed to create " + m_root.string() + ".";
+    }
+
+    for (const auto& entry : std::filesystem::directory_iterator(m_root, ec))
+    {
+      if (const auto id = parse_segment_filename(entry.path().filename()))
+      {
+        ids.push_back(*id);
+      }
+    }
+    if (ec)
+    {
+      return "Failed to list log segments: " + ec.message();
+    }
+    std::sort(std::begin(ids), std::end(ids));
+
+    for (const auto id : ids)
+    {
+      if (const auto error = Replay(
+        m_root / make_segment_filename(id),
+        id == ids.back(),
+        batches
+      ))
+      {
+        return error;
+      }
+    }
+
+    // Mutations are idempotent, so it does not matter if some of them have
+    // already been applied before the crash.
+    for (const auto& batch : batches)
+    {
+      if (const auto error = Apply(batch))
+      {
+        return "Failed to replay log: " + *error;
+      }
+      m_next_sequence = std::max(m_next_sequence, batch.sequence + 1);
+    }
+    m_published_sequence = m_next_sequence - 1;
+
+    if (!ids.empty())
+    {
+      if (!SyncStorage())
+      {
+        return "Failed to sync " + m_data_root.string() + ".";
+      }
+      for (const auto id : ids)
+      {
+        ::unlink((m_root / make_segment_filename(id)).c_str());
+      }
+    }
+
+    return OpenSegment(ids.empty() ? 1 : ids.back() + 1);
+  }
+
+  std::optional<std::string>
+  WalStorage::Replay(
+    const path_type& path,
+    bool last,
+    std::vector<Batch>& batches
+  )
+  {
+    const auto fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    std::string buffer;
+    std::size_t offset = 0;
+    off_t size;
+
+    if (fd < 0 || (size = ::lseek(fd, 0, SEEK_END)) < 0)
+    {
+      if (fd >= 0)
+      {
+        ::close(fd);
+      }
+
+      return "Failed to open " + path.string() + ": " + std::strerror(errno);
+    }
+    buffer.resize(size);
+    if (!utils::read_fully(fd, buffer.data(), buffer.size(), 0))
+    {
+      ::close(fd);
+
+      return "Failed to read " + path.string() + ".";
+    }
+    ::close(fd);
+
+    while (offset + sizeof(RecordHeader) <= buffer.size())
+    {
+      RecordHeader header;
+      Batch batch;
+      std::size_t position = offset + sizeof(RecordHeader);
+      bool valid = true;
+
+      std::memcpy(&header, buffer.data() + offset, sizeof(RecordHeader));
+      if (position + header.length > buffer.size())
+      {
+        break;
+      }
+
+      const auto checksum = header.checksum;
+
+      header.checksum = 0;
+      if (
+        utils::crc32(
+          buffer.data() + position,
+          header.length,
+          utils::crc32(reinterpret_cast<const char*>(&header), sizeof(header))
+        ) != checksum
+      )
+      {
+        break;
+      }
+
+      const auto end = position + header.length;
+
+      batch.sequence = header.sequence;
+      for (std::uint32_t i = 0; valid && i < header.count; ++i)
+      {
+        OperationHeader operation_header;
+        Operation operation;
+
+        if (position + sizeof(OperationHeader) > end)
+        {
+          valid = false;
+          break;
+        }
+        std::memcpy(
+          &operation_header,
+          buffer.data() + position,
+          sizeof(OperationHeader)
+        );
+        position += sizeof(OperationHeader);
+        if (
+          position +
+          operation_header.ns_length +
+          operation_header.key_length +
+          operation_header.value_length > end
+        )
+        {
+          valid = false;
+          break;
+        }
+        operation.type = operation_header.type;
+        operation.ns.assign(
+          buffer.data() + position,
+          operation_header.ns_length
+        );
+        position += operation_header.ns_length;
+        operation.key.assign(
+          buffer.data() + position,
+          operation_header.key_length
+        );
+        position += operation_header.key_length;
+        if (operation.type == OperationType::set)
+        {
+          const auto value = json::parse_object(
+            buffer.data() + position,
+            operation_header.value_length
+          );
+
+          if (!value)
+          {
+            valid = false;
+            break;
+          }
+          operation.value = *value;
+        }
+        position += operation_header.value_length;
+        batch.operations.push_back(std::move(operation));
+      }
+      if (!valid)
+      {
+        break;
+      }
+      batches.push_back(std::move(batch));
+      offset = end;
+    }
+
+    if (offset < buffer.size())
+    {
+      std::cerr << "Ignoring " << (buffer.size() - offset)
+                << " bytes of corrupted or truncated data at the end of "
+                << path
+                << std::endl;
+      // Only the last segment can contain partially written records.
+      if (!last)
+      {
+        return "Corrupted log segment " + path.string() + ".";
+      }
+    }
+
+    return std::nullopt;
+  }
+
+  std::optional<std::string>
+  WalStorage::OpenSegment(segment_id_type id)
+  {
+    auto segment = std::make_shared<Segment>();
+
+    segment->id = id;
+    segment->path = m_root / make_segment_filename(id);
+    segment->fd = ::open(
+      segment->path.c_str(),
+      O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+      0644
+    );
+    segment->size = 0;
+    segment->last_sequence = 0;
+    if (segment->fd < 0)
+    {
+      return "Failed to open " + segment->path.string() + ": " +
+        std::strerror(errno);
+    }
+    else if (!m_durability->SyncDirectory(segment->path.c_str()))
+    {
+      return "Failed to sync " + m_root.string() + ".";
+    }
+    m_active = segment;
+
+    return std::nullopt;
+  }
+
+  WalStorage::append_result_type
+  WalStorage::Append(std::vector<Operation>&& operations)
+  {
+    RecordHeader header;
+    std::string buffer;
+    std::shared_ptr<Segment> segment;
+
+    buffer.resize(sizeof(RecordHeader));
+    for (const auto& operation : operations)
+    {
+      OperationHeader operation_header;
+      const auto value = operation.type == OperationType::set
+        ? json::format(operation.value)
+        : std::string();
+
+      std::memset(&operation_header, 0, sizeof(operation_header));
+      operation_header.value_length = value.length();
+      operation_header.ns_length = operation.ns.length();
+      operation_header.key_length = operation.key.length();
+      operation_header.type = operation.type;
+      buffer.append(
+        reinterpret_cast<const char*>(&operation_header),
+        sizeof(operation_header)
+      );
+      buffer.append(operation.ns);
+      buffer.append(operation.key);
+      buffer.append(value);
+    }
+
+    {
+      std::lock_guard<std::mutex> write_lock(m_write_mutex);
+
+      if (
+        m_active->size > 0 &&
+        m_active->size + buffer.length() > m_segment_size
+      )
+      {
+        const auto previous = m_active;
+
+        if (const auto error = OpenSegment(previous->id + 1))
+        {
+          return append_result_type::error(*error);
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        m_retired.push_back(previous);
+      }
+
+      std::memset(&header, 0, sizeof(header));
+      header.sequence = m_next_sequence;
+      header.length = buffer.length() - sizeof(RecordHeader);
+      header.count = operations.size();
+      std::memcpy(buffer.data(), &header, sizeof(header));
+      header.checksum = utils::crc32(buffer.data(), buffer.length());
+      std::memcpy(buffer.data(), &header, sizeof(header));
+
+      // Partially written record will be overwritten by the next append,
+      // since size of the segment is only updated after successful write.
+      if (!utils::write_fully(
+        m_active->fd,
+        buffer.data(),
+        buffer.length(),
+        m_active->size
+      ))
+      {
+        return append_result_type::error("Failed to write log.");
+      }
+      ++m_next_sequence;
+      m_active->size += buffer.length();
+      m_active->last_sequence = header.sequence;
+      segment = m_active;
+    }
+
+    // Mutations must not become visible to readers or the applier before
+    // they are durable, so the record is only published once it has been
+    // synced. Records are synced concurrently, but published in the same
+    // order as they have been written into the log.
+    const auto synced = m_durability->Sync(segment->fd);
+
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+
+      m_published_condition.wait(
+        lock,
+        [this, &header]()
+        {
+          return m_published_sequence + 1 == header.sequence;
+        }
+      );
+      m_published_sequence = header.sequence;
+
+      // Record which failed to sync is dropped, even though it might still
+      // be replayed after a crash, just like any other write which the
+      // client did not see to complete.
+      if (synced)
+      {
+        for (const auto& operation : operations)
+        {
+          auto& pending = m_overlay[operation.ns];
+
+          pending.sequence = header.sequence;
+          if (operation.type == OperationType::remove_namespace)
+          {
+            pending.entries.clear();
+            pending.removed = header.sequence;
+          }
+          else if (operation.type == OperationType::set)
+          {
+            pending.entries[operation.key] = {
+              header.sequence,
+              operation.value,
+            };
+          } else {
+            pending.entries[operation.key] = {
+              header.sequence,
+              std::nullopt,
+            };
+          }
+        }
+        m_queue.push_back({ header.sequence, std::move(operations) });
+      }
+    }
+    m_published_condition.notify_all();
+
+    if (!synced)
+    {
+      return append_result_type::error("Failed to sync log.");
+    }
+    m_condition.notify_one();
+
+    return append_result_type::ok(header.sequence);
+  }
+
+  std::optional<std::string>
+  WalStorage::Apply(const Batch& batch)
+  {
+    std::vector<WriteOperation> writes;
+    const auto flush = [this, &writes]() -> std::optional<std::string>
+    {
+      if (writes.empty())
+      {
+        return std::nullopt;
+      }
+
+      const auto results = m_storage->Write(writes);
+
+      writes.clear();
+      for (const auto& result : results)
+      {
+        if (!result)
+        {
+          return result.error();
+        }
+      }
+
+      return std::nullopt;
+    };
+
+    for (const auto& operation : batch.operations)
+    {
+      if (operation.type != OperationType::remove_namespace)
+      {
+        m_unsynced.insert(m_data_root / operation.ns / operation.key);
+        writes.push_back({
+          operation.type == OperationType::set
+            ? WriteOperation::Type::set
+            : WriteOperation::Type::remove,
+          operation.ns,
+          operation.key,
+          operation.value,
+        });
+        continue;
+      }
+      else if (const auto error = flush())
+      {
+        return error;
+      }
+
+      // Removed entries have already been returned to the client, so the
+      // wrapped storage does not have to read them again.
+      const auto result = m_storage->DropNamespace(operation.ns);
+
+      m_unsynced.insert(m_data_root / operation.ns);
+
+      if (!result)
+      {
+        return result.error();
+      }
+    }
+
+    return flush();
+  }
+
+  bool
+  WalStorage::SyncStorage()
+  {
+    std::set<path_type> directories;
+
+    directories.insert(m_data_root);
+    for (const auto& path : m_unsynced)
+    {
+      const auto fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+      // Entries which have been removed since are covered by syncing their
+      // directory.
+      if (fd < 0)
+      {
+        if (errno != ENOENT)
+        {
+          return false;
+        }
+      }
+      else if (!utils::sync_data(fd))
+      {
+        ::close(fd);
+
+        return false;
+      } else {
+        ::close(fd);
+      }
+      directories.insert(path.parent_path());
+    }
+    for (const auto& directory : directories)
+    {
+      const auto fd = ::open(
+        directory.c_str(),
+        O_RDONLY | O_DIRECTORY | O_CLOEXEC
+      );
+
+      if (fd < 0)
+      {
+        if (errno != ENOENT)
+        {
+          return false;
+        }
+        continue;
+      }
+
+      const auto result = utils::sync_data(fd);
+
+      ::close(fd);
+      if (!result)
+      {
+        return false;
+      }
+    }
+    m_unsynced.clear();
+
+    return true;
+  }
+
+  bool
+  WalStorage::Lookup(
+    const key_type& ns,
+    const key_type& key,
+    PendingEntry& entry
+  ) const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const auto ns_it = m_overlay.find(ns);
+
+    if (ns_it == std::end(m_overlay))
+    {
+      return false;
+    }
+
+    const auto key_it = ns_it->second.entries.find(key);
+
+    if (key_it != std::end(ns_it->second.entries))
+    {
+      entry = key_it->second;
+
+      return true;
+    }
+    else if (ns_it->second.removed)
+    {
+      entry = { *ns_it->second.removed, std::nullopt };
+
+      return true;
+    }
+
+    return false;
+  }
+
+  std::optional<WalStorage::PendingNamespace>
+  WalStorage::GetPendingNamespace(const key_type& ns) const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const auto it = m_overlay.find(ns);
+
+    if (it != std::end(m_overlay))
+    {
+      return it->second;
+    }
+
+    return std::nullopt;
+  }
+
+  void
+  WalStorage::RunApplier()
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    for (;;)
+    {
+      m_condition.wait(
+        lock,
+        [this]() { return !m_queue.empty() || !m_running; }
+      );
+      if (m_queue.empty())
+      {
+        break;
+      }
+
+      // Other threads only append into the queue, which does not invalidate
+      // references to the existing elements.
+      const auto& batch = m_queue.front();
+
+      lock.unlock();
+      std::unique_lock<std::shared_mutex> apply_lock(m_apply_mutex);
+      const auto error = Apply(batch);
+      apply_lock.unlock();
+      lock.lock();
+
+      if (error)
+      {
+        std::cerr << "Failed to apply log record "
+                  << batch.sequence
+                  << ": "
+                  << *error
+                  << std::endl;
+        if (!m_running)
+        {
+          break;
+        }
+        m_condition.wait_for(lock, retry_interval);
+        continue;
+      }
+
+      // Mutations which have been overwritten by later records stay in the
+      // overlay until those records have been applied.
+      for (const auto& operation : batch.operations)
+      {
+        const auto ns_it = m_overlay.find(operation.ns);
+
+        if (ns_it == std::end(m_overlay))
+        {
+          continue;
+        }
+
+        auto& pending = ns_it->second;
+
+        if (operation.type == OperationType::remove_namespace)
+        {
+          if (pending.removed && *pending.removed == batch.sequence)
+          {
+            pending.removed.reset();
+          }
+        } else {
+          const auto key_it = pending.entries.find(operation.key);
+
+          if (
+            key_it != std::end(pending.entries) &&
+            key_it->second.sequence == batch.sequence
+          )
+          {
+            pending.entries.erase(key_it);
+          }
+        }
+        if (!pending.removed && pending.entries.empty())
+        {
+          m_overlay.erase(ns_it);
+        }
+      }
+
+      const auto sequence = batch.sequence;
+      std::vector<std::shared_ptr<Segment>> applied;
+
+      m_queue.pop_front();
+      for (auto it = std::begin(m_retired); it != std::end(m_retired);)
+      {
+        if ((*it)->last_sequence <= sequence)
+        {
+          applied.push_back(*it);
+          it = m_retired.erase(it);
+        } else {
+          ++it;
+        }
+      }
+
+      // Segments whose records have all been applied are removed once the
+      // wrapped storage has been flushed to disk.
+      if (!applied.empty())
+      {
+        lock.unlock();
+        if (SyncStorage())
+        {
+          for (const auto& segment : applied)
+          {
+            ::unlink(segment->path.c_str());
+          }
+        } else {
+          lock.lock();
+          m_retired.insert(
+            std::begin(m_retired),
+            std::begin(applied),
+            std::end(applied)
+          );
+          continue;
+        }
+        lock.lock();
+      }
+    }
+  }
+}
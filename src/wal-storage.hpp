@@ -0,0 +1,292 @@
+/*
+ * Copyright (c) 2024, Rauli Laine
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
+
+#include "./durability.hpp"
+#include "./storage.hpp"
+
+namespace varasto
+{
+  /**
+   * Storage decorator which appends every mutation into a write-ahead log
+   * and acknowledges it once the log has been made durable. Mutations are
+   * applied to the wrapped storage in a background thread, and until then
+   * they are served from memory. All operations of a batch are written as a
+   * single record, so they are applied either all or none at all. Log is
+   * replayed into the wrapped storage when the storage is opened.
+   */
+  class WalStorage : public Storage
+  {
+  public:
+    using storage_type = std::shared_ptr<Storage>;
+    using path_type = std::filesystem::path;
+    using size_type = std::uint64_t;
+    using sequence_type = std::uint64_t;
+    using segment_id_type = std::uint32_t;
+
+    using open_result_type = peelo::result<
+      std::shared_ptr<WalStorage>,
+      std::string
+    >;
+
+    static constexpr size_type default_segment_size = 16 * 1024 * 1024;
+
+    /**
+     * Opens write-ahead log from given directory in front of given storage,
+     * replaying all mutations found from the log into the storage first.
+     * Root directory of the data is given so that the writes made into the
+     * wrapped storage can be flushed before the log is removed.
+     */
+    static open_result_type Open(
+      const path_type& root,
+      const path_type& data_root,
+      const storage_type& storage,
+      const std::shared_ptr<Durability>& durability =
+        std::make_shared<Durability>(),
+      size_type segment_size = default_segment_size
+    );
+
+    WalStorage(const WalStorage&) = delete;
+    WalStorage(WalStorage&&) = delete;
+    WalStorage& operator=(const WalStorage&) = delete;
+    WalStorage& operator=(WalStorage&&) = delete;
+
+    ~WalStorage();
+
+    get_result_type Get(
+      const key_type& ns,
+      const key_type& key
+    ) const;
+
+    get_raw_result_type GetRaw(
+      const key_type& ns,
+      const key_type& key
+    ) const;
+
+    get_version_result_type GetVersion(
+      const key_type& ns,
+      const key_type& key
+    ) const;
+
+    get_all_keys_type GetAllKeys(
+      const key_type& ns
+    ) const;
+
+    get_stats_result_type GetStats(
+      const key_type& ns
+    ) const;
+
+    get_namespace_version_result_type GetNamespaceVersion(
+      const key_type& ns
+    ) const;
+
+    get_all_keys_type GetKeys(
+      const key_type& ns,
+      const ListOptions& options
+    ) const;
+
+    for_each_entry_result_type ForEachEntry(
+      const key_type& ns,
+      const ListOptions& options,
+      const entry_visitor_type& visitor
+    ) const;
+
+    set_result_type Set(
+      const key_type& ns,
+      const key_type& key,
+      const value_type& value
+    );
+
+    delete_result_type Delete(
+      const key_type& ns,
+      const key_type& key
+    );
+
+    delete_namespace_result_type DeleteNamespace(
+      const key_type& ns
+    );
+
+    drop_namespace_result_type DropNamespace(
+      const key_type& ns
+    );
+
+    write_batch_result_type Write(
+      const std::vector<WriteOperation>& operations
+    );
+
+  private:
+    enum class OperationType : std::uint8_t
+    {
+      set = 1,
+      remove = 2,
+      remove_namespace = 3,
+    };
+
+    struct Operation
+    {
+      OperationType type;
+      key_type ns;
+      key_type key;
+      value_type value;
+    };
+
+    struct Batch
+    {
+      sequence_type sequence;
+      std::vector<Operation> operations;
+    };
+
+    struct RecordHeader
+    {
+      sequence_type sequence;
+      std::uint32_t checksum;
+      std::uint32_t length;
+      std::uint32_t count;
+      std::uint32_t reserved;
+    };
+
+    struct OperationHeader
+    {
+      std::uint32_t value_length;
+      std::uint16_t ns_length;
+      std::uint16_t key_length;
+      OperationType type;
+      std::uint8_t reserved[3];
+    };
+
+    struct Segment
+    {
+      segment_id_type id;
+      path_type path;
+      int fd;
+      size_type size;
+      sequence_type last_sequence;
+
+      ~Segment();
+    };
+
+    /**
+     * Mutation of an entry which has not yet been applied to the wrapped
+     * storage. Missing value means that the entry has been removed.
+     */
+    struct PendingEntry
+    {
+      sequence_type sequence;
+      std::optional<value_type> value;
+    };
+
+    struct PendingNamespace
+    {
+      /** Sequence of a pending removal of the whole namespace. */
+      std::optional<sequence_type> removed;
+      std::unordered_map<key_type, PendingEntry> entries;
+      /** Sequence of the latest pending mutation of the namespace. */
+      sequence_type sequence = 0;
+    };
+
+    using overlay_type = std::unordered_map<key_type, PendingNamespace>;
+    using append_result_type = peelo::result<sequence_type, std::string>;
+
+    WalStorage(
+      const path_type& root,
+      const path_type& data_root,
+      const storage_type& storage,
+      const std::shared_ptr<Durability>& durability,
+      size_type segment_size
+    );
+
+    std::optional<std::string> Recover();
+
+    std::optional<std::string> Replay(
+      const path_type& path,
+      bool last,
+      std::vector<Batch>& batches
+    );
+
+    std::optional<std::string> OpenSegment(segment_id_type id);
+
+    append_result_type Append(std::vector<Operation>&& operations);
+
+    /**
+     * Applies operations of given batch into the wrapped storage.
+     */
+    std::optional<std::string> Apply(const Batch& batch);
+
+    /**
+     * Flushes files and directories of the wrapped storage which have been
+     * modified by applied log records to disk, so that the records can be
+     * removed.
+     */
+    bool SyncStorage();
+
+    /**
+     * Looks for a pending mutation of given entry. Returns false if there is
+     * none, in which case the entry must be read from the wrapped storage.
+     */
+    bool Lookup(
+      const key_type& ns,
+      const key_type& key,
+      PendingEntry& entry
+    ) const;
+
+    std::optional<PendingNamespace> GetPendingNamespace(
+      const key_type& ns
+    ) const;
+
+    void RunApplier();
+
+  private:
+    const path_type m_root;
+    const path_type m_data_root;
+    const storage_type m_storage;
+    const std::shared_ptr<Durability> m_durability;
+    const size_type m_segment_size;
+    std::mutex m_write_mutex;
+    std::shared_ptr<Segment> m_active;
+    sequence_type m_next_sequence;
+    mutable std::mutex m_mutex;
+    std::condition_variable m_condition;
+    /** Sequence of the last record which has been synced and published. */
+    sequence_type m_published_sequence;
+    std::condition_variable m_published_condition;
+    /**
+     * Held exclusively while a batch is being applied, so that readers can
+     * combine pending mutations with the wrapped storage consistently.
+     */
+    mutable std::shared_mutex m_apply_mutex;
+    overlay_type m_overlay;
+    std::deque<Batch> m_queue;
+    std::vector<std::shared_ptr<Segment>> m_retired;
+    /**
+     * Paths of entries modified since the wrapped storage was last synced.
+     * Only accessed by the thread applying the log.
+     */
+    std::set<path_type> m_unsynced;
+    bool m_running;
+    std::thread m_applier_thread;
+  };
+}
@@ -0,0 +1,248 @@
+/*
+ * Copyright (c) 2024, Rauli Laine
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <optional>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "../src/binary-format.hpp"
+#include "../src/compression.hpp"
+#include "../src/slug.hpp"
+#include "../src/utils.hpp"
+
+using varasto::ValueFormat;
+
+static void
+display_usage(std::ostream& output, const char* executable)
+{
+  output << std::endl
+         << "Usage: "
+         << executable
+         << " --to=FORMAT root-directory"
+         << std::endl
+         << "   --to=FORMAT    Format to convert stored values into. Either"
+         << std::endl
+         << "                  \"json\" or \"binary\"."
+         << std::endl
+         << "   --help         Display this message."
+         << std::endl
+         << std::endl
+         << "The server must not be running while values are converted."
+         << std::endl
+         << std::endl;
+}
+
+static bool
+sync_path(const std::filesystem::path& path)
+{
+  const auto fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  bool result;
+
+  if (fd < 0)
+  {
+    return false;
+  }
+  result = ::fsync(fd) == 0;
+  ::close(fd);
+
+  return result;
+}
+
+/**
+ * Converts single entry into given format, by writing it into a temporary
+ * file which is then renamed over the entry. Compressed entries are written
+ * back uncompressed.
+ */
+static bool
+convert_entry(
+  const std::filesystem::path& path,
+  ValueFormat format,
+  const varasto::Compressor& compressor
+)
+{
+  std::ifstream input(path, std::ios::binary);
+  std::string buffer(
+    (std::istreambuf_iterator<char>(input)),
+    std::istreambuf_iterator<char>()
+  );
+
+  if (varasto::Compressor::IsCompressed(buffer.data(), buffer.length()))
+  {
+    const auto decompressed = compressor.Decompress(
+      path.parent_path().filename().string(),
+      buffer.data(),
+      buffer.length()
+    );
+
+    if (!decompressed)
+    {
+      std::cerr << path << ": " << decompressed.error() << std::endl;
+
+      return false;
+    }
+    buffer = *decompressed;
+  }
+
+  const auto result = varasto::binary::parse_value(
+    buffer.data(),
+    buffer.length()
+  );
+
+  if (!result)
+  {
+    std::cerr << path << ": " << result.error() << std::endl;
+
+    return false;
+  }
+
+  const auto output = format == ValueFormat::binary
+    ? varasto::binary::encode(*result)
+    : varasto::json::format(*result);
+  const auto temporary_path = path.parent_path() / (
+    "." + path.filename().string() + ".tmp-migrate"
+  );
+  const auto fd = ::open(
+    temporary_path.c_str(),
+    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+    0644
+  );
+
+  if (fd < 0)
+  {
+    std::cerr << temporary_path << ": " << std::strerror(errno) << std::endl;
+
+    return false;
+  }
+  else if (
+    !varasto::utils::write_fully(fd, output.data(), output.length(), 0) ||
+    ::fsync(fd) != 0
+  )
+  {
+    std::cerr << temporary_path << ": " << std::strerror(errno) << std::endl;
+    ::close(fd);
+    ::unlink(temporary_path.c_str());
+
+    return false;
+  }
+  ::close(fd);
+
+  if (::rename(temporary_path.c_str(), path.c_str()) != 0)
+  {
+    std::cerr << path << ": " << std::strerror(errno) << std::endl;
+    ::unlink(temporary_path.c_str());
+
+    return false;
+  }
+
+  return true;
+}
+
+int
+main(int argc, char** argv)
+{
+  std::optional<ValueFormat> format;
+  std::optional<std::filesystem::path> root;
+  std::size_t converted = 0;
+
+  for (int offset = 1; offset < argc; ++offset)
+  {
+    const auto arg = argv[offset];
+
+    if (!std::strcmp(arg, "--help"))
+    {
+      display_usage(std::cout, argv[0]);
+      return EXIT_SUCCESS;
+    }
+    else if (!std::strcmp(arg, "--to=json"))
+    {
+      format = ValueFormat::json;
+    }
+    else if (!std::strcmp(arg, "--to=binary"))
+    {
+      format = ValueFormat::binary;
+    }
+    else if (*arg != '-' && !root)
+    {
+      root = arg;
+    } else {
+      std::cerr << "Unrecognized switch: " << arg << std::endl;
+      display_usage(std::cerr, argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (!format || !root)
+  {
+    display_usage(std::cerr, argv[0]);
+    return EXIT_FAILURE;
+  }
+  else if (!std::filesystem::is_directory(*root))
+  {
+    std::cerr << "Root directory " << *root << " does not exist." << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  const varasto::Compressor compressor(*root);
+
+  // Readers accept both formats, so a conversion which is interrupted can
+  // simply be run again.
+  for (const auto& ns : std::filesystem::directory_iterator(*root))
+  {
+    if (
+      !ns.is_directory() ||
+      !varasto::is_valid_slug(ns.path().filename().string())
+    )
+    {
+      continue;
+    }
+    for (const auto& entry : std::filesystem::directory_iterator(ns.path()))
+    {
+      if (
+        !entry.is_regular_file() ||
+        !varasto::is_valid_slug(entry.path().filename().string())
+      )
+      {
+        continue;
+      }
+      else if (!convert_entry(entry.path(), *format, compressor))
+      {
+        return EXIT_FAILURE;
+      }
+      ++converted;
+    }
+    if (!sync_path(ns.path()))
+    {
+      std::cerr << ns.path() << ": " << std::strerror(errno) << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (!varasto::binary::write_format_marker(*root, *format))
+  {
+    std::cerr << "Unable to write format marker into " << *root << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  std::cout << "Converted " << converted << " entries." << std::endl;
+
+  return EXIT_SUCCESS;
+}